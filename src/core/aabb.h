@@ -0,0 +1,125 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "common.h"
+#include "packet.h"
+
+/// <summary>
+/// Axis aligned bounding box
+/// </summary>
+class aabb {
+	public:
+		// empty box (contains nothing, any union returns the other box)
+		aabb() : minimum(infinity), maximum(-infinity) {}
+
+		aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+		point3 min() const { return minimum; }
+		point3 max() const { return maximum; }
+
+		bool empty() const {
+			return minimum.x() > maximum.x();
+		}
+
+		point3 centroid() const {
+			return 0.5 * (minimum + maximum);
+		}
+
+		vec3 extent() const {
+			return maximum - minimum;
+		}
+
+		/// <summary>
+		/// Index of the longest axis of the box.
+		/// </summary>
+		int longest_axis() const {
+			vec3 e = extent();
+			if (e.x() > e.y() && e.x() > e.z()) return 0;
+			return e.y() > e.z() ? 1 : 2;
+		}
+
+		/// <summary>
+		/// Surface area of the box, used by the surface area heuristic.
+		/// </summary>
+		double surface_area() const {
+			if (empty()) return 0;
+			vec3 e = extent();
+			return 2.0 * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+		}
+
+		/// <summary>
+		/// Slab test of the ray r against the box.
+		/// </summary>
+		/// <param name="r">The ray.</param>
+		/// <param name="t_min">The t minimum.</param>
+		/// <param name="t_max">The t maximum.</param>
+		/// <returns>True if the ray intersects the box in [t_min, t_max]</returns>
+		bool hit(const ray& r, double t_min, double t_max) const {
+			for (int a = 0; a < 3; a++) {
+				auto invD = 1.0 / r.direction()[a];
+				auto t0 = (minimum[a] - r.origin()[a]) * invD;
+				auto t1 = (maximum[a] - r.origin()[a]) * invD;
+				if (invD < 0.0)
+					std::swap(t0, t1);
+				t_min = t0 > t_min ? t0 : t_min;
+				t_max = t1 < t_max ? t1 : t_max;
+				if (t_max < t_min)
+					return false;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Conservative slab test of all rays of a packet against the box.
+		/// Uses the interval bounds of the packet origins and directions.
+		/// </summary>
+		/// <returns>False if no ray of the packet intersects the box in [t_min, t_max]</returns>
+		bool may_hit(const RayPacket& packet, double t_min, double t_max) const {
+			for (int a = 0; a < 3; a++) {
+				const interval& d = packet.dir[a];
+
+				// directions parallel to the slab for some rays, no culling possible on this axis
+				if (d.lo <= 0 && d.hi >= 0)
+					continue;
+
+				interval invD(1.0 / d.hi, 1.0 / d.lo);
+				interval t0 = (interval(minimum[a]) - packet.orig[a]) * invD;
+				interval t1 = (interval(maximum[a]) - packet.orig[a]) * invD;
+
+				// lower bound of the entry and upper bound of the exit distance
+				t_min = fmax(t_min, fmin(t0.lo, t1.lo));
+				t_max = fmin(t_max, fmax(t0.hi, t1.hi));
+				if (t_max < t_min)
+					return false;
+			}
+			return true;
+		}
+
+	public:
+		point3 minimum;
+		point3 maximum;
+};
+
+/// <summary>
+/// Returns the box enclosing both boxes.
+/// </summary>
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+	point3 small(fmin(box0.min().x(), box1.min().x()),
+				 fmin(box0.min().y(), box1.min().y()),
+				 fmin(box0.min().z(), box1.min().z()));
+
+	point3 big(fmax(box0.max().x(), box1.max().x()),
+			   fmax(box0.max().y(), box1.max().y()),
+			   fmax(box0.max().z(), box1.max().z()));
+
+	return aabb(small, big);
+}
+
+/// <summary>
+/// Returns the box enclosing the box and the point p.
+/// </summary>
+inline aabb surrounding_box(const aabb& box, const point3& p) {
+	return surrounding_box(box, aabb(p, p));
+}
+
+#endif // !AABB_H
@@ -0,0 +1,729 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "common.h"
+#include "camera.h"
+#include "environment.h"
+#include "geometry.h"
+#include "material.h"
+#include "onb.h"
+#include "renderer.h"
+
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// maximum depth (segments - 1) of a bidirectional path: the paths of the
+// path tracer have at most RAY_BOUNCE_LIMIT segments
+#define BDPT_MAX_DEPTH (RAY_BOUNCE_LIMIT - 1)
+// camera rays per side of the grid finding the region seen by the camera
+#define BDPT_FOCUS_GRID 64
+
+/// <summary>
+/// Framebuffer the light tracing strategies splat into. Any render thread
+/// adds to any pixel with relaxed compare-and-swap adds, so the threads
+/// never wait for each other. The sums are drained into the pixels once
+/// all threads stopped splatting (after a pass).
+/// </summary>
+class SplatBuffer {
+	public:
+		void allocate(size_t n) {
+			sums.reset(new std::atomic<double>[3 * n]);
+			count = n;
+			for (size_t i = 0; i < 3 * n; i++)
+				sums[i].store(0, std::memory_order_relaxed);
+		}
+
+		void add(size_t pixel, const color& c) {
+			for (int k = 0; k < 3; k++) {
+				std::atomic<double>& sum = sums[3 * pixel + k];
+				double current = sum.load(std::memory_order_relaxed);
+				while (!sum.compare_exchange_weak(current, current + c[k], std::memory_order_relaxed));
+			}
+		}
+
+		/// <summary>
+		/// Adds the splats to the pixels and clears them.
+		/// </summary>
+		void drain(PixelBuffer& pixels) {
+			for (size_t i = 0; i < count; i++) {
+				pixels[i] += color(sums[3 * i].exchange(0, std::memory_order_relaxed),
+								   sums[3 * i + 1].exchange(0, std::memory_order_relaxed),
+								   sums[3 * i + 2].exchange(0, std::memory_order_relaxed));
+			}
+		}
+
+	private:
+		std::unique_ptr<std::atomic<double>[]> sums;
+		size_t count = 0;
+};
+
+/// <summary>
+/// Lights of a frame rendered by bidirectional path tracing: the emitting
+/// spheres and the environment (the map or the sky gradient), chosen
+/// proportional to their estimated power.
+///
+/// Light paths of the environment start on a disk facing the sampled
+/// direction that covers the region seen by the camera, the density of
+/// points outside of it is 0. The weights of the strategies account for
+/// it, so the estimate stays unbiased while the light paths are not wasted
+/// on far away geometry (e.g. the ground sphere).
+/// </summary>
+class BidirectionalScene {
+	public:
+		BidirectionalScene(const Frame& frame);
+
+		int lightCount() const {
+			return (int)spheres.size() + (infinite ? 1 : 0);
+		}
+
+		// index of the environment light, -1 without one
+		int infiniteLight() const {
+			return infinite ? (int)spheres.size() : -1;
+		}
+
+		const sphereEmitter& sphere(int light) const {
+			return spheres[light];
+		}
+
+		int sampleLight(double u, double& probability) const {
+			int light = sampleAliasTable(selection.data(), (int)selection.size(), u);
+			probability = probabilities[light];
+			return light;
+		}
+
+		double lightProbability(int light) const {
+			return light >= 0 ? probabilities[light] : 0;
+		}
+
+		// light of the emitting sphere hit, -1 if it is not a light of the set
+		int lightOf(const Geometry* geometry) const {
+			auto it = lights.find(geometry);
+			return it == lights.end() ? -1 : it->second;
+		}
+
+		// radiance of the environment from the direction d
+		color environmentRadiance(const vec3& d) const {
+			return environment ? environment->eval(d) : colorGradient(ray(point3(0, 0, 0), d)) * sky;
+		}
+
+		vec3 sampleEnvironment(double& pdf, color& radiance) const {
+			if (environment)
+				return environment->sample(pdf, radiance);
+
+			vec3 d = random_unit_vector();
+			pdf = 1 / (4 * pi);
+			radiance = environmentRadiance(d);
+			return d;
+		}
+
+		double environmentPdf(const vec3& d) const {
+			return environment ? environment->pdf(d) : 1 / (4 * pi);
+		}
+
+		// true if light paths of the environment from direction d can start towards p
+		bool inFocus(const point3& p, const vec3& d) const {
+			vec3 e = p - focus_center;
+			return (e - dot(e, d) * d).squared_length() <= focus_radius * focus_radius;
+		}
+
+		// start of a light path of the environment arriving from direction d
+		point3 environmentOrigin(const vec3& d) const {
+			vec3 disk = focus_radius * random_in_unit_disk();
+			return focus_center + onb(d).local(vec3(disk.x(), disk.y(), 0)) + d * origin_distance;
+		}
+
+		double focusArea() const {
+			return pi * focus_radius * focus_radius;
+		}
+
+		// area of the image plane (at the focus distance) covered by the pixels
+		double filmArea() const {
+			return film_area;
+		}
+
+		SplatBuffer splats;
+
+	private:
+		std::vector<sphereEmitter> spheres;
+		std::unordered_map<const Geometry*, int> lights;
+		std::vector<aliasEntry> selection;
+		std::vector<double> probabilities;
+
+		const EnvironmentMap* environment;
+		std::shared_ptr<const EnvironmentMap> environment_storage;
+		double sky;
+		bool infinite;
+
+		point3 focus_center;
+		double focus_radius = 1;
+		double origin_distance = 1;
+		double film_area;
+};
+
+BidirectionalScene::BidirectionalScene(const Frame& frame)
+	: environment(frame.environment.get()), environment_storage(frame.environment), sky(frame.sky) {
+	const Geometry& world = *frame.world;
+	world.emitters(spheres);
+	for (int i = 0; i < (int)spheres.size(); i++)
+		lights[spheres[i].geometry] = i;
+
+	// the camera samples s in [0, width / (width - 1)) (see renderTile)
+	film_area = frame.cam.image_area() * frame.width / std::max(frame.width - 1, 1) * frame.height / std::max(frame.height - 1, 1);
+
+	// region seen by the camera, from a grid of camera rays
+	seed_random(frame.seed);
+	aabb seen;
+	bool any = false;
+	for (int j = 0; j < BDPT_FOCUS_GRID; j++) {
+		for (int i = 0; i < BDPT_FOCUS_GRID; i++) {
+			ray r = frame.cam.get_ray((i + 0.5) / BDPT_FOCUS_GRID, (j + 0.5) / BDPT_FOCUS_GRID);
+			surfaceHit hit;
+			if (world.intersect(r, 0.001, infinity, hit)) {
+				point3 p = r.point_at_parameter(hit.t);
+				seen = any ? surrounding_box(seen, aabb(p, p)) : aabb(p, p);
+				any = true;
+			}
+		}
+	}
+
+	aabb bounds;
+	bool bounded = world.bounding_box(0, 1, bounds);
+	point3 scene_center = bounded ? 0.5 * (bounds.min() + bounds.max()) : point3(0, 0, 0);
+	double scene_radius = bounded ? 0.5 * (bounds.max() - bounds.min()).length() : 1;
+
+	if (any) {
+		focus_center = 0.5 * (seen.min() + seen.max());
+		// some margin for the light reaching the visible points indirectly
+		focus_radius = 0.5 * (seen.max() - seen.min()).length() * 1.1 + 1e-3;
+	}
+	else {
+		focus_center = scene_center;
+		focus_radius = scene_radius;
+	}
+	origin_distance = scene_radius + (scene_center - focus_center).length() + focus_radius;
+
+	// power of the lights
+	std::vector<double> power;
+	for (const auto& s : spheres)
+		power.push_back(s.power());
+
+	double mean = 0;
+	for (int i = 0; i < 256; i++)
+		mean += luminance(environmentRadiance(random_unit_vector())) / 256;
+	infinite = mean > 0;
+	if (infinite)
+		power.push_back(mean * focusArea() * pi);
+
+	if (power.empty())
+		power.push_back(0);
+	selection.resize(power.size());
+	double total = buildAliasTable(power.data(), (int)power.size(), selection.data());
+	for (double p : power)
+		probabilities.push_back(total > 0 ? p / total : 1.0 / power.size());
+
+	splats.allocate((size_t)frame.width * frame.height);
+}
+
+/// <summary>
+/// Vertex of a camera or light subpath.
+/// </summary>
+struct bdptVertex {
+	enum Type : char {
+		CAMERA,		// point of the lens
+		LIGHT,		// point of an emitting sphere starting a light subpath
+		SURFACE,	// scattering (or emitting) surface
+		INFINITE	// the environment: a camera subpath leaving the scene or the start of a light subpath
+	};
+
+	Type type;
+	hitRecord rec;		// point and normal (facing the side the subpath arrived from), material of a SURFACE
+	vec3 wi;			// SURFACE: unit direction to the previous vertex, INFINITE: unit direction towards the environment
+	color beta;			// throughput of the subpath up to the vertex
+	double pdfFwd = 0;	// area density of sampling the vertex from the previous one (solid angle towards INFINITE)
+	double pdfRev = 0;	// the same in the reverse direction
+	bool delta = false;	// scattered by a specular material
+	int light = -1;		// index of the light for LIGHT, INFINITE and emitting SURFACE vertices
+
+	const point3& p() const { return rec.p; }
+
+	bool emitting() const {
+		return type == INFINITE || type == LIGHT || (type == SURFACE && rec.mat_ptr->emissive());
+	}
+
+	// true if the vertex can be connected to another subpath
+	bool connectible() const {
+		return type == CAMERA || type == LIGHT || (type == SURFACE && !rec.mat_ptr->specular() && !rec.mat_ptr->emissive());
+	}
+
+	// unit direction from the vertex to v
+	vec3 towards(const bdptVertex& v) const {
+		return v.type == INFINITE ? v.wi : unit_vector(v.p() - p());
+	}
+
+	// outward normal of an emitting sphere
+	vec3 emitterNormal() const {
+		return rec.front_face ? rec.normal : -rec.normal;
+	}
+};
+
+/// <summary>
+/// Bidirectional path tracer (Veach 1997): a camera and a light subpath
+/// are traced for every sample and all pairs of their vertices are
+/// connected. The estimates of the strategies are combined with the power
+/// heuristic, light tracing (connections to the lens) is splatted into the
+/// SplatBuffer of the scene.
+/// </summary>
+class BidirectionalIntegrator {
+	public:
+		BidirectionalIntegrator(Frame& frame, const Geometry& world)
+			: frame(frame), world(world), scene(*frame.bidirectional) {}
+
+		/// <summary>
+		/// Radiance of the camera ray, light tracing contributions of the sample
+		/// are splatted.
+		/// </summary>
+		color sample(const ray& r) {
+			time = r.time();
+			int t = cameraSubpath(r);
+			int s = lightSubpath();
+
+			color L(0, 0, 0);
+			for (int ti = 1; ti <= t; ti++) {
+				for (int si = 0; si <= s; si++) {
+					int depth = ti + si - 2;
+					if ((si == 1 && ti == 1) || depth < 0 || depth > BDPT_MAX_DEPTH)
+						continue;
+					L += connect(si, ti);
+				}
+			}
+			return L;
+		}
+
+	private:
+		// area density of the vertex at distance from a point sampled with the solid angle density pdf
+		static double toArea(double pdf, const point3& from, const bdptVertex& to) {
+			if (to.type == bdptVertex::INFINITE)
+				return pdf;
+			vec3 w = to.p() - from;
+			double d2 = w.squared_length();
+			if (d2 <= 0) return 0;
+			if (to.type != bdptVertex::CAMERA)
+				pdf *= fabs(dot(to.rec.normal, w)) / sqrt(d2);
+			return pdf / d2;
+		}
+
+		// solid angle density of the camera ray through p from the lens point
+		double cameraPdf(const point3& lens, const point3& p) const {
+			double s, t, cosine;
+			if (!frame.cam.project(lens, p, s, t, cosine))
+				return 0;
+			double f = frame.cam.focus_distance();
+			return f * f / (scene.filmArea() * cosine * cosine * cosine);
+		}
+
+		// bsdf * |cos| at the surface vertex v scattering from prev into next
+		color f(const bdptVertex& v, const vec3& from, const vec3& to) const {
+			return v.rec.mat_ptr->eval(ray(v.p(), -from), v.rec, to);
+		}
+
+		// area density of the light at v sending a light path to next, blocked if it never can
+		double lightPdf(const bdptVertex& v, const bdptVertex& next, bool& blocked) const {
+			if (v.type == bdptVertex::INFINITE) {
+				if (!scene.inFocus(next.p(), v.wi)) {
+					blocked = true;
+					return 0;
+				}
+				return fabs(dot(next.rec.normal, v.wi)) / scene.focusArea();
+			}
+
+			vec3 w = unit_vector(next.p() - v.p());
+			double cosine = dot(v.emitterNormal(), w);
+			return cosine > 0 ? toArea(cosine / pi, v.p(), next) : 0;
+		}
+
+		// density of the light choosing v as the start of a light path
+		double lightOriginPdf(const bdptVertex& v) const {
+			double choice = scene.lightProbability(v.light);
+			if (v.type == bdptVertex::INFINITE)
+				return choice * scene.environmentPdf(v.wi);
+			if (v.light < 0)
+				return 0;
+			double r = scene.sphere(v.light).radius;
+			return choice / (4 * pi * r * r);
+		}
+
+		// area density of v sampling next, prev is the vertex before v (null for the end of a subpath)
+		double pdf(const bdptVertex& v, const bdptVertex* prev, const bdptVertex& next, bool& blocked) const {
+			switch (v.type) {
+				case bdptVertex::CAMERA:
+					return toArea(cameraPdf(v.p(), next.type == bdptVertex::INFINITE ? v.p() + next.wi : next.p()), v.p(), next);
+				case bdptVertex::LIGHT:
+				case bdptVertex::INFINITE:
+					return lightPdf(v, next, blocked);
+				default:
+					if (!prev)
+						return lightPdf(v, next, blocked);
+					return toArea(v.rec.mat_ptr->pdf(ray(v.p(), -v.towards(*prev)), v.rec, v.towards(next)), v.p(), next);
+			}
+		}
+
+		bool visible(const point3& a, const point3& b, double time) const {
+			vec3 d = b - a;
+			double distance = d.length();
+			surfaceHit hit;
+			traced_rays++;
+			return !world.intersect(ray(a, d / distance, time), 0.001, distance - 0.001, hit);
+		}
+
+		bool unoccluded(const point3& a, const vec3& d, double time) const {
+			surfaceHit hit;
+			traced_rays++;
+			return !world.intersect(ray(a, d, time), 0.001, infinity, hit);
+		}
+
+		// continues the subpath from its last vertex, returns the number of vertices
+		int walk(ray r, color beta, double pdf, bdptVertex* path, int count, int max_vertices, bool camera) {
+			while (count < max_vertices) {
+				bdptVertex& prev = path[count - 1];
+				bdptVertex& v = path[count];
+
+				surfaceHit hit;
+				traced_rays++;
+				if (!world.intersect(r, 0.001, infinity, hit)) {
+					if (camera) {
+						v.type = bdptVertex::INFINITE;
+						v.wi = unit_vector(r.direction());
+						v.beta = beta;
+						v.pdfFwd = pdf;
+						v.pdfRev = 0;
+						v.delta = false;
+						v.light = scene.infiniteLight();
+						count++;
+					}
+					break;
+				}
+
+				// the surface is lost, the subpath ends
+				if (!hit.geometry->interaction(r, hit, v.rec))
+					break;
+				v.type = bdptVertex::SURFACE;
+				v.wi = -unit_vector(r.direction());
+				v.beta = beta;
+				v.pdfFwd = toArea(pdf, prev.type == bdptVertex::INFINITE ? v.p() : prev.p(), v);
+				v.pdfRev = 0;
+				v.delta = false;
+				v.light = v.rec.mat_ptr->emissive() ? scene.lightOf(hit.geometry) : -1;
+				if (++count == max_vertices || v.rec.mat_ptr->emissive())
+					break;
+
+				bsdfSample sample;
+				if (!v.rec.mat_ptr->sample(r, v.rec, sample))
+					break;
+
+				v.delta = sample.specular;
+				pdf = sample.specular ? 0 : sample.pdf;
+				double reverse = sample.specular ? 0 : v.rec.mat_ptr->pdf(ray(v.p(), -sample.direction, r.time()), v.rec, v.wi);
+				prev.pdfRev = toArea(reverse, v.p(), prev);
+
+				beta = beta * sample.weight;
+				r = ray(v.p(), sample.direction, r.time());
+			}
+			return count;
+		}
+
+		int cameraSubpath(const ray& r) {
+			bdptVertex& v = camera_path[0];
+			v.type = bdptVertex::CAMERA;
+			v.rec.p = r.origin();
+			v.beta = color(1, 1, 1);
+			v.delta = false;
+			return walk(r, v.beta, cameraPdf(r.origin(), r.origin() + r.direction()), camera_path, 1, BDPT_MAX_DEPTH + 2, true);
+		}
+
+		int lightSubpath() {
+			if (scene.lightCount() == 0)
+				return 0;
+
+			double choice;
+			int light = scene.sampleLight(random_double(), choice);
+			bdptVertex& v = light_path[0];
+			v.light = light;
+			v.delta = false;
+			v.pdfRev = 0;
+
+			if (light == scene.infiniteLight()) {
+				double direction_pdf;
+				color radiance;
+				vec3 d = scene.sampleEnvironment(direction_pdf, radiance);
+				if (direction_pdf <= 0)
+					return 0;
+
+				v.type = bdptVertex::INFINITE;
+				v.wi = d;
+				v.beta = radiance;
+				v.pdfFwd = choice * direction_pdf;
+
+				double position_pdf = 1 / scene.focusArea();
+				int count = walk(ray(scene.environmentOrigin(d), -d, time), radiance / (choice * position_pdf * direction_pdf),
+								 direction_pdf, light_path, 1, BDPT_MAX_DEPTH + 1, false);
+				if (count > 1)
+					light_path[1].pdfFwd = position_pdf * fabs(dot(light_path[1].rec.normal, d));
+				return count;
+			}
+
+			const sphereEmitter& sphere = scene.sphere(light);
+			vec3 n = random_unit_vector();
+			v.type = bdptVertex::LIGHT;
+			v.rec.p = sphere.center + sphere.radius * n;
+			v.rec.normal = n;
+			v.rec.front_face = true;
+			v.rec.mat_ptr = sphere.mat_ptr;
+			v.beta = sphere.mat_ptr->emitted(v.rec);
+			v.pdfFwd = lightOriginPdf(v);
+
+			// cosine weighted emission: radiance * cos / (choice * position pdf * cos / pi)
+			vec3 d = onb(n).local(random_cosine_direction());
+			return walk(ray(v.p(), d, time), v.beta * pi / v.pdfFwd, dot(n, d) / pi, light_path, 1, BDPT_MAX_DEPTH + 1, false);
+		}
+
+		// estimate of the strategy with s light and t camera vertices
+		color connect(int s, int t) {
+			bdptVertex sampled;
+			color L(0, 0, 0);
+			const bdptVertex& pt = camera_path[t - 1];
+
+			if (s == 0) {
+				// the camera subpath found a light
+				if (!pt.emitting())
+					return L;
+				L = pt.beta * (pt.type == bdptVertex::INFINITE ? scene.environmentRadiance(pt.wi) : pt.rec.mat_ptr->emitted(pt.rec));
+				if (pt.type == bdptVertex::SURFACE && pt.light < 0)
+					return L;	// no other strategy finds lights outside of the set
+			}
+			else if (t == 1) {
+				// light tracing: connect to a point of the lens and splat
+				const bdptVertex& qs = light_path[s - 1];
+				if (!qs.connectible() || qs.type != bdptVertex::SURFACE)
+					return L;
+
+				point3 lens = frame.cam.sample_lens();
+				double u, v, cosine;
+				if (!frame.cam.project(lens, qs.p(), u, v, cosine))
+					return L;
+				int x = (int)floor(u * (frame.width - 1)), j = (int)floor(v * (frame.height - 1));
+				if (x < 0 || x >= frame.width || j < 0 || j >= frame.height)
+					return L;
+
+				vec3 d = lens - qs.p();
+				double d2 = d.squared_length();
+				color c = qs.beta * f(qs, qs.wi, d / sqrt(d2)) * cameraPdf(lens, qs.p()) / d2;
+				if (c.r() <= 0 && c.g() <= 0 && c.b() <= 0)
+					return L;
+				if (!visible(qs.p(), lens, time))
+					return L;
+
+				sampled.type = bdptVertex::CAMERA;
+				sampled.rec.p = lens;
+				sampled.beta = color(1, 1, 1);
+				c *= weight(s, t, sampled);
+				if (c.r() == c.r() && c.g() == c.g() && c.b() == c.b())
+					scene.splats.add((size_t)(frame.height - 1 - j) * frame.width + x, c);
+				return L;
+			}
+			else if (s == 1) {
+				// next event: sample a point of a light
+				if (!pt.connectible() || scene.lightCount() == 0)
+					return L;
+
+				double choice;
+				int light = scene.sampleLight(random_double(), choice);
+				sampled.light = light;
+
+				if (light == scene.infiniteLight()) {
+					double direction_pdf;
+					color radiance;
+					vec3 d = scene.sampleEnvironment(direction_pdf, radiance);
+					if (direction_pdf <= 0)
+						return L;
+
+					sampled.type = bdptVertex::INFINITE;
+					sampled.wi = d;
+					sampled.beta = radiance / (choice * direction_pdf);
+					sampled.pdfFwd = lightOriginPdf(sampled);
+
+					L = pt.beta * f(pt, pt.wi, d) * sampled.beta;
+					if ((L.r() <= 0 && L.g() <= 0 && L.b() <= 0) || !unoccluded(pt.p(), d, time))
+						return color(0, 0, 0);
+				}
+				else {
+					const sphereEmitter& sphere = scene.sphere(light);
+					vec3 n = random_unit_vector();
+					sampled.type = bdptVertex::LIGHT;
+					sampled.rec.p = sphere.center + sphere.radius * n;
+					sampled.rec.normal = n;
+					sampled.rec.front_face = true;
+					sampled.rec.mat_ptr = sphere.mat_ptr;
+					sampled.pdfFwd = lightOriginPdf(sampled);
+
+					vec3 d = sampled.p() - pt.p();
+					double d2 = d.squared_length();
+					d /= sqrt(d2);
+					double cosine = -dot(n, d);
+					if (cosine <= 0)
+						return L;
+
+					sampled.beta = sphere.mat_ptr->emitted(sampled.rec) / sampled.pdfFwd;
+					L = pt.beta * f(pt, pt.wi, d) * sampled.beta * (cosine / d2);
+					if ((L.r() <= 0 && L.g() <= 0 && L.b() <= 0) || !visible(pt.p(), sampled.p(), time))
+						return color(0, 0, 0);
+				}
+			}
+			else {
+				// connect a light and a camera vertex
+				const bdptVertex& qs = light_path[s - 1];
+				if (!qs.connectible() || !pt.connectible())
+					return L;
+
+				vec3 d = pt.p() - qs.p();
+				double d2 = d.squared_length();
+				d /= sqrt(d2);
+				L = qs.beta * f(qs, qs.wi, d) * f(pt, pt.wi, -d) * pt.beta / d2;
+				if ((L.r() <= 0 && L.g() <= 0 && L.b() <= 0) || !visible(qs.p(), pt.p(), time))
+					return color(0, 0, 0);
+			}
+
+			if (L.r() <= 0 && L.g() <= 0 && L.b() <= 0)
+				return L;
+			return L * weight(s, t, sampled);
+		}
+
+		/// <summary>
+		/// Power heuristic weight of the strategy (s, t) among all strategies
+		/// that could sample the same path. The densities of the other
+		/// strategies follow from the forward and reverse densities of the
+		/// vertices (Veach 10.2), the vertices at the connection get the
+		/// reverse densities of this path.
+		/// </summary>
+		double weight(int s, int t, const bdptVertex& sampled) {
+			if (s + t == 2)
+				return 1;
+
+			// ratios of the densities, with delta vertices counted as 1
+			auto ratio = [](double rev, double fwd) {
+				double r = (rev != 0 ? rev : 1) / (fwd != 0 ? fwd : 1);
+				return r * r;
+			};
+
+			const bdptVertex& pt = t == 1 ? sampled : camera_path[t - 1];
+			const bdptVertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+			const bdptVertex* qs = s == 1 ? &sampled : (s > 1 ? &light_path[s - 1] : nullptr);
+			const bdptVertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+
+			// densities of the vertices of this path
+			double camera_fwd[BDPT_MAX_DEPTH + 2], camera_rev[BDPT_MAX_DEPTH + 2];
+			bool camera_delta[BDPT_MAX_DEPTH + 2], camera_blocked[BDPT_MAX_DEPTH + 2];
+			for (int i = 0; i < t; i++) {
+				const bdptVertex& v = i == t - 1 ? pt : camera_path[i];
+				camera_fwd[i] = v.pdfFwd;
+				camera_rev[i] = v.pdfRev;
+				camera_delta[i] = v.delta;
+				camera_blocked[i] = false;
+			}
+
+			double light_fwd[BDPT_MAX_DEPTH + 1], light_rev[BDPT_MAX_DEPTH + 1];
+			bool light_delta[BDPT_MAX_DEPTH + 1];
+			for (int i = 0; i < s; i++) {
+				const bdptVertex& v = i == s - 1 ? *qs : light_path[i];
+				light_fwd[i] = v.pdfFwd;
+				light_rev[i] = v.pdfRev;
+				light_delta[i] = v.delta;
+			}
+
+			// the connected vertices are sampled, not scattered specularly
+			camera_delta[t - 1] = false;
+			if (s > 0)
+				light_delta[s - 1] = false;
+
+			bool blocked = false;
+			camera_rev[t - 1] = s > 0 ? pdf(*qs, qs_minus, pt, blocked) : lightOriginPdf(pt);
+			camera_blocked[t - 1] = blocked;
+
+			if (pt_minus) {
+				blocked = false;
+				camera_rev[t - 2] = s > 0 ? pdf(pt, qs, *pt_minus, blocked) : lightPdf(pt, *pt_minus, blocked);
+				camera_blocked[t - 2] = blocked;
+			}
+			if (s > 0)
+				light_rev[s - 1] = pdf(pt, pt_minus, *qs, blocked);
+			if (s > 1)
+				light_rev[s - 2] = pdf(*qs, &pt, *qs_minus, blocked);
+
+			double sum = 0, r = 1;
+
+			// the camera vertices sampled by the light subpath instead
+			for (int i = t - 1; i > 0; i--) {
+				// the light never starts a path reaching the vertex
+				if (camera_blocked[i])
+					break;
+				r *= ratio(camera_rev[i], camera_fwd[i]);
+				if (!camera_delta[i] && !camera_delta[i - 1])
+					sum += r;
+			}
+
+			// the light vertices sampled by the camera subpath instead
+			r = 1;
+			for (int i = s - 1; i >= 0; i--) {
+				r *= ratio(light_rev[i], light_fwd[i]);
+				if (!light_delta[i] && (i == 0 || !light_delta[i - 1]))
+					sum += r;
+			}
+
+			return 1 / (1 + sum);
+		}
+
+	private:
+		Frame& frame;
+		const Geometry& world;
+		BidirectionalScene& scene;
+		double time = 0;	// of the current sample
+
+		bdptVertex camera_path[BDPT_MAX_DEPTH + 2];
+		bdptVertex light_path[BDPT_MAX_DEPTH + 1];
+};
+
+/// <summary>
+/// Renders samples of a tile with bidirectional path tracing and adds them
+/// to frame.pixels, the light tracing contributions of all pixels are
+/// splatted into frame.bidirectional->splats.
+/// </summary>
+void renderTileBidirectional(Frame& frame, const Tile& tile, int pass, int samples) {
+	const Geometry& world = frame.worldOn(currentNumaNode());
+	BidirectionalIntegrator integrator(frame, world);
+
+	seed_random(tileSeed(frame.seed, frame.number, pass, tile.index));
+
+	for (int y = tile.y0; y < tile.y1; ++y) {
+		if (frame.cancel && frame.cancel->load(std::memory_order_relaxed))
+			return;
+
+		int j = frame.height - 1 - y;
+		for (int i = tile.x0; i < tile.x1; ++i) {
+			unsigned long long before = traced_rays;
+			color sum(0, 0, 0);
+			for (int s = 0; s < samples; ++s) {
+				auto u = (i + random_double()) / (frame.width - 1);
+				auto v = (j + random_double()) / (frame.height - 1);
+				color c = integrator.sample(frame.cam.get_ray(u, v));
+				c.replaceNaN();
+				sum += c;
+			}
+			frame.pixels[(size_t)y * frame.width + i] += sum;
+			if (!frame.cost.empty())
+				frame.cost[(size_t)y * frame.width + i] += (unsigned int)(traced_rays - before);
+		}
+	}
+}
+
+#endif // !BDPT_H
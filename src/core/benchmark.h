@@ -0,0 +1,401 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "common.h"
+#include "bvh.h"
+#include "encoder.h"
+#include "environment.h"
+#include "guiding.h"
+#include "image.h"
+#include "pipeline.h"
+#include "renderer.h"
+#include "renderOptions.h"
+#include "scene.h"
+#include "threadPool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// offset of the seed of the reference renderings, so their samples differ from the measured ones
+#define BENCHMARK_REFERENCE_SEED 1000003
+// epsilon of the relative MSE, keeps black reference pixels from dominating
+#define BENCHMARK_RELMSE_EPSILON 0.01
+// standard deviation in pixels of the spatial filter of the FLIP-like error
+#define BENCHMARK_FLIP_SIGMA 1.0
+
+/// <summary>
+/// Settings of an efficiency benchmark (--benchmark).
+/// </summary>
+struct BenchmarkSettings {
+	std::string output;								// prefix of the .json, .csv and reference files
+	std::vector<std::string> scenes{ "random" };	// scenes measured one after the other
+	int max_samples = 256;							// samples per pixel of the last measurement
+	double time_budget = 0;							// seconds per scene, 0 for no limit
+	int reference_samples = 4096;					// samples per pixel of the references
+};
+
+/// <summary>
+/// Error of a rendering after some samples per pixel and render time.
+/// </summary>
+struct benchmarkResult {
+	std::string scene;
+	int samples;
+	double seconds;	// render time of all samples so far
+	double rmse;
+	double relmse;
+	double flip;
+};
+
+/// <summary>
+/// Root mean squared error of the linear colors.
+/// </summary>
+double imageRMSE(const std::vector<color>& image, const std::vector<color>& reference) {
+	double sum = 0;
+	for (size_t i = 0; i < image.size(); i++) {
+		color d = image[i] - reference[i];
+		sum += d.squared_length();
+	}
+	return sqrt(sum / (3.0 * image.size()));
+}
+
+/// <summary>
+/// Relative mean squared error: the squared error of a channel divided by
+/// the squared reference value, which weights dark and bright regions alike.
+/// </summary>
+double imageRelMSE(const std::vector<color>& image, const std::vector<color>& reference) {
+	double sum = 0;
+	for (size_t i = 0; i < image.size(); i++) {
+		for (int c = 0; c < 3; c++) {
+			double d = image[i][c] - reference[i][c];
+			sum += d * d / (reference[i][c] * reference[i][c] + BENCHMARK_RELMSE_EPSILON);
+		}
+	}
+	return sum / (3.0 * image.size());
+}
+
+/// <summary>
+/// Perceptual error in the spirit of FLIP (its color pipeline without the
+/// edge and point feature term): both images are tone mapped as written,
+/// converted to the opponent space YCxCz, low pass filtered like the eye
+/// at normal viewing distance, then compared in L*a*b* with the HyAB
+/// distance. The per pixel error is normalized to [0,1] and compressed,
+/// the result is the mean over the image.
+/// </summary>
+class PerceptualError {
+	public:
+		PerceptualError(int width, int height, const ToneMapping& tm) : width(width), height(height), tm(tm) {
+			// the largest color distance of FLIP, between pure green and blue
+			max_distance = pow(hyab(lab(xyz(color(0, 1, 0))), lab(xyz(color(0, 0, 1)))), FLIP_EXPONENT);
+		}
+
+		double operator()(const std::vector<color>& image, const std::vector<color>& reference) const {
+			std::vector<color> a = filtered(image), b = filtered(reference);
+
+			double sum = 0;
+			for (size_t i = 0; i < a.size(); i++) {
+				double e = pow(hyab(lab(fromYCxCz(a[i])), lab(fromYCxCz(b[i]))), FLIP_EXPONENT) / max_distance;
+				sum += std::min(e, 1.0);
+			}
+			return sum / a.size();
+		}
+
+	private:
+		// compression of the color distance, as in FLIP
+		static constexpr double FLIP_EXPONENT = 0.7;
+
+		// the tone mapped display color, back in linear sRGB
+		color display(const color& c) const {
+			color d = c * tm.exposure;
+			if (tm.reinhard)
+				d = d / (color(1, 1, 1) + d);
+			for (int k = 0; k < 3; k++)
+				d[k] = clamp(d[k], 0.0, 1.0);
+			return d;
+		}
+
+		// linear sRGB to XYZ, scaled to a white point of 1
+		static color xyz(const color& c) {
+			return color((0.4124 * c[0] + 0.3576 * c[1] + 0.1805 * c[2]) / 0.9505,
+						 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2],
+						 (0.0193 * c[0] + 0.1192 * c[1] + 0.9505 * c[2]) / 1.0890);
+		}
+
+		static color toYCxCz(const color& x) {
+			return color(116 * x[1] - 16, 500 * (x[0] - x[1]), 200 * (x[1] - x[2]));
+		}
+
+		static color fromYCxCz(const color& c) {
+			double y = (c[0] + 16) / 116;
+			return color(c[1] / 500 + y, y, y - c[2] / 200);
+		}
+
+		static color lab(const color& x) {
+			auto f = [](double t) { return t > 0.008856 ? cbrt(t) : 7.787 * t + 16.0 / 116; };
+			double fx = f(x[0]), fy = f(x[1]), fz = f(x[2]);
+			return color(116 * fy - 16, 500 * (fx - fy), 200 * (fy - fz));
+		}
+
+		// Euclidean in chroma, absolute in lightness
+		static double hyab(const color& a, const color& b) {
+			double da = a[1] - b[1], db = a[2] - b[2];
+			return fabs(a[0] - b[0]) + sqrt(da * da + db * db);
+		}
+
+		// YCxCz of the display image, filtered by a separable Gaussian
+		std::vector<color> filtered(const std::vector<color>& image) const {
+			int r = (int)ceil(3 * BENCHMARK_FLIP_SIGMA);
+			std::vector<double> kernel(2 * r + 1);
+			double norm = 0;
+			for (int k = -r; k <= r; k++)
+				norm += kernel[k + r] = exp(-k * k / (2 * BENCHMARK_FLIP_SIGMA * BENCHMARK_FLIP_SIGMA));
+			for (auto& k : kernel)
+				k /= norm;
+
+			std::vector<color> opponent(image.size()), rows(image.size()), out(image.size());
+			for (size_t i = 0; i < image.size(); i++)
+				opponent[i] = toYCxCz(xyz(display(image[i])));
+
+			// clamped at the border
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					color c(0, 0, 0);
+					for (int k = -r; k <= r; k++)
+						c += kernel[k + r] * opponent[y * width + std::min(std::max(x + k, 0), width - 1)];
+					rows[y * width + x] = c;
+				}
+			}
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					color c(0, 0, 0);
+					for (int k = -r; k <= r; k++)
+						c += kernel[k + r] * rows[std::min(std::max(y + k, 0), height - 1) * width + x];
+					out[y * width + x] = c;
+				}
+			}
+			return out;
+		}
+
+	private:
+		int width, height;
+		ToneMapping tm;
+		double max_distance;
+};
+
+/// <summary>
+/// Measures the rendering efficiency: error against a high sample
+/// reference over render time and samples per pixel.
+///
+/// Every scene is rendered in progressive passes doubling the samples per
+/// pixel (1, 2, 4, ...) up to max_samples or until the time budget is
+/// spent. After each pass the mean image is compared with the reference,
+/// the time spent comparing is not counted. A reference is rendered with
+/// the same options and a different seed, and kept next to the results,
+/// so later runs (e.g. with a changed sampler) compare against the same
+/// image.
+///
+/// The results are written to output.json and output.csv.
+/// </summary>
+class Benchmark {
+	public:
+		Benchmark(const RenderOption& options, const BenchmarkSettings& settings, ThreadPool& pool)
+			: options(options), settings(settings), pool(pool) {}
+
+		/// <summary>
+		/// Measures all scenes and writes the results.
+		/// </summary>
+		/// <returns>False if a scene, the environment map or an output file is unavailable</returns>
+		bool run() {
+			if (!options.env.empty() && !(environment = EnvironmentMap::load(options.env, options.env_intensity, options.env_rotation, pool)))
+				return false;
+
+			for (const auto& scene : settings.scenes) {
+				if (!measure(scene))
+					return false;
+			}
+			return writeJSON(settings.output + ".json") && writeCSV(settings.output + ".csv");
+		}
+
+		const std::vector<benchmarkResult>& getResults() const {
+			return results;
+		}
+
+	private:
+		// renders the scene and compares each pass with its reference
+		bool measure(const std::string& scene) {
+			RenderOption o = options;
+			o.scene = scene;
+
+			seed_random(o.seed);
+			GeometryList list;
+			if (!buildScene(o, pool, list)) {
+				std::cerr << "benchmark: unknown scene " << scene << "\n";
+				return false;
+			}
+			auto world = make_shared<BVHAccel>(list.getObjects(), 0, 0, BVHCache(o.bvh_cache));
+
+			std::vector<color> reference;
+			if (!loadReference(o, world, reference))
+				return false;
+
+			Frame frame;
+			initFrame(frame, o, o.camera, world, environment);
+			frame.pixels.assign((size_t)frame.width * frame.height, color(0, 0, 0));
+
+			// guiding trains in the first passes as in renderPasses
+			std::unique_ptr<PathGuide> guide;
+			aabb bounds;
+			if (o.guiding && !frame.bidirectional && world->bounding_box(0, 1, bounds)) {
+				guide.reset(new PathGuide(bounds, (size_t)(o.guiding_memory * 1024 * 1024)));
+				frame.guide = guide.get();
+			}
+
+			// the radiance cache fills during the first passes as in renderPasses, the reference is rendered without it
+			std::unique_ptr<RadianceCache> radiance_cache;
+			if (o.radiance_cache && !frame.bidirectional) {
+				radiance_cache.reset(new RadianceCache(o.radiance_cache_cell, o.radiance_cache_samples, o.radiance_cache_depth,
+													   (size_t)(o.radiance_cache_memory * 1024 * 1024)));
+				frame.radiance_cache = radiance_cache.get();
+			}
+
+			PerceptualError flip(frame.width, frame.height, toneMapping(o));
+			std::vector<color> image(frame.pixels.size());
+			double seconds = 0;
+			int total = 0;
+
+			for (int pass = 0; total < settings.max_samples; pass++) {
+				int samples = std::min(std::max(total, 1), settings.max_samples - total);
+				if (guide)
+					guide->training = pass < o.guiding_training;
+
+				auto start = std::chrono::steady_clock::now();
+				renderSamples(frame, pass, samples);
+				if (guide && guide->training)
+					guide->refine(samples);
+				seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				total += samples;
+
+				for (size_t i = 0; i < image.size(); i++)
+					image[i] = frame.pixels[i] / total;
+
+				benchmarkResult r{ scene, total, seconds, imageRMSE(image, reference), imageRelMSE(image, reference), flip(image, reference) };
+				results.push_back(r);
+				std::cerr << "benchmark: " << scene << " " << std::setw(6) << total << " spp " << std::setw(9) << std::fixed
+						  << std::setprecision(3) << seconds << " s  rmse " << std::setprecision(5) << r.rmse << "  relmse " << r.relmse
+						  << "  flip " << r.flip << std::defaultfloat << "\n";
+
+				if (settings.time_budget > 0 && seconds >= settings.time_budget)
+					break;
+			}
+			return true;
+		}
+
+		// adds samples to the frame on the pool
+		void renderSamples(Frame& frame, int pass, int samples) {
+			for (const auto& tile : makeTiles(frame.width, frame.height, options.tile_size))
+				pool.submit([&frame, tile, pass, samples]() { renderTile(frame, tile, pass, samples); });
+			pool.wait();
+
+			if (frame.bidirectional)
+				frame.bidirectional->splats.drain(frame.pixels);
+		}
+
+		// path of the reference, named by a hash of everything the image depends on:
+		// the scene (with its material edits), the view, the lighting and the integrator
+		std::string referencePath(const RenderOption& o) const {
+			std::ostringstream description;
+			const CameraSettings& c = o.camera;
+			description << std::setprecision(17) << o.scene << '\n' << o.seed << '\n' << o.scene_count << '\n' << o.stream << '\n';
+			for (const auto& edit : o.material_edits)
+				description << edit << '\n';
+			description << o.image_width << 'x' << o.image_height << ' ' << o.aspect_ratio << '\n' << settings.reference_samples << '\n'
+						<< c.lookfrom << ' ' << c.lookat << ' ' << c.vup << ' ' << c.vfov << ' ' << c.aperture << ' ' << c.focus_dist << '\n'
+						<< o.sky << '\n' << o.env << '\n' << o.env_intensity << '\n' << o.env_rotation << '\n' << o.integrator;
+
+			std::string text = description.str();
+			unsigned long long h = fnv1a(FNV1A_BASIS, text.data(), text.size());
+
+			char key[17];
+			std::snprintf(key, sizeof(key), "%016llx", h);
+			return settings.output + "-" + o.scene + "-" + key + ".pfm";
+		}
+
+		// loads the reference of the scene or renders and stores it
+		bool loadReference(const RenderOption& o, shared_ptr<Geometry> world, std::vector<color>& reference) {
+			std::string path = referencePath(o);
+			int width, height;
+			if (readPFM(path, width, height, reference) && width == o.image_width && height == o.image_height) {
+				std::cerr << "benchmark: reference " << path << "\n";
+				return true;
+			}
+
+			// without guiding, its training would depend on the options measured
+			Frame frame;
+			initFrame(frame, o, o.camera, world, environment);
+			frame.seed += BENCHMARK_REFERENCE_SEED;
+			frame.pixels.assign((size_t)frame.width * frame.height, color(0, 0, 0));
+
+			auto start = std::chrono::steady_clock::now();
+			for (int total = 0, pass = 0; total < settings.reference_samples; pass++) {
+				int samples = std::min(64, settings.reference_samples - total);
+				renderSamples(frame, pass, samples);
+				total += samples;
+				std::cerr << "\rbenchmark: rendering the " << o.scene << " reference, " << total << "/" << settings.reference_samples << " spp";
+			}
+			std::cerr << " in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s\n";
+
+			reference.resize(frame.pixels.size());
+			for (size_t i = 0; i < reference.size(); i++)
+				reference[i] = frame.pixels[i] / settings.reference_samples;
+
+			if (!writePFM(path, o.image_width, o.image_height, reference))
+				std::cerr << "benchmark: cannot write the reference " << path << "\n";
+			return true;
+		}
+
+		bool writeJSON(const std::string& path) const {
+			std::ofstream out(path);
+			out << std::setprecision(9);
+			out << "{\n"
+				<< "\t\"width\": " << options.image_width << ",\n"
+				<< "\t\"height\": " << options.image_height << ",\n"
+				<< "\t\"threads\": " << pool.size() << ",\n"
+				<< "\t\"reference_samples\": " << settings.reference_samples << ",\n"
+				<< "\t\"results\": [";
+			for (size_t i = 0; i < results.size(); i++) {
+				const benchmarkResult& r = results[i];
+				out << (i ? ",\n" : "\n") << "\t\t{ \"scene\": \"" << r.scene << "\", \"spp\": " << r.samples << ", \"seconds\": " << r.seconds
+					<< ", \"rmse\": " << r.rmse << ", \"relmse\": " << r.relmse << ", \"flip\": " << r.flip << " }";
+			}
+			out << "\n\t]\n}\n";
+
+			if (!out)
+				std::cerr << "benchmark: cannot write " << path << "\n";
+			return (bool)out;
+		}
+
+		bool writeCSV(const std::string& path) const {
+			std::ofstream out(path);
+			out << std::setprecision(9) << "scene,spp,seconds,rmse,relmse,flip\n";
+			for (const auto& r : results)
+				out << r.scene << "," << r.samples << "," << r.seconds << "," << r.rmse << "," << r.relmse << "," << r.flip << "\n";
+
+			if (!out)
+				std::cerr << "benchmark: cannot write " << path << "\n";
+			return (bool)out;
+		}
+
+	private:
+		RenderOption options;
+		BenchmarkSettings settings;
+		ThreadPool& pool;
+		shared_ptr<const EnvironmentMap> environment;
+		std::vector<benchmarkResult> results;
+};
+
+#endif // !BENCHMARK_H
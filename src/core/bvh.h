@@ -0,0 +1,875 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "common.h"
+#include "geometry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// boost
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// maximum number of primitives in a leaf
+#define BVH_MAX_LEAF_SIZE 4
+// number of bins used to evaluate the surface area heuristic
+#define BVH_SAH_BINS 16
+// maximum depth of the hierarchy (size of the traversal stack)
+#define BVH_MAX_DEPTH 64
+
+// count the primitive tests of the traversals for --estimate, 0 leaves primitive_tests at 0
+#ifndef BVH_COUNT_TESTS
+#define BVH_COUNT_TESTS 1
+#endif
+
+// primitives of the leaves visited by the traversals of the calling thread (per ray of a packet)
+thread_local unsigned long long primitive_tests = 0;
+
+/// <summary>
+/// Node of a flattened bounding volume hierarchy.
+///
+/// The nodes are stored depth first in one array, the first child of an
+/// interior node directly follows its parent. The node holds no pointers,
+/// so the array can be copied or stored as it is.
+/// </summary>
+struct bvhNode {
+	aabb box;
+	int offset;	// leaf: index of the first primitive, interior: index of the second child
+	int count;	// number of primitives, 0 for interior nodes
+	int axis;	// split axis of interior nodes
+	int pad;
+};
+
+/// <summary>
+/// Bounding volume hierarchy over a set of primitive bounding boxes.
+///
+/// The hierarchy only stores the primitive order and is independent of the
+/// primitive type, the intersection of the primitives is done by a callback.
+/// </summary>
+class BVH {
+	public:
+		BVH() {}
+
+		BVH(const BVH& other) {
+			*this = other;
+		}
+
+		BVH& operator=(const BVH& other) {
+			if (this == &other) return *this;
+
+			nodes = other.nodes;
+			indices = other.indices;
+			storage = other.storage;
+			node_count = other.node_count;
+			index_count = other.index_count;
+
+			// a built hierarchy points into its own arrays
+			node_data = storage ? other.node_data : nodes.data();
+			index_data = storage ? other.index_data : indices.data();
+			return *this;
+		}
+
+		/// <summary>
+		/// Builds the hierarchy using the binned surface area heuristic.
+		/// </summary>
+		/// <param name="boxes">The bounding boxes of the primitives.</param>
+		void build(const std::vector<aabb>& boxes);
+
+		/// <summary>
+		/// Traverses the hierarchy with the ray r, front to back.
+		/// </summary>
+		/// <param name="r">The ray.</param>
+		/// <param name="t_min">The t minimum.</param>
+		/// <param name="t_max">The t maximum, lowered to the closest hit.</param>
+		/// <param name="intersect">Callback bool(int primitive, double&amp; t_max) intersecting a primitive.</param>
+		/// <returns>True if any primitive was hit</returns>
+		template<typename F>
+		bool traverse(const ray& r, double t_min, double& t_max, F intersect) const;
+
+		/// <summary>
+		/// Traverses the hierarchy with a whole packet, a node is skipped for all
+		/// rays if the packet bounds miss its box.
+		/// </summary>
+		/// <param name="packet">The ray packet.</param>
+		/// <param name="t_min">The t minimum.</param>
+		/// <param name="rec">The per ray records.</param>
+		/// <param name="intersect">Callback bool(int primitive) intersecting a primitive with the packet.</param>
+		/// <returns>True if any primitive was hit</returns>
+		template<typename F>
+		bool traverse_packet(const RayPacket& packet, double t_min, const packetHitRecord& rec, F intersect) const;
+
+		/// <summary>
+		/// Uses nodes and indices stored outside of the hierarchy (e.g. a memory
+		/// mapped cache file) without copying them.
+		/// </summary>
+		/// <param name="nodes">The nodes, depth first.</param>
+		/// <param name="node_count">The number of nodes.</param>
+		/// <param name="indices">The primitive order.</param>
+		/// <param name="index_count">The number of primitives.</param>
+		/// <param name="storage">Keeps the memory of nodes and indices alive.</param>
+		void attach(const bvhNode* nodes, int node_count, const int* indices, int index_count, std::shared_ptr<const void> storage);
+
+		/// <summary>
+		/// Copies attached nodes and indices into arrays owned by the hierarchy.
+		/// </summary>
+		void own();
+
+		/// <summary>
+		/// Checks nodes read from a file before they are traversed: the
+		/// children of every interior node follow it in the array, the depth
+		/// fits the traversal stack and the leaves refer to ranges of the
+		/// primitives.
+		/// </summary>
+		/// <param name="nodes">The nodes, depth first.</param>
+		/// <param name="node_count">The number of nodes.</param>
+		/// <param name="primitive_count">The number of primitives (or indices) the leaves refer to.</param>
+		static bool valid(const bvhNode* nodes, int node_count, int primitive_count);
+
+		/// <summary>
+		/// Order of the primitives, leaves refer to ranges of this array.
+		/// </summary>
+		const int* getIndices() const {
+			return index_data;
+		}
+
+		int indexCount() const {
+			return index_count;
+		}
+
+		const bvhNode* getNodes() const {
+			return node_data;
+		}
+
+		int nodeCount() const {
+			return node_count;
+		}
+
+		bool empty() const {
+			return node_count == 0;
+		}
+
+		aabb bounds() const {
+			return empty() ? aabb() : node_data[0].box;
+		}
+
+	private:
+		struct buildPrimitive {
+			aabb box;
+			point3 centroid;
+			int index;
+		};
+
+		int buildRecursive(std::vector<buildPrimitive>& prims, int begin, int end, int depth);
+
+		int makeLeaf(std::vector<buildPrimitive>& prims, int begin, int end, const aabb& box);
+
+	private:
+		// storage of a built hierarchy
+		std::vector<bvhNode> nodes;
+		std::vector<int> indices;
+
+		// hierarchy used for the traversal, points into nodes and indices or into storage
+		const bvhNode* node_data = nullptr;
+		const int* index_data = nullptr;
+		int node_count = 0;
+		int index_count = 0;
+		std::shared_ptr<const void> storage;
+};
+
+void BVH::build(const std::vector<aabb>& boxes) {
+	attach(nullptr, 0, nullptr, 0, nullptr);
+
+	if (boxes.empty()) return;
+
+	std::vector<buildPrimitive> prims(boxes.size());
+	for (size_t i = 0; i < boxes.size(); i++) {
+		prims[i].box = boxes[i];
+		prims[i].centroid = boxes[i].centroid();
+		prims[i].index = (int)i;
+	}
+
+	nodes.reserve(2 * boxes.size() / BVH_MAX_LEAF_SIZE + 1);
+	indices.reserve(boxes.size());
+	buildRecursive(prims, 0, (int)prims.size(), 0);
+
+	node_data = nodes.data();
+	node_count = (int)nodes.size();
+	index_data = indices.data();
+	index_count = (int)indices.size();
+}
+
+void BVH::attach(const bvhNode* nodes, int node_count, const int* indices, int index_count, std::shared_ptr<const void> storage) {
+	this->nodes.clear();
+	this->indices.clear();
+
+	this->node_data = nodes;
+	this->node_count = node_count;
+	this->index_data = indices;
+	this->index_count = index_count;
+	this->storage = storage;
+}
+
+bool BVH::valid(const bvhNode* nodes, int node_count, int primitive_count) {
+	if (node_count <= 0)
+		return node_count == 0 && primitive_count == 0;
+
+	// (node, depth) of the subtrees to check, every node is reached once from its parent
+	std::vector<std::pair<int, int>> pending(1, std::make_pair(0, 0));
+	int visited = 0;
+	while (!pending.empty()) {
+		int current = pending.back().first, depth = pending.back().second;
+		pending.pop_back();
+		if (++visited > node_count)
+			return false;
+
+		const bvhNode& node = nodes[current];
+		if (node.count > 0) {
+			if (node.offset < 0 || node.offset > primitive_count - node.count)
+				return false;
+			continue;
+		}
+
+		// the interior nodes of buildRecursive end at BVH_MAX_DEPTH - 2
+		if (node.count < 0 || node.axis < 0 || node.axis > 2 || depth >= BVH_MAX_DEPTH - 1 ||
+			current + 1 >= node.offset || node.offset >= node_count)
+			return false;
+		pending.push_back(std::make_pair(current + 1, depth + 1));
+		pending.push_back(std::make_pair(node.offset, depth + 1));
+	}
+	return true;
+}
+
+void BVH::own() {
+	if (!storage) return;
+
+	std::vector<bvhNode> owned_nodes(node_data, node_data + node_count);
+	std::vector<int> owned_indices(index_data, index_data + index_count);
+	storage.reset();
+
+	nodes.swap(owned_nodes);
+	indices.swap(owned_indices);
+	node_data = nodes.data();
+	index_data = indices.data();
+}
+
+int BVH::makeLeaf(std::vector<buildPrimitive>& prims, int begin, int end, const aabb& box) {
+	bvhNode node;
+	node.box = box;
+	node.offset = (int)indices.size();
+	node.count = end - begin;
+	node.axis = 0;
+	node.pad = 0;
+
+	for (int i = begin; i < end; i++)
+		indices.push_back(prims[i].index);
+
+	nodes.push_back(node);
+	return (int)nodes.size() - 1;
+}
+
+int BVH::buildRecursive(std::vector<buildPrimitive>& prims, int begin, int end, int depth) {
+	aabb box, centroid_box;
+	for (int i = begin; i < end; i++) {
+		box = surrounding_box(box, prims[i].box);
+		centroid_box = surrounding_box(centroid_box, prims[i].centroid);
+	}
+
+	int n = end - begin;
+	if (n <= BVH_MAX_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1)
+		return makeLeaf(prims, begin, end, box);
+
+	int axis = centroid_box.longest_axis();
+	double c_min = centroid_box.min()[axis];
+	double c_extent = centroid_box.extent()[axis];
+
+	int mid = begin;
+
+	if (c_extent > 0) {
+		// bin the primitives by their centroids
+		int bin_count[BVH_SAH_BINS] = { 0 };
+		aabb bin_box[BVH_SAH_BINS];
+
+		auto bin_of = [&](const buildPrimitive& p) {
+			int b = (int)(BVH_SAH_BINS * (p.centroid[axis] - c_min) / c_extent);
+			return std::min(std::max(b, 0), BVH_SAH_BINS - 1);
+		};
+
+		for (int i = begin; i < end; i++) {
+			int b = bin_of(prims[i]);
+			bin_count[b]++;
+			bin_box[b] = surrounding_box(bin_box[b], prims[i].box);
+		}
+
+		// cost of splitting after bin i: sweep from the right, then from the left
+		double right_area[BVH_SAH_BINS];
+		int right_count[BVH_SAH_BINS];
+		aabb acc;
+		int cnt = 0;
+		for (int i = BVH_SAH_BINS - 1; i > 0; i--) {
+			acc = surrounding_box(acc, bin_box[i]);
+			cnt += bin_count[i];
+			right_area[i] = acc.surface_area();
+			right_count[i] = cnt;
+		}
+
+		double best_cost = infinity;
+		int best_split = -1;
+		acc = aabb();
+		cnt = 0;
+		for (int i = 0; i < BVH_SAH_BINS - 1; i++) {
+			acc = surrounding_box(acc, bin_box[i]);
+			cnt += bin_count[i];
+			if (cnt == 0 || right_count[i + 1] == 0) continue;
+
+			double cost = cnt * acc.surface_area() + right_count[i + 1] * right_area[i + 1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_split = i;
+			}
+		}
+
+		if (best_split >= 0) {
+			mid = (int)(std::partition(prims.begin() + begin, prims.begin() + end,
+				[&](const buildPrimitive& p) { return bin_of(p) <= best_split; }) - prims.begin());
+		}
+	}
+
+	// no useful split found, split by count at the median centroid
+	if (mid == begin || mid == end) {
+		mid = begin + n / 2;
+		std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+			[axis](const buildPrimitive& a, const buildPrimitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	bvhNode node;
+	node.box = box;
+	node.count = 0;
+	node.axis = axis;
+	node.pad = 0;
+	node.offset = 0;
+
+	int idx = (int)nodes.size();
+	nodes.push_back(node);
+
+	buildRecursive(prims, begin, mid, depth + 1);
+	// the node array may grow while building the children
+	int second = buildRecursive(prims, mid, end, depth + 1);
+	nodes[idx].offset = second;
+
+	return idx;
+}
+
+template<typename F>
+bool BVH::traverse(const ray& r, double t_min, double& t_max, F intersect) const {
+	if (empty()) return false;
+
+	bool dir_neg[3] = { r.direction().x() < 0, r.direction().y() < 0, r.direction().z() < 0 };
+
+	int stack[BVH_MAX_DEPTH];
+	int sp = 0;
+	int current = 0;
+	bool hit_anything = false;
+
+	while (true) {
+		const bvhNode& node = node_data[current];
+
+		if (node.box.hit(r, t_min, t_max)) {
+			if (node.count > 0) {
+#if BVH_COUNT_TESTS
+				primitive_tests += node.count;
+#endif
+				for (int i = node.offset; i < node.offset + node.count; i++) {
+					if (intersect(i, t_max))
+						hit_anything = true;
+				}
+			}
+			else {
+				// visit the near child first
+				if (dir_neg[node.axis]) {
+					stack[sp++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[sp++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (sp == 0) break;
+		current = stack[--sp];
+	}
+
+	return hit_anything;
+}
+
+template<typename F>
+bool BVH::traverse_packet(const RayPacket& packet, double t_min, const packetHitRecord& rec, F intersect) const {
+	if (empty()) return false;
+
+	// largest closest distance of all rays in the packet
+	auto packet_t_max = [&]() {
+		double t = 0;
+		for (int i = 0; i < packet.count; i++)
+			t = fmax(t, rec.closest[i]);
+		return t;
+	};
+
+	double t_max = packet_t_max();
+
+	int stack[BVH_MAX_DEPTH];
+	int sp = 0;
+	int current = 0;
+	bool hit_anything = false;
+
+	while (true) {
+		const bvhNode& node = node_data[current];
+
+		if (node.box.may_hit(packet, t_min, t_max)) {
+			if (node.count > 0) {
+#if BVH_COUNT_TESTS
+				primitive_tests += (unsigned long long)node.count * packet.count;
+#endif
+				bool leaf_hit = false;
+				for (int i = node.offset; i < node.offset + node.count; i++) {
+					if (intersect(i))
+						leaf_hit = true;
+				}
+
+				if (leaf_hit) {
+					hit_anything = true;
+					t_max = packet_t_max();
+				}
+			}
+			else {
+				// the direction interval decides the near child for the whole packet
+				if (packet.dir[node.axis].hi < 0) {
+					stack[sp++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[sp++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (sp == 0) break;
+		current = stack[--sp];
+	}
+
+	return hit_anything;
+}
+
+// version of the cache files, increase when bvhNode or the build changes
+#define BVH_CACHE_VERSION 1
+// alignment of the arrays in the cache files
+#define BVH_CACHE_ALIGN 64
+
+/// <summary>
+/// Header of a cache file. All offsets are relative to the start of the
+/// file, so the mapped file is used at any address without fix-up.
+/// </summary>
+struct bvhCacheHeader {
+	char magic[8];			// "PTBVH"
+	uint32_t version;		// BVH_CACHE_VERSION
+	uint32_t byte_order;	// 0x01020304 in the byte order of the writer
+	uint32_t node_size;		// sizeof(bvhNode)
+	uint32_t pad;
+	uint64_t key;			// hash of the primitive boxes
+	uint64_t node_count;
+	uint64_t node_offset;
+	uint64_t index_count;
+	uint64_t index_offset;
+	uint64_t size;			// size of the file
+};
+
+/// <summary>
+/// Temporary name of a file written by this thread, renamed to path once it
+/// is complete. Processes sharing a directory can write the same file at once.
+/// </summary>
+inline std::string temporaryPath(const std::string& path) {
+	std::ostringstream name;
+	name << path << '.' << std::hex << std::random_device()() << '.' << std::this_thread::get_id() << ".tmp";
+	return name.str();
+}
+
+/// <summary>
+/// On-disk cache of built hierarchies.
+///
+/// A hierarchy only depends on the bounding boxes of its primitives, so it
+/// is stored under a hash of the boxes (and of the build parameters). The
+/// cache file holds the node and index arrays exactly as they are used, a
+/// cached hierarchy is memory mapped and traversed in place.
+/// </summary>
+class BVHCache {
+	public:
+		/// <summary>
+		/// Initializes a new instance of the <see cref="BVHCache"/> class.
+		/// </summary>
+		/// <param name="directory">The directory of the cache files, empty disables the cache.</param>
+		explicit BVHCache(const std::string& directory = "") : directory(directory) {}
+
+		bool enabled() const {
+			return !directory.empty();
+		}
+
+		/// <summary>
+		/// Hash of the primitive boxes and of the build parameters.
+		/// </summary>
+		static uint64_t key(const std::vector<aabb>& boxes) {
+			uint64_t parameters[] = { BVH_CACHE_VERSION, BVH_MAX_LEAF_SIZE, BVH_SAH_BINS, BVH_MAX_DEPTH, boxes.size() };
+			uint64_t h = fnv1a(FNV1A_BASIS, parameters, sizeof(parameters));
+
+			for (const auto& box : boxes) {
+				double bounds[] = { box.min().x(), box.min().y(), box.min().z(), box.max().x(), box.max().y(), box.max().z() };
+				h = fnv1a(h, bounds, sizeof(bounds));
+			}
+
+			return h;
+		}
+
+		/// <summary>
+		/// Path of the cache file of the key.
+		/// </summary>
+		std::string path(uint64_t key) const {
+			char name[32];
+			std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+
+			std::string dir = directory;
+			if (dir.back() != '/' && dir.back() != '\\')
+				dir += '/';
+			return dir + name;
+		}
+
+		/// <summary>
+		/// Maps the cached hierarchy of the key into bvh. The nodes and indices
+		/// are checked, so a corrupt file is rebuilt instead of traversed.
+		/// </summary>
+		/// <param name="key">The key of the primitive boxes.</param>
+		/// <param name="primitive_count">The number of primitives of the hierarchy.</param>
+		/// <param name="bvh">The hierarchy.</param>
+		/// <returns>False if there is no valid cache file</returns>
+		bool load(uint64_t key, int primitive_count, BVH& bvh) const {
+			if (!enabled()) return false;
+
+			std::string file = path(key);
+			if (!std::ifstream(file)) return false;
+
+			namespace bip = boost::interprocess;
+			std::shared_ptr<bip::mapped_region> region;
+			try {
+				bip::file_mapping mapping(file.c_str(), bip::read_only);
+				region = std::make_shared<bip::mapped_region>(mapping, bip::read_only);
+			}
+			catch (std::exception& e) {
+				std::cerr << "bvh cache: cannot map " << file << ": " << e.what() << "\n";
+				return false;
+			}
+
+			const char* data = static_cast<const char*>(region->get_address());
+			size_t size = region->get_size();
+
+			bvhCacheHeader header;
+			if (size < sizeof(header)) return false;
+			std::memcpy(&header, data, sizeof(header));
+
+			if (std::strncmp(header.magic, "PTBVH", sizeof(header.magic)) != 0 ||
+				header.version != BVH_CACHE_VERSION ||
+				header.byte_order != 0x01020304u ||
+				header.node_size != sizeof(bvhNode) ||
+				header.key != key ||
+				header.size != size ||
+				header.node_offset % BVH_CACHE_ALIGN != 0 ||
+				header.node_offset + header.node_count * sizeof(bvhNode) > size ||
+				header.index_offset + header.index_count * sizeof(int) > size ||
+				header.index_count != (uint64_t)primitive_count || header.node_count > (uint64_t)std::numeric_limits<int>::max()) {
+				std::cerr << "bvh cache: ignoring invalid or outdated " << file << "\n";
+				return false;
+			}
+
+			const bvhNode* nodes = reinterpret_cast<const bvhNode*>(data + header.node_offset);
+			const int* indices = reinterpret_cast<const int*>(data + header.index_offset);
+			bool valid = BVH::valid(nodes, (int)header.node_count, primitive_count);
+			for (int i = 0; i < primitive_count && valid; i++)
+				valid = indices[i] >= 0 && indices[i] < primitive_count;
+			if (!valid) {
+				std::cerr << "bvh cache: ignoring corrupt " << file << "\n";
+				return false;
+			}
+
+			bvh.attach(reinterpret_cast<const bvhNode*>(data + header.node_offset), (int)header.node_count,
+					   reinterpret_cast<const int*>(data + header.index_offset), (int)header.index_count,
+					   region);
+			return true;
+		}
+
+		/// <summary>
+		/// Writes the hierarchy to the cache file of the key. The file is written
+		/// under a temporary name and renamed, so readers never see a partial file.
+		/// </summary>
+		/// <returns>True if the file was written</returns>
+		bool store(uint64_t key, const BVH& bvh) const {
+			if (!enabled()) return false;
+
+			bvhCacheHeader header;
+			std::memset(&header, 0, sizeof(header));
+			std::strncpy(header.magic, "PTBVH", sizeof(header.magic));
+			header.version = BVH_CACHE_VERSION;
+			header.byte_order = 0x01020304u;
+			header.node_size = sizeof(bvhNode);
+			header.key = key;
+			header.node_count = bvh.nodeCount();
+			header.node_offset = align(sizeof(header));
+			header.index_count = bvh.indexCount();
+			header.index_offset = align(header.node_offset + header.node_count * sizeof(bvhNode));
+			header.size = header.index_offset + header.index_count * sizeof(int);
+
+			std::string file = path(key);
+			std::string temp = temporaryPath(file);
+			{
+				std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+				if (!out) {
+					std::cerr << "bvh cache: cannot write " << temp << "\n";
+					return false;
+				}
+
+				std::vector<char> zeros(BVH_CACHE_ALIGN, 0);
+				out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+				out.write(zeros.data(), header.node_offset - sizeof(header));
+				out.write(reinterpret_cast<const char*>(bvh.getNodes()), header.node_count * sizeof(bvhNode));
+				out.write(zeros.data(), header.index_offset - header.node_offset - header.node_count * sizeof(bvhNode));
+				out.write(reinterpret_cast<const char*>(bvh.getIndices()), header.index_count * sizeof(int));
+
+				if (!out) {
+					std::cerr << "bvh cache: cannot write " << temp << "\n";
+					std::remove(temp.c_str());
+					return false;
+				}
+			}
+
+			std::remove(file.c_str());
+			if (std::rename(temp.c_str(), file.c_str()) != 0) {
+				std::remove(temp.c_str());
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		static uint64_t align(uint64_t offset) {
+			return (offset + BVH_CACHE_ALIGN - 1) / BVH_CACHE_ALIGN * BVH_CACHE_ALIGN;
+		}
+
+	private:
+		std::string directory;
+};
+
+/// <summary>
+/// Geometry storing other Geometry in a bounding volume hierarchy.
+/// </summary>
+/// <seealso cref="Geometry" />
+class BVHAccel : public Geometry {
+	public:
+		BVHAccel() {}
+
+		/// <summary>
+		/// Initializes a new instance of the <see cref="BVHAccel"/> class.
+		/// </summary>
+		/// <param name="list">The objects stored in the hierarchy.</param>
+		/// <param name="time0">The shutter open time.</param>
+		/// <param name="time1">The shutter close time.</param>
+		/// <param name="cache">The on-disk cache the hierarchy is loaded from or stored to.</param>
+		BVHAccel(const std::vector<shared_ptr<Geometry>>& list, double time0 = 0, double time1 = 0, const BVHCache& cache = BVHCache());
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const override;
+
+		virtual bool may_hit(const RayPacket& packet, double t_min) const override {
+			return bvh.bounds().may_hit(packet, t_min, infinity);
+		}
+
+		virtual bool hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const override;
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+			if (bvh.empty()) return false;
+			output_box = bvh.bounds();
+			return true;
+		}
+
+		virtual void emitters(std::vector<sphereEmitter>& lights) const override {
+			for (const auto& object : objects)
+				object->emitters(lights);
+			for (const auto& object : unbounded)
+				object->emitters(lights);
+		}
+
+		virtual void materials(std::vector<shared_ptr<material>>& list) const override {
+			for (const auto& object : objects)
+				object->materials(list);
+			for (const auto& object : unbounded)
+				object->materials(list);
+		}
+
+		const std::vector<shared_ptr<Geometry>>& getObjects() const {
+			return objects;
+		}
+
+		const std::vector<shared_ptr<Geometry>>& getUnbounded() const {
+			return unbounded;
+		}
+
+		/// <summary>
+		/// Copy of the hierarchy and of the object list in memory allocated by the
+		/// calling thread, the objects themselves are shared.
+		/// </summary>
+		shared_ptr<BVHAccel> replicate() const {
+			auto copy = make_shared<BVHAccel>(*this);
+			copy->bvh.own();
+			return copy;
+		}
+
+		/// <summary>
+		/// Bytes of the hierarchy and of the object lists, without the objects.
+		/// </summary>
+		size_t memory() const {
+			return (size_t)bvh.nodeCount() * sizeof(bvhNode) + (size_t)bvh.indexCount() * sizeof(int) +
+				   (objects.capacity() + unbounded.capacity()) * sizeof(shared_ptr<Geometry>);
+		}
+
+		/// <summary>
+		/// True if the hierarchy was mapped from the cache instead of being built.
+		/// </summary>
+		bool cached() const {
+			return from_cache;
+		}
+
+		void print(std::ostream& os) const {
+			os << "BVH {\tobjects:" << objects.size() << "\tnodes:" << bvh.nodeCount() << "\t}";
+		}
+
+	private:
+		// objects sorted into the order of the hierarchy leaves
+		std::vector<shared_ptr<Geometry>> objects;
+		// objects without a bounding box, tested against every ray
+		std::vector<shared_ptr<Geometry>> unbounded;
+		BVH bvh;
+		bool from_cache = false;
+};
+
+BVHAccel::BVHAccel(const std::vector<shared_ptr<Geometry>>& list, double time0, double time1, const BVHCache& cache) {
+	std::vector<aabb> boxes;
+	std::vector<shared_ptr<Geometry>> bounded;
+
+	boxes.reserve(list.size());
+	bounded.reserve(list.size());
+
+	for (const auto& object : list) {
+		aabb box;
+		if (object->bounding_box(time0, time1, box)) {
+			boxes.push_back(box);
+			bounded.push_back(object);
+		}
+		else {
+			unbounded.push_back(object);
+		}
+	}
+
+	if (cache.enabled()) {
+		auto key = BVHCache::key(boxes);
+		from_cache = cache.load(key, (int)boxes.size(), bvh);
+		if (!from_cache) {
+			bvh.build(boxes);
+			cache.store(key, bvh);
+		}
+	}
+	else {
+		bvh.build(boxes);
+	}
+
+	objects.reserve(bounded.size());
+	for (int i = 0; i < bvh.indexCount(); i++)
+		objects.push_back(bounded[bvh.getIndices()[i]]);
+}
+
+bool BVHAccel::intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const {
+	auto closest_so_far = t_max;
+	auto hit_anything = false;
+
+	for (const auto& object : unbounded) {
+		if (object->intersect(r, t_min, closest_so_far, hit)) {
+			hit_anything = true;
+			closest_so_far = hit.t;
+		}
+	}
+
+	if (bvh.traverse(r, t_min, closest_so_far,
+		[&](int i, double& t) {
+			if (!objects[i]->intersect(r, t_min, t, hit)) return false;
+			t = hit.t;
+			return true;
+		}))
+		hit_anything = true;
+
+	return hit_anything;
+}
+
+bool BVHAccel::hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const {
+	auto hit_anything = false;
+
+	if (!packet.coherent) {
+		for (int i = 0; i < packet.count; i++) {
+			if (intersect(packet.rays[i], t_min, rec.closest[i], rec.surface[i])) {
+				hit_anything = true;
+				rec.hit[i] = true;
+				rec.closest[i] = rec.surface[i].t;
+			}
+		}
+		return hit_anything;
+	}
+
+	for (const auto& object : unbounded) {
+		if (object->hit_packet(packet, t_min, rec))
+			hit_anything = true;
+	}
+
+	if (bvh.traverse_packet(packet, t_min, rec,
+		[&](int i) { return objects[i]->hit_packet(packet, t_min, rec); }))
+		hit_anything = true;
+
+	return hit_anything;
+}
+
+/// <summary>
+/// Adds the objects at the top of the world to objects, lists and
+/// hierarchies are replaced by their objects.
+/// </summary>
+void flattenGeometry(const shared_ptr<Geometry>& geometry, std::vector<shared_ptr<Geometry>>& objects) {
+	if (auto accel = std::dynamic_pointer_cast<BVHAccel>(geometry)) {
+		for (const auto& object : accel->getObjects())
+			flattenGeometry(object, objects);
+		for (const auto& object : accel->getUnbounded())
+			flattenGeometry(object, objects);
+	}
+	else if (auto list = std::dynamic_pointer_cast<GeometryList>(geometry)) {
+		for (const auto& object : list->getObjects())
+			flattenGeometry(object, objects);
+	}
+	else {
+		objects.push_back(geometry);
+	}
+}
+
+#endif // !BVH_H
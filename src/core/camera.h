@@ -3,6 +3,9 @@
 
 #include "common.h"
 
+#include <algorithm>
+#include <cmath>
+
 /// <summary>
 /// Implements an (axis aligned) camera
 /// </summary>
@@ -52,6 +55,7 @@ class Camera {
 								- focus_dist * w;
 
 			lens_radius = aperture / 2;
+			focus = focus_dist;
 			time0 = _time0;
 			time1 = _time1;
 		};
@@ -65,6 +69,112 @@ class Camera {
 						lower_left_corner + s* horizontal+ t * vertical - origin - offset,
 						random_double(time0, time1));
 		};
+
+		/// <summary>
+		/// Ray through the image point (s, t) from given samples instead of
+		/// random numbers, so the ray can be built again.
+		/// </summary>
+		/// <param name="lens_u">The first uniform sample of the lens point.</param>
+		/// <param name="lens_v">The second uniform sample of the lens point.</param>
+		/// <param name="time_u">The uniform sample of the time in the shutter interval.</param>
+		ray get_ray(double s, double t, double lens_u, double lens_v, double time_u) const {
+			vec3 rd = lens_radius * concentric_disk(lens_u, lens_v);
+
+			vec3 offset = u * rd.x() + v * rd.y();
+
+			return ray(origin + offset,
+					   lower_left_corner + s * horizontal + t * vertical - origin - offset,
+					   time0 + (time1 - time0) * time_u);
+		}
+
+		/// <summary>
+		/// Samples a point of the lens, uniform in its area.
+		/// </summary>
+		point3 sample_lens() const {
+			vec3 rd = lens_radius * random_in_unit_disk();
+			return origin + u * rd.x() + v * rd.y();
+		}
+
+		/// <summary>
+		/// Projects the point p seen from a point of the lens onto the image,
+		/// the inverse of get_ray.
+		/// </summary>
+		/// <param name="lens">The point of the lens.</param>
+		/// <param name="p">The point.</param>
+		/// <param name="s">The horizontal image coordinate, as passed to get_ray.</param>
+		/// <param name="t">The vertical image coordinate, as passed to get_ray.</param>
+		/// <param name="cosine">The cosine of the direction to p with the viewing direction.</param>
+		/// <returns>False if p is behind the lens</returns>
+		bool project(const point3& lens, const point3& p, double& s, double& t, double& cosine) const {
+			vec3 d = p - lens;
+			double along = -dot(d, w);
+			if (along <= 0) return false;
+
+			vec3 e = lens + d * (focus / along) - lower_left_corner;
+			s = dot(e, u) / horizontal.length();
+			t = dot(e, v) / vertical.length();
+			cosine = along / d.length();
+			return true;
+		}
+
+		/// <summary>
+		/// Area of the image (s, t in [0,1]) on the plane in focus.
+		/// </summary>
+		double image_area() const {
+			return horizontal.length() * vertical.length();
+		}
+
+		double focus_distance() const {
+			return focus;
+		}
+
+		double sample_time() const {
+			return random_double(time0, time1);
+		}
+
+		double shutter_open() const { return time0; }
+		double shutter_close() const { return time1; }
+
+		/// <summary>
+		/// Rectangle of image coordinates (s, t as passed to get_ray) of the
+		/// camera rays which can pass a sphere.
+		///
+		/// The rays start anywhere on the lens and pass the focus plane at
+		/// their image point, so at depth z a point spreads by the circle of
+		/// confusion lens_radius * |1 - focus / z| on the focus plane around
+		/// its pinhole projection. A sphere reaching behind the lens plane
+		/// covers the whole image.
+		/// </summary>
+		/// <returns>False if the sphere is behind the lens</returns>
+		bool sphere_bounds(const point3& center, double radius, double& s0, double& s1, double& t0, double& t1) const {
+			vec3 rel = center - origin;
+			double cx = dot(rel, u), cy = dot(rel, v), cz = -dot(rel, w);
+			double zmin = cz - radius, zmax = cz + radius;
+
+			if (zmax <= 0)
+				return false;
+
+			if (zmin <= focus * 1e-6) {
+				s0 = t0 = -infinity;
+				s1 = t1 = infinity;
+				return true;
+			}
+
+			// pinhole projection of the box around the sphere, x / z is extreme at the corners
+			double xs[] = { (cx - radius) / zmin, (cx - radius) / zmax, (cx + radius) / zmin, (cx + radius) / zmax };
+			double ys[] = { (cy - radius) / zmin, (cy - radius) / zmax, (cy + radius) / zmin, (cy + radius) / zmax };
+
+			// |1 - focus / z| is extreme at the ends of the depth range
+			double coc = lens_radius * std::max(std::fabs(1 - focus / zmin), std::fabs(1 - focus / zmax));
+
+			double width = horizontal.length(), height = vertical.length();
+			s0 = (focus * *std::min_element(xs, xs + 4) - coc) / width + 0.5;
+			s1 = (focus * *std::max_element(xs, xs + 4) + coc) / width + 0.5;
+			t0 = (focus * *std::min_element(ys, ys + 4) - coc) / height + 0.5;
+			t1 = (focus * *std::max_element(ys, ys + 4) + coc) / height + 0.5;
+			return true;
+		}
+
 	private:
 		point3 origin;
 		point3 lower_left_corner;
@@ -74,8 +184,43 @@ class Camera {
 		vec3 u, v, w;
 
 		double lens_radius;
+		double focus;		 // distance of the plane in focus
 		double time0, time1; // shutter open/close times
 
 };
 
+/// <summary>
+/// Constructor arguments of a <see cref="Camera"/> (without the aspect ratio),
+/// e.g. to store and interpolate camera keyframes.
+/// </summary>
+struct CameraSettings {
+	point3 lookfrom = point3(13, 2, 3);
+	point3 lookat = point3(0, 0, 0);
+	vec3 vup = vec3(0, 1, 0);
+	double vfov = 20;	// vertical field-of-view in degrees
+	double aperture = 0.1;
+	double focus_dist = 10.0;
+
+	/// <summary>
+	/// Creates the camera for the aspect ratio.
+	/// </summary>
+	Camera make(double aspect) const {
+		return Camera(lookfrom, lookat, vup, vfov, aspect, aperture, focus_dist);
+	}
+};
+
+/// <summary>
+/// Linear blend of two camera settings.
+/// </summary>
+inline CameraSettings lerp(const CameraSettings& a, const CameraSettings& b, double t) {
+	CameraSettings c;
+	c.lookfrom = lerp(a.lookfrom, b.lookfrom, t);
+	c.lookat = lerp(a.lookat, b.lookat, t);
+	c.vup = lerp(a.vup, b.vup, t);
+	c.vfov = (1 - t) * a.vfov + t * b.vfov;
+	c.aperture = (1 - t) * a.aperture + t * b.aperture;
+	c.focus_dist = (1 - t) * a.focus_dist + t * b.focus_dist;
+	return c;
+}
+
 #endif // !CAMERA_H
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <cstdlib>
 #include <limits>
 #include <memory> // for shared ptr
+#include <random>
 
 // Usings
 
@@ -50,22 +51,30 @@ inline double clamp(double x, double min, double max) {
 }
 
 /// <summary>
-/// Returns a random real in [0,1)
+/// Returns the random number generator of the calling thread.
+/// Every thread owns its generator, so no state is shared between render threads.
 /// </summary>
 /// <returns></returns>
-inline double random_double() {
-	return rand() / (RAND_MAX + 1.0);
+inline std::mt19937& random_generator() {
+	static thread_local std::mt19937 generator;
+	return generator;
 }
 
-/* alternative random number generator cpp */
-/*
-#include <random>
+/// <summary>
+/// Seeds the random number generator of the calling thread.
+/// </summary>
+/// <param name="seed">The seed.</param>
+inline void seed_random(unsigned int seed) {
+	random_generator().seed(seed);
+}
+
+/// <summary>
+/// Returns a random real in [0,1)
+/// </summary>
+/// <returns></returns>
 inline double random_double() {
-	static std::uniform_int_distribution<double> distribution(0.0, 1.0);
-	static std::mt19937 generator;
-	return distribution(generator);
+	return random_generator()() / 4294967296.0;
 }
-*/
 
 /// <summary>
 /// Returns a random real in [minimum, maximum)
@@ -87,6 +96,25 @@ inline int random_int(int min, int max) {
 	return static_cast<int>(random_double(min, max + 1));
 }
 
+// offset basis of the FNV-1a hash, the h of an empty input
+#define FNV1A_BASIS 14695981039346656037ull
+
+/// <summary>
+/// Continues the FNV-1a hash h with the bytes of data.
+/// </summary>
+/// <param name="h">The hash so far, FNV1A_BASIS to start a hash.</param>
+/// <param name="data">The bytes.</param>
+/// <param name="size">The number of bytes.</param>
+/// <returns></returns>
+inline unsigned long long fnv1a(unsigned long long h, const void* data, size_t size) {
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
 // common headers
 #include "ray.h"
 #include "vec.h"
@@ -0,0 +1,227 @@
+#ifndef COSTMAP_H
+#define COSTMAP_H
+
+#include "common.h"
+#include "image.h"
+#include "renderer.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/algorithm/string/predicate.hpp>
+
+// edge length of the blocks of pixels the cost is kept for
+#define COST_BLOCK 8
+// paths traced per block by the estimate pass
+#define COST_ESTIMATE_PATHS 4
+// tasks per render thread, tiles costing more than their share are split
+#define COST_TASKS_PER_THREAD 8
+// smallest edge length of a split tile
+#define COST_MIN_TILE 8
+
+/// <summary>
+/// Cost model of the tile scheduling: the rays traced per sample of the
+/// pixels, in blocks of COST_BLOCK x COST_BLOCK pixels.
+///
+/// The cost is counted in rays instead of time, so the tiles (and with
+/// them the random numbers) do not depend on the machine or its load and
+/// every run still renders the same image.
+/// </summary>
+class CostMap {
+	public:
+		CostMap(int width, int height)
+			: width(width), height(height),
+			  columns((width + COST_BLOCK - 1) / COST_BLOCK), rows((height + COST_BLOCK - 1) / COST_BLOCK),
+			  blocks((size_t)columns * rows, 0.0) {}
+
+		/// <summary>
+		/// Estimates the cost with a low resolution pass of COST_ESTIMATE_PATHS
+		/// path traced samples per block, the pixels of the frame are not
+		/// changed. A row of blocks is a task of the pool. The paths predict
+		/// the cost of path traced frames only, bidirectional frames are
+		/// scheduled from their measured cost.
+		/// </summary>
+		void estimate(ThreadPool& pool, const Frame& frame) {
+			for (int by = 0; by < rows; by++) {
+				pool.submit([this, &frame, by]() {
+					const Geometry& world = frame.worldOn(currentNumaNode());
+					PathContext context;
+					context.environment = frame.environment.get();
+					context.sky = frame.sky;
+
+					// after the seeds of the preview stages
+					seed_random(tileSeed(frame.seed, frame.number, -3, by));
+
+					for (int bx = 0; bx < columns; bx++) {
+						unsigned long long before = traced_rays;
+						for (int s = 0; s < COST_ESTIMATE_PATHS; s++) {
+							double x = std::min(bx * COST_BLOCK + random_double() * COST_BLOCK, (double)width);
+							double y = std::min(by * COST_BLOCK + random_double() * COST_BLOCK, (double)height);
+							ray_color(frame.cam.get_ray(x / (width - 1), (height - y) / (height - 1)), world, 0, context);
+						}
+						blocks[(size_t)by * columns + bx] = (double)(traced_rays - before) / COST_ESTIMATE_PATHS;
+					}
+				});
+			}
+			pool.wait();
+		}
+
+		/// <summary>
+		/// Sets the cost from the rays measured for the pixels (frame.cost).
+		/// </summary>
+		/// <param name="frame">The frame.</param>
+		/// <param name="samples">The samples per pixel frame.cost is the sum of.</param>
+		void measure(const Frame& frame, int samples) {
+			for (int by = 0; by < rows; by++) {
+				for (int bx = 0; bx < columns; bx++) {
+					int x1 = std::min((bx + 1) * COST_BLOCK, width), y1 = std::min((by + 1) * COST_BLOCK, height);
+					double sum = 0;
+					for (int y = by * COST_BLOCK; y < y1; y++) {
+						for (int x = bx * COST_BLOCK; x < x1; x++)
+							sum += frame.cost[(size_t)y * width + x];
+					}
+					blocks[(size_t)by * columns + bx] = sum / ((double)(x1 - bx * COST_BLOCK) * (y1 - by * COST_BLOCK) * std::max(samples, 1));
+				}
+			}
+		}
+
+		/// <summary>
+		/// Rays traced per sample of all pixels of the tile.
+		/// </summary>
+		double cost(const Tile& tile) const {
+			double sum = 0;
+			for (int by = tile.y0 / COST_BLOCK; by * COST_BLOCK < tile.y1; by++) {
+				int h = std::min((by + 1) * COST_BLOCK, tile.y1) - std::max(by * COST_BLOCK, tile.y0);
+				for (int bx = tile.x0 / COST_BLOCK; bx * COST_BLOCK < tile.x1; bx++) {
+					int w = std::min((bx + 1) * COST_BLOCK, tile.x1) - std::max(bx * COST_BLOCK, tile.x0);
+					sum += blocks[(size_t)by * columns + bx] * w * h;
+				}
+			}
+			return sum;
+		}
+
+		/// <summary>
+		/// Orders the tiles for the render threads: tiles costing more than
+		/// their share of the image (1 / (threads * COST_TASKS_PER_THREAD))
+		/// are split into quarters down to COST_MIN_TILE pixels, then the
+		/// most expensive tiles start first (longest processing time first),
+		/// so no expensive tile is left over at the end of the pass.
+		///
+		/// Tiles which are not split keep their index (and random numbers),
+		/// the parts of split tiles are numbered after the last tile.
+		/// </summary>
+		/// <param name="tiles">The tiles of makeTiles.</param>
+		/// <param name="threads">The number of render threads.</param>
+		/// <param name="split">False to keep the tiles and only order them.</param>
+		std::vector<Tile> schedule(const std::vector<Tile>& tiles, int threads, bool split) const {
+			double total = 0;
+			for (const auto& tile : tiles)
+				total += cost(tile);
+			double share = total / (std::max(threads, 1) * COST_TASKS_PER_THREAD);
+
+			std::vector<std::pair<double, Tile>> costed;
+			int next = (int)tiles.size();
+
+			std::function<void(const Tile&, double)> add = [&](const Tile& tile, double c) {
+				int w = tile.x1 - tile.x0, h = tile.y1 - tile.y0;
+				if (!split || c <= share || (w <= COST_MIN_TILE && h <= COST_MIN_TILE)) {
+					costed.push_back(std::make_pair(c, tile));
+					return;
+				}
+
+				int mx = w > COST_MIN_TILE ? tile.x0 + w / 2 : tile.x1;
+				int my = h > COST_MIN_TILE ? tile.y0 + h / 2 : tile.y1;
+				const int xs[] = { tile.x0, mx, tile.x1 }, ys[] = { tile.y0, my, tile.y1 };
+				for (int j = 0; j < 2; j++) {
+					for (int i = 0; i < 2; i++) {
+						if (xs[i] == xs[i + 1] || ys[j] == ys[j + 1]) continue;
+						Tile part{ xs[i], ys[j], xs[i + 1], ys[j + 1], next++ };
+						add(part, cost(part));
+					}
+				}
+			};
+
+			for (const auto& tile : tiles)
+				add(tile, cost(tile));
+
+			std::stable_sort(costed.begin(), costed.end(),
+							 [](const std::pair<double, Tile>& a, const std::pair<double, Tile>& b) { return a.first > b.first; });
+
+			std::vector<Tile> order;
+			for (const auto& c : costed)
+				order.push_back(c.second);
+			return order;
+		}
+
+		/// <summary>
+		/// Time of the pass predicted by the cost model relative to a perfect
+		/// balance (1), if the threads take the tiles in this order.
+		/// </summary>
+		double imbalance(const std::vector<Tile>& order, int threads) const {
+			threads = std::max(threads, 1);
+			std::priority_queue<double, std::vector<double>, std::greater<double>> finish;
+			for (int i = 0; i < threads; i++)
+				finish.push(0);
+
+			double total = 0, end = 0;
+			for (const auto& tile : order) {
+				double c = cost(tile), start = finish.top();
+				finish.pop();
+				finish.push(start + c);
+				end = std::max(end, start + c);
+				total += c;
+			}
+			return total > 0 ? end * threads / total : 1;
+		}
+
+	private:
+		int width;
+		int height;
+		int columns;
+		int rows;
+		std::vector<double> blocks;	// rays per sample and pixel of each block
+};
+
+/// <summary>
+/// Writes the cost heatmap of the frame: the rays traced per sample of
+/// every pixel. A .pfm stores the ray counts, the 8 bit formats a false
+/// color image scaled to the most expensive pixel (black, blue, red,
+/// yellow, white).
+/// </summary>
+/// <param name="path">The file path.</param>
+/// <param name="frame">The frame with the measured frame.cost.</param>
+/// <param name="samples">The samples per pixel frame.cost is the sum of.</param>
+/// <returns>false if the heatmap cannot be written</returns>
+bool writeCostImage(const std::string& path, const Frame& frame, int samples) {
+	if (frame.cost.empty())
+		return false;
+
+	size_t n = (size_t)frame.width * frame.height;
+	if (boost::algorithm::ends_with(path, ".pfm")) {
+		std::vector<vec3> rays(n);
+		for (size_t i = 0; i < n; i++)
+			rays[i] = vec3(1, 1, 1) * ((double)frame.cost[i] / std::max(samples, 1));
+		return writePFM(path, frame.width, frame.height, rays);
+	}
+
+	unsigned int most = std::max(1u, *std::max_element(frame.cost.begin(), frame.cost.end()));
+	const color ramp[] = { color(0, 0, 0), color(0, 0, 1), color(1, 0, 0), color(1, 1, 0), color(1, 1, 1) };
+
+	std::vector<unsigned char> rgb(n * 3);
+	for (size_t i = 0; i < n; i++) {
+		double t = 4.0 * frame.cost[i] / most;
+		int k = std::min((int)t, 3);
+		color c = ramp[k] + (ramp[k + 1] - ramp[k]) * (t - k);
+		for (int j = 0; j < 3; j++)
+			rgb[3 * i + j] = (unsigned char)(255.99 * clamp(c[j], 0.0, 1.0));
+	}
+	return writeImage(path, frame.width, frame.height, rgb.data());
+}
+
+#endif // !COSTMAP_H
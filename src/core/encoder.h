@@ -0,0 +1,208 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "common.h"
+#include "image.h"
+#include "renderer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Parameters mapping the linear radiance to display values.
+/// </summary>
+struct ToneMapping {
+	double exposure = 1.0;	// scale applied before the tone curve
+	bool reinhard = false;	// compress highlights with c / (1 + c), otherwise clamp
+};
+
+/// <summary>
+/// Maps a display value in [0,1] to 8 bit, values outside are clamped.
+/// </summary>
+inline unsigned char quantize(double v) {
+	return (unsigned char)(256 * clamp(v, 0.0, 0.999));
+}
+
+/// <summary>
+/// Tone maps a linear color (already scaled by exposure / samples) to 8 bit RGB.
+/// </summary>
+inline void tonemapPixel(color c, const ToneMapping& tm, unsigned char* p) {
+	if (tm.reinhard)
+		c = c / (color(1, 1, 1) + c);
+
+	//  gamma=2.0 correction
+	p[0] = quantize(sqrt(fmax(c.r(), 0.0)));
+	p[1] = quantize(sqrt(fmax(c.g(), 0.0)));
+	p[2] = quantize(sqrt(fmax(c.b(), 0.0)));
+}
+
+/// <summary>
+/// Tone maps a tile of the accumulated frame into an 8 bit RGB image.
+/// Runs on the render threads right after a tile is finished, so the
+/// linear framebuffer is never copied.
+/// </summary>
+/// <param name="frame">The frame holding the sample sums.</param>
+/// <param name="tile">The tile.</param>
+/// <param name="samples">The number of samples accumulated so far.</param>
+/// <param name="tm">The tone mapping parameters.</param>
+/// <param name="rgb">The 8 bit image (width * height * 3), row by row from the top.</param>
+void tonemapTile(const Frame& frame, const Tile& tile, int samples, const ToneMapping& tm, unsigned char* rgb) {
+	// divide the color for multi sampling by the number of samples
+	auto scale = tm.exposure / std::max(samples, 1);
+
+	for (int y = tile.y0; y < tile.y1; ++y) {
+		for (int i = tile.x0; i < tile.x1; ++i) {
+			size_t k = (size_t)y * frame.width + i;
+			tonemapPixel(frame.pixels[k] * scale, tm, rgb + 3 * k);
+		}
+	}
+}
+
+/// <summary>
+/// Tone mapped image waiting for its encoding.
+/// </summary>
+struct EncodeJob {
+	std::string path;
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> rgb;
+
+	// called by the encoding thread once the image is written
+	std::function<void(bool)> written;
+};
+
+/// <summary>
+/// Background stage encoding finished images (PNG/JPEG/PPM) while the
+/// render threads continue with the next frame or pass.
+///
+/// At most capacity images are in flight, acquire blocks until an image
+/// was written, which bounds the memory and throttles the renderer if the
+/// encoding falls behind. The 8 bit buffers of written images are reused.
+/// </summary>
+class ImageEncoder {
+	public:
+		explicit ImageEncoder(int capacity = 2)
+			: capacity(std::max(capacity, 1)), outstanding(0), stop(false),
+			  worker(&ImageEncoder::work, this) {}
+
+		~ImageEncoder() {
+			finish();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			queued.notify_all();
+			worker.join();
+		}
+
+		ImageEncoder(const ImageEncoder&) = delete;
+		ImageEncoder& operator=(const ImageEncoder&) = delete;
+
+		/// <summary>
+		/// Reserves an image for the encoding, blocks while capacity images are in flight.
+		/// </summary>
+		/// <param name="path">The output path.</param>
+		/// <param name="width">The image width.</param>
+		/// <param name="height">The image height.</param>
+		shared_ptr<EncodeJob> acquire(const std::string& path, int width, int height) {
+			auto job = make_shared<EncodeJob>();
+			job->path = path;
+			job->width = width;
+			job->height = height;
+
+			std::unique_lock<std::mutex> lock(mutex);
+			released.wait(lock, [this]() { return outstanding < capacity; });
+			outstanding++;
+
+			if (!buffers.empty()) {
+				job->rgb.swap(buffers.back());
+				buffers.pop_back();
+			}
+			lock.unlock();
+
+			job->rgb.resize(width * height * 3);
+			return job;
+		}
+
+		/// <summary>
+		/// Hands the tone mapped image to the background encoding.
+		/// </summary>
+		void submit(shared_ptr<EncodeJob> job) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				jobs.push_back(job);
+			}
+			queued.notify_one();
+		}
+
+		/// <summary>
+		/// Returns an acquired image which is not going to be written (e.g. a cancelled render).
+		/// </summary>
+		void release(shared_ptr<EncodeJob> job) {
+			recycle(*job);
+			released.notify_all();
+		}
+
+		/// <summary>
+		/// Blocks until all acquired images are written.
+		/// </summary>
+		void finish() {
+			std::unique_lock<std::mutex> lock(mutex);
+			released.wait(lock, [this]() { return outstanding == 0; });
+		}
+
+	private:
+		void work() {
+			while (true) {
+				shared_ptr<EncodeJob> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					queued.wait(lock, [this]() { return stop || !jobs.empty(); });
+
+					if (jobs.empty())
+						return;
+
+					job = jobs.front();
+					jobs.pop_front();
+				}
+
+				bool ok = writeImage(job->path, job->width, job->height, job->rgb.data());
+				if (!ok)
+					std::cerr << "\nunsupported image format " << job->path << "\n";
+
+				if (job->written)
+					job->written(ok);
+
+				recycle(*job);
+				released.notify_all();
+			}
+		}
+
+		void recycle(EncodeJob& job) {
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers.push_back(std::vector<unsigned char>());
+			buffers.back().swap(job.rgb);
+			outstanding--;
+		}
+
+	private:
+		int capacity;
+		int outstanding;	// acquired and not yet written images
+		bool stop;
+
+		std::deque<shared_ptr<EncodeJob>> jobs;
+		std::vector<std::vector<unsigned char>> buffers;	// buffers of written images
+
+		std::mutex mutex;
+		std::condition_variable queued;
+		std::condition_variable released;
+
+		std::thread worker;
+};
+
+#endif // !ENCODER_H
@@ -0,0 +1,275 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "common.h"
+#include "image.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// rows of the map handled by one task while building the sampling tables
+#define ENVIRONMENT_BUILD_ROWS 64
+
+/// <summary>
+/// Entry of an alias table (Walker / Vose), which samples an index
+/// proportional to its weight in constant time.
+/// </summary>
+struct aliasEntry {
+	float probability;	// probability of keeping the index instead of the alias
+	int alias;
+};
+
+/// <summary>
+/// Builds the alias table of the weights in linear time.
+/// </summary>
+/// <param name="weights">The non-negative weights.</param>
+/// <param name="n">The number of weights.</param>
+/// <param name="out">The n table entries.</param>
+/// <returns>The sum of the weights</returns>
+double buildAliasTable(const double* weights, int n, aliasEntry* out) {
+	double total = 0;
+	for (int i = 0; i < n; i++)
+		total += weights[i];
+
+	if (total <= 0) {
+		for (int i = 0; i < n; i++)
+			out[i] = aliasEntry{ 1.0f, i };
+		return 0;
+	}
+
+	// scaled probabilities, the mean is 1
+	std::vector<double> scaled(n);
+	std::vector<int> small, large;
+	for (int i = 0; i < n; i++) {
+		scaled[i] = weights[i] * n / total;
+		(scaled[i] < 1 ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty()) {
+		int s = small.back(), l = large.back();
+		small.pop_back();
+
+		out[s] = aliasEntry{ (float)scaled[s], l };
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// the rest is 1 up to rounding
+	for (int i : small) out[i] = aliasEntry{ 1.0f, i };
+	for (int i : large) out[i] = aliasEntry{ 1.0f, i };
+
+	return total;
+}
+
+/// <summary>
+/// Samples an index of the alias table with one random number in [0,1).
+/// </summary>
+inline int sampleAliasTable(const aliasEntry* entries, int n, double u) {
+	double x = u * n;
+	int i = std::min((int)x, n - 1);
+	return x - i < entries[i].probability ? i : entries[i].alias;
+}
+
+/// <summary>
+/// HDR environment map in equirectangular (latitude-longitude) layout,
+/// lighting the rays leaving the scene.
+///
+/// Directions are importance sampled by the luminance of the texels
+/// (weighted by the solid angle of their row): an alias table over the
+/// rows picks a row, the alias table of the row a texel. Both tables are
+/// built in linear time, the rows in parallel, and sampling costs two
+/// table lookups.
+///
+/// The top row of the map is +y, the center column looks down -z.
+/// </summary>
+class EnvironmentMap {
+	public:
+		/// <summary>
+		/// Loads an HDR (or LDR, linearized by stb) image.
+		/// </summary>
+		/// <param name="path">The image path.</param>
+		/// <param name="intensity">The scale of the radiance.</param>
+		/// <param name="rotation">The rotation around +y in degrees.</param>
+		/// <param name="pool">The threads building the sampling tables.</param>
+		/// <returns>The map, null if the image cannot be loaded</returns>
+		static std::shared_ptr<EnvironmentMap> load(const std::string& path, double intensity, double rotation, ThreadPool& pool);
+
+		/// <summary>
+		/// Initializes a new instance of the <see cref="EnvironmentMap"/> class
+		/// from RGB texels, the sampling tables are built on the pool.
+		/// </summary>
+		EnvironmentMap(int width, int height, std::vector<float> rgb, double intensity, double rotation, ThreadPool& pool);
+
+		/// <summary>
+		/// Radiance arriving from direction d.
+		/// </summary>
+		color eval(const vec3& d) const {
+			double u, v;
+			toMap(d, u, v);
+			return texel(column(u), row(v));
+		}
+
+		/// <summary>
+		/// Samples a direction proportional to the radiance.
+		/// </summary>
+		/// <param name="pdf">The solid angle density of the direction.</param>
+		/// <param name="radiance">The radiance from the direction.</param>
+		/// <returns>The unit direction</returns>
+		vec3 sample(double& pdf, color& radiance) const {
+			if (total <= 0) {
+				pdf = 1 / (4 * pi);
+				vec3 d = random_unit_vector();
+				radiance = eval(d);
+				return d;
+			}
+
+			int y = sampleAliasTable(rows.data(), height, random_double());
+			int x = sampleAliasTable(&columns[(size_t)y * width], width, random_double());
+
+			double u = (x + random_double()) / width;
+			double v = (y + random_double()) / height;
+			vec3 d = fromMap(u, v);
+
+			radiance = texel(x, y);
+			pdf = density(x, y, v);
+			return d;
+		}
+
+		/// <summary>
+		/// Solid angle density of sample for direction d.
+		/// </summary>
+		double pdf(const vec3& d) const {
+			if (total <= 0)
+				return 1 / (4 * pi);
+
+			double u, v;
+			toMap(d, u, v);
+			return density(column(u), row(v), v);
+		}
+
+		int getWidth() const { return width; }
+		int getHeight() const { return height; }
+
+		/// <summary>
+		/// Bytes of the texels and of the sampling tables.
+		/// </summary>
+		size_t memory() const {
+			return texels.capacity() * sizeof(float) + columns.capacity() * sizeof(aliasEntry) +
+				   rows.capacity() * sizeof(aliasEntry) + row_weight.capacity() * sizeof(double);
+		}
+
+	private:
+		// sampling weight of a texel: luminance times the sine of its row
+		double weight(int x, int y) const {
+			const float* t = &texels[3 * ((size_t)y * width + x)];
+			double theta = pi * (y + 0.5) / height;
+			return luminance(color(t[0], t[1], t[2])) * sin(theta);
+		}
+
+		// solid angle density of the texel at the latitude v
+		double density(int x, int y, double v) const {
+			double sin_theta = sin(pi * v);
+			if (sin_theta <= 0) return 0;
+			return weight(x, y) / total * width * height / (2 * pi * pi * sin_theta);
+		}
+
+		color texel(int x, int y) const {
+			const float* t = &texels[3 * ((size_t)y * width + x)];
+			return color(t[0], t[1], t[2]);
+		}
+
+		int column(double u) const {
+			return std::min((int)(u * width), width - 1);
+		}
+
+		int row(double v) const {
+			return std::min((int)(v * height), height - 1);
+		}
+
+		void toMap(const vec3& d, double& u, double& v) const {
+			vec3 n = unit_vector(d);
+			double phi = atan2(n.x(), -n.z()) + rotation;
+			u = phi / (2 * pi) + 0.5;
+			u -= floor(u);
+			v = acos(clamp(n.y(), -1.0, 1.0)) / pi;
+		}
+
+		vec3 fromMap(double u, double v) const {
+			double phi = (u - 0.5) * 2 * pi - rotation;
+			double theta = v * pi;
+			double sin_theta = sin(theta);
+			return vec3(sin_theta * sin(phi), cos(theta), -sin_theta * cos(phi));
+		}
+
+	private:
+		int width = 0;
+		int height = 0;
+		double rotation = 0;				// radians around +y
+		std::vector<float> texels;			// rgb, row by row from the top
+		std::vector<aliasEntry> columns;	// alias table of each row
+		std::vector<aliasEntry> rows;		// alias table over the rows
+		std::vector<double> row_weight;
+		double total = 0;					// sum of the texel weights
+};
+
+EnvironmentMap::EnvironmentMap(int width, int height, std::vector<float> rgb, double intensity, double rotation, ThreadPool& pool)
+	: width(width), height(height), rotation(rotation * pi / 180), texels(std::move(rgb)) {
+	if (intensity != 1) {
+		for (auto& t : texels)
+			t = (float)(t * intensity);
+	}
+
+	columns.resize((size_t)width * height);
+	row_weight.resize(height);
+
+	// alias table of every row, in parallel
+	for (int y0 = 0; y0 < height; y0 += ENVIRONMENT_BUILD_ROWS) {
+		pool.submit([this, y0]() {
+			std::vector<double> weights(this->width);
+			for (int y = y0; y < std::min(y0 + ENVIRONMENT_BUILD_ROWS, this->height); y++) {
+				for (int x = 0; x < this->width; x++)
+					weights[x] = weight(x, y);
+				row_weight[y] = buildAliasTable(weights.data(), this->width, &columns[(size_t)y * this->width]);
+			}
+		});
+	}
+	pool.wait();
+
+	rows.resize(height);
+	total = buildAliasTable(row_weight.data(), height, rows.data());
+}
+
+std::shared_ptr<EnvironmentMap> EnvironmentMap::load(const std::string& path, double intensity, double rotation, ThreadPool& pool) {
+	auto start = std::chrono::steady_clock::now();
+
+	int width, height, channels;
+	float* data = stbi_loadf(path.c_str(), &width, &height, &channels, 3);
+	if (!data) {
+		std::cerr << "environment: cannot load " << path << ": " << stbi_failure_reason() << "\n";
+		return nullptr;
+	}
+
+	std::vector<float> rgb(data, data + (size_t)width * height * 3);
+	stbi_image_free(data);
+
+	auto loaded = std::chrono::steady_clock::now();
+	auto map = std::make_shared<EnvironmentMap>(width, height, std::move(rgb), intensity, rotation, pool);
+	auto built = std::chrono::steady_clock::now();
+
+	std::cerr << "environment: " << width << "x" << height << " loaded in "
+			  << std::chrono::duration<double, std::milli>(loaded - start).count() << " ms, sampling tables built in "
+			  << std::chrono::duration<double, std::milli>(built - loaded).count() << " ms, "
+			  << map->memory() / (1024.0 * 1024.0) << " MB\n";
+	return map;
+}
+
+#endif // !ENVIRONMENT_H
@@ -0,0 +1,290 @@
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include "common.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "lookdev.h"
+#include "pipeline.h"
+#include "renderer.h"
+#include "renderOptions.h"
+#include "sphereField.h"
+#include "streamedField.h"
+#include "threadPool.h"
+#include "transform.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+// edge length of the sampled blocks, a packet block of renderTile
+#define ESTIMATE_BLOCK PACKET_SIZE
+// one block is sampled per stratum of ESTIMATE_STRATUM x ESTIMATE_STRATUM blocks
+#define ESTIMATE_STRATUM 8
+
+/// <summary>
+/// Bytes of the geometry of the world: the hierarchies, the sphere fields
+/// and the objects (the mapped chunk budget of streamed fields).
+/// </summary>
+size_t geometryMemory(const shared_ptr<Geometry>& world) {
+	size_t bytes = 0;
+	if (auto accel = std::dynamic_pointer_cast<BVHAccel>(world))
+		bytes += accel->memory();
+
+	std::vector<shared_ptr<Geometry>> objects;
+	flattenGeometry(world, objects);
+	for (const auto& object : objects) {
+		if (auto field = std::dynamic_pointer_cast<SphereField>(object))
+			bytes += field->memory();
+		else if (auto streamed = std::dynamic_pointer_cast<StreamedSphereField>(object))
+			bytes += streamed->memory();
+		else if (auto instance = std::dynamic_pointer_cast<Instance>(object))
+			bytes += sizeof(Instance);
+		else
+			bytes += sizeof(Sphere);
+	}
+	return bytes;
+}
+
+/// <summary>
+/// Seconds of processor time of the calling thread, the wall clock where
+/// it is not known. Other processes preempting the thread are not counted.
+/// </summary>
+double threadTime() {
+#if defined(__linux__)
+	timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// <summary>
+/// Resident memory of the process in bytes, 0 where it is not known.
+/// </summary>
+size_t residentMemory() {
+#if defined(__linux__)
+	std::ifstream statm("/proc/self/statm");
+	size_t pages = 0, resident = 0;
+	if (statm >> pages >> resident)
+		return resident * 4096;
+#endif
+	return 0;
+}
+
+/// <summary>
+/// Estimate of the cost of a render before it is queued: the memory of the
+/// subsystems the options enable and the render time, projected from the
+/// render of a stratified subset of the pixels.
+///
+/// One block of ESTIMATE_BLOCK pixels is rendered with all samples per
+/// stratum of ESTIMATE_STRATUM x ESTIMATE_STRATUM blocks (1/64 of the
+/// pixels) and timed. The time per pixel of a stratum is taken for all its
+/// pixels, the tiles of the render are then scheduled on the threads in
+/// the order of the pool (one pass after the other), which gives the time
+/// of the render per thread count, assuming a core per thread.
+///
+/// The blocks are timed in processor time of their threads, which keeps
+/// other processes out of the estimate. They trace without the path guide
+/// and the radiance cache, so their training and filling is not modelled.
+/// </summary>
+class RenderEstimate {
+	public:
+		RenderEstimate(Frame& frame, const RenderOption& options)
+			: frame(frame), options(options),
+			  columns((frame.width + ESTIMATE_STRATUM * ESTIMATE_BLOCK - 1) / (ESTIMATE_STRATUM * ESTIMATE_BLOCK)),
+			  rows((frame.height + ESTIMATE_STRATUM * ESTIMATE_BLOCK - 1) / (ESTIMATE_STRATUM * ESTIMATE_BLOCK)),
+			  strata((size_t)columns * rows, 0.0) {}
+
+		/// <summary>
+		/// Bytes of each subsystem the options enable.
+		/// </summary>
+		std::vector<std::pair<std::string, size_t>> memory() const {
+			std::vector<std::pair<std::string, size_t>> items;
+			size_t pixels = (size_t)frame.width * frame.height;
+
+			size_t geometry = geometryMemory(frame.world);
+			items.push_back(std::make_pair("geometry", geometry));
+			if (options.numa_replicate && options.numa)
+				items.push_back(std::make_pair("NUMA replicas (per extra node)", geometry));
+
+			if (options.scanline) {
+				items.push_back(std::make_pair("framebuffer (bands in flight)",
+											   (size_t)SCANLINE_BANDS_IN_FLIGHT * options.tile_size * frame.width * sizeof(color)));
+				items.push_back(std::make_pair("output row", (size_t)frame.width * 3 * sizeof(float)));
+			}
+			else {
+				items.push_back(std::make_pair(options.live.empty() ? "framebuffer" : "live framebuffer (mapped)", pixels * sizeof(color)));
+				// the encoder keeps two images in flight
+				items.push_back(std::make_pair("encoder", 2 * pixels * 3));
+			}
+
+			if (frame.environment)
+				items.push_back(std::make_pair("environment map", frame.environment->memory()));
+			if (frame.culling)
+				items.push_back(std::make_pair("tile culling", (size_t)(frame.culling->candidates() * frame.culling->tileCount() * sizeof(shared_ptr<Geometry>))));
+			if (frame.lights)
+				items.push_back(std::make_pair("light tree", frame.lights->memory() + frame.lights->lightCount() * sizeof(sphereEmitter)));
+			if (frame.bidirectional)
+				items.push_back(std::make_pair("bidirectional splats", pixels * 3 * sizeof(double)));
+			if (options.cost_tiles || !options.cost_map.empty())
+				items.push_back(std::make_pair("cost map", pixels * sizeof(unsigned int)));
+			if (options.guiding && !frame.bidirectional)
+				items.push_back(std::make_pair("path guiding (limit)", (size_t)(options.guiding_memory * 1024 * 1024)));
+			if (options.radiance_cache && !frame.bidirectional)
+				items.push_back(std::make_pair("radiance cache",
+											   RadianceCache::slotCount((size_t)(options.radiance_cache_memory * 1024 * 1024)) * sizeof(RadianceCache::cell)));
+			if (!options.gbuffer.empty())
+				items.push_back(std::make_pair("gbuffer", pixels * frame.samples * sizeof(gbufferSample) + pixels * sizeof(color)));
+			return items;
+		}
+
+		/// <summary>
+		/// Renders and times the sampled blocks, a row of strata at a time
+		/// into a window of the framebuffer.
+		/// </summary>
+		void sample(ThreadPool& pool) {
+			int stratum = ESTIMATE_STRATUM * ESTIMATE_BLOCK;
+			seed_random(frame.seed);
+
+			for (int sy = 0; sy < rows; sy++) {
+				int y0 = sy * stratum, y1 = std::min(y0 + stratum, frame.height);
+				frame.pixels.allocate((size_t)(y1 - y0) * frame.width, (size_t)y0 * frame.width);
+
+				for (int sx = 0; sx < columns; sx++) {
+					int x0 = sx * stratum, x1 = std::min(x0 + stratum, frame.width);
+
+					// a random block of the stratum
+					int bx = x0 + std::min((int)(random_double() * (x1 - x0 + ESTIMATE_BLOCK - 1) / ESTIMATE_BLOCK), (x1 - x0 - 1) / ESTIMATE_BLOCK) * ESTIMATE_BLOCK;
+					int by = y0 + std::min((int)(random_double() * (y1 - y0 + ESTIMATE_BLOCK - 1) / ESTIMATE_BLOCK), (y1 - y0 - 1) / ESTIMATE_BLOCK) * ESTIMATE_BLOCK;
+					Tile block{ bx, by, std::min(bx + ESTIMATE_BLOCK, x1), std::min(by + ESTIMATE_BLOCK, y1), sy * columns + sx };
+
+					pool.submit([this, block]() {
+						for (int y = block.y0; y < block.y1; y++)
+							frame.pixels.clear((size_t)y * frame.width + block.x0, (size_t)y * frame.width + block.x1);
+
+						unsigned long long rays = traced_rays, tests = primitive_tests;
+						double start = threadTime();
+						renderTile(frame, block, 0, frame.samples);
+						double seconds = threadTime() - start;
+
+						int pixels = (block.x1 - block.x0) * (block.y1 - block.y0);
+						strata[block.index] = seconds / pixels;
+						sampled_pixels += pixels;
+						sampled_rays += traced_rays - rays;
+						sampled_tests += primitive_tests - tests;
+						sampled_nanoseconds += (long long)(seconds * 1e9);
+					});
+				}
+				pool.wait();
+			}
+
+			frame.pixels.allocate(0);
+		}
+
+		/// <summary>
+		/// Projected time of the render on the threads: the tiles of every
+		/// pass are taken in order by the first free thread.
+		/// </summary>
+		double projectedTime(int threads) const {
+			auto tiles = makeTiles(frame.width, frame.height, options.tile_size);
+			int passes = std::max(1, std::min(options.passes, frame.samples));
+
+			double total = 0;
+			for (int pass = 0; pass < passes; pass++) {
+				// share of the samples of the pass, as in renderPasses
+				double share = (double)((frame.samples * (pass + 1)) / passes - (frame.samples * pass) / passes) / frame.samples;
+
+				std::priority_queue<double, std::vector<double>, std::greater<double>> finish;
+				for (int i = 0; i < threads; i++)
+					finish.push(0);
+
+				double end = 0;
+				for (const auto& tile : tiles) {
+					double start = finish.top();
+					finish.pop();
+					finish.push(start + tileCost(tile) * share);
+					end = std::max(end, start + tileCost(tile) * share);
+				}
+				total += end;
+			}
+			return total;
+		}
+
+		/// <summary>
+		/// Prints the memory, the statistics of the sampled paths and the
+		/// projected render time per thread count.
+		/// </summary>
+		void print(std::ostream& out, int pool_threads) const {
+			auto items = memory();
+			size_t total = 0;
+			out << "memory:\n";
+			for (const auto& item : items) {
+				out << "  " << std::left << std::setw(32) << item.first << std::right << std::fixed << std::setprecision(1)
+					<< std::setw(10) << item.second / (1024.0 * 1024.0) << " MB\n";
+				total += item.second;
+			}
+			out << "  " << std::left << std::setw(32) << "total" << std::right << std::setw(10) << total / (1024.0 * 1024.0) << " MB\n";
+			if (size_t resident = residentMemory())
+				out << "  " << std::left << std::setw(32) << "resident after the setup" << std::right << std::setw(10)
+					<< resident / (1024.0 * 1024.0) << " MB\n";
+
+			double camera_rays = (double)sampled_pixels * frame.samples;
+			out << std::defaultfloat << std::setprecision(4);
+			out << "sampled " << sampled_pixels.load() << " of " << (size_t)frame.width * frame.height << " pixels at "
+				<< frame.samples << " spp in " << sampled_nanoseconds / 1e9 << " s of thread time\n";
+			out << "rays per camera ray (path length): " << (camera_rays > 0 ? sampled_rays / camera_rays : 0) << "\n";
+#if BVH_COUNT_TESTS
+			out << "primitive tests per ray: " << (sampled_rays > 0 ? (double)sampled_tests / sampled_rays : 0) << "\n";
+#endif
+
+			std::vector<int> counts = { 1, 2, 4, 8, 16, 32, 64 };
+			if (std::find(counts.begin(), counts.end(), pool_threads) == counts.end())
+				counts.push_back(pool_threads);
+			std::sort(counts.begin(), counts.end());
+
+			out << "projected render time:\n";
+			for (int threads : counts)
+				out << "  " << std::setw(3) << threads << " threads" << (threads == pool_threads ? " (this run)" : "           ")
+					<< std::setw(12) << projectedTime(threads) << " s\n";
+		}
+
+	private:
+		// time of a tile, every pixel costs the time per pixel of its stratum
+		double tileCost(const Tile& tile) const {
+			int stratum = ESTIMATE_STRATUM * ESTIMATE_BLOCK;
+			double cost = 0;
+			for (int sy = tile.y0 / stratum; sy * stratum < tile.y1; sy++) {
+				int h = std::min((sy + 1) * stratum, tile.y1) - std::max(sy * stratum, tile.y0);
+				for (int sx = tile.x0 / stratum; sx * stratum < tile.x1; sx++) {
+					int w = std::min((sx + 1) * stratum, tile.x1) - std::max(sx * stratum, tile.x0);
+					cost += strata[(size_t)sy * columns + sx] * w * h;
+				}
+			}
+			return cost;
+		}
+
+	private:
+		Frame& frame;
+		const RenderOption& options;
+
+		int columns;
+		int rows;
+		std::vector<double> strata;		// seconds per pixel of each stratum
+
+		std::atomic<size_t> sampled_pixels{ 0 };
+		std::atomic<unsigned long long> sampled_rays{ 0 };
+		std::atomic<unsigned long long> sampled_tests{ 0 };
+		std::atomic<long long> sampled_nanoseconds{ 0 };
+};
+
+#endif // !ESTIMATE_H
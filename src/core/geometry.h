@@ -2,10 +2,13 @@
 #define GEOMETRY_H
 
 #include "common.h"
+#include "aabb.h"
+#include "packet.h"
 
 #include <vector>
 
 class material; // forward declaration
+class Geometry;
 
 struct hitRecord {
 	point3 p;
@@ -25,8 +28,89 @@ struct hitRecord {
 	}
 };
 
+/// <summary>
+/// Closest intersection found by Geometry::intersect, only the distance and
+/// the primitive. The hitRecord is computed from it once by Geometry::interaction.
+/// </summary>
+struct surfaceHit {
+	double t;
+	const Geometry* geometry;	// the geometry computing the interaction
+	int primitive;				// primitive of the geometry, -1 if it has none
+
+	// set by an Instance (geometry): the hit of its object, null if it is not known
+	const Geometry* object;
+	int object_primitive;
+};
+
+/// <summary>
+/// Per ray intersection results of a RayPacket.
+/// </summary>
+struct packetHitRecord {
+	surfaceHit surface[PACKET_MAX_RAYS];
+	double closest[PACKET_MAX_RAYS];	// closest hit distance so far (t_max of the ray)
+	bool hit[PACKET_MAX_RAYS];
+
+	/// <summary>
+	/// Resets the records for count rays with the maximum distance t_max.
+	/// </summary>
+	void reset(int count, double t_max) {
+		for (int i = 0; i < count; i++) {
+			closest[i] = t_max;
+			hit[i] = false;
+		}
+	}
+};
+
+/// <summary>
+/// Sphere whose material emits light, reported by Geometry::emitters.
+/// </summary>
+struct sphereEmitter {
+	point3 center;
+	double radius;
+	shared_ptr<material> mat_ptr;
+	const Geometry* geometry;	// the geometry intersect reports for hits of the sphere
+
+	/// <summary>
+	/// Emitted power (luminance) of the sphere, 0 if its material is not a diffuse_light.
+	/// </summary>
+	double power() const;
+};
+
 class Geometry {
 	public:
+		/// <summary>
+		/// Finds the closest intersection of the ray, without computing the
+		/// surface at the intersection.
+		/// </summary>
+		/// <param name="r">The ray.</param>
+		/// <param name="t_min">The t minimum.</param>
+		/// <param name="t_max">The t maximum.</param>
+		/// <param name="hit">The closest intersection, only written if there is one.</param>
+		/// <returns>
+		/// True if the Geometry is hit by the ray.
+		/// </returns>
+		virtual bool intersect(const ray& r,
+							   double t_min,
+							   double t_max,
+							   surfaceHit& hit) const = 0;
+
+		/// <summary>
+		/// Computes the surface (point, normal, material) of an intersection
+		/// found by intersect. Called on hit.geometry.
+		///
+		/// By default the ray is intersected again in [hit.t, hit.t], the same
+		/// computation usually finds the same distance and fills the record.
+		/// </summary>
+		/// <param name="r">The ray.</param>
+		/// <param name="hit">The intersection.</param>
+		/// <param name="rec">The record of the intersection.</param>
+		/// <returns>False if the surface is not found again, rec is then not valid</returns>
+		virtual bool interaction(const ray& r,
+								 const surfaceHit& hit,
+								 hitRecord& rec) const {
+			return this->hit(r, hit.t, hit.t, rec);
+		}
+
 		/// <summary>
 		/// Checks if a specific Ray hits the Geometry.
 		/// </summary>
@@ -40,7 +124,73 @@ class Geometry {
 		virtual bool hit(const ray& r,
 						 double t_min,
 						 double t_max,
-						 hitRecord& rec) const = 0;
+						 hitRecord& rec) const {
+			surfaceHit closest;
+			if (!intersect(r, t_min, t_max, closest))
+				return false;
+
+			return closest.geometry->interaction(r, closest, rec);
+		}
+
+		/// <summary>
+		/// Computes the bounding box of the Geometry.
+		/// </summary>
+		/// <param name="time0">The shutter open time.</param>
+		/// <param name="time1">The shutter close time.</param>
+		/// <param name="output_box">The bounding box.</param>
+		/// <returns>False if the Geometry has no bounding box (e.g. an infinite plane)</returns>
+		virtual bool bounding_box(double time0,
+								  double time1,
+								  aabb& output_box) const = 0;
+
+		/// <summary>
+		/// Conservative test if any ray of the packet can hit the Geometry.
+		/// Returning true is always valid, false only if every ray misses.
+		/// </summary>
+		/// <param name="packet">The ray packet.</param>
+		/// <param name="t_min">The t minimum.</param>
+		/// <returns>False if no ray of the packet hits the Geometry.</returns>
+		virtual bool may_hit(const RayPacket& packet, double t_min) const {
+			return true;
+		}
+
+		/// <summary>
+		/// Intersects all rays of a packet with the Geometry.
+		/// Records of rays with a closer hit are updated, the surfaces are
+		/// computed afterwards by interactions.
+		/// </summary>
+		/// <param name="packet">The ray packet.</param>
+		/// <param name="t_min">The t minimum.</param>
+		/// <param name="rec">The per ray records, closest holds the t maximum of each ray.</param>
+		/// <returns>True if any ray of the packet hit the Geometry.</returns>
+		virtual bool hit_packet(const RayPacket& packet,
+								double t_min,
+								packetHitRecord& rec) const {
+			if (packet.coherent && !may_hit(packet, t_min))
+				return false;
+
+			auto hit_anything = false;
+			for (int i = 0; i < packet.count; i++) {
+				if (intersect(packet.rays[i], t_min, rec.closest[i], rec.surface[i])) {
+					hit_anything = true;
+					rec.hit[i] = true;
+					rec.closest[i] = rec.surface[i].t;
+				}
+			}
+			return hit_anything;
+		}
+
+		/// <summary>
+		/// Adds the emitting spheres of the Geometry to lights. Geometry moved
+		/// by an instance is not reported.
+		/// </summary>
+		virtual void emitters(std::vector<sphereEmitter>& lights) const {}
+
+		/// <summary>
+		/// Adds the materials of the Geometry to list, a material shared by
+		/// several objects may be added more than once.
+		/// </summary>
+		virtual void materials(std::vector<shared_ptr<material>>& list) const {}
 
 		friend std::ostream& operator<< (std::ostream& out,
 										 const Geometry& mc) {
@@ -72,14 +222,36 @@ public:
 
 
 	/// <summary>
-	/// Checks if the ray r hits the geometry in the geometry list
+	/// Finds the closest intersection of the ray r with the geometry in the geometry list
 	/// </summary>
 	/// <param name="r">The ray.</param>
 	/// <param name="t_min">The t minimum.</param>
 	/// <param name="t_max">The t maximum.</param>
-	/// <param name="rec">The record.</param>
+	/// <param name="hit">The closest intersection.</param>
 	/// <returns></returns>
-	virtual bool hit(const ray& r, double t_min, double t_max, hitRecord& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const override;
+
+	/// <summary>
+	/// Intersects a coherent packet with the geometry in the list.
+	/// Every object is culled for the whole packet before single rays are tested.
+	/// </summary>
+	virtual bool hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const override;
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+	virtual void emitters(std::vector<sphereEmitter>& lights) const override {
+		for (const auto& object : objects)
+			object->emitters(lights);
+	}
+
+	virtual void materials(std::vector<shared_ptr<material>>& list) const override {
+		for (const auto& object : objects)
+			object->materials(list);
+	}
+
+	const std::vector<shared_ptr<Geometry>>& getObjects() const {
+		return objects;
+	}
 
 	//Geometry** getList() {
 	//	return list;
@@ -116,22 +288,56 @@ private:
 };
 
 
-bool GeometryList::hit(const ray& r, double t_min, double t_max, hitRecord& rec) const {
-	hitRecord temp_rec;
+bool GeometryList::intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const {
 	auto hit_anything = false;
 	auto closes_so_far = t_max;
 
 	for (const auto& object : objects)
 	{
-		if (object->hit(r, t_min, closes_so_far, temp_rec)) {
+		if (object->intersect(r, t_min, closes_so_far, hit)) {
 			hit_anything = true;
-			closes_so_far = temp_rec.t;
-			rec = temp_rec;
+			closes_so_far = hit.t;
 		}
 	}
 	return hit_anything;
 };
 
+bool GeometryList::hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const {
+	// incoherent packets gain nothing from the shared tests
+	if (!packet.coherent) {
+		auto hit_anything = false;
+		for (int i = 0; i < packet.count; i++) {
+			if (intersect(packet.rays[i], t_min, rec.closest[i], rec.surface[i])) {
+				hit_anything = true;
+				rec.hit[i] = true;
+				rec.closest[i] = rec.surface[i].t;
+			}
+		}
+		return hit_anything;
+	}
+
+	auto hit_anything = false;
+	for (const auto& object : objects)
+	{
+		if (object->hit_packet(packet, t_min, rec))
+			hit_anything = true;
+	}
+	return hit_anything;
+};
+
+bool GeometryList::bounding_box(double time0, double time1, aabb& output_box) const {
+	if (objects.empty()) return false;
+
+	aabb temp_box;
+	output_box = aabb();
+
+	for (const auto& object : objects) {
+		if (!object->bounding_box(time0, time1, temp_box)) return false;
+		output_box = surrounding_box(output_box, temp_box);
+	}
+	return true;
+};
+
 // ------------------------------------------------------------------------------
 // Geometry Implementations
 // ------------------------------------------------------------------------------
@@ -152,10 +358,25 @@ public:
 	/// <param name="material">The material.</param>
 	Sphere(double r, point3 c, shared_ptr<material> material) : radius(r), center(c), mat_ptr(material){};
 
-	virtual bool hit(const ray& r,
-					double t_min,
-					double t_max,
-					hitRecord& rec) const override;
+	virtual bool intersect(const ray& r,
+						   double t_min,
+						   double t_max,
+						   surfaceHit& hit) const override;
+
+	virtual bool interaction(const ray& r, const surfaceHit& hit, hitRecord& rec) const override;
+
+	virtual bool may_hit(const RayPacket& packet, double t_min) const override;
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+		output_box = aabb(center - vec3(radius), center + vec3(radius));
+		return true;
+	}
+
+	virtual void emitters(std::vector<sphereEmitter>& lights) const override;
+
+	virtual void materials(std::vector<shared_ptr<material>>& list) const override {
+		if (mat_ptr) list.push_back(mat_ptr);
+	}
 	
 	double getRadius() {
 		return radius;
@@ -174,12 +395,17 @@ private:
 	shared_ptr<material> mat_ptr;
 };
 
-bool Sphere::hit(const ray& r,
-				 double t_min,
-				 double t_max,
-				 hitRecord& rec) const
-{
-
+/// <summary>
+/// Intersects the ray with a sphere.
+/// </summary>
+/// <param name="center">The sphere center.</param>
+/// <param name="radius">The sphere radius.</param>
+/// <param name="r">The ray.</param>
+/// <param name="t_min">The t minimum.</param>
+/// <param name="t_max">The t maximum.</param>
+/// <param name="t">The distance of the nearest intersection in [t_min, t_max].</param>
+/// <returns>True if the sphere is hit</returns>
+inline bool hit_sphere(const point3& center, double radius, const ray& r, double t_min, double t_max, double& t) {
 	vec3 oc = r.origin() - center;
 
 	auto a = r.direction().squared_length();
@@ -201,15 +427,73 @@ bool Sphere::hit(const ray& r,
 			return false;
 	}
 
-	rec.t = root;
+	t = root;
+	return true;
+}
+
+/// <summary>
+/// Conservative test if any ray of the packet can hit a sphere.
+/// </summary>
+inline bool may_hit_sphere(const point3& center, double radius, const RayPacket& packet) {
+	// evaluate the discriminant of the sphere intersection with intervals
+	// over all origins and directions of the packet
+	interval a(0), half_b(0), c(-radius * radius);
+	for (int k = 0; k < 3; k++) {
+		interval oc = packet.orig[k] - interval(center[k]);
+		a = a + sqr(packet.dir[k]);
+		half_b = half_b + oc * packet.dir[k];
+		c = c + sqr(oc);
+	}
+
+	// the largest possible discriminant is negative: every ray misses
+	auto discriminant = sqr(half_b) - a * c;
+	return discriminant.hi >= 0;
+}
+
+bool Sphere::intersect(const ray& r,
+					   double t_min,
+					   double t_max,
+					   surfaceHit& hit) const
+{
+	if (!hit_sphere(center, radius, r, t_min, t_max, hit.t))
+		return false;
+
+	hit.geometry = this;
+	hit.primitive = 0;
+	return true;
+}
+
+bool Sphere::interaction(const ray& r, const surfaceHit& hit, hitRecord& rec) const
+{
+	rec.t = hit.t;
 	rec.p = r.point_at_parameter(rec.t);
 	// calculate normal at intersection time
 	vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
 	rec.mat_ptr = mat_ptr;
-	
 	return true;
 }
 
+bool Sphere::may_hit(const RayPacket& packet, double t_min) const
+{
+	return may_hit_sphere(center, radius, packet);
+}
+
+// the materials use hitRecord, so they are included once it is defined
+#include "material.h"
+
+void Sphere::emitters(std::vector<sphereEmitter>& lights) const
+{
+	if (mat_ptr && mat_ptr->emissive())
+		lights.push_back(sphereEmitter{ center, radius, mat_ptr, this });
+}
+
+double sphereEmitter::power() const
+{
+	// a sphere emits along all its outward normals, each into the hemisphere around it
+	auto emitter = std::dynamic_pointer_cast<diffuse_light>(mat_ptr);
+	return emitter ? luminance(emitter->getRadiance()) * 4 * pi * pi * radius * radius : 0;
+}
+
 
 #endif // !GEOMETRY_H
\ No newline at end of file
@@ -0,0 +1,382 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "common.h"
+#include "aabb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// fraction of the energy of the tree above which a directional quadrant is split
+#define GUIDING_SPLIT_FRACTION 0.01
+// maximum depth of the directional quadtrees
+#define GUIDING_MAX_DEPTH 20
+// samples a spatial leaf collects (times sqrt of the samples per pixel) before it is split
+#define GUIDING_SPATIAL_THRESHOLD 12000
+// probability of sampling the material instead of the guiding distribution
+#define GUIDING_BSDF_FRACTION 0.5
+
+/// <summary>
+/// Float with atomic accumulation, copies are not atomic and only made
+/// between the passes.
+/// </summary>
+struct atomicFloat {
+	std::atomic<float> value;
+
+	atomicFloat(float v = 0) : value(v) {}
+	atomicFloat(const atomicFloat& other) : value(other.load()) {}
+
+	atomicFloat& operator=(const atomicFloat& other) {
+		value.store(other.load(), std::memory_order_relaxed);
+		return *this;
+	}
+
+	float load() const {
+		return value.load(std::memory_order_relaxed);
+	}
+
+	void add(float v) {
+		float current = value.load(std::memory_order_relaxed);
+		while (!value.compare_exchange_weak(current, current + v, std::memory_order_relaxed));
+	}
+};
+
+/// <summary>
+/// Maps a unit direction to the unit square, (cos theta, phi) is area preserving.
+/// </summary>
+inline void directionToSquare(const vec3& d, double& u, double& v) {
+	u = clamp(0.5 * (d.z() + 1), 0.0, 1.0);
+	double phi = atan2(d.y(), d.x());
+	if (phi < 0) phi += 2 * pi;
+	v = clamp(phi / (2 * pi), 0.0, 1.0);
+}
+
+inline vec3 squareToDirection(double u, double v) {
+	double cos_theta = 2 * u - 1;
+	double sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+	double phi = 2 * pi * v;
+	return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+/// <summary>
+/// Directional quadtree (D-tree) over the square of directions.
+///
+/// Every node has four quadrants, a quadrant is either split into a child
+/// node or a leaf. Radiance is recorded into the leaves, the sums of the
+/// inner quadrants are only computed when the tree is finalized.
+/// </summary>
+class DTree {
+	public:
+		DTree() : nodes(1) {}
+
+		/// <summary>
+		/// Adds the value to the leaf of the direction.
+		/// </summary>
+		void record(const vec3& d, float value) {
+			double u, v;
+			directionToSquare(d, u, v);
+
+			int n = 0;
+			while (true) {
+				int q = quadrant(u, v);
+				int child = nodes[n].child[q];
+				if (!child) {
+					nodes[n].sum[q].add(value);
+					return;
+				}
+				n = child;
+			}
+		}
+
+		/// <summary>
+		/// Samples a direction proportional to the recorded radiance.
+		/// </summary>
+		vec3 sample() const {
+			if (total() <= 0)
+				return random_unit_vector();
+
+			double x0 = 0, y0 = 0, size = 1;
+			int n = 0;
+			while (true) {
+				const node& nd = nodes[n];
+				double s[4];
+				double t = 0;
+				for (int i = 0; i < 4; i++) t += s[i] = nd.sum[i].load();
+
+				// choose a quadrant proportional to its energy
+				double r = random_double() * t;
+				int q = 0;
+				while (q < 3 && r >= s[q]) r -= s[q++];
+
+				size *= 0.5;
+				x0 += (q & 1) * size;
+				y0 += (q >> 1) * size;
+
+				if (!nd.child[q])
+					return squareToDirection(x0 + random_double() * size, y0 + random_double() * size);
+				n = nd.child[q];
+			}
+		}
+
+		/// <summary>
+		/// Solid angle density of sample.
+		/// </summary>
+		double pdf(const vec3& d) const {
+			double t = total();
+			if (t <= 0)
+				return 1 / (4 * pi);
+
+			double u, v;
+			directionToSquare(d, u, v);
+
+			double p = 1;
+			int n = 0;
+			while (true) {
+				const node& nd = nodes[n];
+				double s = 0;
+				for (int i = 0; i < 4; i++) s += nd.sum[i].load();
+
+				int q = quadrant(u, v);
+				if (s <= 0) return 0;
+				p *= 4 * nd.sum[q].load() / s;
+
+				if (!nd.child[q] || p <= 0)
+					return p / (4 * pi);
+				n = nd.child[q];
+			}
+		}
+
+		/// <summary>
+		/// Sum of the leaves (valid after finalize).
+		/// </summary>
+		double total() const {
+			double t = 0;
+			for (int i = 0; i < 4; i++) t += nodes[0].sum[i].load();
+			return t;
+		}
+
+		/// <summary>
+		/// Sets the sums of the inner quadrants to the sums of their children.
+		/// </summary>
+		void finalize() {
+			finalize(0);
+		}
+
+		/// <summary>
+		/// Tree recording the next pass: quadrants holding more than
+		/// GUIDING_SPLIT_FRACTION of the energy are split, the others are
+		/// merged. The sums of the result are zero.
+		/// </summary>
+		/// <param name="grow">False if no new nodes may be added (memory limit).</param>
+		DTree refined(bool grow) const {
+			DTree out;
+			double t = total();
+			if (t > 0)
+				refine(out, 0, t, 0, t, 1, grow);
+			return out;
+		}
+
+		size_t memory() const {
+			return nodes.size() * sizeof(node);
+		}
+
+	private:
+		struct node {
+			atomicFloat sum[4];
+			int child[4] = { 0, 0, 0, 0 };	// 0: the quadrant is a leaf
+		};
+
+		// quadrant of (u, v) in the current node, (u, v) is rescaled to the quadrant
+		static int quadrant(double& u, double& v) {
+			int q = 0;
+			u *= 2;
+			v *= 2;
+			if (u >= 1) { q |= 1; u -= 1; }
+			if (v >= 1) { q |= 2; v -= 1; }
+			u = fmin(u, 1.0);
+			v = fmin(v, 1.0);
+			return q;
+		}
+
+		double finalize(int n) {
+			double t = 0;
+			for (int q = 0; q < 4; q++) {
+				if (nodes[n].child[q])
+					nodes[n].sum[q].value = (float)finalize(nodes[n].child[q]);
+				t += nodes[n].sum[q].load();
+			}
+			return t;
+		}
+
+		// builds the quadrants of node out_n from node n of this tree, n is -1
+		// if the region was a leaf holding the energy e, spread evenly over its quadrants
+		void refine(DTree& out, int n, double e, int out_n, double total, int depth, bool grow) const {
+			for (int q = 0; q < 4; q++) {
+				double quadrant_energy = n >= 0 ? nodes[n].sum[q].load() : e / 4;
+				int child = n >= 0 ? nodes[n].child[q] : 0;
+
+				if (quadrant_energy / total <= GUIDING_SPLIT_FRACTION || depth >= GUIDING_MAX_DEPTH || !(grow || child))
+					continue;
+
+				int index = (int)out.nodes.size();
+				out.nodes.push_back(node());
+				out.nodes[out_n].child[q] = index;
+				refine(out, child ? child : -1, quadrant_energy, index, total, depth + 1, grow);
+			}
+		}
+
+	private:
+		std::vector<node> nodes;
+};
+
+/// <summary>
+/// Learned distribution of the incident radiance (spatial-directional tree
+/// of Müller et al. 2017, "Practical Path Guiding").
+///
+/// A binary tree splits the scene bounds in the middle, cycling the axes.
+/// Each spatial leaf holds two directional trees: the sampling tree learned
+/// in the previous passes and the training tree recording the current one.
+/// After a training pass the leaves with many recorded samples are split
+/// and the training trees become the sampling trees.
+/// </summary>
+class PathGuide {
+	public:
+		/// <summary>
+		/// Initializes a new instance of the <see cref="PathGuide"/> class.
+		/// </summary>
+		/// <param name="bounds">The bounds of the scene.</param>
+		/// <param name="memory_limit">The memory the trees may use in bytes.</param>
+		PathGuide(const aabb& bounds, size_t memory_limit) : training(true), bounds(bounds), memory_limit(memory_limit), iteration(0) {
+			spatial.push_back(spatialNode());
+			leaves.push_back(leaf());
+		}
+
+		/// <summary>
+		/// True while the passes record radiance.
+		/// </summary>
+		bool training;
+
+		/// <summary>
+		/// The sampling distribution at the point, null before the first training pass finished.
+		/// </summary>
+		const DTree* sampling(const point3& p) const {
+			if (iteration == 0) return nullptr;
+			return &leaves[lookup(p)].sampling;
+		}
+
+		/// <summary>
+		/// Records the radiance estimate (divided by the pdf of its direction)
+		/// arriving at p from direction d.
+		/// </summary>
+		void record(const point3& p, const vec3& d, double value) {
+			if (!training || !(value >= 0) || value > infinity) return;
+
+			leaf& l = leaves[lookup(p)];
+			l.training.record(d, (float)value);
+			l.samples.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/// <summary>
+		/// Finishes a training pass: splits the spatial leaves and refines the
+		/// directional trees. Not thread safe, called between the passes.
+		/// </summary>
+		/// <param name="spp">The samples per pixel of the pass.</param>
+		void refine(int spp) {
+			size_t threshold = (size_t)(GUIDING_SPATIAL_THRESHOLD * sqrt((double)std::max(spp, 1)));
+
+			// spatial split, the children start with copies of the trees and are
+			// visited again (they are appended), so a leaf is split until its
+			// halves fall below the threshold
+			size_t bytes = memory();
+			for (size_t n = 0; n < spatial.size(); n++) {
+				int l = spatial[n].leaf;
+				if (l < 0 || leaves[l].samples.load() <= threshold || bytes >= memory_limit)
+					continue;
+
+				size_t half = leaves[l].samples.load() / 2;
+				leaves[l].samples = half;
+
+				leaf copy(leaves[l]);
+				leaves.push_back(copy);
+				bytes += 2 * sizeof(spatialNode) + sizeof(leaf) + copy.sampling.memory() + copy.training.memory();
+
+				int c0 = (int)spatial.size();
+				spatial.push_back(spatialNode());
+				spatial.push_back(spatialNode());
+				spatial[c0].axis = spatial[c0 + 1].axis = (spatial[n].axis + 1) % 3;
+				spatial[c0].leaf = l;
+				spatial[c0 + 1].leaf = (int)leaves.size() - 1;
+
+				spatial[n].leaf = -1;
+				spatial[n].child = c0;
+			}
+
+			bool grow = memory() < memory_limit;
+			for (auto& l : leaves) {
+				l.training.finalize();
+				l.sampling = l.training;
+				l.training = l.sampling.refined(grow);
+				l.samples = 0;
+			}
+
+			iteration++;
+		}
+
+		/// <summary>
+		/// Bytes used by the trees.
+		/// </summary>
+		size_t memory() const {
+			size_t bytes = spatial.size() * sizeof(spatialNode);
+			for (const auto& l : leaves)
+				bytes += sizeof(leaf) + l.sampling.memory() + l.training.memory();
+			return bytes;
+		}
+
+		size_t leafCount() const {
+			return leaves.size();
+		}
+
+	private:
+		struct spatialNode {
+			int axis = 0;		// split axis (in the middle of the node bounds)
+			int child = 0;		// index of the first child, the second follows
+			int leaf = 0;		// index into leaves, -1 for inner nodes
+		};
+
+		struct leaf {
+			DTree sampling;
+			DTree training;
+			std::atomic<size_t> samples;
+
+			leaf() : samples(0) {}
+			leaf(const leaf& other) : sampling(other.sampling), training(other.training), samples(other.samples.load()) {}
+		};
+
+		int lookup(const point3& p) const {
+			point3 lo = bounds.min(), hi = bounds.max();
+			int n = 0;
+			while (spatial[n].leaf < 0) {
+				int axis = spatial[n].axis;
+				double mid = 0.5 * (lo[axis] + hi[axis]);
+				if (p[axis] < mid) {
+					hi[axis] = mid;
+					n = spatial[n].child;
+				}
+				else {
+					lo[axis] = mid;
+					n = spatial[n].child + 1;
+				}
+			}
+			return spatial[n].leaf;
+		}
+
+	private:
+		aabb bounds;
+		size_t memory_limit;
+		std::vector<spatialNode> spatial;
+		std::vector<leaf> leaves;
+		int iteration;
+};
+
+#endif // !GUIDING_H
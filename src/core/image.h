@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <vector>
 
+// boost
+#include <boost/algorithm/string/predicate.hpp>
+
 // Disable pedantic warnings for this external library.
 #ifdef _MSC_VER
 	// Microsoft Visual C++ Compiler
@@ -29,7 +32,7 @@
 /// <param name="y">height in pixel</param>
 /// <param name="color">color image Data</param>
 /// <returns></returns>
-int createPPM(std::string filePath, int x, int y, std::vector<vec3> color) {
+int createPPM(const std::string& filePath, int x, int y, const std::vector<vec3>& color) {
 	
 	std::ofstream outFile;
 	outFile.open(filePath);
@@ -56,7 +59,7 @@ int createPPM(std::string filePath, int x, int y, std::vector<vec3> color) {
 /// <param name="y">height in pixel</param>
 /// <param name="color">color image Data</param>
 /// <returns></returns>
-int createJPEG(std::string filePath, int x, int y, std::vector<vec3> color) {
+int createJPEG(const std::string& filePath, int x, int y, const std::vector<vec3>& color) {
 	unsigned char * data = (unsigned char* ) malloc(x * y * 3 * sizeof(unsigned char));
 	int idx = 0;
 	for (int j = y-1; j >= 0; --j) {
@@ -82,7 +85,7 @@ int createJPEG(std::string filePath, int x, int y, std::vector<vec3> color) {
 /// <param name="y">height in pixel</param>
 /// <param name="color">The color.</param>
 /// <returns>color image Data</returns>
-int createPNG(std::string filePath, int x, int y, std::vector<vec3> color) {
+int createPNG(const std::string& filePath, int x, int y, const std::vector<vec3>& color) {
 	unsigned char* data = (unsigned char*)malloc(x * y * 3 * sizeof(unsigned char));
 	int idx = 0;
 	for (int j = y - 1; j >= 0; --j) {
@@ -99,3 +102,124 @@ int createPNG(std::string filePath, int x, int y, std::vector<vec3> color) {
 	free(data);
 	return 1;
 }
+
+/// <summary>
+/// Writes the image, the format is chosen by the extension of the file path
+/// (.ppm, .jpg or .png).
+/// </summary>
+/// <param name="filePath">The file path.</param>
+/// <param name="x">width in pixel</param>
+/// <param name="y">height in pixel</param>
+/// <param name="color">color image Data</param>
+/// <returns>false if the extension is not supported</returns>
+bool writeImage(const std::string& filePath, int x, int y, const std::vector<vec3>& color) {
+	if (boost::algorithm::ends_with(filePath, ".ppm")) {
+		createPPM(filePath, x, y, color);
+	}
+	else if (boost::algorithm::ends_with(filePath, ".jpg")) {
+		createJPEG(filePath, x, y, color);
+	}
+	else if (boost::algorithm::ends_with(filePath, ".png")) {
+		createPNG(filePath, x, y, color);
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Creates a PPM Image from 8 bit RGB data
+/// </summary>
+/// <param name="filePath">The file path.</param>
+/// <param name="x">width in pixel</param>
+/// <param name="y">height in pixel</param>
+/// <param name="data">RGB image data, row by row from the top</param>
+/// <returns></returns>
+int createPPM(const std::string& filePath, int x, int y, const unsigned char* data) {
+	std::ofstream outFile;
+	outFile.open(filePath);
+	outFile << "P3\n" << x << " " << y << "\n255\n";
+	for (int k = 0; k < x * y; k++) {
+		outFile << int(data[3 * k]) << " " << int(data[3 * k + 1]) << " " << int(data[3 * k + 2]) << "\n";
+	}
+	outFile.close();
+
+	return 0;
+}
+
+/// <summary>
+/// Writes 8 bit RGB data, the format is chosen by the extension of the file path
+/// (.ppm, .jpg or .png).
+/// </summary>
+/// <param name="filePath">The file path.</param>
+/// <param name="x">width in pixel</param>
+/// <param name="y">height in pixel</param>
+/// <param name="data">RGB image data, row by row from the top</param>
+/// <returns>false if the extension is not supported</returns>
+bool writeImage(const std::string& filePath, int x, int y, const unsigned char* data) {
+	if (boost::algorithm::ends_with(filePath, ".ppm")) {
+		createPPM(filePath, x, y, data);
+	}
+	else if (boost::algorithm::ends_with(filePath, ".jpg")) {
+		stbi_write_jpg(filePath.c_str(), x, y, 3, data, x * 3);
+	}
+	else if (boost::algorithm::ends_with(filePath, ".png")) {
+		stbi_write_png(filePath.c_str(), x, y, 3, data, x * 3);
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Writes linear RGB data as PFM (32 bit float, little endian).
+/// </summary>
+/// <param name="filePath">The file path.</param>
+/// <param name="x">width in pixel</param>
+/// <param name="y">height in pixel</param>
+/// <param name="color">color image Data, row by row from the top</param>
+/// <returns>false if the file cannot be written</returns>
+bool writePFM(const std::string& filePath, int x, int y, const std::vector<vec3>& color) {
+	std::ofstream outFile(filePath, std::ios::binary);
+	outFile << "PF\n" << x << " " << y << "\n-1.0\n";
+
+	// PFM rows run from the bottom
+	std::vector<float> row(3 * x);
+	for (int j = y - 1; j >= 0; j--) {
+		for (int i = 0; i < x; i++) {
+			for (int c = 0; c < 3; c++)
+				row[3 * i + c] = (float)color[j * x + i][c];
+		}
+		outFile.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+	}
+	return (bool)outFile;
+}
+
+/// <summary>
+/// Reads a little endian RGB PFM written by writePFM.
+/// </summary>
+/// <param name="filePath">The file path.</param>
+/// <param name="x">width in pixel</param>
+/// <param name="y">height in pixel</param>
+/// <param name="color">color image Data, row by row from the top</param>
+/// <returns>false if the file is missing or not such a PFM</returns>
+bool readPFM(const std::string& filePath, int& x, int& y, std::vector<vec3>& color) {
+	std::ifstream inFile(filePath, std::ios::binary);
+	std::string magic;
+	double scale;
+	if (!(inFile >> magic >> x >> y >> scale) || magic != "PF" || scale >= 0 || x <= 0 || y <= 0)
+		return false;
+	inFile.get();
+
+	color.resize((size_t)x * y);
+	std::vector<float> row(3 * x);
+	for (int j = y - 1; j >= 0; j--) {
+		if (!inFile.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float)))
+			return false;
+		for (int i = 0; i < x; i++)
+			color[j * x + i] = vec3(row[3 * i], row[3 * i + 1], row[3 * i + 2]);
+	}
+	return true;
+}
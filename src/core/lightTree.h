@@ -0,0 +1,305 @@
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+#include "common.h"
+#include "aabb.h"
+#include "geometry.h"
+#include "material.h"
+#include "onb.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// Samples a direction from p towards the sphere, uniform in the cone of
+/// directions it subtends.
+/// </summary>
+/// <returns>False if p is inside the sphere</returns>
+inline bool sampleSphereCone(const sphereEmitter& sphere, const point3& p, double u1, double u2, vec3& direction, double& pdf) {
+	vec3 d = sphere.center - p;
+	double d2 = d.squared_length(), r2 = sphere.radius * sphere.radius;
+	if (d2 <= r2)
+		return false;
+
+	// 1 - cos theta_max without cancellation for small far spheres
+	double sin2_max = r2 / d2;
+	double cos_max = sqrt(1 - sin2_max);
+	double one_minus = sin2_max / (1 + cos_max);
+
+	double cos_theta = 1 - u1 * one_minus;
+	double sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+	double phi = 2 * pi * u2;
+	direction = onb(unit_vector(d)).local(vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta));
+	pdf = 1 / (2 * pi * one_minus);
+	return true;
+}
+
+/// <summary>
+/// Density of sampleSphereCone for a direction towards the sphere.
+/// </summary>
+inline double sphereConePdf(const sphereEmitter& sphere, const point3& p) {
+	double d2 = (sphere.center - p).squared_length(), r2 = sphere.radius * sphere.radius;
+	if (d2 <= r2)
+		return 0;
+	double sin2_max = r2 / d2;
+	return 1 / (2 * pi * sin2_max / (1 + sqrt(1 - sin2_max)));
+}
+
+/// <summary>
+/// Hierarchy of the emitting spheres of a world for many-light sampling.
+///
+/// Every node bounds its lights by a box, their total power and the cone
+/// of their emitting normals (axis, spread theta_o and the emission angle
+/// theta_e around a normal). A shading point descends from the root and
+/// picks a child proportional to its importance: the power over the
+/// squared distance, times the largest cosine the box can have with the
+/// emitting normals and with the normal of the point. So a light is picked
+/// in logarithmic time, likely a bright and near one facing the point.
+///
+/// The probability of a light is found again from the bits of its path
+/// (left or right at every level), for the weights of the light hit by a
+/// scattered ray.
+/// </summary>
+class LightTree {
+	public:
+		explicit LightTree(const Geometry& world) {
+			world.emitters(lights);
+			if (lights.empty())
+				return;
+
+			for (int i = 0; i < (int)lights.size(); i++)
+				index[lights[i].geometry] = i;
+
+			std::vector<int> order(lights.size());
+			for (int i = 0; i < (int)order.size(); i++)
+				order[i] = i;
+
+			trails.assign(lights.size(), 0);
+			nodes.reserve(2 * lights.size() - 1);
+			build(order, 0, (int)order.size(), 0, 0);
+		}
+
+		size_t lightCount() const {
+			return lights.size();
+		}
+
+		size_t nodeCount() const {
+			return nodes.size();
+		}
+
+		const sphereEmitter& light(int i) const {
+			return lights[i];
+		}
+
+		// light of the emitting sphere hit, -1 if it is not a light of the tree
+		int lightOf(const Geometry* geometry) const {
+			auto it = index.find(geometry);
+			return it == index.end() ? -1 : it->second;
+		}
+
+		/// <summary>
+		/// Picks a light for the point p with the normal n.
+		/// </summary>
+		/// <param name="u">A uniform random number.</param>
+		/// <param name="probability">The probability of the light picked.</param>
+		/// <returns>The light, -1 if no light can reach the point</returns>
+		int sample(const point3& p, const vec3& n, double u, double& probability) const {
+			probability = 1;
+			if (nodes.empty())
+				return -1;
+
+			int node = 0;
+			while (nodes[node].light < 0) {
+				double a = importance(nodes[node + 1], p, n), b = importance(nodes[nodes[node].second], p, n);
+				if (a + b <= 0)
+					return -1;
+
+				double pa = a / (a + b);
+				if (u < pa) {
+					u = std::min(u / pa, 1 - 1e-12);
+					probability *= pa;
+					node = node + 1;
+				}
+				else {
+					u = std::min((u - pa) / (1 - pa), 1 - 1e-12);
+					probability *= 1 - pa;
+					node = nodes[node].second;
+				}
+			}
+			return nodes[node].light;
+		}
+
+		/// <summary>
+		/// Probability that sample picks the light for the point p with the normal n.
+		/// </summary>
+		double probability(const point3& p, const vec3& n, int light) const {
+			unsigned long long trail = trails[light];
+			double probability = 1;
+
+			int node = 0;
+			while (nodes[node].light < 0) {
+				double a = importance(nodes[node + 1], p, n), b = importance(nodes[nodes[node].second], p, n);
+				if (a + b <= 0)
+					return 0;
+
+				bool second = trail & 1;
+				trail >>= 1;
+				probability *= (second ? b : a) / (a + b);
+				node = second ? nodes[node].second : node + 1;
+			}
+			return probability;
+		}
+
+		/// <summary>
+		/// Bytes of the nodes.
+		/// </summary>
+		size_t memory() const {
+			return nodes.capacity() * sizeof(lightNode);
+		}
+
+	private:
+		/// <summary>
+		/// Bounds of the lights below a node, the first child follows its
+		/// parent, the second is at second.
+		/// </summary>
+		struct lightNode {
+			float min[3], max[3];
+			float power;
+			float axis[3];
+			float cos_theta_o;	// spread of the emitting normals around the axis
+			float cos_theta_e;	// emission around a normal, 0 for a hemisphere
+			int second;			// second child of an inner node
+			int light;			// light of a leaf, -1 for an inner node
+		};
+
+		// the node of the lights order[begin, end), the light of order[begin] is at depth
+		int build(std::vector<int>& order, int begin, int end, int depth, unsigned long long trail) {
+			int node = (int)nodes.size();
+			nodes.push_back(lightNode());
+
+			if (end - begin == 1) {
+				const sphereEmitter& s = lights[order[begin]];
+				lightNode& leaf = nodes[node];
+				for (int k = 0; k < 3; k++) {
+					leaf.min[k] = (float)(s.center[k] - s.radius);
+					leaf.max[k] = (float)(s.center[k] + s.radius);
+					leaf.axis[k] = k == 2 ? 1.0f : 0.0f;
+				}
+				leaf.power = (float)s.power();
+				leaf.cos_theta_o = -1;
+				leaf.cos_theta_e = 0;
+				leaf.second = -1;
+				leaf.light = order[begin];
+				trails[order[begin]] = trail;
+				return node;
+			}
+
+			// median split along the largest extent of the centers
+			point3 lo = lights[order[begin]].center, hi = lo;
+			for (int i = begin; i < end; i++) {
+				for (int k = 0; k < 3; k++) {
+					lo[k] = std::min(lo[k], lights[order[i]].center[k]);
+					hi[k] = std::max(hi[k], lights[order[i]].center[k]);
+				}
+			}
+			vec3 extent = hi - lo;
+			int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+			int mid = begin + (end - begin) / 2;
+			std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+							 [&](int a, int b) { return lights[a].center[axis] < lights[b].center[axis]; });
+
+			build(order, begin, mid, depth + 1, trail);
+			int second = build(order, mid, end, depth + 1, trail | (1ull << depth));
+
+			const lightNode& a = nodes[node + 1];
+			const lightNode& b = nodes[second];
+			lightNode merged;
+			for (int k = 0; k < 3; k++) {
+				merged.min[k] = std::min(a.min[k], b.min[k]);
+				merged.max[k] = std::max(a.max[k], b.max[k]);
+			}
+			merged.power = a.power + b.power;
+			mergeCones(a, b, merged);
+			merged.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+			merged.second = second;
+			merged.light = -1;
+			nodes[node] = merged;
+			return node;
+		}
+
+		// the cone of the normals of both nodes
+		static void mergeCones(const lightNode& a, const lightNode& b, lightNode& out) {
+			vec3 axis_a(a.axis[0], a.axis[1], a.axis[2]), axis_b(b.axis[0], b.axis[1], b.axis[2]);
+			double theta_a = acos(clamp((double)a.cos_theta_o, -1.0, 1.0));
+			double theta_b = acos(clamp((double)b.cos_theta_o, -1.0, 1.0));
+			double theta_d = acos(clamp(dot(axis_a, axis_b), -1.0, 1.0));
+
+			auto set = [&out](const vec3& axis, double theta) {
+				for (int k = 0; k < 3; k++)
+					out.axis[k] = (float)axis[k];
+				out.cos_theta_o = theta >= pi ? -1.0f : (float)cos(theta);
+			};
+
+			// one cone contains the other
+			if (std::min(theta_d + theta_b, pi) <= theta_a) { set(axis_a, theta_a); return; }
+			if (std::min(theta_d + theta_a, pi) <= theta_b) { set(axis_b, theta_b); return; }
+
+			double theta_o = (theta_a + theta_d + theta_b) / 2;
+			if (theta_o >= pi) { set(axis_a, pi); return; }
+
+			// rotate axis a towards b by theta_o - theta_a
+			vec3 w = cross(axis_a, axis_b);
+			if (w.squared_length() < 1e-12) { set(axis_a, pi); return; }
+			double angle = theta_o - theta_a;
+			vec3 k = unit_vector(w);
+			vec3 axis = axis_a * cos(angle) + cross(k, axis_a) * sin(angle) + k * dot(k, axis_a) * (1 - cos(angle));
+			set(unit_vector(axis), theta_o);
+		}
+
+		// cos(max(0, a - b)) of the angles with the cosines cos_a and cos_b
+		static double cosMinusClamped(double cos_a, double cos_b) {
+			if (cos_a >= cos_b)
+				return 1;
+			return cos_a * cos_b + sqrt(fmax(0.0, 1 - cos_a * cos_a)) * sqrt(fmax(0.0, 1 - cos_b * cos_b));
+		}
+
+		// importance of the lights of the node for the point p with the normal n
+		static double importance(const lightNode& node, const point3& p, const vec3& n) {
+			if (node.power <= 0)
+				return 0;
+
+			point3 center((node.min[0] + node.max[0]) / 2.0, (node.min[1] + node.max[1]) / 2.0, (node.min[2] + node.max[2]) / 2.0);
+			vec3 half((node.max[0] - node.min[0]) / 2.0, (node.max[1] - node.min[1]) / 2.0, (node.max[2] - node.min[2]) / 2.0);
+			vec3 to_point = p - center;
+			double d2 = to_point.squared_length(), r2 = half.squared_length();
+
+			// distance clamped to the size of the box, points inside see it in all directions
+			double distance2 = std::max(d2, r2);
+			double cos_b = d2 > r2 ? sqrt(1 - r2 / d2) : -1;
+			vec3 wi = d2 > 0 ? to_point / sqrt(d2) : vec3(0, 0, 1);
+
+			// smallest angle of the direction to the point with an emitting normal
+			double cos_w = clamp(dot(vec3(node.axis[0], node.axis[1], node.axis[2]), wi), -1.0, 1.0);
+			double cos_theta = cosMinusClamped(cosMinusClamped(cos_w, node.cos_theta_o), cos_b);
+			if (cos_theta <= node.cos_theta_e)
+				return 0;
+
+			// largest cosine with the normal of the point
+			double cos_i = cosMinusClamped(clamp(dot(n, -wi), -1.0, 1.0), cos_b);
+			if (cos_i <= 0)
+				return 0;
+
+			return node.power * cos_theta * cos_i / distance2;
+		}
+
+	private:
+		std::vector<sphereEmitter> lights;
+		std::unordered_map<const Geometry*, int> index;		// light of the geometry intersect reports
+		std::vector<unsigned long long> trails;				// path of each light, bit k: second child at depth k
+		std::vector<lightNode> nodes;						// depth first
+};
+
+#endif // !LIGHTTREE_H
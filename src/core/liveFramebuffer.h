@@ -0,0 +1,315 @@
+#ifndef LIVEFRAMEBUFFER_H
+#define LIVEFRAMEBUFFER_H
+
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// boost
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// version of the live framebuffer layout, increase when it changes
+#define LIVE_VERSION 1
+// alignment of the pixels in the file
+#define LIVE_ALIGN 64
+
+static_assert(sizeof(color) == 3 * sizeof(double), "the live framebuffer stores a color as three doubles");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "the live framebuffer needs lock-free atomics");
+
+/// <summary>
+/// Header at the start of a live framebuffer file, followed by the tile
+/// table and the pixels.
+/// </summary>
+struct liveHeader {
+	char magic[8];					// "PTLIVE", written last
+	uint32_t version;				// LIVE_VERSION
+	uint32_t byte_order;			// 0x01020304 in the byte order of the writer
+	uint32_t width;
+	uint32_t height;
+	uint32_t tile_count;
+	uint32_t passes;				// passes of the rendering
+	uint64_t tiles_offset;			// liveTile[tile_count]
+	uint64_t pixels_offset;			// width * height sample sums, three doubles each, row by row from the top
+	uint64_t size;					// size of the file
+	std::atomic<uint32_t> pass;		// finished passes
+	std::atomic<uint32_t> done;		// 1 once the rendering finished
+	std::atomic<uint64_t> updates;	// number of finished tile updates, for polling
+};
+
+/// <summary>
+/// Tile of a live framebuffer. The sequence number is odd while the render
+/// thread writes the pixels of the tile (a sequence lock): a reader copies
+/// the tile and keeps the copy only if the number was even and unchanged.
+/// </summary>
+struct liveTile {
+	std::atomic<uint64_t> sequence;
+	std::atomic<uint32_t> samples;	// samples per pixel accumulated in the tile
+	uint32_t x0, y0, x1, y1;
+	uint32_t pad;
+};
+
+/// <summary>
+/// Accumulation buffer of a rendering in a memory-mapped file, for external
+/// viewers and monitoring tools. A path in /dev/shm keeps the file in
+/// shared memory.
+///
+/// The render threads accumulate straight into the mapped pixels, so the
+/// image is never copied and the render loop takes no locks, it only bumps
+/// the sequence number of a tile before and after rendering it.
+/// </summary>
+class LiveFramebuffer {
+	public:
+		/// <summary>
+		/// Creates (or replaces) the file and maps it.
+		/// </summary>
+		/// <param name="path">The path of the file.</param>
+		/// <param name="width">The image width.</param>
+		/// <param name="height">The image height.</param>
+		/// <param name="tile_count">The number of tiles, set up with setTile.</param>
+		/// <param name="passes">The number of passes.</param>
+		/// <returns>The framebuffer, null if the file cannot be created</returns>
+		static std::shared_ptr<LiveFramebuffer> create(const std::string& path, int width, int height, int tile_count, int passes);
+
+		/// <summary>
+		/// The pixels in the file (not initialized).
+		/// </summary>
+		color* pixels() {
+			return reinterpret_cast<color*>(data + header->pixels_offset);
+		}
+
+		/// <summary>
+		/// Sets the rectangle of a tile.
+		/// </summary>
+		void setTile(int index, int x0, int y0, int x1, int y1) {
+			liveTile& t = tiles[index];
+			t.x0 = x0;
+			t.y0 = y0;
+			t.x1 = x1;
+			t.y1 = y1;
+		}
+
+		/// <summary>
+		/// Marks the tile as being written.
+		/// </summary>
+		void beginTile(int index) {
+			tiles[index].sequence.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+
+		/// <summary>
+		/// Marks the tile as written, it holds samples per pixel now.
+		/// </summary>
+		void endTile(int index, int samples) {
+			tiles[index].samples.store(samples, std::memory_order_relaxed);
+			tiles[index].sequence.fetch_add(1, std::memory_order_release);
+			header->updates.fetch_add(1, std::memory_order_release);
+		}
+
+		/// <summary>
+		/// Sets the number of finished passes.
+		/// </summary>
+		void setPass(int pass) {
+			header->pass.store(pass, std::memory_order_release);
+		}
+
+		/// <summary>
+		/// Marks the rendering as finished.
+		/// </summary>
+		void finish() {
+			header->done.store(1, std::memory_order_release);
+			header->updates.fetch_add(1, std::memory_order_release);
+		}
+
+	private:
+		std::unique_ptr<boost::interprocess::mapped_region> region;
+		char* data = nullptr;
+		liveHeader* header = nullptr;
+		liveTile* tiles = nullptr;
+};
+
+std::shared_ptr<LiveFramebuffer> LiveFramebuffer::create(const std::string& path, int width, int height, int tile_count, int passes) {
+	uint64_t tiles_offset = (sizeof(liveHeader) + LIVE_ALIGN - 1) / LIVE_ALIGN * LIVE_ALIGN;
+	uint64_t pixels_offset = (tiles_offset + tile_count * sizeof(liveTile) + LIVE_ALIGN - 1) / LIVE_ALIGN * LIVE_ALIGN;
+	uint64_t size = pixels_offset + (uint64_t)width * height * sizeof(color);
+
+	namespace bip = boost::interprocess;
+	auto live = std::make_shared<LiveFramebuffer>();
+	try {
+		// a new file, so a viewer of the previous rendering never sees the new layout
+		std::remove(path.c_str());
+		{
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			if (!file) throw std::runtime_error("cannot create the file");
+			file.seekp(size - 1);
+			file.put(0);
+			if (!file) throw std::runtime_error("cannot resize the file");
+		}
+
+		bip::file_mapping mapping(path.c_str(), bip::read_write);
+		live->region.reset(new bip::mapped_region(mapping, bip::read_write));
+	}
+	catch (std::exception& e) {
+		std::cerr << "live framebuffer: cannot map " << path << ": " << e.what() << "\n";
+		return nullptr;
+	}
+
+	live->data = static_cast<char*>(live->region->get_address());
+	live->header = new (live->data) liveHeader();
+	live->tiles = reinterpret_cast<liveTile*>(live->data + tiles_offset);
+	for (int i = 0; i < tile_count; i++)
+		new (live->tiles + i) liveTile();
+
+	liveHeader& h = *live->header;
+	h.version = LIVE_VERSION;
+	h.byte_order = 0x01020304u;
+	h.width = width;
+	h.height = height;
+	h.tile_count = tile_count;
+	h.passes = passes;
+	h.tiles_offset = tiles_offset;
+	h.pixels_offset = pixels_offset;
+	h.size = size;
+	h.pass = 0;
+	h.done = 0;
+	h.updates = 0;
+
+	std::atomic_thread_fence(std::memory_order_release);
+	std::strncpy(h.magic, "PTLIVE", sizeof(h.magic));
+
+	return live;
+}
+
+/// <summary>
+/// Reads the image of a live framebuffer written by another process.
+/// </summary>
+class LiveFramebufferReader {
+	public:
+		/// <summary>
+		/// Maps the file.
+		/// </summary>
+		/// <returns>False if the file is missing or not (yet) a live framebuffer</returns>
+		bool open(const std::string& path) {
+			namespace bip = boost::interprocess;
+			if (!std::ifstream(path)) return false;
+
+			try {
+				bip::file_mapping mapping(path.c_str(), bip::read_only);
+				region.reset(new bip::mapped_region(mapping, bip::read_only));
+			}
+			catch (std::exception&) {
+				return false;
+			}
+
+			data = static_cast<const char*>(region->get_address());
+			if (region->get_size() < sizeof(liveHeader)) return false;
+			header = reinterpret_cast<const liveHeader*>(data);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (std::strncmp(header->magic, "PTLIVE", sizeof(header->magic)) != 0 ||
+				header->version != LIVE_VERSION ||
+				header->byte_order != 0x01020304u ||
+				header->size > region->get_size())
+				return false;
+
+			// the tile table and the pixels must lie inside the file, a stale or
+			// corrupt file would make the copies read outside the mapping
+			size_t size = header->size;
+			size_t tiles_offset = header->tiles_offset, pixels_offset = header->pixels_offset;
+			if (tiles_offset > size || (size - tiles_offset) / sizeof(liveTile) < header->tile_count ||
+				pixels_offset > size || (size - pixels_offset) / sizeof(color) / std::max<size_t>(header->width, 1) < header->height)
+				return false;
+			return true;
+		}
+
+		const liveHeader& getHeader() const {
+			return *header;
+		}
+
+		/// <summary>
+		/// Copies the tile into image (width * height) and its samples per pixel
+		/// into samples, retrying while the tile is written. A tile outside the
+		/// image is not copied and has no samples.
+		/// </summary>
+		/// <returns>The sequence number of the copy</returns>
+		uint64_t readTile(int index, color* image, uint32_t& samples) const {
+			const liveTile& t = tiles()[index];
+			const color* pixels = reinterpret_cast<const color*>(data + header->pixels_offset);
+			uint32_t r[4];
+			if (!rectangle(t, r)) {
+				samples = 0;
+				return t.sequence.load(std::memory_order_acquire);
+			}
+
+			while (true) {
+				uint64_t before = t.sequence.load(std::memory_order_acquire);
+				if (before & 1) {
+					std::this_thread::yield();
+					continue;
+				}
+
+				samples = t.samples.load(std::memory_order_relaxed);
+				for (size_t y = r[1]; y < r[3]; y++)
+					std::memcpy(image + y * header->width + r[0], pixels + y * header->width + r[0], (r[2] - r[0]) * sizeof(color));
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (t.sequence.load(std::memory_order_relaxed) == before)
+					return before;
+			}
+		}
+
+		/// <summary>
+		/// Copies the whole image, each tile is consistent on its own. Pixels of
+		/// tiles not rendered yet are black.
+		/// </summary>
+		/// <param name="image">The mean color of each pixel.</param>
+		void snapshot(std::vector<color>& image) const {
+			image.assign((size_t)header->width * header->height, color(0, 0, 0));
+			for (uint32_t i = 0; i < header->tile_count; i++) {
+				uint32_t samples, r[4];
+				readTile(i, image.data(), samples);
+				if (!rectangle(tiles()[i], r)) continue;
+
+				double scale = samples ? 1.0 / samples : 0.0;
+				for (size_t y = r[1]; y < r[3]; y++) {
+					for (size_t x = r[0]; x < r[2]; x++)
+						image[y * header->width + x] *= scale;
+				}
+			}
+		}
+
+	private:
+		const liveTile* tiles() const {
+			return reinterpret_cast<const liveTile*>(data + header->tiles_offset);
+		}
+
+		/// <summary>
+		/// Reads the rectangle of the tile into r (x0, y0, x1, y1).
+		/// </summary>
+		/// <returns>False if it is not inside the image</returns>
+		bool rectangle(const liveTile& t, uint32_t r[4]) const {
+			r[0] = t.x0;
+			r[1] = t.y0;
+			r[2] = t.x1;
+			r[3] = t.y1;
+			return r[0] <= r[2] && r[2] <= header->width && r[1] <= r[3] && r[3] <= header->height;
+		}
+
+	private:
+		std::unique_ptr<boost::interprocess::mapped_region> region;
+		const char* data = nullptr;
+		const liveHeader* header = nullptr;
+};
+
+#endif // !LIVEFRAMEBUFFER_H
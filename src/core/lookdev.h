@@ -0,0 +1,339 @@
+#ifndef LOOKDEV_H
+#define LOOKDEV_H
+
+#include "common.h"
+#include "bvh.h"
+#include "encoder.h"
+#include "pipeline.h"
+#include "renderer.h"
+#include "renderOptions.h"
+#include "threadPool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// first bytes of a G-buffer file, the last two are the version
+#define GBUFFER_MAGIC "PTGBUF01"
+// object index of a sample missing the scene
+#define GBUFFER_MISS -1
+// object index of a sample hitting a geometry which is not an object of the world
+#define GBUFFER_UNKNOWN -2
+
+/// <summary>
+/// First hit of a camera ray sample. The ray is built from the stored
+/// samples (see Camera::get_ray), so it is the same ray in every render
+/// and the surface of the hit is computed again without a traversal.
+/// </summary>
+struct gbufferSample {
+	int32_t object;		// index of the object hit (see flattenGeometry), GBUFFER_MISS or GBUFFER_UNKNOWN
+	int32_t primitive;	// primitive of the object
+	double t;			// distance of the hit
+	float jitter[2];	// position of the sample in the pixel
+	float lens[2];		// uniform samples of the lens point
+	float time;			// uniform sample of the time
+	uint32_t material;	// low bits of the hash of the material hit
+};
+
+/// <summary>
+/// First hit cache for look-dev: the first hit of every camera ray sample
+/// and the sample sums of the pixels, kept in a file between renders.
+///
+/// The file is valid while the hashes of the geometry (scene description
+/// and the bounds of the objects of the world) and of the view (camera,
+/// image size, samples, seed and lighting) match. A render with a valid
+/// file only re-shades the pixels where the material of a first hit
+/// changed, i.e. after a --material edit, the other pixels keep their
+/// previous sums. Changes of the light reflected from edited materials
+/// onto other pixels are not updated, a full render (delete the file)
+/// resolves them.
+///
+/// The cache renders with the path tracer, one sample at a time without
+/// packets, culling or passes.
+/// </summary>
+class GBuffer {
+	public:
+		GBuffer(const Frame& frame, const RenderOption& options)
+			: width(frame.width), height(frame.height), samples(std::max(frame.samples, 1)) {
+			flattenGeometry(frame.world, objects);
+			for (size_t i = 0; i < objects.size(); i++)
+				index[objects[i].get()] = (int)i;
+
+			// geometry: the scene description and the bounds of the objects
+			geometry_hash = hash(FNV1A_BASIS, options.scene + '\n' + std::to_string(options.seed) + '\n' +
+														  std::to_string(options.scene_count) + '\n' + options.stream);
+			for (const auto& object : objects) {
+				aabb box;
+				if (object->bounding_box(frame.cam.shutter_open(), frame.cam.shutter_close(), box)) {
+					double bounds[] = { box.min().x(), box.min().y(), box.min().z(), box.max().x(), box.max().y(), box.max().z() };
+					geometry_hash = fnv1a(geometry_hash, bounds, sizeof(bounds));
+				}
+				else
+					geometry_hash = hash(geometry_hash, "unbounded");
+			}
+
+			// view: camera, image, random numbers and the light of the rays leaving the scene
+			const CameraSettings& c = options.camera;
+			double view[] = { c.lookfrom.x(), c.lookfrom.y(), c.lookfrom.z(), c.lookat.x(), c.lookat.y(), c.lookat.z(),
+							  c.vup.x(), c.vup.y(), c.vup.z(), c.vfov, c.aperture, c.focus_dist, options.aspect_ratio,
+							  (double)frame.seed, (double)frame.number, frame.sky, options.env_intensity, options.env_rotation };
+			view_hash = hash(fnv1a(FNV1A_BASIS, view, sizeof(view)), options.env);
+
+			sums.assign((size_t)width * height, color(0, 0, 0));
+			records.resize((size_t)width * height * samples);
+		}
+
+		/// <summary>
+		/// Loads the cache, fails if the file is missing or was written for
+		/// another geometry, view or image.
+		/// </summary>
+		bool load(const std::string& path) {
+			std::ifstream file(path, std::ios::binary);
+			if (!file)
+				return false;
+
+			char magic[8];
+			int32_t size[3];
+			unsigned long long hashes[2];
+			file.read(magic, sizeof(magic));
+			file.read(reinterpret_cast<char*>(size), sizeof(size));
+			file.read(reinterpret_cast<char*>(hashes), sizeof(hashes));
+			if (!file || std::memcmp(magic, GBUFFER_MAGIC, sizeof(magic)) != 0 || size[0] != width || size[1] != height ||
+				size[2] != samples || hashes[0] != geometry_hash || hashes[1] != view_hash)
+				return false;
+
+			file.read(reinterpret_cast<char*>(sums.data()), sums.size() * sizeof(color));
+			file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(gbufferSample));
+			if (!file)
+				return false;
+
+			// a corrupt file with a valid header must not index past the objects
+			for (const auto& g : records) {
+				if (g.object < GBUFFER_UNKNOWN || g.object >= (int)objects.size())
+					return false;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Writes the cache.
+		/// </summary>
+		/// <returns>false if the file cannot be written</returns>
+		bool save(const std::string& path) const {
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			int32_t size[] = { width, height, samples };
+			unsigned long long hashes[] = { geometry_hash, view_hash };
+			file.write(GBUFFER_MAGIC, 8);
+			file.write(reinterpret_cast<const char*>(size), sizeof(size));
+			file.write(reinterpret_cast<const char*>(hashes), sizeof(hashes));
+			file.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(color));
+			file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(gbufferSample));
+			file.close();
+			return !file.fail();
+		}
+
+		/// <summary>
+		/// Renders the pixels of the tile into frame.pixels. Without a
+		/// loaded cache all samples are traced and their first hits recorded,
+		/// else only the pixels whose first hit materials changed are shaded.
+		/// </summary>
+		/// <param name="frame">The frame.</param>
+		/// <param name="tile">The tile.</param>
+		/// <param name="cached">True if the cache was loaded.</param>
+		/// <returns>The number of pixels shaded</returns>
+		size_t renderTile(Frame& frame, const Tile& tile, bool cached) {
+			const Geometry& world = frame.worldOn(currentNumaNode());
+			PathContext context(frame);
+			size_t shaded = 0;
+
+			// recording uses the seeds of the first pass of renderPasses, re-shading its own
+			seed_random(tileSeed(frame.seed, frame.number, cached ? -4 : 0, tile.index));
+
+			for (int y = tile.y0; y < tile.y1; y++) {
+				for (int x = tile.x0; x < tile.x1; x++) {
+					size_t p = (size_t)y * width + x;
+					gbufferSample* first = &records[p * samples];
+
+					if (cached && !changed(frame, x, y, first)) {
+						frame.pixels[p] = sums[p];
+						continue;
+					}
+
+					color sum(0, 0, 0);
+					for (int s = 0; s < samples; s++) {
+						gbufferSample& g = first[s];
+						if (!cached) {
+							g.jitter[0] = (float)random_double();
+							g.jitter[1] = (float)random_double();
+							g.lens[0] = (float)random_double();
+							g.lens[1] = (float)random_double();
+							g.time = (float)random_double();
+						}
+
+						color c = shade(frame, world, context, x, y, g, cached && g.object >= 0);
+						c.replaceNaN();
+						sum += c;
+					}
+
+					frame.pixels[p] = sums[p] = sum;
+					shaded++;
+				}
+			}
+			return shaded;
+		}
+
+		/// <summary>
+		/// Bytes of the records and the pixel sums.
+		/// </summary>
+		size_t memory() const {
+			return records.size() * sizeof(gbufferSample) + sums.size() * sizeof(color);
+		}
+
+	private:
+		static unsigned long long hash(unsigned long long h, const std::string& s) {
+			return fnv1a(h, s.data(), s.size());
+		}
+
+		// the camera ray of the sample of the pixel (x, y)
+		ray cameraRay(const Frame& frame, int x, int y, const gbufferSample& g) const {
+			auto u = (x + (double)g.jitter[0]) / (width - 1);
+			auto v = (height - 1 - y + (double)g.jitter[1]) / (height - 1);
+			return frame.cam.get_ray(u, v, g.lens[0], g.lens[1], g.time);
+		}
+
+		// true if the material of a first hit of the pixel's samples changed
+		bool changed(const Frame& frame, int x, int y, const gbufferSample* first) const {
+			for (int s = 0; s < samples; s++) {
+				const gbufferSample& g = first[s];
+				if (g.object == GBUFFER_UNKNOWN)
+					return true;
+				if (g.object == GBUFFER_MISS)
+					continue;
+
+				hitRecord rec;
+				ray r = cameraRay(frame, x, y, g);
+				if (!objects[g.object]->interaction(r, surfaceHit{ g.t, objects[g.object].get(), g.primitive }, rec) ||
+					(uint32_t)rec.mat_ptr->hash() != g.material)
+					return true;
+			}
+			return false;
+		}
+
+		// color of the sample, the first hit is intersected and recorded unless reused
+		color shade(const Frame& frame, const Geometry& world, const PathContext& context, int x, int y, gbufferSample& g, bool reuse) const {
+			ray r = cameraRay(frame, x, y, g);
+			hitRecord rec;
+			surfaceHit hit{ g.t, nullptr, g.primitive };
+
+			if (reuse)
+				hit.geometry = objects[g.object].get();
+			else {
+				traced_rays++;
+				if (!world.intersect(r, 0.001, infinity, hit)) {
+					g.object = GBUFFER_MISS;
+					return background(r, context, 0);
+				}
+
+				auto it = index.find(hit.geometry);
+				g.object = it != index.end() ? it->second : GBUFFER_UNKNOWN;
+				g.primitive = hit.primitive;
+				g.t = hit.t;
+			}
+
+			// a surface not found again is shaded as a miss and traced anew by the next render
+			if (!hit.geometry->interaction(r, hit, rec)) {
+				g.object = GBUFFER_UNKNOWN;
+				return background(r, context, 0);
+			}
+			g.material = (uint32_t)rec.mat_ptr->hash();
+			return shade_hit(r, rec, world, 0, context);
+		}
+
+	private:
+		int width;
+		int height;
+		int samples;
+
+		std::vector<shared_ptr<Geometry>> objects;				// objects of the world, the indices of the records
+		std::unordered_map<const Geometry*, int> index;			// object index of the geometry reported by intersect
+
+		unsigned long long geometry_hash = 0;
+		unsigned long long view_hash = 0;
+
+		std::vector<color> sums;				// sample sums of the pixels
+		std::vector<gbufferSample> records;		// samples of the pixels, row by row from the top
+};
+
+/// <summary>
+/// Renders the frame with the first hit cache in the file at
+/// options.gbuffer (see GBuffer) and writes the image to path. The cache is
+/// created or updated after the image is rendered.
+/// </summary>
+/// <param name="pool">The thread pool.</param>
+/// <param name="encoder">The image encoder.</param>
+/// <param name="frame">The frame, its pixels are allocated here.</param>
+/// <param name="options">The render options (tiles, tone mapping, the cache file).</param>
+/// <param name="path">The output path of the image.</param>
+/// <param name="written">Called from the encoder with the pass, the pass count (0, 1) and whether the image was written.</param>
+/// <returns>False if the rendering was cancelled</returns>
+bool renderGBuffer(ThreadPool& pool, ImageEncoder& encoder, Frame& frame, const RenderOption& options,
+				   const std::string& path, std::function<void(int, int, bool)> written = std::function<void(int, int, bool)>()) {
+	if (frame.bidirectional || options.guiding || options.passes > 1 || options.preview || !options.live.empty())
+		std::cerr << "gbuffer: renders with the path tracer in a single pass, other integrators, guiding, passes, preview and live are ignored\n";
+
+	// the encode job is submitted by the last tile, an empty image has none
+	auto tiles = makeTiles(frame.width, frame.height, options.tile_size);
+	if (tiles.empty()) {
+		std::cerr << "the image is empty, nothing written\n";
+		return true;
+	}
+
+	GBuffer gbuffer(frame, options);
+	bool cached = gbuffer.load(options.gbuffer);
+
+	auto tm = toneMapping(options);
+	frame.pixels.allocate((size_t)frame.width * frame.height);
+
+	auto job = encoder.acquire(path, frame.width, frame.height);
+	if (written)
+		job->written = [written](bool ok) { written(0, 1, ok); };
+	std::atomic<size_t> shaded(0);
+	std::atomic<bool> cancelled(false);
+
+	for (const auto& tile : tiles) {
+		pool.submit([&, tile]() {
+			if (frame.cancel && frame.cancel->load()) {
+				cancelled = true;
+				return;
+			}
+			shaded += gbuffer.renderTile(frame, tile, cached);
+			tonemapTile(frame, tile, frame.samples, tm, job->rgb.data());
+		});
+	}
+	pool.wait();
+
+	if (cancelled) {
+		encoder.release(job);
+		return false;
+	}
+	encoder.submit(job);
+
+	size_t pixels = (size_t)frame.width * frame.height;
+	if (cached)
+		std::cerr << "gbuffer: " << shaded << " of " << pixels << " pixels re-shaded\n";
+	else
+		std::cerr << "gbuffer: recorded " << pixels * frame.samples << " first hits, "
+				  << gbuffer.memory() / (1024.0 * 1024.0) << " MB\n";
+
+	if ((!cached || shaded > 0) && !gbuffer.save(options.gbuffer))
+		std::cerr << "cannot write the gbuffer " << options.gbuffer << "\n";
+	return true;
+}
+
+#endif // !LOOKDEV_H
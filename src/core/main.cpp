@@ -1,7 +1,12 @@
 #include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>     // std::cout
 #include <iterator>
 #include <limits>       // std::numeric_limits
+#include <mutex>
 #include <vector>
 
 // boost
@@ -10,13 +15,25 @@ namespace po = boost::program_options;
 #include <boost/algorithm/string/predicate.hpp>
 
 #include "ray.h"
+#include "benchmark.h"
+#include "bvh.h"
 #include "camera.h"
 #include "geometry.h"
 #include "material.h"
+#include "renderer.h"
 #include "renderOptions.h"
 #include "scene.h"
+#include "sequence.h"
+#include "streamedField.h"
 #include "image.h"
+#include "encoder.h"
+#include "estimate.h"
+#include "lookdev.h"
+#include "pipeline.h"
+#include "server.h"
 #include "texture.h"
+#include "threadPool.h"
+#include "views.h"
 
 /**
  * Output
@@ -26,97 +43,319 @@ namespace po = boost::program_options;
  */
 //#define OUTPUT 0
 
-// recursion depth to limit the maximum light bounces
-#define RAY_BOUNCE_LIMIT 50 
-
 //std::string colTerm = ",";
 
 /* GLOBALS */
 RenderOption rO;
-RenderOption rO;
 
+// number of frames of a sequence rendered at the same time
+#define FRAMES_IN_FLIGHT 2
 
-// ray intersection
-color ray_color(const ray& r, const Geometry& world, int depth) {
-	hitRecord rec;
-	
-	// ray bounce limit
-	if (depth >= RAY_BOUNCE_LIMIT)
-		return color(0, 0, 0);
-
-	// using 0.001 to fix shadow acne
-	// ignore hits very near zero
-	if (world.hit(r, 0.001, infinity, rec)) {
-		ray scattered;
-		color attenuation;
-		
-		if (rec.mat_ptr->scatter(r, rec, attenuation, scattered)) 
-			return attenuation * ray_color(scattered, world, depth+1);
+/// <summary>
+/// Builds the scene of the render options, its hierarchy and the
+/// environment map shared by the frames rendered from them.
+/// </summary>
+/// <param name="pool">The thread pool.</param>
+/// <param name="scene">The objects of the scene.</param>
+/// <param name="world">The hierarchy of the objects.</param>
+/// <param name="environment">The environment map, null without --env.</param>
+/// <returns>False if the scene is unknown or the environment cannot be loaded</returns>
+bool buildWorld(ThreadPool& pool, GeometryList& scene, shared_ptr<BVHAccel>& world, shared_ptr<const EnvironmentMap>& environment) {
+	seed_random(rO.seed);
 
-		return vec3(1, 0, 0);
+	/* Assemble (acceleration) */
+	if (!buildScene(rO, pool, scene)) {
+		std::cerr << "unknown scene " << rO.scene << "\n";
+		return false;
 	}
-	
-	return colorGradient(r);
-};
+	auto start = std::chrono::steady_clock::now();
+	world = make_shared<BVHAccel>(scene.getObjects(), 0, 0, BVHCache(rO.bvh_cache));
+	auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << "hierarchy " << (world->cached() ? "mapped from cache" : "built") << " in " << ms << " ms\n";
 
+	return rO.env.empty() || (environment = EnvironmentMap::load(rO.env, rO.env_intensity, rO.env_rotation, pool));
+}
 
-std::vector<vec3> renderScene() {
-	std::vector<vec3> colors;
+void renderScene(ThreadPool& pool, ImageEncoder& encoder) {
+	GeometryList scene;
+	shared_ptr<BVHAccel> world;
+	shared_ptr<const EnvironmentMap> environment;
+	if (!buildWorld(pool, scene, world, environment))
+		return;
+
+	if (rO.estimate) {
+		Frame frame;
+		initFrame(frame, rO, rO.camera, world, environment);
+		RenderEstimate estimate(frame, rO);
+		estimate.sample(pool);
+		estimate.print(std::cout, pool.size());
+		return;
+	}
 
-	srand(rO.seed);
+	if (rO.scanline) {
+		auto start = std::chrono::steady_clock::now();
+		if (renderScanlines(pool, rO, world, environment, rO.outputPath)) {
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cerr << "rendered in " << seconds << " s, "
+					  << (double)rO.image_width * rO.image_height * rO.samples / seconds / 1e6 << " M camera rays/s\n";
+		}
+		return;
+	}
 
-	/* Assemble (acceleration) */
-	auto world = random_scene();
-
-	/* Camera */
-	point3 lookfrom(13, 2, 3);
-	point3 lookat(0, 0, 0);
-	vec3 vup(0, 1, 0);
-	auto dist_to_focus = 10.0;
-	auto aperture =0.1;
-
-	// initialize camera 
-	Camera cam(lookfrom,
-				lookat,
-				vup,
-				20,
-				rO.aspect_ratio,
-				aperture,
-				dist_to_focus);
-	
 	// Render 
-	for (int j = rO.image_height - 1; j >= 0; --j) {
-		// progress indicator
-		std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-		
-		for (int i = 0; i < rO.image_width; ++i) {
-			color pixel_color(0, 0, 0);
-
-			for (int s = 0; s < rO.samples; ++s) {
-				auto u = (i + random_double()) / (rO.image_width-1);
-				auto v = (j + random_double()) / (rO.image_height-1);
-				ray r = cam.get_ray(u, v);
-				pixel_color += ray_color(r, world, 0);
-			}
-			
-			// replace NaN components 
-			pixel_color.replaceNaN();
+	Frame frame;
+	auto start = std::chrono::steady_clock::now();
+	initFrame(frame, rO, rO.camera, world, environment);
+	if (frame.culling) {
+		auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::cerr << "culling: " << frame.culling->tileCount() << " tiles, " << frame.culling->candidates()
+				  << " candidates per tile, built in " << ms << " ms\n";
+	}
+	// shade_sampled draws the light of guided and environment lit paths, it does not sample the tree
+	if (frame.lights && (rO.guiding || frame.environment))
+		std::cerr << "light tree: not sampled with --guiding or --env\n";
+	else if (frame.lights)
+		std::cerr << "light tree: " << frame.lights->lightCount() << " lights, " << frame.lights->nodeCount() << " nodes, "
+				  << frame.lights->memory() / (1024.0 * 1024.0) << " MB\n";
+	start = std::chrono::steady_clock::now();
+	if (!rO.gbuffer.empty())
+		renderGBuffer(pool, encoder, frame, rO, rO.outputPath);
+	else
+		renderPasses(pool, encoder, frame, rO, rO.outputPath);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << "rendered in " << seconds << " s, "
+			  << (double)frame.width * frame.height * frame.samples / seconds / 1e6 << " M camera rays/s\n";
+
+	for (const auto& object : scene.getObjects()) {
+		if (auto streamed = std::dynamic_pointer_cast<StreamedSphereField>(object))
+			streamed->printStats(std::cerr);
+	}
+}
 
-			// divide the color for multi sampling by the number of samples
-			auto scale = 1.0 / rO.samples;
-			pixel_color *= scale;
-			
-			//  gamma=2.0 correction 
-			pixel_color = vec3(
-				sqrt(pixel_color.r()), 
-				sqrt(pixel_color.g()),
-				sqrt(pixel_color.b()));
+/// <summary>
+/// Renders the frames [first, last] of an animation sequence.
+/// 
+/// The static part of the scene is built once, the tiles of up to
+/// FRAMES_IN_FLIGHT frames share the thread pool, so the threads are busy
+/// while the last tiles of a frame finish. Tiles are tone mapped as soon as
+/// they are done and a finished frame is encoded in the background.
+/// </summary>
+/// <param name="pool">The thread pool.</param>
+/// <param name="encoder">The image encoder.</param>
+/// <param name="sequence">The sequence.</param>
+/// <param name="first">The first frame.</param>
+/// <param name="last">The last frame.</param>
+void renderSequence(ThreadPool& pool, ImageEncoder& encoder, const Sequence& sequence, int first, int last) {
+	seed_random(rO.seed);
+
+	/* Assemble (acceleration) */
+	GeometryList scene;
+	if (!buildScene(rO, pool, scene)) {
+		std::cerr << "unknown scene " << rO.scene << "\n";
+		return;
+	}
+	SequenceScene animated(scene, sequence, BVHCache(rO.bvh_cache));
+
+	if (rO.passes > 1 || rO.preview || rO.guiding || rO.radiance_cache || rO.cost_tiles || !rO.cost_map.empty() || !rO.gbuffer.empty() ||
+		rO.scanline || rO.estimate)
+		std::cerr << "sequences ignore --passes, --preview, --guiding, --radiance-cache, --cost-tiles, --cost-map, --gbuffer, --scanline and --estimate\n";
+
+	shared_ptr<const EnvironmentMap> environment;
+	if (!rO.env.empty() && !(environment = EnvironmentMap::load(rO.env, rO.env_intensity, rO.env_rotation, pool)))
+		return;
+
+	auto tm = toneMapping(rO);
+
+	std::mutex mutex;
+	std::condition_variable frame_done;
+	int in_flight = 0;
+
+	for (int f = first; f <= last; f++) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			frame_done.wait(lock, [&]() { return in_flight < FRAMES_IN_FLIGHT; });
+			in_flight++;
+		}
+
+		auto frame = make_shared<Frame>();
+		initFrame(*frame, rO, sequence.camera(f, rO.camera), animated.world(f), environment);
+		frame->number = f;
+		frame->pixels.assign((size_t)frame->width * frame->height, color(0, 0, 0));
+
+		std::string path = framePath(rO.outputPath, f);
+		auto job = encoder.acquire(path, frame->width, frame->height);
+
+		auto tiles = makeTiles(frame->width, frame->height, rO.tile_size);
+		auto remaining = make_shared<std::atomic<int>>((int)tiles.size());
 
-			colors.push_back(pixel_color);
+		// an empty image has no last tile finishing the frame
+		if (tiles.empty()) {
+			encoder.release(job);
+			std::lock_guard<std::mutex> lock(mutex);
+			std::cerr << "frame " << frame->number << " is empty, nothing written\n";
+			in_flight--;
+			continue;
 		}
+
+		for (const auto& tile : tiles) {
+			pool.submit([&, frame, job, remaining, tile]() {
+				renderTile(*frame, tile, 0, frame->samples);
+				if (!frame->bidirectional)
+					tonemapTile(*frame, tile, frame->samples, tm, job->rgb.data());
+
+				if (--*remaining > 0) return;
+
+				// last tile of the frame, the light tracing splats are complete now
+				if (frame->bidirectional) {
+					frame->bidirectional->splats.drain(frame->pixels);
+					for (const auto& t : makeTiles(frame->width, frame->height, rO.tile_size))
+						tonemapTile(*frame, t, frame->samples, tm, job->rgb.data());
+				}
+				encoder.submit(job);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				std::cerr << "frame " << frame->number << " rendered, writing " << job->path << "\n";
+				in_flight--;
+				frame_done.notify_all();
+			});
+		}
+	}
+
+	pool.wait();
+}
+
+/// <summary>
+/// Renders the views of a scene (e.g. stereo pairs, cube map faces or a
+/// camera array) in one run.
+///
+/// The scene, its hierarchy (and its NUMA replicas) and the light tree are
+/// built once and shared by all views. The tiles of all views are queued on the pool at once, in the
+/// order of the views, so the threads move on to the next view while the
+/// last tiles of a view finish. A view is set up (camera, culling,
+/// framebuffer) by the first of its tiles to run and freed by its last one,
+/// so only the views being rendered hold a framebuffer.
+///
+/// Every view is written to its own image (see viewPath) or all views are
+/// packed into one atlas image, in rows of ceil(sqrt(views)) views. As the
+/// frames of a sequence, the views are rendered in a single pass.
+/// </summary>
+/// <param name="pool">The thread pool.</param>
+/// <param name="encoder">The image encoder.</param>
+/// <param name="views">The views.</param>
+/// <param name="atlas">Pack the views into the image at the output path.</param>
+void renderViews(ThreadPool& pool, ImageEncoder& encoder, const std::vector<ViewSettings>& views, bool atlas) {
+	GeometryList scene;
+	shared_ptr<BVHAccel> world;
+	shared_ptr<const EnvironmentMap> environment;
+	if (!buildWorld(pool, scene, world, environment))
+		return;
+
+	if (rO.passes > 1 || rO.preview || rO.guiding || rO.radiance_cache || !rO.live.empty() || !rO.gbuffer.empty() || rO.scanline)
+		std::cerr << "views ignore --passes, --preview, --guiding, --radiance-cache, --live, --gbuffer and --scanline\n";
+
+	int width = rO.image_width, height = rO.image_height;
+	for (const auto& view : views) {
+		if (view.aspect > 0 && std::fabs(view.aspect - (double)width / height) > 1e-3)
+			std::cerr << "view " << view.name << " has the aspect ratio " << view.aspect << ", the image " << width << "x" << height << " is distorted\n";
+	}
+
+	// the light tree and the NUMA replicas are shared, the candidates of the camera rays are culled per view
+	RenderOption view_options = rO;
+	view_options.light_tree = false;
+	shared_ptr<const LightTree> lights = rO.light_tree && rO.integrator != "bdpt" ? make_shared<LightTree>(*world) : nullptr;
+	std::vector<shared_ptr<Geometry>> replicas;
+	if (rO.numa_replicate)
+		replicas = replicateWorld(pool, world);
+
+	auto tm = toneMapping(rO);
+	int columns = (int)std::ceil(std::sqrt((double)views.size()));
+	int rows = ((int)views.size() + columns - 1) / columns;
+	shared_ptr<EncodeJob> atlas_job;
+	if (atlas) {
+		atlas_job = encoder.acquire(rO.outputPath, columns * width, rows * height);
+		std::fill(atlas_job->rgb.begin(), atlas_job->rgb.end(), (unsigned char)0);
 	}
 
-	return colors;
+	struct viewState {
+		Frame frame;
+		std::once_flag setup;
+		std::vector<unsigned char> rgb;
+		std::atomic<int> remaining;
+	};
+
+	std::mutex mutex;
+	auto tiles = makeTiles(width, height, rO.tile_size);
+	auto start = std::chrono::steady_clock::now();
+
+	for (int v = 0; v < (int)views.size(); v++) {
+		auto state = make_shared<viewState>();
+		state->remaining = (int)tiles.size();
+
+		for (const auto& tile : tiles) {
+			pool.submit([&, state, v, tile]() {
+				std::call_once(state->setup, [&]() {
+					RenderOption options = view_options;
+					if (views[v].aspect > 0)
+						options.aspect_ratio = views[v].aspect;
+					initFrame(state->frame, options, views[v].camera, world, environment);
+					state->frame.number = v;
+					state->frame.lights = lights;
+					state->frame.replicas = replicas;
+					state->frame.pixels.assign((size_t)width * height, color(0, 0, 0));
+					state->rgb.resize((size_t)width * height * 3);
+				});
+
+				Frame& frame = state->frame;
+				renderTile(frame, tile, 0, frame.samples);
+				if (!frame.bidirectional)
+					tonemapTile(frame, tile, frame.samples, tm, state->rgb.data());
+
+				if (--state->remaining > 0) return;
+
+				// last tile of the view, the light tracing splats are complete now
+				if (frame.bidirectional) {
+					frame.bidirectional->splats.drain(frame.pixels);
+					for (const auto& t : tiles)
+						tonemapTile(frame, t, frame.samples, tm, state->rgb.data());
+				}
+
+				std::string written;
+				if (atlas) {
+					size_t row_bytes = (size_t)width * 3;
+					for (int y = 0; y < height; y++) {
+						size_t target = ((size_t)((v / columns) * height + y) * columns * width + (size_t)(v % columns) * width) * 3;
+						std::copy(state->rgb.begin() + y * row_bytes, state->rgb.begin() + (y + 1) * row_bytes, atlas_job->rgb.begin() + target);
+					}
+				}
+				else {
+					auto job = encoder.acquire(viewPath(rO.outputPath, views[v].name), width, height);
+					job->rgb.swap(state->rgb);
+					written = job->path;
+					encoder.submit(job);
+				}
+
+				// free the view, the state lives on until the last tile task is destroyed
+				frame.pixels.allocate(0);
+				frame.bidirectional.reset();
+				frame.culling.reset();
+				frame.replicas.clear();
+				std::vector<unsigned char>().swap(state->rgb);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				std::cerr << "view " << views[v].name << " rendered" << (written.empty() ? "" : ", writing " + written) << "\n";
+			});
+		}
+	}
+
+	pool.wait();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << views.size() << " views rendered in " << seconds << " s, "
+			  << (double)views.size() * width * height * rO.samples / seconds / 1e6 << " M camera rays/s\n";
+
+	if (atlas) {
+		std::cerr << "writing the " << columns << "x" << rows << " atlas " << atlas_job->path << "\n";
+		encoder.submit(atlas_job);
+	}
 }
 
 /// <summary>
@@ -131,11 +370,21 @@ int main(int ac, char* av[]){
 		
 		desc.add_options()
 			("help", "produce help message")
-			("out", po::value<std::string>(), "set the output path for the rendering")
-			("width", po::value<int>(), "width of the result image")
-			("height", po::value<int>(), "height of the result image")
-			("samples", po::value<int>(), "samples of the result image")
+			("threads", po::value<int>(), "number of render threads (default: one per hardware thread)")
+			("numa", po::value<bool>(), "pin the render threads to the NUMA nodes and assign the tiles by node (default: false)")
+			("sequence", po::value<std::string>(), "render the frames of a keyframe sequence file, '#' in out is replaced by the frame number")
+			("frame-start", po::value<int>(), "first frame of the sequence (default: first keyframe)")
+			("frame-end", po::value<int>(), "last frame of the sequence (default: last keyframe)")
+			("views", po::value<std::string>(), "render the cameras of a view file in one run sharing the scene (see loadViews), '#' in out is replaced by the view name")
+			("views-atlas", po::value<bool>(), "pack the --views into one image at out instead of an image per view (default: false)")
+			("server", "keep running and render the jobs read from stdin (see RenderServer), the options are the defaults of the jobs")
+			("benchmark", po::value<std::string>(), "measure the error against a reference over time and spp, write <arg>.json and <arg>.csv")
+			("benchmark-scenes", po::value<std::string>(), "comma separated scenes of --benchmark (default: random)")
+			("benchmark-spp", po::value<int>(), "samples per pixel of the last --benchmark measurement (default: 256)")
+			("benchmark-time", po::value<double>(), "seconds per scene of --benchmark, 0 for no limit (default: 0)")
+			("benchmark-reference-spp", po::value<int>(), "samples per pixel of the --benchmark references (default: 4096)")
 			;
+		desc.add(renderOptionsDescription());
 
 		po::variables_map vm;
 		po::store(po::parse_command_line(ac, av, desc), vm);
@@ -146,40 +395,86 @@ int main(int ac, char* av[]){
 			return 0;
 		}
 
-		if (vm.count("out")) {
-			rO.outputPath = vm["out"].as<std::string>();
-		} else {
+		if (!vm.count("out") && !vm.count("server") && !vm.count("benchmark")) {
 			std::cout << "out was not set.\n";
 		}
 
-		if (vm.count("width")) {
-			rO.image_width = std::max(0, vm["width"].as<int>());
-			// todo fix settings based on image_width
-		}
+		applyRenderOptions(vm, rO);
 
-		if (vm.count("height")) {
-			rO.image_height = std::max(0, vm["height"].as<int>());
-			// todo fix settings based on image_height
+		if (vm.count("threads")) {
+			rO.threads = std::max(0, vm["threads"].as<int>());
 		}
 
-		if (vm.count("samples")) {
-			rO.samples = std::max(0, vm["samples"].as<int>());
+		if (vm.count("numa")) {
+			rO.numa = vm["numa"].as<bool>();
 		}
 
+		std::unique_ptr<ThreadPool> threads(rO.numa ? new ThreadPool(rO.threads, NumaTopology::detect()) : new ThreadPool(rO.threads));
+		ThreadPool& pool = *threads;
+		ImageEncoder encoder;
+
 		// MAIN PROGRAM
-		//std::vector<vec3> colors = createSimpleColorGradient(rO.image_height, rO.image_width);
-		std::vector<vec3> colors = renderScene();
+		if (vm.count("server")) {
+			RenderServer server(rO, pool, encoder);
+			server.run(std::cin, std::cout);
+			return 0;
+		}
 
-		// run programm 
-		if (boost::algorithm::ends_with(rO.outputPath, ".ppm")) {
-			createPPM(rO.outputPath, rO.image_width, rO.image_height, colors);
+		if (vm.count("benchmark")) {
+			BenchmarkSettings settings;
+			settings.output = vm["benchmark"].as<std::string>();
+			if (vm.count("benchmark-scenes")) {
+				settings.scenes.clear();
+				std::stringstream scenes(vm["benchmark-scenes"].as<std::string>());
+				for (std::string scene; std::getline(scenes, scene, ',');) {
+					if (!scene.empty()) settings.scenes.push_back(scene);
+				}
+			}
+			if (vm.count("benchmark-spp")) settings.max_samples = std::max(1, vm["benchmark-spp"].as<int>());
+			if (vm.count("benchmark-time")) settings.time_budget = std::max(0.0, vm["benchmark-time"].as<double>());
+			if (vm.count("benchmark-reference-spp")) settings.reference_samples = std::max(1, vm["benchmark-reference-spp"].as<int>());
+
+			Benchmark benchmark(rO, settings, pool);
+			return benchmark.run() ? 0 : 1;
 		}
-		else if (boost::algorithm::ends_with(rO.outputPath, ".jpg")) {
-			createJPEG(rO.outputPath, rO.image_width, rO.image_height, colors);
+
+		if (vm.count("sequence")) {
+			// the frames in flight would share one live framebuffer
+			if (!rO.live.empty()) {
+				std::cerr << "--live cannot be combined with --sequence\n";
+				return 1;
+			}
+
+			Sequence sequence;
+			std::string error;
+			if (!sequence.load(vm["sequence"].as<std::string>(), error)) {
+				std::cerr << error << "\n";
+				return 1;
+			}
+
+			int first, last;
+			sequence.range(first, last);
+			if (vm.count("frame-start")) first = vm["frame-start"].as<int>();
+			if (vm.count("frame-end")) last = vm["frame-end"].as<int>();
+
+			renderSequence(pool, encoder, sequence, first, last);
+			return 0;
 		}
-		else if (boost::algorithm::ends_with(rO.outputPath, ".png")) {
-			createPNG(rO.outputPath, rO.image_width, rO.image_height, colors);
+
+		if (vm.count("views")) {
+			std::vector<ViewSettings> views;
+			std::string error;
+			if (!loadViews(vm["views"].as<std::string>(), views, error)) {
+				std::cerr << error << "\n";
+				return 1;
+			}
+
+			renderViews(pool, encoder, views, vm.count("views-atlas") && vm["views-atlas"].as<bool>());
+			return 0;
 		}
+
+		//std::vector<vec3> colors = createSimpleColorGradient(rO.image_height, rO.image_width);
+		renderScene(pool, encoder);
 	/*}
 	catch (std::exception& e) {
 		std::cerr << "error: " << e.what() << "\n";
@@ -2,6 +2,11 @@
 #define MATERIAL_H
 
 #include "common.h"
+#include "onb.h"
+
+#include <cstring>
+#include <initializer_list>
+#include <string>
 
 // refractive indices
 // air = 1.0
@@ -10,56 +15,163 @@
 
 struct hitRecord; // forward declaration
 
+/// <summary>
+/// FNV-1a hash of the name and the values of a material's parameters.
+/// </summary>
+inline unsigned long long hashParameters(const char* name, std::initializer_list<double> values) {
+	unsigned long long h = fnv1a(FNV1A_BASIS, name, std::strlen(name));
+	for (double v : values)
+		h = fnv1a(h, &v, sizeof(v));
+	return h;
+}
+
+/// <summary>
+/// Direction sampled by a material.
+/// </summary>
+struct bsdfSample {
+	vec3 direction;		// sampled direction (unit vector)
+	color weight;		// bsdf * |cos| / pdf, the factor of the path throughput
+	double pdf = 0;		// solid angle density, 0 for specular (delta) directions
+	bool specular = false;
+};
+
+/// <summary>
+/// Scattering function of a surface.
+///
+/// All directions point away from the surface, wi towards the previous
+/// vertex (-r_in direction) and wo towards the next one. eval and pdf refer to
+/// the same sampling technique as sample, so the estimators of other
+/// techniques can be combined with it (multiple importance sampling).
+/// Specular materials return 0 from eval and pdf.
+/// </summary>
 class material {
 	public:
 		/// <summary>
-		/// Scatters the specified r in.
+		/// Samples the direction of the scattered ray.
 		/// </summary>
-		/// <param name="r_in">The r in.</param>
-		/// <param name="rec">The record.</param>
-		/// <param name="attenuation">The attenuation.</param>
-		/// <param name="scattered">The scattered.</param>
-		/// <returns></returns>
-		virtual bool scatter(const ray& r_in,
-							 const hitRecord& rec,
-							 vec3& attenuation,
-							 ray& scattered) const = 0;
+		/// <param name="r_in">The incoming ray.</param>
+		/// <param name="rec">The record of the intersection.</param>
+		/// <param name="sample">The sampled direction, its weight and pdf.</param>
+		/// <returns>False if the ray is absorbed</returns>
+		virtual bool sample(const ray& r_in, const hitRecord& rec, bsdfSample& sample) const = 0;
+
+		/// <summary>
+		/// Evaluates bsdf * |cos| of the scattering into wo.
+		/// </summary>
+		virtual color eval(const ray& r_in, const hitRecord& rec, const vec3& wo) const {
+			return color(0, 0, 0);
+		}
+
+		/// <summary>
+		/// Solid angle density of sample choosing wo.
+		/// </summary>
+		virtual double pdf(const ray& r_in, const hitRecord& rec, const vec3& wo) const {
+			return 0;
+		}
+
+		/// <summary>
+		/// True if the material only scatters into discrete (delta) directions,
+		/// which can only be found by sample.
+		/// </summary>
+		virtual bool specular() const {
+			return false;
+		}
+
+		/// <summary>
+		/// Radiance emitted at the intersection towards the incoming ray.
+		/// </summary>
+		virtual color emitted(const hitRecord& rec) const {
+			return color(0, 0, 0);
+		}
+
+		/// <summary>
+		/// True if the material emits light (a light source).
+		/// </summary>
+		virtual bool emissive() const {
+			return false;
+		}
+
+		/// <summary>
+		/// True if the material reflects like a lambertian surface: the
+		/// sample weight does not depend on the direction, so the reflected
+		/// light only depends on the irradiance and can be cached.
+		/// </summary>
+		virtual bool diffuse() const {
+			return false;
+		}
+
+		/// <summary>
+		/// Name of the material type, selects the materials of look-dev edits.
+		/// </summary>
+		virtual const char* name() const {
+			return "material";
+		}
+
+		/// <summary>
+		/// The named parameter, for look-dev edits (see applyMaterialEdits).
+		/// </summary>
+		/// <returns>Null if the material has no parameter of the name</returns>
+		virtual double* parameter(const std::string& name) {
+			return nullptr;
+		}
+
+		/// <summary>
+		/// Hash of the type and the parameters, changes when the material is edited.
+		/// </summary>
+		virtual unsigned long long hash() const {
+			return hashParameters(name(), {});
+		}
+
+	protected:
+		// the r, g or b parameter of a color
+		static double* channel(color& c, const std::string& name) {
+			if (name == "r") return &c[0];
+			if (name == "g") return &c[1];
+			if (name == "b") return &c[2];
+			return nullptr;
+		}
 };
 
+/// <summary>
+/// Ideal diffuse material, sampled proportional to the cosine.
+/// </summary>
+/// <seealso cref="material" />
 class lambertian : 
 	public material {
 public:
 	lambertian(const color& a) : albedo(a) {};
 
-	virtual bool scatter(
-		const ray& r_in,
-		const hitRecord& rec,
-		color& attenuation,
-		ray& scattered
-	) const override {
-		// note it's possible to scatter with some probability p and have attenuation be albedo/p
-
-		// find point in unit sphere
-		auto scatter_direction = rec.normal + random_in_unit_sphere();
-		
-		// alternative using hemisphere
-		//auto scatter_direction = random_in_hemisphere(rec.normal);
-
-		// catch degenerate scatter direction
-		// if random unit vector is exactly opposite the normal vector
-		if (scatter_direction.near_zero())
-			scatter_direction = rec.normal;
-		
-		scattered = ray(rec.p, scatter_direction);
-		attenuation = albedo;
-		return true;
-	};
+	virtual bool sample(const ray& r_in, const hitRecord& rec, bsdfSample& sample) const override;
+
+	virtual color eval(const ray& r_in, const hitRecord& rec, const vec3& wo) const override {
+		return albedo * (fmax(dot(rec.normal, unit_vector(wo)), 0.0) / pi);
+	}
+
+	virtual double pdf(const ray& r_in, const hitRecord& rec, const vec3& wo) const override {
+		return fmax(dot(rec.normal, unit_vector(wo)), 0.0) / pi;
+	}
+
+	virtual bool diffuse() const override { return true; }
+
+	virtual const char* name() const override { return "lambertian"; }
+
+	virtual double* parameter(const std::string& name) override {
+		return channel(albedo, name);
+	}
+
+	virtual unsigned long long hash() const override {
+		return hashParameters(name(), { albedo[0], albedo[1], albedo[2] });
+	}
 private:
 	color albedo;
 };
 
 /// <summary>
 /// Material to represent reflecting material
+///
+/// Rough metals use the GGX microfacet distribution with Schlick's
+/// Fresnel and are sampled with the distribution of visible normals
+/// (Heitz 2018), fuzz 0 is a perfect mirror.
 /// </summary>
 /// <seealso cref="material" />
 class metal :
@@ -67,27 +179,137 @@ class metal :
 	public:
 		metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
-		virtual bool scatter(	
-			const ray& r_in,
-			const hitRecord& rec,
-			color& attenuation,
-			ray& scattered
-		) const override {
-			vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-			
-			// fuzz parameter to offset reflection point
-			scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
-			
-			attenuation = albedo;
-			return (dot(scattered.direction(), rec.normal) > 0);
-		};
+		virtual bool sample(const ray& r_in, const hitRecord& rec, bsdfSample& sample) const override;
+
+		virtual color eval(const ray& r_in, const hitRecord& rec, const vec3& wo) const override;
+
+		virtual double pdf(const ray& r_in, const hitRecord& rec, const vec3& wo) const override;
+
+		virtual bool specular() const override {
+			return fuzz <= 0;
+		}
+
+		virtual const char* name() const override { return "metal"; }
+
+		virtual double* parameter(const std::string& name) override {
+			return name == "fuzz" ? &fuzz : channel(albedo, name);
+		}
+
+		virtual unsigned long long hash() const override {
+			return hashParameters(name(), { albedo[0], albedo[1], albedo[2], fuzz });
+		}
+
+	private:
+		// GGX roughness, fuzz is used as perceptual roughness
+		double alpha() const {
+			return fmax(fuzz * fuzz, 1e-4);
+		}
+
+		// GGX normal distribution
+		double D(const vec3& h) const {
+			double a2 = alpha() * alpha();
+			double d = h.z() * h.z() * (a2 - 1) + 1;
+			return a2 / (pi * d * d);
+		}
+
+		// Smith Lambda of the direction (local, z is the normal)
+		double lambda(const vec3& w) const {
+			double cos2 = w.z() * w.z();
+			double tan2 = fmax(1 - cos2, 0.0) / cos2;
+			return 0.5 * (-1 + sqrt(1 + alpha() * alpha() * tan2));
+		}
+
+		color fresnel(double cosine) const {
+			return albedo + (color(1, 1, 1) - albedo) * pow(1 - fmax(cosine, 0.0), 5);
+		}
+
 	private:
 		color albedo;
 		// fuzziness/perturbation.
-		// radius of a sphere for choosing the randomized reflection
+		// roughness of the surface
 		double fuzz;
 };
 
+bool lambertian::sample(const ray& r_in, const hitRecord& rec, bsdfSample& sample) const {
+	// cosine weighted: bsdf * cos / pdf = albedo
+	sample.direction = onb(rec.normal).local(random_cosine_direction());
+	sample.pdf = fmax(dot(rec.normal, sample.direction), 0.0) / pi;
+	sample.weight = albedo;
+	sample.specular = false;
+	return true;
+}
+
+bool metal::sample(const ray& r_in, const hitRecord& rec, bsdfSample& sample) const {
+	vec3 unit_direction = unit_vector(r_in.direction());
+
+	if (fuzz <= 0) {
+		sample.direction = reflect(unit_direction, rec.normal);
+		sample.weight = fresnel(dot(-unit_direction, rec.normal));
+		sample.pdf = 0;
+		sample.specular = true;
+		return true;
+	}
+
+	onb frame(rec.normal);
+	vec3 wi = frame.toLocal(-unit_direction);
+	if (wi.z() <= 0) return false;
+
+	double a = alpha();
+
+	// visible normal: stretch the view direction to the hemisphere configuration
+	vec3 vh = unit_vector(vec3(a * wi.x(), a * wi.y(), wi.z()));
+	double len2 = vh.x() * vh.x() + vh.y() * vh.y();
+	vec3 t1 = len2 > 0 ? vec3(-vh.y(), vh.x(), 0) / sqrt(len2) : vec3(1, 0, 0);
+	vec3 t2 = cross(vh, t1);
+
+	// sample the projected area of the visible hemisphere
+	vec3 d = random_in_unit_disk();
+	double s = 0.5 * (1 + vh.z());
+	double p1 = d.x();
+	double p2 = (1 - s) * sqrt(fmax(0.0, 1 - p1 * p1)) + s * d.y();
+	vec3 nh = p1 * t1 + p2 * t2 + sqrt(fmax(0.0, 1 - p1 * p1 - p2 * p2)) * vh;
+
+	// unstretch
+	vec3 h = unit_vector(vec3(a * nh.x(), a * nh.y(), fmax(1e-6, nh.z())));
+	vec3 wo = 2 * dot(wi, h) * h - wi;
+	if (wo.z() <= 0) return false;
+
+	// bsdf * cos / pdf = F * G2 / G1(wi)
+	double g1 = 1 / (1 + lambda(wi));
+	double g2 = 1 / (1 + lambda(wi) + lambda(wo));
+
+	sample.direction = frame.local(wo);
+	sample.weight = fresnel(dot(wi, h)) * (g2 / g1);
+	sample.pdf = g1 * D(h) / (4 * wi.z());
+	sample.specular = false;
+	return true;
+}
+
+color metal::eval(const ray& r_in, const hitRecord& rec, const vec3& wo) const {
+	if (fuzz <= 0) return color(0, 0, 0);
+
+	onb frame(rec.normal);
+	vec3 i = frame.toLocal(-unit_vector(r_in.direction()));
+	vec3 o = frame.toLocal(unit_vector(wo));
+	if (i.z() <= 0 || o.z() <= 0) return color(0, 0, 0);
+
+	vec3 h = unit_vector(i + o);
+	double g2 = 1 / (1 + lambda(i) + lambda(o));
+	return fresnel(dot(i, h)) * (D(h) * g2 / (4 * i.z()));
+}
+
+double metal::pdf(const ray& r_in, const hitRecord& rec, const vec3& wo) const {
+	if (fuzz <= 0) return 0;
+
+	onb frame(rec.normal);
+	vec3 i = frame.toLocal(-unit_vector(r_in.direction()));
+	vec3 o = frame.toLocal(unit_vector(wo));
+	if (i.z() <= 0 || o.z() <= 0) return 0;
+
+	vec3 h = unit_vector(i + o);
+	return D(h) / ((1 + lambda(i)) * 4 * i.z());
+}
+
 /// <summary>
 /// Material to represent a reflecting/refracting material 
 /// </summary>
@@ -97,14 +319,15 @@ class dielectric :
 public:
 	dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
-	virtual bool scatter(
-		const ray& r_in,
-		const hitRecord& rec,
-		color& attenuation, 
-		ray& scattered
-	) const override {
+	virtual bool specular() const override {
+		return true;
+	}
+
+	virtual bool sample(const ray& r_in, const hitRecord& rec, bsdfSample& sample) const override {
 		// override attenuation
-		attenuation = color(1.0, 1.0, 1.0);
+		sample.weight = color(1.0, 1.0, 1.0);
+		sample.pdf = 0;
+		sample.specular = true;
 
 		double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
@@ -124,9 +347,19 @@ public:
 		else
 			direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-		scattered = ray(rec.p, direction);
+		sample.direction = direction;
 		return true;
 	};
+
+	virtual const char* name() const override { return "dielectric"; }
+
+	virtual double* parameter(const std::string& name) override {
+		return name == "ir" ? &ir : nullptr;
+	}
+
+	virtual unsigned long long hash() const override {
+		return hashParameters(name(), { ir });
+	}
 public:
 	double ir; // index of refraction
 private:
@@ -144,4 +377,44 @@ private:
 
 };
 
+/// <summary>
+/// Light source emitting the same radiance into all directions of the
+/// outside (front face), it does not scatter light.
+/// </summary>
+/// <seealso cref="material" />
+class diffuse_light :
+	public material {
+public:
+	diffuse_light(const color& radiance) : radiance(radiance) {}
+
+	virtual bool sample(const ray& r_in, const hitRecord& rec, bsdfSample& sample) const override {
+		return false;
+	}
+
+	virtual color emitted(const hitRecord& rec) const override {
+		return rec.front_face ? radiance : color(0, 0, 0);
+	}
+
+	virtual bool emissive() const override {
+		return true;
+	}
+
+	virtual const char* name() const override { return "diffuse_light"; }
+
+	virtual double* parameter(const std::string& name) override {
+		return channel(radiance, name);
+	}
+
+	virtual unsigned long long hash() const override {
+		return hashParameters(name(), { radiance[0], radiance[1], radiance[2] });
+	}
+
+	const color& getRadiance() const {
+		return radiance;
+	}
+
+private:
+	color radiance;
+};
+
 #endif // !MATERIAL_H
@@ -0,0 +1,122 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/// <summary>
+/// NUMA node of the calling thread, set by the workers of a pinned
+/// ThreadPool, 0 for all other threads.
+/// </summary>
+inline int& currentNumaNode() {
+	static thread_local int node = 0;
+	return node;
+}
+
+/// <summary>
+/// CPUs of the NUMA nodes (sockets) of the machine.
+///
+/// Read from /sys/devices/system/node on Linux, elsewhere (or if the
+/// topology is not available) all hardware threads form one node.
+/// </summary>
+class NumaTopology {
+	public:
+		/// <summary>
+		/// Detects the topology of the machine.
+		/// </summary>
+		static NumaTopology detect() {
+			NumaTopology topology;
+
+#if defined(__linux__)
+			for (int node = 0;; node++) {
+				std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+				std::string list;
+				if (!file || !std::getline(file, list))
+					break;
+
+				auto cpus = parseCpuList(list);
+				if (!cpus.empty())
+					topology.cpus.push_back(cpus);
+			}
+#endif
+
+			if (topology.cpus.empty()) {
+				int n = std::max(1u, std::thread::hardware_concurrency());
+				topology.cpus.push_back(std::vector<int>());
+				for (int i = 0; i < n; i++)
+					topology.cpus[0].push_back(i);
+			}
+
+			return topology;
+		}
+
+		int nodes() const {
+			return (int)cpus.size();
+		}
+
+		const std::vector<int>& nodeCpus(int node) const {
+			return cpus[node];
+		}
+
+		int cpuCount() const {
+			int n = 0;
+			for (const auto& node : cpus)
+				n += (int)node.size();
+			return n;
+		}
+
+		/// <summary>
+		/// Parses a cpu list like "0-15,32-47".
+		/// </summary>
+		static std::vector<int> parseCpuList(const std::string& list) {
+			std::vector<int> result;
+			std::stringstream in(list);
+			std::string range;
+
+			while (std::getline(in, range, ',')) {
+				int first, last;
+				char dash;
+				std::istringstream r(range);
+				if (!(r >> first)) continue;
+				if (!(r >> dash >> last)) last = first;
+				for (int cpu = first; cpu <= last; cpu++)
+					result.push_back(cpu);
+			}
+
+			return result;
+		}
+
+	private:
+		std::vector<std::vector<int>> cpus;
+};
+
+/// <summary>
+/// Restricts the thread to the cpus (of one node).
+/// </summary>
+/// <returns>False if pinning is not supported or failed</returns>
+inline bool pinThread(std::thread& thread, const std::vector<int>& cpus) {
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+	(void)thread;
+	(void)cpus;
+	return false;
+#endif
+}
+
+#endif // !NUMA_H
@@ -0,0 +1,49 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "common.h"
+
+/// <summary>
+/// Orthonormal basis (u, v, w) used to place directions sampled around +z
+/// around a surface normal.
+/// </summary>
+class onb {
+	public:
+		onb() {}
+
+		/// <summary>
+		/// Builds the basis with w along the unit vector n (Duff et al., branchless).
+		/// </summary>
+		explicit onb(const vec3& n) {
+			double sign = n.z() >= 0 ? 1.0 : -1.0;
+			double a = -1 / (sign + n.z());
+			double b = n.x() * n.y() * a;
+
+			axis[0] = vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+			axis[1] = vec3(b, sign + n.y() * n.y() * a, -n.y());
+			axis[2] = n;
+		}
+
+		vec3 u() const { return axis[0]; }
+		vec3 v() const { return axis[1]; }
+		vec3 w() const { return axis[2]; }
+
+		/// <summary>
+		/// Direction given in the basis to world space.
+		/// </summary>
+		vec3 local(const vec3& a) const {
+			return a.x() * axis[0] + a.y() * axis[1] + a.z() * axis[2];
+		}
+
+		/// <summary>
+		/// World space direction to the basis.
+		/// </summary>
+		vec3 toLocal(const vec3& a) const {
+			return vec3(dot(a, axis[0]), dot(a, axis[1]), dot(a, axis[2]));
+		}
+
+	private:
+		vec3 axis[3];
+};
+
+#endif // !ONB_H
@@ -0,0 +1,134 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "common.h"
+
+#include <cassert>
+
+// edge length of the pixel block traced as one packet (8x8 pixels)
+#define PACKET_SIZE 8
+#define PACKET_MAX_RAYS (PACKET_SIZE * PACKET_SIZE)
+
+// maximum spread of the normalized directions inside a packet.
+// packets with a wider spread are treated as incoherent and traced ray by ray
+#define PACKET_COHERENCE_LIMIT 0.25
+
+/// <summary>
+/// Closed interval [lo, hi] used for conservative interval arithmetic.
+/// </summary>
+struct interval {
+	double lo, hi;
+
+	interval() : lo(infinity), hi(-infinity) {}
+	interval(double v) : lo(v), hi(v) {}
+	interval(double l, double h) : lo(l), hi(h) {}
+
+	/// <summary>
+	/// Grows the interval to contain the value v.
+	/// </summary>
+	void extend(double v) {
+		lo = fmin(lo, v);
+		hi = fmax(hi, v);
+	}
+
+	double width() const {
+		return hi - lo;
+	}
+};
+
+inline interval operator+(const interval& a, const interval& b) {
+	return interval(a.lo + b.lo, a.hi + b.hi);
+}
+
+inline interval operator-(const interval& a, const interval& b) {
+	return interval(a.lo - b.hi, a.hi - b.lo);
+}
+
+inline interval operator*(const interval& a, const interval& b) {
+	double p0 = a.lo * b.lo, p1 = a.lo * b.hi;
+	double p2 = a.hi * b.lo, p3 = a.hi * b.hi;
+	return interval(fmin(fmin(p0, p1), fmin(p2, p3)),
+					fmax(fmax(p0, p1), fmax(p2, p3)));
+}
+
+/// <summary>
+/// Squares the interval (tighter than a * a if the interval contains zero).
+/// </summary>
+inline interval sqr(const interval& a) {
+	if (a.lo >= 0) return interval(a.lo * a.lo, a.hi * a.hi);
+	if (a.hi <= 0) return interval(a.hi * a.hi, a.lo * a.lo);
+	return interval(0, fmax(a.lo * a.lo, a.hi * a.hi));
+}
+
+/// <summary>
+/// A bundle of coherent rays (e.g. camera rays of a pixel block) which share
+/// their traversal decisions.
+///
+/// The packet keeps interval bounds over all ray origins and directions, so a
+/// geometry can reject the whole packet with a single conservative test.
+/// </summary>
+class RayPacket {
+	public:
+		RayPacket() : count(0), coherent(false) {}
+
+		void clear() {
+			count = 0;
+			coherent = false;
+		}
+
+		bool full() const {
+			return count >= PACKET_MAX_RAYS;
+		}
+
+		/// <summary>
+		/// Adds the ray r to the packet, which must not be full.
+		/// </summary>
+		/// <returns>index of the ray inside the packet</returns>
+		int add(const ray& r) {
+			assert(!full());
+			rays[count] = r;
+			return count++;
+		}
+
+		/// <summary>
+		/// Computes the interval bounds of the packet.
+		/// Has to be called after the last ray was added.
+		/// </summary>
+		void finalize() {
+			interval unit_dir[3];
+
+			for (int k = 0; k < 3; k++) {
+				orig[k] = interval();
+				dir[k] = interval();
+			}
+
+			for (int i = 0; i < count; i++) {
+				vec3 d = rays[i].direction();
+				vec3 u = unit_vector(d);
+
+				for (int k = 0; k < 3; k++) {
+					orig[k].extend(rays[i].origin()[k]);
+					dir[k].extend(d[k]);
+					unit_dir[k].extend(u[k]);
+				}
+			}
+
+			coherent = count > 1 &&
+				unit_dir[0].width() < PACKET_COHERENCE_LIMIT &&
+				unit_dir[1].width() < PACKET_COHERENCE_LIMIT &&
+				unit_dir[2].width() < PACKET_COHERENCE_LIMIT;
+		}
+
+	public:
+		ray rays[PACKET_MAX_RAYS];
+		int count;
+
+		// interval bounds over all origins and (unnormalized) directions
+		interval orig[3];
+		interval dir[3];
+
+		// false if the rays diverge too much for the shared bound tests
+		bool coherent;
+};
+
+#endif // !PACKET_H
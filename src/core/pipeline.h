@@ -0,0 +1,530 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "common.h"
+#include "bdpt.h"
+#include "bvh.h"
+#include "camera.h"
+#include "costMap.h"
+#include "encoder.h"
+#include "environment.h"
+#include "geometry.h"
+#include "guiding.h"
+#include "liveFramebuffer.h"
+#include "renderer.h"
+#include "renderOptions.h"
+#include "scanlineImage.h"
+#include "threadPool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <iomanip>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// bands of tile rows of a scanline rendering held in memory at a time
+#define SCANLINE_BANDS_IN_FLIGHT 3
+
+/// <summary>
+/// NUMA node rendering the tile. The image is split into horizontal bands,
+/// one per node, so the rows of a band are written by a single node.
+/// </summary>
+inline int tileNode(const Tile& tile, int height, int nodes) {
+	if (nodes <= 1) return -1;
+	return std::min(nodes - 1, tile.y0 * nodes / std::max(height, 1));
+}
+
+/// <summary>
+/// Copies the world to every node of the pool, each copy is made by a thread
+/// of its node so its memory is local to the node. Only hierarchies (BVHAccel)
+/// are copied, the primitives are shared.
+/// </summary>
+/// <returns>The copy per node (Frame::replicas), empty if nothing is copied</returns>
+std::vector<shared_ptr<Geometry>> replicateWorld(ThreadPool& pool, const shared_ptr<Geometry>& world) {
+	std::vector<shared_ptr<Geometry>> replicas;
+	auto accel = std::dynamic_pointer_cast<BVHAccel>(world);
+	if (!accel || pool.nodes() <= 1) return replicas;
+
+	replicas.assign(pool.nodes(), nullptr);
+	for (int node = 0; node < pool.nodes(); node++)
+		pool.submit([&replicas, accel, node]() { replicas[node] = accel->replicate(); }, node, true);
+	pool.wait();
+	return replicas;
+}
+
+/// <summary>
+/// Prints the throughput of each NUMA node between two counter snapshots.
+/// </summary>
+/// <param name="before">The counters before the rendering.</param>
+/// <param name="after">The counters after the rendering.</param>
+/// <param name="samples">The samples traced by each node.</param>
+void printNodeCounters(const std::vector<ThreadPool::NodeCounters>& before, const std::vector<ThreadPool::NodeCounters>& after,
+					   const std::vector<long long>& samples) {
+	for (size_t node = 0; node < after.size(); node++) {
+		double busy = after[node].busy - before[node].busy;
+		long long tasks = after[node].tasks - before[node].tasks;
+		long long stolen = after[node].stolen - before[node].stolen;
+
+		std::cerr << "node " << node << ": " << after[node].threads << " threads, "
+				  << tasks << " tiles (" << stolen << " from other nodes), "
+				  << std::fixed << std::setprecision(3) << samples[node] / 1e6 << " M samples, "
+				  << (busy > 0 ? samples[node] / busy / 1e6 : 0.0) << " M samples/s per thread\n";
+		std::cerr.unsetf(std::ios::floatfield);
+	}
+}
+
+/// <summary>
+/// Tone mapping from the render options.
+/// </summary>
+ToneMapping toneMapping(const RenderOption& options) {
+	ToneMapping tm;
+	tm.exposure = options.exposure;
+	tm.reinhard = options.tonemap == "reinhard";
+	return tm;
+}
+
+/// <summary>
+/// Sets up the frame from the render options.
+/// </summary>
+/// <param name="environment">The environment map of options.env, loaded once by the caller.</param>
+void initFrame(Frame& frame, const RenderOption& options, const CameraSettings& camera, shared_ptr<Geometry> world,
+			   shared_ptr<const EnvironmentMap> environment = nullptr) {
+	frame.width = options.image_width;
+	frame.height = options.image_height;
+	frame.samples = options.samples;
+	frame.seed = options.seed;
+	frame.packets = options.packets;
+	frame.cam = camera.make(options.aspect_ratio);
+	frame.world = world;
+	frame.environment = environment;
+	frame.sky = options.sky;
+
+	if (options.integrator == "bdpt")
+		frame.bidirectional = make_shared<BidirectionalScene>(frame);
+
+	if (options.cull_tiles)
+		frame.culling = make_shared<TileCulling>(frame.cam, frame.width, frame.height, options.tile_size, world);
+
+	if (options.light_tree && !frame.bidirectional)
+		frame.lights = make_shared<LightTree>(*world);
+}
+
+/// <summary>
+/// Renders the frame in progressive passes on the thread pool.
+///
+/// Every tile is tone mapped by its render thread as soon as it is done.
+/// After each pass the snapshot is handed to the encoder and written in the
+/// background while the next pass renders.
+///
+/// If frame.cancel is set the remaining tiles are skipped and the snapshot
+/// of the interrupted pass is dropped.
+///
+/// On a pool pinned to several NUMA nodes the tiles are assigned to the
+/// nodes by bands and the framebuffer pages are first touched by the node
+/// rendering them.
+///
+/// With options.live the frame accumulates into a live framebuffer file
+/// that other processes can read while the frame renders.
+///
+/// With options.preview the image is first rendered at 1/16 and 1/4 of the
+/// resolution (one sample per block, upscaled into the framebuffer), then
+/// a pass of one sample per pixel precedes the passes of options.passes.
+/// The tiles are rendered from the center out and the time of every stage
+/// is reported.
+///
+/// With frame.bidirectional the light tracing splats of a pass are added
+/// to the pixels once its last tile is done, the pass is tone mapped then.
+///
+/// With options.guiding the first passes train the path guide, the guide is
+/// refined after each of them and the later passes sample it. All passes
+/// are accumulated into the image.
+///
+/// With options.cost_tiles the rays traced per pixel are counted and the
+/// tiles are split and ordered by their cost (see CostMap::schedule): the
+/// first pass by a low resolution estimate, the later ones by the cost
+/// measured so far. The estimate traces paths, so the first pass of a
+/// bidirectional frame keeps the scanline tiles and is only measured. The live framebuffer keeps its tiles, they are only
+/// ordered. options.cost_map writes the measured cost as a heatmap.
+///
+/// With options.radiance_cache the later diffuse bounces of the path tracer
+/// end at a radiance cache (see RadianceCache), which fills during the
+/// first passes and is kept for the later ones.
+/// </summary>
+/// <param name="pool">The thread pool.</param>
+/// <param name="encoder">The image encoder.</param>
+/// <param name="frame">The frame.</param>
+/// <param name="options">The render options (tiles, passes, tone mapping).</param>
+/// <param name="path">The output path of the snapshots and of the final image.</param>
+/// <param name="written">Called from the encoder with the pass, its total pass count and whether the snapshot was written.</param>
+/// <returns>False if the rendering was cancelled</returns>
+bool renderPasses(ThreadPool& pool, ImageEncoder& encoder, Frame& frame, const RenderOption& options,
+				  const std::string& path, std::function<void(int, int, bool)> written = std::function<void(int, int, bool)>()) {
+	// the encode jobs are submitted by the last tile of a pass, an empty image has none
+	auto tiles = makeTiles(frame.width, frame.height, options.tile_size);
+	if (tiles.empty()) {
+		std::cerr << "the image is empty, nothing written\n";
+		return true;
+	}
+
+	int nodes = pool.nodes();
+	if (options.numa_replicate)
+		frame.replicas = replicateWorld(pool, frame.world);
+
+	auto before = pool.nodeCounters();
+	std::vector<std::atomic<long long>> node_samples(nodes);
+	for (auto& n : node_samples)
+		n = 0;
+
+	auto tm = toneMapping(options);
+	std::mutex progress;
+
+	int passes = std::max(1, std::min(options.passes, frame.samples));
+	int done = 0;
+
+	std::unique_ptr<PathGuide> guide;
+	aabb bounds;
+	if (options.guiding && !frame.bidirectional && frame.world->bounding_box(0, 1, bounds)) {
+		guide.reset(new PathGuide(bounds, (size_t)(options.guiding_memory * 1024 * 1024)));
+		passes = std::max(1, std::min(std::max(options.passes, options.guiding_training + 1), frame.samples));
+		frame.guide = guide.get();
+	}
+
+	// recorded by all passes
+	std::unique_ptr<RadianceCache> radiance_cache;
+	if (options.radiance_cache && !frame.bidirectional) {
+		radiance_cache.reset(new RadianceCache(options.radiance_cache_cell, options.radiance_cache_samples, options.radiance_cache_depth,
+											   (size_t)(options.radiance_cache_memory * 1024 * 1024)));
+		frame.radiance_cache = radiance_cache.get();
+	}
+
+	// the preview adds a first pass of one sample per pixel
+	bool preview = options.preview && frame.samples > 1;
+	if (preview)
+		passes = std::min(passes + 1, frame.samples);
+
+	// samples per pixel accumulated after the pass
+	auto passTotal = [&](int pass) {
+		if (preview)
+			return pass == passes - 1 ? frame.samples : 1 + ((frame.samples - 1) * pass) / (passes - 1);
+		return (frame.samples * (pass + 1)) / passes;
+	};
+
+	// submission order, the queues run the tiles in this order
+	std::vector<Tile> order = tiles;
+	if (options.preview) {
+		auto distance = [&frame](const Tile& t) {
+			double dx = t.x0 + t.x1 - frame.width, dy = t.y0 + t.y1 - frame.height;
+			return dx * dx + dy * dy;
+		};
+		std::stable_sort(order.begin(), order.end(), [&](const Tile& a, const Tile& b) { return distance(a) < distance(b); });
+	}
+
+	// rays per pixel, cost of the tile scheduling
+	std::unique_ptr<CostMap> costs;
+	if (options.cost_tiles || !options.cost_map.empty())
+		frame.cost.assign((size_t)frame.width * frame.height, 0);
+
+	// cleared by the tiles of the first pass
+	std::shared_ptr<LiveFramebuffer> live;
+	if (!options.live.empty())
+		live = LiveFramebuffer::create(options.live, frame.width, frame.height, (int)tiles.size(), passes);
+
+	if (live) {
+		for (const auto& tile : tiles)
+			live->setTile(tile.index, tile.x0, tile.y0, tile.x1, tile.y1);
+		frame.pixels.attach(live->pixels(), (size_t)frame.width * frame.height, live);
+	}
+	else {
+		frame.pixels.allocate((size_t)frame.width * frame.height);
+	}
+
+	auto cancelled = [&frame]() { return frame.cancel && frame.cancel->load(); };
+
+	auto start = std::chrono::steady_clock::now();
+	auto stage_start = start;
+	auto reportStage = [&](const std::string& stage) {
+		auto now = std::chrono::steady_clock::now();
+		if (options.progress)
+			std::cerr << "\r";
+		std::cerr << "preview: " << stage << " in " << std::chrono::duration<double, std::milli>(now - stage_start).count()
+				  << " ms (" << std::chrono::duration<double, std::milli>(now - start).count() << " ms after the start)\n";
+		stage_start = now;
+	};
+
+	// low resolution stages, 1/16 and 1/4 of the pixels
+	const int preview_scales[] = { 4, 2 };
+	for (int stage = 0; options.preview && stage < 2 && !cancelled(); stage++) {
+		int scale = preview_scales[stage];
+		auto job = encoder.acquire(path, frame.width, frame.height);
+		std::atomic<int> remaining((int)order.size());
+
+		for (const auto& tile : order) {
+			pool.submit([&, tile, job, scale, stage]() {
+				if (live)
+					live->beginTile(tile.index);
+
+				if (!cancelled()) {
+					renderPreviewTile(frame, tile, scale, stage);
+					tonemapTile(frame, tile, 1, tm, job->rgb.data());
+				}
+
+				if (live)
+					live->endTile(tile.index, 1);
+
+				if (--remaining == 0) {
+					if (cancelled())
+						encoder.release(job);
+					else
+						encoder.submit(job);
+				}
+			}, tileNode(tile, frame.height, nodes));
+		}
+
+		pool.wait();
+		reportStage(stage == 0 ? "first image (1/16 resolution)" : "1/4 resolution");
+	}
+
+	// tiles of the passes, in the order they are submitted
+	std::vector<Tile> pass_order = order;
+	if (options.cost_tiles && !cancelled()) {
+		costs.reset(new CostMap(frame.width, frame.height));
+		if (!frame.bidirectional) {
+			costs->estimate(pool, frame);
+			pass_order = costs->schedule(tiles, pool.size(), !live);
+			if (options.progress)
+				std::cerr << "cost tiles: " << pass_order.size() << " tiles, predicted pass time " << std::setprecision(3)
+						  << costs->imbalance(pass_order, pool.size()) << "x of a perfect balance (scanline tiles: "
+						  << costs->imbalance(tiles, pool.size()) << "x)\n" << std::setprecision(6);
+		}
+	}
+
+	for (int pass = 0; pass < passes && !cancelled(); pass++) {
+		int total = passTotal(pass);
+		int samples = total - done;
+
+		if (guide)
+			guide->training = pass < options.guiding_training;
+
+		auto job = encoder.acquire(path, frame.width, frame.height);
+		if (written)
+			job->written = [written, pass, passes](bool ok) { written(pass, passes, ok); };
+
+		std::atomic<int> remaining((int)pass_order.size());
+
+		for (const auto& tile : pass_order) {
+			pool.submit([&, tile, job, pass, samples, total]() {
+				if (live)
+					live->beginTile(tile.index);
+
+				if (pass == 0) {
+					for (int y = tile.y0; y < tile.y1; y++)
+						frame.pixels.clear((size_t)y * frame.width + tile.x0, (size_t)y * frame.width + tile.x1);
+				}
+
+				if (!cancelled()) {
+					renderTile(frame, tile, pass, samples);
+					if (!frame.bidirectional)
+						tonemapTile(frame, tile, total, tm, job->rgb.data());
+					node_samples[currentNumaNode()] += (long long)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * samples;
+				}
+
+				if (live)
+					live->endTile(tile.index, cancelled() ? done : total);
+
+				int left = --remaining;
+				if (left == 0) {
+					// light tracing splats into every tile, the pass is complete once all tiles are
+					if (frame.bidirectional && !cancelled()) {
+						frame.bidirectional->splats.drain(frame.pixels);
+						for (const auto& t : tiles)
+							tonemapTile(frame, t, total, tm, job->rgb.data());
+					}
+
+					if (cancelled())
+						encoder.release(job);
+					else
+						encoder.submit(job);
+				}
+
+				// progress indicator
+				if (options.progress) {
+					std::lock_guard<std::mutex> lock(progress);
+					std::cerr << "\rPass " << pass + 1 << "/" << passes << " tiles remaining: " << left << ' ' << std::flush;
+				}
+			}, tileNode(tile, frame.height, nodes));
+		}
+
+		pool.wait();
+		done = total;
+
+		if (costs && !cancelled()) {
+			costs->measure(frame, total);
+			pass_order = costs->schedule(tiles, pool.size(), !live);
+		}
+
+		if (live && !cancelled())
+			live->setPass(pass + 1);
+
+		if (options.preview && !cancelled())
+			reportStage(pass == 0 && preview ? "full resolution, 1 spp" : "pass " + std::to_string(pass + 1) + ", " + std::to_string(total) + " spp");
+
+		if (guide && guide->training && !cancelled()) {
+			guide->refine(samples);
+			if (options.progress)
+				std::cerr << "\rguiding: " << guide->leafCount() << " spatial leaves, "
+						  << guide->memory() / (1024.0 * 1024.0) << " MB\n";
+		}
+	}
+
+	if (options.progress)
+		std::cerr << "\n";
+
+	if (options.numa) {
+		std::vector<long long> samples(nodes);
+		for (int node = 0; node < nodes; node++)
+			samples[node] = node_samples[node];
+		printNodeCounters(before, pool.nodeCounters(), samples);
+	}
+
+	if (!options.cost_map.empty() && !cancelled() && !writeCostImage(options.cost_map, frame, done))
+		std::cerr << "cannot write the cost map " << options.cost_map << "\n";
+
+	if (radiance_cache)
+		radiance_cache->printStats(std::cerr);
+
+	frame.replicas.clear();
+	frame.guide = nullptr;
+	frame.radiance_cache = nullptr;
+	frame.cost.clear();
+	frame.cost.shrink_to_fit();
+
+	if (live)
+		live->finish();
+
+	return !cancelled();
+}
+
+/// <summary>
+/// Renders an image too large for memory in bands of one row of tiles and
+/// streams the finished rows to a scanline file (see ScanlineImage).
+///
+/// Every band has its own framebuffer covering only its rows. The tiles of
+/// up to SCANLINE_BANDS_IN_FLIGHT bands are queued on the pool, the calling
+/// thread writes the oldest band once it is done and frees it, so the
+/// memory is bounded by the bands in flight (three rows of tiles) instead
+/// of the image size.
+///
+/// All samples of a pixel are rendered at once, the tiles use the seeds of
+/// a single pass render, so the image equals the one of renderPasses with
+/// one pass. Passes, the preview, the live framebuffer, path guiding, the
+/// radiance cache and the cost tiles and map need the whole image and are
+/// ignored, bidirectional path tracing splats
+/// anywhere into the image and is not supported.
+/// </summary>
+/// <param name="pool">The thread pool.</param>
+/// <param name="options">The render options (image, camera, tiles, tone mapping).</param>
+/// <param name="world">The world.</param>
+/// <param name="environment">The environment map of options.env.</param>
+/// <param name="path">The output path, .ppm or .pfm.</param>
+/// <returns>false if the image cannot be written</returns>
+bool renderScanlines(ThreadPool& pool, const RenderOption& options, shared_ptr<Geometry> world,
+					 shared_ptr<const EnvironmentMap> environment, const std::string& path) {
+	if (options.integrator != "path") {
+		std::cerr << "scanline rendering needs the path integrator\n";
+		return false;
+	}
+	if (options.passes > 1 || options.preview || options.guiding || !options.live.empty() || options.radiance_cache || options.cost_tiles ||
+		!options.cost_map.empty())
+		std::cerr << "scanline rendering ignores --passes, --preview, --guiding, --live, --radiance-cache, --cost-tiles and --cost-map\n";
+
+	int width = options.image_width, height = options.image_height;
+	auto image = ScanlineImage::create(path, width, height, toneMapping(options));
+	if (!image)
+		return false;
+
+	// the candidates of the camera rays are culled for every band
+	RenderOption band_options = options;
+	band_options.cull_tiles = false;
+	band_options.light_tree = false;
+	shared_ptr<const LightTree> lights = options.light_tree ? make_shared<LightTree>(*world) : nullptr;
+
+	struct band {
+		Frame frame;
+		int y0, y1;
+		std::atomic<int> remaining;
+	};
+
+	int nodes = pool.nodes();
+	int tile_size = std::max(options.tile_size, 1);
+	std::deque<shared_ptr<band>> bands;
+	std::mutex mutex;
+	std::condition_variable band_done;
+	bool ok = true;
+
+	std::cerr << "scanline: " << (height + tile_size - 1) / tile_size << " bands of " << width << "x" << tile_size << ", "
+			  << SCANLINE_BANDS_IN_FLIGHT * (double)width * tile_size * sizeof(color) / (1024.0 * 1024.0) << " MB in flight\n";
+
+	// waits for the oldest band, writes and frees it
+	auto writeOldest = [&]() {
+		auto b = bands.front();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			band_done.wait(lock, [&b]() { return b->remaining == 0; });
+		}
+		ok = ok && image->writeRows(b->frame.pixels, b->y0, b->y1, b->frame.samples);
+		bands.pop_front();
+
+		if (options.progress)
+			std::cerr << "\rscanline: " << b->y1 << "/" << height << " rows written " << std::flush;
+	};
+
+	for (int y = 0; y < height && ok; y += tile_size) {
+		if (bands.size() >= SCANLINE_BANDS_IN_FLIGHT)
+			writeOldest();
+
+		auto b = make_shared<band>();
+		initFrame(b->frame, band_options, options.camera, world, environment);
+		b->frame.lights = lights;
+		b->y0 = y;
+		b->y1 = std::min(y + tile_size, height);
+		if (options.cull_tiles)
+			b->frame.culling = make_shared<TileCulling>(b->frame.cam, width, height, tile_size, world, b->y0, b->y1);
+		b->frame.pixels.allocate((size_t)(b->y1 - b->y0) * width, (size_t)y * width);
+
+		auto tiles = makeTileRow(width, height, tile_size, y);
+		b->remaining = (int)tiles.size();
+		bands.push_back(b);
+
+		for (const auto& tile : tiles) {
+			pool.submit([&, b, tile]() {
+				for (int row = tile.y0; row < tile.y1; row++)
+					b->frame.pixels.clear((size_t)row * width + tile.x0, (size_t)row * width + tile.x1);
+
+				renderTile(b->frame, tile, 0, b->frame.samples);
+
+				if (--b->remaining == 0) {
+					std::lock_guard<std::mutex> lock(mutex);
+					band_done.notify_all();
+				}
+			}, tileNode(tile, height, nodes));
+		}
+	}
+
+	while (!bands.empty())
+		writeOldest();
+
+	if (options.progress)
+		std::cerr << "\n";
+
+	ok = image->close() && ok;
+	if (!ok)
+		std::cerr << "cannot write " << path << "\n";
+	return ok;
+}
+
+#endif // !PIPELINE_H
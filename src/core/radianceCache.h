@@ -0,0 +1,172 @@
+#ifndef RADIANCECACHE_H
+#define RADIANCECACHE_H
+
+#include "common.h"
+#include "guiding.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <memory>
+
+// edge length of the octahedral grid of normal directions of a cell
+#define RADIANCE_CACHE_NORMAL_BINS 4
+// slots probed for a cell before the cache counts as full
+#define RADIANCE_CACHE_PROBES 8
+
+/// <summary>
+/// World space cache of the incident radiance of diffuse surfaces
+/// (irradiance / pi), a hashed grid of cells.
+///
+/// A cell is a cube of the grid and a bin of normal directions. The paths
+/// reaching a diffuse surface at a later bounce (depth) record the radiance
+/// arriving along their cosine sampled direction into the cell, until the
+/// cell holds samples records. From then on such paths end at the surface
+/// with the average of the cell instead of tracing on.
+///
+/// The cell size is the bias (the irradiance is blurred over a cell), the
+/// samples per cell the noise of the cached value. Cells are recorded by
+/// all threads and all passes, so the image depends on the order of the
+/// tiles. The table has a fixed number of slots, cells not finding a free
+/// slot are traced as without the cache.
+/// </summary>
+class RadianceCache {
+	public:
+		/// <summary>
+		/// Cell of the cache, the sums are only read once all samples are recorded.
+		/// </summary>
+		struct cell {
+			std::atomic<unsigned long long> key;	// 0 for a free slot
+			std::atomic<unsigned int> reserved;		// records started
+			std::atomic<unsigned int> recorded;		// records added to the sums
+			atomicFloat sum[3];						// radiance recorded
+
+			cell() : key(0), reserved(0), recorded(0) {}
+		};
+
+		/// <summary>
+		/// Creates an empty cache.
+		/// </summary>
+		/// <param name="cell_size">The edge length of the cells in world units.</param>
+		/// <param name="samples">The records of a cell before it is used.</param>
+		/// <param name="depth">The first bounce ending at the cache (1 for the first bounce after the camera hit).</param>
+		/// <param name="memory">The size of the table in bytes.</param>
+		RadianceCache(double cell_size, int samples, int depth, size_t memory)
+			: inverse_size(1 / std::max(cell_size, 1e-6)), samples(std::max(samples, 1)), first_depth(std::max(depth, 1)) {
+			size_t slots = slotCount(memory);
+			table.reset(new cell[slots]);
+			mask = slots - 1;
+		}
+
+		/// <summary>
+		/// Slots of the table of a cache of the memory, a power of two.
+		/// </summary>
+		static size_t slotCount(size_t memory) {
+			size_t slots = 1024;
+			while (slots * 2 * sizeof(cell) <= memory)
+				slots *= 2;
+			return slots;
+		}
+
+		int depth() const {
+			return first_depth;
+		}
+
+		/// <summary>
+		/// The cell of the point with the (unit) normal, added if it is new.
+		/// </summary>
+		/// <returns>The cell, null if the table is full</returns>
+		cell* find(const point3& p, const vec3& normal) {
+			unsigned long long key = hash(p, normal);
+
+			for (int i = 0; i < RADIANCE_CACHE_PROBES; i++) {
+				cell& c = table[(key + i) & mask];
+				unsigned long long current = c.key.load(std::memory_order_acquire);
+				if (current == key)
+					return &c;
+				// a failed exchange loads the key another thread stored
+				if (current == 0 && (c.key.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key))
+					return &c;
+			}
+			return nullptr;
+		}
+
+		/// <summary>
+		/// The cached radiance of the cell, false while it needs records.
+		/// </summary>
+		bool lookup(const cell& c, color& radiance) const {
+			if (c.recorded.load(std::memory_order_acquire) < (unsigned int)samples)
+				return false;
+			radiance = color(c.sum[0].load(), c.sum[1].load(), c.sum[2].load()) / samples;
+			return true;
+		}
+
+		/// <summary>
+		/// Reserves a record of the cell, false if all its samples are reserved.
+		/// </summary>
+		bool reserve(cell& c) {
+			return c.reserved.load(std::memory_order_relaxed) < (unsigned int)samples &&
+				   c.reserved.fetch_add(1, std::memory_order_relaxed) < (unsigned int)samples;
+		}
+
+		/// <summary>
+		/// Adds a record reserved by reserve.
+		/// </summary>
+		void record(cell& c, const color& radiance) {
+			for (int k = 0; k < 3; k++)
+				c.sum[k].add((float)radiance[k]);
+			c.recorded.fetch_add(1, std::memory_order_release);
+		}
+
+		/// <summary>
+		/// Prints the cells in use and the memory of the table.
+		/// </summary>
+		void printStats(std::ostream& os) const {
+			size_t used = 0, ready = 0;
+			for (size_t i = 0; i <= mask; i++) {
+				if (table[i].key.load(std::memory_order_relaxed) == 0) continue;
+				used++;
+				color radiance;
+				if (lookup(table[i], radiance)) ready++;
+			}
+			os << "radiance cache: " << used << " cells (" << ready << " complete) of " << mask + 1 << " slots, "
+			   << (mask + 1) * sizeof(cell) / (1024.0 * 1024.0) << " MB\n";
+		}
+
+	private:
+		// hash of the grid cube and the normal bin, never 0
+		unsigned long long hash(const point3& p, const vec3& n) const {
+			long long cube[] = { (long long)std::floor(p.x() * inverse_size), (long long)std::floor(p.y() * inverse_size),
+								 (long long)std::floor(p.z() * inverse_size) };
+
+			// octahedral map of the normal to the square [-1, 1]^2
+			double l1 = std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z());
+			double u = n.x() / l1, v = n.y() / l1;
+			if (n.z() < 0) {
+				double fu = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+				v = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+				u = fu;
+			}
+			int bu = std::min((int)((u + 1) / 2 * RADIANCE_CACHE_NORMAL_BINS), RADIANCE_CACHE_NORMAL_BINS - 1);
+			int bv = std::min((int)((v + 1) / 2 * RADIANCE_CACHE_NORMAL_BINS), RADIANCE_CACHE_NORMAL_BINS - 1);
+
+			// FNV-1a, then a finalizer spreading the bits over the slots
+			int bin = bu * RADIANCE_CACHE_NORMAL_BINS + bv;
+			unsigned long long h = fnv1a(fnv1a(FNV1A_BASIS, cube, sizeof(cube)), &bin, sizeof(bin));
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			return h ? h : 1;
+		}
+
+	private:
+		double inverse_size;
+		int samples;
+		int first_depth;
+
+		std::unique_ptr<cell[]> table;
+		size_t mask;
+};
+
+#endif // !RADIANCECACHE_H
@@ -1,5 +1,17 @@
+#ifndef RENDEROPTIONS_H
+#define RENDEROPTIONS_H
+
 #include <stdlib.h>
+#include <algorithm>
 #include <iostream>     // std::cout
+#include <sstream>
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/program_options.hpp>
+
+#include "camera.h"
 
 /**
 * Image parameters
@@ -17,10 +29,346 @@ public:
 
 	int samples = 20; // samples per pixel
 
+	// trace camera rays in coherent packets
+	bool packets = true;
+
+	// number of render threads, 0 uses one per hardware thread
+	int threads = 0;
+
+	// pin the threads to the NUMA nodes, tiles are assigned by node
+	bool numa = false;
+
+	// copy the scene hierarchy to every NUMA node
+	bool numa_replicate = false;
+
+	// edge length of the tiles handed to the render threads
+	int tile_size = 32;
+
+	// number of progressive passes, the image is written after each pass
+	int passes = 1;
+
+	// tone mapping
+	double exposure = 1.0;
+	std::string tonemap = "clamp";	// clamp or reinhard
+
 	// Seed for Random Samples
 	int seed = 0;	// random Seed
 
+	// scene to render (see buildScene)
+	std::string scene = "random";
+
+	// number of spheres of the generated scenes (uniform, clustered, uneven)
+	long long scene_count = 100000;
+
+	// camera constructor arguments
+	CameraSettings camera;
+
+	// directory of the on-disk hierarchy cache, empty disables the cache
+	std::string bvh_cache;
+
+	// chunk file of a generated sphere field streamed from disk, empty keeps the field in memory
+	std::string stream;
+	double stream_budget = 1024;	// MB of chunks kept mapped
+
+	// test the camera rays of a tile only against the objects projecting into the tile
+	bool cull_tiles = false;
+
+	// split and order the tiles by the rays traced per pixel
+	bool cost_tiles = false;
+	// heatmap of the rays traced per pixel and sample (.pfm for the counts), empty for none
+	std::string cost_map;
+
+	// render in bands of tile rows and stream the finished rows to the output, for images larger than memory
+	bool scanline = false;
+
+	// look-dev: edits of material parameters (see applyMaterialEdits) and the first hit cache file, empty for none
+	std::vector<std::string> material_edits;
+	std::string gbuffer;
+
+	// print the memory and the projected render time from a sampled subset of the pixels instead of rendering
+	bool estimate = false;
+
+	// print the tile progress to std::cerr
+	bool progress = true;
+
+	// fast preview: render 1/16 and 1/4 resolution, then 1 spp before the passes
+	bool preview = false;
+
+	// file exposing the accumulation buffer to viewers while rendering, empty for none
+	std::string live;
+
+	// path guiding: learn the incident radiance in the first passes
+	bool guiding = false;
+	int guiding_training = 4;		// training passes
+	double guiding_memory = 256;	// memory of the guiding trees in MB
+
+	// radiance cache ending the later diffuse bounces (see RadianceCache)
+	bool radiance_cache = false;
+	double radiance_cache_cell = 0.25;		// edge length of the cells in world units (bias)
+	int radiance_cache_samples = 64;		// records of a cell before it is used (noise)
+	int radiance_cache_depth = 1;			// first bounce ending at the cache
+	double radiance_cache_memory = 128;		// MB of the cache table
+
+	// sample the emitting spheres at the path vertices, picked by a light hierarchy (see LightTree)
+	bool light_tree = false;
+
+	// light transport: path (path tracing) or bdpt (bidirectional path tracing)
+	std::string integrator = "path";
+
+	// scale of the gradient sky
+	double sky = 1;
+
+	// HDR environment map lighting the scene, empty for the gradient sky
+	std::string env;
+	double env_intensity = 1;		// scale of the radiance
+	double env_rotation = 0;		// rotation around +y in degrees
+
 	// empty constructor
 	RenderOption() {
 	}
-};
\ No newline at end of file
+};
+
+/// <summary>
+/// Parses a vector given as "x y z" or "x,y,z".
+/// </summary>
+inline vec3 parseVec3(std::string s) {
+	std::replace(s.begin(), s.end(), ',', ' ');
+	std::istringstream in(s);
+	vec3 v;
+	if (!(in >> v))
+		throw boost::program_options::error("cannot parse vector '" + s + "'");
+	return v;
+}
+
+/// <summary>
+/// Command line options changing a <see cref="RenderOption"/>.
+/// </summary>
+inline boost::program_options::options_description renderOptionsDescription() {
+	namespace po = boost::program_options;
+	po::options_description desc("Render options");
+
+	desc.add_options()
+		("out", po::value<std::string>(), "set the output path for the rendering")
+		("width", po::value<int>(), "width of the result image")
+		("height", po::value<int>(), "height of the result image")
+		("samples", po::value<int>(), "samples of the result image")
+		("seed", po::value<int>(), "random seed of the scene and the samples")
+		("scene", po::value<std::string>(), "scene to render: random (default), random2, glass (caustics, lit by a small light), lights (--count small lights) or a generated sphere field: uniform, clustered, uneven")
+		("count", po::value<long long>(), "number of spheres of a generated sphere field or of lights of the lights scene (default: 100000)")
+		("lookfrom", po::value<std::string>(), "camera position \"x y z\"")
+		("lookat", po::value<std::string>(), "camera target \"x y z\"")
+		("vup", po::value<std::string>(), "camera up vector \"x y z\"")
+		("vfov", po::value<double>(), "vertical field-of-view in degrees")
+		("aperture", po::value<double>(), "lens aperture")
+		("focus-dist", po::value<double>(), "focus distance")
+		("packets", po::value<bool>(), "trace camera rays as coherent packets (default: true)")
+		("passes", po::value<int>(), "split the samples into progressive passes, the image is written after every pass")
+		("exposure", po::value<double>(), "exposure scale applied before tone mapping")
+		("tonemap", po::value<std::string>(), "tone curve: clamp (default) or reinhard")
+		("numa-replicate", po::value<bool>(), "with --numa: copy the scene hierarchy to every node (default: false)")
+		("bvh-cache", po::value<std::string>(), "directory caching the built hierarchies, later runs map them instead of building")
+		("preview", po::value<bool>(), "show a 1/16 and 1/4 resolution image and 1 spp first, tiles from the center out (default: false)")
+		("live", po::value<std::string>(), "accumulate into this memory-mapped file (e.g. in /dev/shm) that viewers can read while rendering, not with --sequence")
+		("cull-tiles", po::value<bool>(), "test the camera rays of a tile only against the objects in its view frustum (default: false)")
+		("cost-tiles", po::value<bool>(), "split expensive tiles and render them first, by the rays counted per pixel (default: false)")
+		("cost-map", po::value<std::string>(), "write the rays traced per pixel and sample as a heatmap (.pfm for the counts)")
+		("scanline", po::value<bool>(), "render in rows of tiles and stream the finished rows to out (.ppm or .pfm), the memory does not grow with the image (default: false)")
+		("material", po::value<std::vector<std::string>>()->composing(), "edit a material after the scene is built: <type or #index>.<parameter>=<value>, e.g. metal.fuzz=0.3 (repeatable)")
+		("gbuffer", po::value<std::string>(), "cache the first hits in this file, a later render of the same view only re-shades the pixels whose first material changed")
+		("stream", po::value<std::string>(), "keep a generated sphere field in this chunk file and map the chunks on demand")
+		("stream-budget", po::value<double>(), "MB of streamed chunks kept in memory (default: 1024)")
+		("guiding", po::value<bool>(), "guide the diffuse and glossy bounces by the learned incident radiance (default: false)")
+		("guiding-training", po::value<int>(), "passes learning the incident radiance with --guiding (default: 4)")
+		("guiding-memory", po::value<double>(), "memory limit of the guiding trees in MB (default: 256)")
+		("radiance-cache", po::value<bool>(), "end the later diffuse bounces at a cache of the irradiance, fewer rays for some bias (default: false)")
+		("radiance-cache-cell", po::value<double>(), "edge length of the radiance cache cells in world units, larger is faster and blurrier (default: 0.25)")
+		("radiance-cache-samples", po::value<int>(), "paths recorded into a radiance cache cell before it is used, more is less noisy (default: 64)")
+		("radiance-cache-depth", po::value<int>(), "first bounce ending at the radiance cache, 1 is the bounce after the camera hit (default: 1)")
+		("radiance-cache-memory", po::value<double>(), "memory of the radiance cache table in MB (default: 128)")
+		("estimate", po::value<bool>(), "build the scene, print the memory per subsystem and the render time projected from a sampled 1/64 of the pixels, then exit (default: false)")
+		("light-tree", po::value<bool>(), "path tracer: sample the emitting spheres at every bounce, picked by a light hierarchy for scenes with many lights (default: false)")
+		("integrator", po::value<std::string>(), "light transport: path (default) or bdpt, bidirectional for caustics and small lights")
+		("sky", po::value<double>(), "scale of the gradient sky, 0 for a black background (default: 1)")
+		("env", po::value<std::string>(), "light the scene by this HDR environment map (equirectangular) instead of the sky gradient")
+		("env-intensity", po::value<double>(), "scale of the environment radiance (default: 1)")
+		("env-rotation", po::value<double>(), "rotation of the environment around the up axis in degrees (default: 0)")
+		;
+
+	return desc;
+}
+
+/// <summary>
+/// Applies the parsed options of renderOptionsDescription to the render option o.
+/// </summary>
+inline void applyRenderOptions(const boost::program_options::variables_map& vm, RenderOption& o) {
+	if (vm.count("out")) {
+		o.outputPath = vm["out"].as<std::string>();
+	}
+
+	if (vm.count("width")) {
+		o.image_width = std::max(0, vm["width"].as<int>());
+		// todo fix settings based on image_width
+	}
+
+	if (vm.count("height")) {
+		o.image_height = std::max(0, vm["height"].as<int>());
+		// todo fix settings based on image_height
+	}
+
+	if (vm.count("samples")) {
+		o.samples = std::max(0, vm["samples"].as<int>());
+	}
+
+	if (vm.count("seed")) {
+		o.seed = vm["seed"].as<int>();
+	}
+
+	if (vm.count("scene")) {
+		o.scene = vm["scene"].as<std::string>();
+	}
+
+	if (vm.count("count")) {
+		o.scene_count = std::max(1LL, vm["count"].as<long long>());
+	}
+
+	if (vm.count("lookfrom")) o.camera.lookfrom = parseVec3(vm["lookfrom"].as<std::string>());
+	if (vm.count("lookat")) o.camera.lookat = parseVec3(vm["lookat"].as<std::string>());
+	if (vm.count("vup")) o.camera.vup = parseVec3(vm["vup"].as<std::string>());
+	if (vm.count("vfov")) o.camera.vfov = vm["vfov"].as<double>();
+	if (vm.count("aperture")) o.camera.aperture = vm["aperture"].as<double>();
+	if (vm.count("focus-dist")) o.camera.focus_dist = vm["focus-dist"].as<double>();
+
+	if (vm.count("packets")) {
+		o.packets = vm["packets"].as<bool>();
+	}
+
+	if (vm.count("passes")) {
+		o.passes = std::max(1, vm["passes"].as<int>());
+	}
+
+	if (vm.count("exposure")) {
+		o.exposure = vm["exposure"].as<double>();
+	}
+
+	if (vm.count("tonemap")) {
+		o.tonemap = vm["tonemap"].as<std::string>();
+		if (o.tonemap != "clamp" && o.tonemap != "reinhard") {
+			std::cerr << "unknown tonemap " << o.tonemap << ", using clamp\n";
+			o.tonemap = "clamp";
+		}
+	}
+
+	if (vm.count("numa-replicate")) {
+		o.numa_replicate = vm["numa-replicate"].as<bool>();
+	}
+
+	if (vm.count("bvh-cache")) {
+		o.bvh_cache = vm["bvh-cache"].as<std::string>();
+	}
+
+	if (vm.count("preview")) {
+		o.preview = vm["preview"].as<bool>();
+	}
+
+	if (vm.count("live")) {
+		o.live = vm["live"].as<std::string>();
+	}
+
+	if (vm.count("cull-tiles")) {
+		o.cull_tiles = vm["cull-tiles"].as<bool>();
+	}
+
+	if (vm.count("cost-tiles")) {
+		o.cost_tiles = vm["cost-tiles"].as<bool>();
+	}
+
+	if (vm.count("cost-map")) {
+		o.cost_map = vm["cost-map"].as<std::string>();
+	}
+
+	if (vm.count("scanline")) {
+		o.scanline = vm["scanline"].as<bool>();
+	}
+
+	if (vm.count("material")) {
+		o.material_edits = vm["material"].as<std::vector<std::string>>();
+	}
+
+	if (vm.count("gbuffer")) {
+		o.gbuffer = vm["gbuffer"].as<std::string>();
+	}
+
+	if (vm.count("stream")) {
+		o.stream = vm["stream"].as<std::string>();
+	}
+
+	if (vm.count("stream-budget")) {
+		o.stream_budget = std::max(1.0, vm["stream-budget"].as<double>());
+	}
+
+	if (vm.count("radiance-cache")) {
+		o.radiance_cache = vm["radiance-cache"].as<bool>();
+	}
+
+	if (vm.count("radiance-cache-cell")) {
+		o.radiance_cache_cell = std::max(1e-6, vm["radiance-cache-cell"].as<double>());
+	}
+
+	if (vm.count("radiance-cache-samples")) {
+		o.radiance_cache_samples = std::max(1, vm["radiance-cache-samples"].as<int>());
+	}
+
+	if (vm.count("radiance-cache-depth")) {
+		o.radiance_cache_depth = std::max(1, vm["radiance-cache-depth"].as<int>());
+	}
+
+	if (vm.count("radiance-cache-memory")) {
+		o.radiance_cache_memory = std::max(1.0, vm["radiance-cache-memory"].as<double>());
+	}
+
+	if (vm.count("estimate")) {
+		o.estimate = vm["estimate"].as<bool>();
+	}
+
+	if (vm.count("light-tree")) {
+		o.light_tree = vm["light-tree"].as<bool>();
+	}
+
+	if (vm.count("guiding")) {
+		o.guiding = vm["guiding"].as<bool>();
+	}
+
+	if (vm.count("guiding-training")) {
+		o.guiding_training = std::max(1, vm["guiding-training"].as<int>());
+	}
+
+	if (vm.count("guiding-memory")) {
+		o.guiding_memory = std::max(1.0, vm["guiding-memory"].as<double>());
+	}
+
+	if (vm.count("integrator")) {
+		o.integrator = vm["integrator"].as<std::string>();
+		if (o.integrator != "path" && o.integrator != "bdpt") {
+			std::cerr << "unknown integrator " << o.integrator << ", using path\n";
+			o.integrator = "path";
+		}
+	}
+
+	if (vm.count("sky")) {
+		o.sky = std::max(0.0, vm["sky"].as<double>());
+	}
+
+	if (vm.count("env")) {
+		o.env = vm["env"].as<std::string>();
+	}
+
+	if (vm.count("env-intensity")) {
+		o.env_intensity = std::max(0.0, vm["env-intensity"].as<double>());
+	}
+
+	if (vm.count("env-rotation")) {
+		o.env_rotation = vm["env-rotation"].as<double>();
+	}
+}
+
+#endif // !RENDEROPTIONS_H
@@ -0,0 +1,621 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "common.h"
+#include "camera.h"
+#include "environment.h"
+#include "geometry.h"
+#include "guiding.h"
+#include "lightTree.h"
+#include "material.h"
+#include "numa.h"
+#include "packet.h"
+#include "radianceCache.h"
+#include "texture.h"
+#include "tileCulling.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+// recursion depth to limit the maximum light bounces
+#define RAY_BOUNCE_LIMIT 50
+
+// rays traced by the thread (closest hit and shadow rays), measures the cost of pixels
+thread_local unsigned long long traced_rays = 0;
+
+/// <summary>
+/// Rectangle of pixels [x0, x1) x [y0, y1) rendered as one task.
+/// Rows are counted from the top of the image.
+/// </summary>
+struct Tile {
+	int x0, y0, x1, y1;
+	int index;
+};
+
+/// <summary>
+/// Pixel colors of an image, or of a window [first, first + size) of the
+/// pixels of an image (e.g. a band of rows), indexed by image pixel.
+///
+/// allocate reserves the memory without writing it, so each page is placed
+/// on the NUMA node of the thread clearing it first (first touch).
+/// </summary>
+class PixelBuffer {
+	public:
+		/// <summary>
+		/// Allocates n pixels, all set to c.
+		/// </summary>
+		void assign(size_t n, const color& c) {
+			allocate(n);
+			clear(0, n, c);
+		}
+
+		/// <summary>
+		/// Allocates n pixels without initializing them, every pixel has to be
+		/// set with clear before it is used.
+		/// </summary>
+		/// <param name="n">The number of pixels.</param>
+		/// <param name="first">The image index of the first pixel, for a window of a larger image.</param>
+		void allocate(size_t n, size_t first = 0) {
+			storage.reset();
+			memory.reset(n ? static_cast<color*>(std::malloc(n * sizeof(color))) : nullptr);
+			if (n && !memory) throw std::bad_alloc();
+			data = memory.get();
+			count = n;
+			this->first = first;
+		}
+
+		/// <summary>
+		/// Uses n pixels of memory owned by someone else (e.g. a mapped file),
+		/// kept alive by storage. The pixels are not initialized.
+		/// </summary>
+		void attach(color* pixels, size_t n, std::shared_ptr<void> storage) {
+			memory.reset();
+			this->storage = storage;
+			data = pixels;
+			count = n;
+			first = 0;
+		}
+
+		/// <summary>
+		/// Sets the pixels [begin, end) to c.
+		/// </summary>
+		void clear(size_t begin, size_t end, const color& c = color(0, 0, 0)) {
+			for (size_t i = begin; i < end; i++)
+				new (data + i - first) color(c);
+		}
+
+		color& operator[](size_t i) { return data[i - first]; }
+		const color& operator[](size_t i) const { return data[i - first]; }
+
+		size_t size() const { return count; }
+		size_t begin() const { return first; }
+
+	private:
+		struct freeDeleter {
+			void operator()(color* p) const { std::free(p); }
+		};
+
+		std::unique_ptr<color, freeDeleter> memory;
+		std::shared_ptr<void> storage;
+		color* data = nullptr;
+		size_t count = 0;
+		size_t first = 0;	// image index of data[0]
+};
+
+class BidirectionalScene;
+
+/// <summary>
+/// Everything needed to render one image.
+/// </summary>
+class Frame {
+	public:
+		int number = 0;			// frame number of a sequence
+		int width = 0;
+		int height = 0;
+		int samples = 1;		// samples per pixel
+		unsigned int seed = 0;	// random seed
+		bool packets = true;	// trace camera rays in coherent packets
+
+		Camera cam;
+		shared_ptr<Geometry> world;
+
+		// copies of world per NUMA node, the nodes without a copy use world
+		std::vector<shared_ptr<Geometry>> replicas;
+
+		// learned incident radiance, null renders without path guiding
+		PathGuide* guide = nullptr;
+
+		// cached irradiance ending the later diffuse bounces, null traces them
+		RadianceCache* radiance_cache = nullptr;
+
+		// emitting spheres sampled at the path vertices, null finds lights only by scattering
+		shared_ptr<const LightTree> lights;
+
+		// lighting of the rays leaving the scene, null for the gradient background
+		shared_ptr<const EnvironmentMap> environment;
+		double sky = 1;	// scale of the gradient background
+
+		// lights and splats of bidirectional path tracing, null renders with the path tracer
+		shared_ptr<BidirectionalScene> bidirectional;
+
+		// candidates of the camera rays per tile, null tests them against the world
+		shared_ptr<const TileCulling> culling;
+
+		// set to stop the rendering, tiles stop after the current packet block
+		const std::atomic<bool>* cancel = nullptr;
+
+		// sum of the (linear) sample colors, row by row from the top.
+		// divided by the number of samples only when the image is tone mapped
+		PixelBuffer pixels;
+
+		// rays traced per pixel summed over the samples, empty if the cost is not measured
+		std::vector<unsigned int> cost;
+
+		/// <summary>
+		/// The world used by the threads of the NUMA node.
+		/// </summary>
+		const Geometry& worldOn(int node) const {
+			if (node >= 0 && node < (int)replicas.size() && replicas[node])
+				return *replicas[node];
+			return *world;
+		}
+};
+
+
+/// <summary>
+/// State shared by all paths of a frame besides the geometry.
+/// </summary>
+struct PathContext {
+	PathGuide* guide = nullptr;						// path guiding, null for none
+	RadianceCache* cache = nullptr;					// radiance cache, null for none
+	const LightTree* lights = nullptr;				// lights sampled at the vertices, null for none
+	const EnvironmentMap* environment = nullptr;	// null for the gradient background
+	double sky = 1;									// scale of the gradient background
+
+	PathContext() {}
+	explicit PathContext(const Frame& frame)
+		: guide(frame.guide), cache(frame.radiance_cache), lights(frame.lights.get()), environment(frame.environment.get()), sky(frame.sky) {}
+};
+
+color ray_color(const ray& r, const Geometry& world, int depth, const PathContext& context, double scatter_pdf = 0);
+color shade_hit(const ray& r, const hitRecord& rec, const Geometry& world, int depth, const PathContext& context);
+
+// power heuristic of multiple importance sampling
+inline double power_heuristic(double pdf, double other_pdf) {
+	double a = pdf * pdf, b = other_pdf * other_pdf;
+	return a + b > 0 ? a / (a + b) : 0;
+}
+
+/// <summary>
+/// Light of the rays leaving the scene.
+/// </summary>
+/// <param name="r">The ray.</param>
+/// <param name="context">The path context.</param>
+/// <param name="scatter_pdf">The density the ray was sampled with at a non-specular surface, 0 for camera rays and specular bounces.</param>
+inline color background(const ray& r, const PathContext& context, double scatter_pdf) {
+	if (!context.environment)
+		return colorGradient(r) * context.sky;
+
+	color radiance = context.environment->eval(r.direction());
+	if (scatter_pdf > 0)
+		radiance *= power_heuristic(scatter_pdf, context.environment->pdf(r.direction()));
+	return radiance;
+}
+
+/// <summary>
+/// Shading of a non-specular surface with path guiding or an environment
+/// map.
+///
+/// With guiding the direction is sampled from the material or from the
+/// learned distribution and weighted with the pdf of both (one sample MIS),
+/// while training the radiance arriving from the direction is recorded.
+///
+/// With an environment map a direction of the map is sampled as well
+/// (next event estimation), both estimates are combined with the power
+/// heuristic.
+/// </summary>
+color shade_sampled(const ray& r, const hitRecord& rec, const Geometry& world, int depth, const PathContext& context) {
+	const DTree* dtree = context.guide ? context.guide->sampling(rec.p) : nullptr;
+	double bsdf_fraction = dtree && dtree->total() > 0 ? GUIDING_BSDF_FRACTION : 1.0;
+
+	// density of sampling direction d
+	auto scatter_pdf = [&](const vec3& d) {
+		double pdf = bsdf_fraction * rec.mat_ptr->pdf(r, rec, d);
+		if (bsdf_fraction < 1)
+			pdf += (1 - bsdf_fraction) * dtree->pdf(d);
+		return pdf;
+	};
+
+	color direct(0, 0, 0);
+	if (context.environment) {
+		double light_pdf;
+		color radiance;
+		vec3 d = context.environment->sample(light_pdf, radiance);
+		color f = rec.mat_ptr->eval(r, rec, d);
+
+		if (light_pdf > 0 && (f.r() > 0 || f.g() > 0 || f.b() > 0)) {
+			traced_rays++;
+			surfaceHit occluder;
+			if (!world.intersect(ray(rec.p, d, r.time()), 0.001, infinity, occluder))
+				direct = f * radiance * power_heuristic(light_pdf, scatter_pdf(d)) / light_pdf;
+		}
+	}
+
+	vec3 direction;
+	if (random_double() < bsdf_fraction) {
+		bsdfSample sample;
+		if (!rec.mat_ptr->sample(r, rec, sample))
+			return direct;
+		direction = sample.direction;
+	}
+	else {
+		direction = dtree->sample();
+	}
+
+	double pdf = scatter_pdf(direction);
+	color f = rec.mat_ptr->eval(r, rec, direction);
+	if (pdf <= 0 || (f.r() <= 0 && f.g() <= 0 && f.b() <= 0))
+		return direct;
+
+	color incident = ray_color(ray(rec.p, direction, r.time()), world, depth + 1, context, context.environment ? pdf : 0);
+	if (context.guide)
+		context.guide->record(rec.p, direction, luminance(incident) / pdf);
+
+	return direct + f * incident / pdf;
+}
+
+/// <summary>
+/// Shading of a diffuse surface at a bounce ending at the radiance cache:
+/// the cached incident radiance of the cell, or while the cell needs
+/// records the radiance traced along a cosine sampled direction, which is
+/// recorded. The direction is sampled by the material alone, so the record
+/// holds all light arriving along it.
+/// </summary>
+color shade_cached(const ray& r, const hitRecord& rec, const Geometry& world, int depth, const PathContext& context) {
+	bsdfSample sample;
+	if (!rec.mat_ptr->sample(r, rec, sample))
+		return color(0, 0, 0);
+
+	RadianceCache::cell* cell = context.cache->find(rec.p, rec.normal);
+	color incident;
+	if (cell && context.cache->lookup(*cell, incident))
+		return sample.weight * incident;
+
+	bool recording = cell && context.cache->reserve(*cell);
+	incident = ray_color(ray(rec.p, sample.direction, r.time()), world, depth + 1, context);
+	if (recording) {
+		incident.replaceNaN();
+		context.cache->record(*cell, incident);
+	}
+	return sample.weight * incident;
+}
+
+/// <summary>
+/// Shading of a non-specular surface with the lights of the light tree:
+/// a light picked by the tree for the point is sampled (next event
+/// estimation) and a direction is sampled by the material, the two
+/// estimates of the light are combined with the power heuristic.
+/// </summary>
+color shade_lights(const ray& r, const hitRecord& rec, const Geometry& world, int depth, const PathContext& context) {
+	const LightTree& lights = *context.lights;
+	color direct(0, 0, 0);
+
+	double choice, cone_pdf;
+	vec3 d;
+	int light = lights.sample(rec.p, rec.normal, random_double(), choice);
+	if (light >= 0 && sampleSphereCone(lights.light(light), rec.p, random_double(), random_double(), d, cone_pdf)) {
+		color f = rec.mat_ptr->eval(r, rec, d);
+		if (f.r() > 0 || f.g() > 0 || f.b() > 0) {
+			traced_rays++;
+			ray shadow(rec.p, d, r.time());
+			surfaceHit hit;
+			hitRecord emitter;
+			if (world.intersect(shadow, 0.001, infinity, hit) && hit.geometry == lights.light(light).geometry &&
+				hit.geometry->interaction(shadow, hit, emitter)) {
+				double light_pdf = choice * cone_pdf;
+				direct = f * emitter.mat_ptr->emitted(emitter) * power_heuristic(light_pdf, rec.mat_ptr->pdf(r, rec, d)) / light_pdf;
+			}
+		}
+	}
+
+	bsdfSample sample;
+	if (!rec.mat_ptr->sample(r, rec, sample) || depth + 1 >= RAY_BOUNCE_LIMIT)
+		return direct;
+
+	ray scattered(rec.p, sample.direction, r.time());
+	surfaceHit hit;
+	traced_rays++;
+	if (!world.intersect(scattered, 0.001, infinity, hit))
+		return direct + sample.weight * background(scattered, context, 0);
+
+	hitRecord next;
+	if (!hit.geometry->interaction(scattered, hit, next))
+		return direct;
+	if (!next.mat_ptr->emissive())
+		return direct + sample.weight * shade_hit(scattered, next, world, depth + 1, context);
+
+	// the light could also have been picked by the tree
+	double weight = 1;
+	int hit_light = lights.lightOf(hit.geometry);
+	if (!sample.specular && hit_light >= 0)
+		weight = power_heuristic(sample.pdf, lights.probability(rec.p, rec.normal, hit_light) * sphereConePdf(lights.light(hit_light), rec.p));
+	return direct + sample.weight * next.mat_ptr->emitted(next) * weight;
+}
+
+// shading of an intersection found for the ray r
+color shade_hit(const ray& r, const hitRecord& rec, const Geometry& world, int depth, const PathContext& context) {
+	// light sources do not scatter
+	if (rec.mat_ptr->emissive())
+		return rec.mat_ptr->emitted(rec);
+
+	if (context.cache && depth >= context.cache->depth() && rec.mat_ptr->diffuse())
+		return shade_cached(r, rec, world, depth, context);
+
+	if ((context.guide || context.environment) && !rec.mat_ptr->specular())
+		return shade_sampled(r, rec, world, depth, context);
+
+	if (context.lights && !rec.mat_ptr->specular())
+		return shade_lights(r, rec, world, depth, context);
+
+	bsdfSample sample;
+
+	if (rec.mat_ptr->sample(r, rec, sample))
+		return sample.weight * ray_color(ray(rec.p, sample.direction, r.time()), world, depth + 1, context);
+
+	// absorbed
+	return color(0, 0, 0);
+}
+
+// ray intersection
+color ray_color(const ray& r, const Geometry& world, int depth, const PathContext& context, double scatter_pdf) {
+	hitRecord rec;
+
+	// ray bounce limit
+	if (depth >= RAY_BOUNCE_LIMIT)
+		return color(0, 0, 0);
+
+	traced_rays++;
+
+	// using 0.001 to fix shadow acne
+	// ignore hits very near zero
+	if (world.hit(r, 0.001, infinity, rec))
+		return shade_hit(r, rec, world, depth, context);
+
+	return background(r, context, scatter_pdf);
+};
+
+/// <summary>
+/// Color of a camera ray, the first hit is searched in primary (the
+/// candidates of the tile), the later bounces in the world.
+/// </summary>
+color camera_ray_color(const ray& r, const Geometry& primary, const Geometry& world, const PathContext& context) {
+	hitRecord rec;
+	traced_rays++;
+
+	if (primary.hit(r, 0.001, infinity, rec))
+		return shade_hit(r, rec, world, 0, context);
+
+	return background(r, context, 0);
+}
+
+/// <summary>
+/// Traces the camera rays of a packet.
+///
+/// Only the first hit is found for the whole packet, after the first bounce
+/// the rays lost their coherence and are traced one by one.
+/// </summary>
+/// <param name="packet">The packet of camera rays.</param>
+/// <param name="primary">The geometry the first hit is searched in, the world or the candidates of the tile.</param>
+/// <param name="world">The world.</param>
+/// <param name="colors">The resulting color for each ray of the packet.</param>
+/// <param name="context">The path context.</param>
+/// <param name="rays">The number of rays traced for each ray of the packet, null if not measured.</param>
+void packet_color(const RayPacket& packet, const Geometry& primary, const Geometry& world, color* colors, const PathContext& context,
+				  unsigned int* rays = nullptr) {
+	static thread_local packetHitRecord rec;
+	rec.reset(packet.count, infinity);
+
+	primary.hit_packet(packet, 0.001, rec);
+	traced_rays += packet.count;
+
+	hitRecord surface;
+	for (int i = 0; i < packet.count; i++) {
+		unsigned long long before = traced_rays;
+		// a surface not found again is taken as a miss, surface would be stale
+		if (rec.hit[i] && rec.surface[i].geometry->interaction(packet.rays[i], rec.surface[i], surface))
+			colors[i] = shade_hit(packet.rays[i], surface, world, 0, context);
+		else
+			colors[i] = background(packet.rays[i], context, 0);
+
+		if (rays)
+			rays[i] = (unsigned int)(traced_rays - before) + 1;
+	}
+}
+
+/// <summary>
+/// Splits the image into tiles.
+/// </summary>
+/// <param name="width">The image width.</param>
+/// <param name="height">The image height.</param>
+/// <param name="tile_size">The edge length of the tiles.</param>
+/// <returns>The tiles in scanline order</returns>
+std::vector<Tile> makeTiles(int width, int height, int tile_size) {
+	std::vector<Tile> tiles;
+
+	for (int y = 0; y < height; y += tile_size) {
+		for (int x = 0; x < width; x += tile_size) {
+			Tile tile;
+			tile.x0 = x;
+			tile.y0 = y;
+			tile.x1 = std::min(x + tile_size, width);
+			tile.y1 = std::min(y + tile_size, height);
+			tile.index = (int)tiles.size();
+			tiles.push_back(tile);
+		}
+	}
+
+	return tiles;
+}
+
+/// <summary>
+/// Tiles of the row of tiles starting at image row y, numbered like the
+/// tiles of makeTiles.
+/// </summary>
+std::vector<Tile> makeTileRow(int width, int height, int tile_size, int y) {
+	std::vector<Tile> tiles;
+	int per_row = (width + tile_size - 1) / tile_size;
+
+	for (int x = 0; x < width; x += tile_size) {
+		Tile tile;
+		tile.x0 = x;
+		tile.y0 = y;
+		tile.x1 = std::min(x + tile_size, width);
+		tile.y1 = std::min(y + tile_size, height);
+		tile.index = (y / tile_size) * per_row + x / tile_size;
+		tiles.push_back(tile);
+	}
+
+	return tiles;
+}
+
+/// <summary>
+/// Seed of the random numbers of a tile.
+/// Tiles are independent of the thread rendering them, so every run produces the same image.
+/// </summary>
+inline unsigned int tileSeed(unsigned int seed, int frame, int pass, int tile) {
+	unsigned int h = seed * 0x9E3779B9u;
+	h ^= (unsigned int)frame * 0x85EBCA6Bu + (h << 6) + (h >> 2);
+	h ^= (unsigned int)pass * 0x27D4EB2Fu + (h << 6) + (h >> 2);
+	h ^= (unsigned int)tile * 0xC2B2AE35u + (h << 6) + (h >> 2);
+	return h;
+}
+
+/// <summary>
+/// Renders samples of a tile and adds them to frame.pixels.
+///
+/// The tile is traced in blocks of PACKET_SIZE x PACKET_SIZE pixels,
+/// for every sample the camera rays of a block form one packet. Frames
+/// with frame.bidirectional are rendered by renderTileBidirectional.
+///
+/// If frame.cost is allocated the rays traced for each pixel are added to it.
+/// With frame.culling the camera rays are only tested against the
+/// candidates of the tile.
+/// </summary>
+/// <param name="frame">The frame.</param>
+/// <param name="tile">The tile.</param>
+/// <param name="pass">The progressive pass (selects the random numbers).</param>
+/// <param name="samples">The number of samples per pixel to add.</param>
+void renderTileBidirectional(Frame& frame, const Tile& tile, int pass, int samples);
+
+void renderTile(Frame& frame, const Tile& tile, int pass, int samples) {
+	if (frame.bidirectional) {
+		renderTileBidirectional(frame, tile, pass, samples);
+		return;
+	}
+
+	RayPacket packet;
+	color packet_colors[PACKET_MAX_RAYS];
+	unsigned int packet_rays[PACKET_MAX_RAYS];
+	bool measure = !frame.cost.empty();
+	const Geometry& world = frame.worldOn(currentNumaNode());
+	const Geometry& primary = frame.culling ? frame.culling->tile(tile.x0, tile.y0) : world;
+	PathContext context(frame);
+
+	seed_random(tileSeed(frame.seed, frame.number, pass, tile.index));
+
+	for (int by = tile.y0; by < tile.y1; by += PACKET_SIZE) {
+		int by1 = std::min(by + PACKET_SIZE, tile.y1);
+
+		for (int bx = tile.x0; bx < tile.x1; bx += PACKET_SIZE) {
+			int bx1 = std::min(bx + PACKET_SIZE, tile.x1);
+
+			if (frame.cancel && frame.cancel->load(std::memory_order_relaxed))
+				return;
+
+			// a block of at most PACKET_SIZE x PACKET_SIZE pixels fills one packet
+			for (int s = 0; s < samples; ++s) {
+				packet.clear();
+
+				for (int y = by; y < by1; ++y) {
+					int j = frame.height - 1 - y;
+					for (int i = bx; i < bx1; ++i) {
+						auto u = (i + random_double()) / (frame.width - 1);
+						auto v = (j + random_double()) / (frame.height - 1);
+						packet.add(frame.cam.get_ray(u, v));
+					}
+				}
+
+				if (frame.packets) {
+					packet.finalize();
+					packet_color(packet, primary, world, packet_colors, context, measure ? packet_rays : nullptr);
+				}
+				else {
+					for (int k = 0; k < packet.count; k++) {
+						unsigned long long before = traced_rays;
+						packet_colors[k] = camera_ray_color(packet.rays[k], primary, world, context);
+						packet_rays[k] = (unsigned int)(traced_rays - before);
+					}
+				}
+
+				int k = 0;
+				for (int y = by; y < by1; ++y) {
+					for (int i = bx; i < bx1; ++i, ++k) {
+						// replace NaN components
+						packet_colors[k].replaceNaN();
+						frame.pixels[(size_t)y * frame.width + i] += packet_colors[k];
+						if (measure)
+							frame.cost[(size_t)y * frame.width + i] += packet_rays[k];
+					}
+				}
+			}
+		}
+	}
+}
+
+/// <summary>
+/// Renders a tile at a lower resolution for a fast preview: one sample per
+/// block of scale x scale pixels, written to all pixels of the block.
+/// The pixels hold a single sample afterwards (not added to the sums).
+/// </summary>
+/// <param name="frame">The frame.</param>
+/// <param name="tile">The tile.</param>
+/// <param name="scale">The edge length of the blocks in pixels.</param>
+/// <param name="stage">The preview stage (selects the random numbers).</param>
+void renderPreviewTile(Frame& frame, const Tile& tile, int scale, int stage) {
+	const Geometry& world = frame.worldOn(currentNumaNode());
+
+	// the preview is not guided
+	PathContext context;
+	context.environment = frame.environment.get();
+	context.sky = frame.sky;
+
+	// negative passes, so the random numbers of the passes stay the same
+	seed_random(tileSeed(frame.seed, frame.number, -1 - stage, tile.index));
+
+	for (int by = tile.y0 / scale * scale; by < tile.y1; by += scale) {
+		int y0 = std::max(by, tile.y0), y1 = std::min(by + scale, tile.y1);
+
+		for (int bx = tile.x0 / scale * scale; bx < tile.x1; bx += scale) {
+			int x0 = std::max(bx, tile.x0), x1 = std::min(bx + scale, tile.x1);
+
+			if (frame.cancel && frame.cancel->load(std::memory_order_relaxed))
+				return;
+
+			// a random position in the block
+			auto u = (bx + random_double() * scale) / (frame.width - 1);
+			auto v = (frame.height - 1 - by - scale + 1 + random_double() * scale) / (frame.height - 1);
+
+			color c = ray_color(frame.cam.get_ray(u, v), world, 0, context);
+			c.replaceNaN();
+
+			for (int y = y0; y < y1; y++)
+				frame.pixels.clear((size_t)y * frame.width + x0, (size_t)y * frame.width + x1, c);
+		}
+	}
+}
+
+#endif // !RENDERER_H
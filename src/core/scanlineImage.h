@@ -0,0 +1,122 @@
+#ifndef SCANLINEIMAGE_H
+#define SCANLINEIMAGE_H
+
+#include "common.h"
+#include "encoder.h"
+#include "renderer.h"
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/algorithm/string/predicate.hpp>
+
+/// <summary>
+/// Image file written row by row, for images too large to be held in
+/// memory. Only the rows passed to writeRows are converted, so the memory
+/// is one row of the output format.
+///
+/// Supported are binary PPM (P6, 8 bit tone mapped, rows from the top,
+/// appended in order) and PFM (32 bit float linear radiance, rows from the
+/// bottom, each row is written at its offset). PNG and JPEG cannot be
+/// streamed by stb.
+/// </summary>
+class ScanlineImage {
+	public:
+		/// <summary>
+		/// Creates the file and writes its header.
+		/// </summary>
+		/// <param name="path">The path, .ppm or .pfm.</param>
+		/// <param name="width">The image width.</param>
+		/// <param name="height">The image height.</param>
+		/// <param name="tm">The tone mapping of the 8 bit formats.</param>
+		/// <returns>The image, null if the format is not supported or the file cannot be created</returns>
+		static std::unique_ptr<ScanlineImage> create(const std::string& path, int width, int height, const ToneMapping& tm) {
+			bool pfm = boost::algorithm::ends_with(path, ".pfm");
+			if (!pfm && !boost::algorithm::ends_with(path, ".ppm")) {
+				std::cerr << "scanline output needs a .ppm or .pfm file: " << path << "\n";
+				return nullptr;
+			}
+
+			std::unique_ptr<ScanlineImage> image(new ScanlineImage(width, height, pfm, tm));
+			image->file.open(path, std::ios::binary | std::ios::trunc);
+			if (pfm)
+				image->file << "PF\n" << width << " " << height << "\n-1.0\n";
+			else
+				image->file << "P6\n" << width << " " << height << "\n255\n";
+			image->header = image->file.tellp();
+
+			if (!image->file) {
+				std::cerr << "cannot create " << path << "\n";
+				return nullptr;
+			}
+			return image;
+		}
+
+		/// <summary>
+		/// Writes the rows [y0, y1) of the sample sums, every row has to be
+		/// written once and the PPM rows in order.
+		/// </summary>
+		/// <param name="pixels">The sample sums holding the rows.</param>
+		/// <param name="samples">The samples per pixel of the sums.</param>
+		/// <returns>false if the file cannot be written</returns>
+		bool writeRows(const PixelBuffer& pixels, int y0, int y1, int samples) {
+			for (int y = y0; y < y1; y++) {
+				size_t row = (size_t)y * width;
+
+				if (pfm) {
+					for (int i = 0; i < width; i++) {
+						color c = pixels[row + i] / std::max(samples, 1);
+						for (int k = 0; k < 3; k++)
+							linear[3 * i + k] = (float)c[k];
+					}
+
+					// PFM rows run from the bottom
+					file.seekp(header + (std::streamoff)(height - 1 - y) * width * 3 * sizeof(float));
+					file.write(reinterpret_cast<const char*>(linear.data()), linear.size() * sizeof(float));
+				}
+				else {
+					double scale = tm.exposure / std::max(samples, 1);
+					for (int i = 0; i < width; i++)
+						tonemapPixel(pixels[row + i] * scale, tm, &rgb[3 * i]);
+
+					file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+				}
+			}
+			return (bool)file;
+		}
+
+		/// <summary>
+		/// Flushes the file.
+		/// </summary>
+		/// <returns>false if the file cannot be written</returns>
+		bool close() {
+			file.close();
+			return !file.fail();
+		}
+
+	private:
+		ScanlineImage(int width, int height, bool pfm, const ToneMapping& tm)
+			: width(width), height(height), pfm(pfm), tm(tm) {
+			if (pfm)
+				linear.resize((size_t)width * 3);
+			else
+				rgb.resize((size_t)width * 3);
+		}
+
+	private:
+		int width;
+		int height;
+		bool pfm;
+		ToneMapping tm;
+
+		std::ofstream file;
+		std::streamoff header = 0;			// size of the header
+		std::vector<unsigned char> rgb;		// one row of the PPM
+		std::vector<float> linear;			// one row of the PFM
+};
+
+#endif // !SCANLINEIMAGE_H
@@ -1,5 +1,18 @@
+#ifndef SCENE_H
+#define SCENE_H
+
 #include "geometry.h"
 #include "material.h"
+#include "renderOptions.h"
+#include "sphereField.h"
+#include "streamedField.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 
 #define SPHERES_AMOUNT 10
@@ -58,6 +71,76 @@ GeometryList random_scene() {
 	return world;
 }
 
+/// <summary>
+/// Glass heavy variant of random_scene lit by a small spherical light: the
+/// caustics of the glass spheres on the ground (best seen with --sky 0).
+/// </summary>
+GeometryList glass_scene() {
+	GeometryList world;
+
+	auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+	world.add(make_shared<Sphere>(1000, point3(0, -1000, 0), ground_material));
+
+	auto glass = make_shared<dielectric>(1.5);
+	for (int a = -6; a < 6; a++) {
+		for (int b = -6; b < 6; b++) {
+			auto choose_mat = random_double();
+			point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+			if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+				if (choose_mat < 0.7)
+					world.add(make_shared<Sphere>(0.2, center, glass));
+				else
+					world.add(make_shared<Sphere>(0.2, center, make_shared<lambertian>(color::random() * color::random())));
+			}
+		}
+	}
+
+	world.add(make_shared<Sphere>(1.0, point3(0, 1, 0), glass));
+	world.add(make_shared<Sphere>(1.0, point3(-4, 1, 0), glass));
+	world.add(make_shared<Sphere>(1.0, point3(4, 1, 0), make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+	// small and bright, above and behind the big glass spheres
+	world.add(make_shared<Sphere>(0.25, point3(-2, 5, -3), make_shared<diffuse_light>(color(400, 380, 340))));
+
+	return world;
+}
+
+/// <summary>
+/// Many small spherical lights floating over a few diffuse and metal
+/// spheres, lit only by them (render with --sky 0). The total power does not
+/// depend on the number of lights.
+/// </summary>
+/// <param name="count">The number of lights.</param>
+GeometryList lights_scene(long long count) {
+	GeometryList world;
+
+	world.add(make_shared<Sphere>(1000, point3(0, -1000, 0), make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+
+	for (int a = -3; a <= 3; a++) {
+		for (int b = -3; b <= 3; b++) {
+			point3 center(2 * a + 0.5 * random_double(), 0.5, 2 * b + 0.5 * random_double());
+			if (random_double() < 0.8)
+				world.add(make_shared<Sphere>(0.5, center, make_shared<lambertian>(color::random() * color::random())));
+			else
+				world.add(make_shared<Sphere>(0.5, center, make_shared<metal>(color::random(0.5, 1), random_double(0, 0.3))));
+		}
+	}
+
+	// a few warm and cool tints shared by the lights
+	std::vector<shared_ptr<material>> tints;
+	double radiance = 4e4 / count;
+	for (int i = 0; i < 8; i++)
+		tints.push_back(make_shared<diffuse_light>(color::random(0.3, 1) * radiance));
+
+	for (long long i = 0; i < count; i++) {
+		point3 center(random_double(-8, 8), random_double(1.2, 4), random_double(-8, 8));
+		world.add(make_shared<Sphere>(0.05, center, tints[(size_t)(random_double() * tints.size()) % tints.size()]));
+	}
+
+	return world;
+}
+
 GeometryList random_scene2() {
 	/* Geometry*/
 	GeometryList world;
@@ -83,4 +166,96 @@ GeometryList random_scene2() {
 	return world;
 }
 
+/// <summary>
+/// Applies look-dev edits to the materials of the world. An edit
+/// "<selector>.<parameter>=<value>" sets the parameter of the materials the
+/// selector names: a type (lambertian, metal, dielectric, diffuse_light)
+/// names all materials of the type, #n the n-th material of the world.
+/// Invalid edits are reported and skipped.
+/// </summary>
+/// <param name="world">The world.</param>
+/// <param name="edits">The edits, applied in order.</param>
+/// <returns>The number of material parameters changed</returns>
+int applyMaterialEdits(const Geometry& world, const std::vector<std::string>& edits) {
+	if (edits.empty())
+		return 0;
+
+	// the materials in the order of the world, once each
+	std::vector<shared_ptr<material>> all, materials;
+	world.materials(all);
+	for (const auto& m : all) {
+		if (std::find(materials.begin(), materials.end(), m) == materials.end())
+			materials.push_back(m);
+	}
+
+	int changed = 0;
+	for (const auto& edit : edits) {
+		size_t dot = edit.find('.'), equals = edit.find('=');
+		double value;
+		if (dot == std::string::npos || equals == std::string::npos || equals < dot ||
+			!(std::istringstream(edit.substr(equals + 1)) >> value)) {
+			std::cerr << "invalid material edit '" << edit << "', expected <type or #index>.<parameter>=<value>\n";
+			continue;
+		}
+
+		std::string selector = edit.substr(0, dot), parameter = edit.substr(dot + 1, equals - dot - 1);
+		int selected = 0, edited = 0;
+		for (size_t i = 0; i < materials.size(); i++) {
+			if (selector[0] == '#' ? selector != "#" + std::to_string(i) : selector != materials[i]->name())
+				continue;
+			selected++;
+			if (double* p = materials[i]->parameter(parameter)) {
+				*p = value;
+				edited++;
+			}
+		}
+
+		if (selected == 0)
+			std::cerr << "material edit '" << edit << "': no material " << selector << "\n";
+		else if (edited == 0)
+			std::cerr << "material edit '" << edit << "': " << selector << " has no parameter " << parameter << "\n";
+		changed += edited;
+	}
+	return changed;
+}
+
+/// <summary>
+/// Builds the scene named by the options, the random numbers of the calling
+/// thread have to be seeded before.
+/// </summary>
+/// <param name="options">The options: scene name (random, random2, glass, lights or a sphere field
+/// distribution: uniform, clustered, uneven), sphere count, seed and the chunk file of
+/// a streamed field, the material edits applied to the scene.</param>
+/// <param name="pool">The threads generating the sphere fields.</param>
+/// <param name="world">The scene.</param>
+/// <returns>False if there is no scene with the name</returns>
+bool buildScene(const RenderOption& options, ThreadPool& pool, GeometryList& world) {
+	const std::string& name = options.scene;
+
+	if (name == "random")
+		world = random_scene();
+	else if (name == "random2")
+		world = random_scene2();
+	else if (name == "glass")
+		world = glass_scene();
+	else if (name == "lights")
+		world = lights_scene(options.scene_count);
+	else if (!options.stream.empty()) {
+		auto field = streamSphereField(name, options.scene_count, options.seed, pool, options.stream,
+									   (size_t)(options.stream_budget * 1024 * 1024));
+		if (!field)
+			return false;
+		world = GeometryList(field);
+	}
+	else {
+		auto field = generateSphereField(name, options.scene_count, options.seed, pool, BVHCache(options.bvh_cache));
+		if (!field)
+			return false;
+		world = GeometryList(field);
+	}
+
+	applyMaterialEdits(world, options.material_edits);
+	return true;
+}
 
+#endif // !SCENE_H
@@ -0,0 +1,258 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "common.h"
+#include "bvh.h"
+#include "camera.h"
+#include "geometry.h"
+#include "transform.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Keyframed animation of the camera and of scene objects.
+///
+/// The sequence is read from a text file with one keyframe per line,
+/// values between two keyframes are interpolated linearly:
+///
+///		# camera frame  lookfrom(x y z) lookat(x y z) vup(x y z) vfov aperture focus_dist
+///		camera 0        13 2 3  0 0 0  0 1 0  20 0.1 10
+///		# object frame index  translate(x y z) rotate(x y z, degrees) scale (> 0)
+///		object 0  -1  0 0 0  0 0 0  1
+///
+/// The object index refers to the objects of the scene, negative indices
+/// count from the end (-1 is the last object).
+/// </summary>
+class Sequence {
+	public:
+		struct objectKey {
+			vec3 translate;
+			vec3 rotate;
+			double scale = 1;
+		};
+
+		/// <summary>
+		/// Loads the sequence file.
+		/// </summary>
+		/// <param name="path">The path of the sequence file.</param>
+		/// <param name="error">The error message if loading failed.</param>
+		/// <returns>True if the file was read</returns>
+		bool load(const std::string& path, std::string& error) {
+			std::ifstream file(path);
+			if (!file) {
+				error = "cannot open sequence " + path;
+				return false;
+			}
+
+			std::string line;
+			int line_number = 0;
+			while (std::getline(file, line)) {
+				line_number++;
+
+				// strip comments
+				auto comment = line.find('#');
+				if (comment != std::string::npos)
+					line.erase(comment);
+
+				std::istringstream in(line);
+				std::string type;
+				if (!(in >> type))
+					continue;
+
+				double frame;
+				if (type == "camera") {
+					CameraSettings c;
+					if (in >> frame >> c.lookfrom >> c.lookat >> c.vup >> c.vfov >> c.aperture >> c.focus_dist) {
+						cameras[frame] = c;
+						continue;
+					}
+				}
+				else if (type == "object") {
+					int index;
+					objectKey k;
+					if (in >> frame >> index >> k.translate >> k.rotate >> k.scale) {
+						// the inverse transformation divides by the scale
+						if (!(k.scale > 0)) {
+							error = path + ":" + std::to_string(line_number) + ": the scale of object " + std::to_string(index) + " must be positive";
+							return false;
+						}
+						objects[index][frame] = k;
+						continue;
+					}
+				}
+
+				error = path + ":" + std::to_string(line_number) + ": cannot parse '" + line + "'";
+				return false;
+			}
+
+			return true;
+		}
+
+		/// <summary>
+		/// First and last keyframe of the sequence.
+		/// </summary>
+		void range(int& first, int& last) const {
+			double lo = infinity, hi = -infinity;
+			for (const auto& key : cameras) {
+				lo = fmin(lo, key.first);
+				hi = fmax(hi, key.first);
+			}
+			for (const auto& object : objects) {
+				for (const auto& key : object.second) {
+					lo = fmin(lo, key.first);
+					hi = fmax(hi, key.first);
+				}
+			}
+			first = lo > hi ? 0 : (int)floor(lo);
+			last = lo > hi ? 0 : (int)ceil(hi);
+		}
+
+		/// <summary>
+		/// Camera settings at the frame, fallback is used without camera keyframes.
+		/// </summary>
+		CameraSettings camera(double frame, const CameraSettings& fallback) const {
+			if (cameras.empty()) return fallback;
+			return interpolate(cameras, frame);
+		}
+
+		/// <summary>
+		/// Indices of the animated objects (as given in the file).
+		/// </summary>
+		std::vector<int> animatedObjects() const {
+			std::vector<int> indices;
+			for (const auto& object : objects)
+				indices.push_back(object.first);
+			return indices;
+		}
+
+		/// <summary>
+		/// Transformation of the animated object at the frame.
+		/// </summary>
+		Transform transform(int index, double frame) const {
+			auto it = objects.find(index);
+			if (it == objects.end()) return Transform();
+
+			objectKey k = interpolate(it->second, frame);
+			return Transform::compose(k.translate, k.rotate, k.scale);
+		}
+
+	private:
+		static CameraSettings blend(const CameraSettings& a, const CameraSettings& b, double t) {
+			return lerp(a, b, t);
+		}
+
+		static objectKey blend(const objectKey& a, const objectKey& b, double t) {
+			objectKey k;
+			k.translate = lerp(a.translate, b.translate, t);
+			k.rotate = lerp(a.rotate, b.rotate, t);
+			k.scale = (1 - t) * a.scale + t * b.scale;
+			return k;
+		}
+
+		/// <summary>
+		/// Linear interpolation between the keyframes around the frame,
+		/// the first and last keyframe are held outside of the keyed range.
+		/// </summary>
+		template<typename T>
+		static T interpolate(const std::map<double, T>& keys, double frame) {
+			auto next = keys.lower_bound(frame);
+			if (next == keys.begin()) return next->second;
+			if (next == keys.end()) return keys.rbegin()->second;
+
+			auto prev = std::prev(next);
+			double t = (frame - prev->first) / (next->first - prev->first);
+			return blend(prev->second, next->second, t);
+		}
+
+	private:
+		std::map<double, CameraSettings> cameras;
+		std::map<int, std::map<double, objectKey>> objects;
+};
+
+/// <summary>
+/// Scene of an animation sequence.
+///
+/// The static objects are stored in a hierarchy which is built once and
+/// shared by all frames, only the animated objects are placed anew per frame.
+/// </summary>
+class SequenceScene {
+	public:
+		SequenceScene(const GeometryList& scene, const Sequence& seq, const BVHCache& cache = BVHCache()) : sequence(seq) {
+			const auto& objects = scene.getObjects();
+			int n = (int)objects.size();
+
+			std::vector<bool> animated(n, false);
+			for (int index : sequence.animatedObjects()) {
+				int i = index < 0 ? n + index : index;
+				if (i < 0 || i >= n) {
+					std::cerr << "sequence: object " << index << " does not exist, ignored\n";
+					continue;
+				}
+				animated[i] = true;
+				dynamic.push_back(std::make_pair(index, objects[i]));
+			}
+
+			std::vector<shared_ptr<Geometry>> fixed;
+			for (int i = 0; i < n; i++) {
+				if (!animated[i])
+					fixed.push_back(objects[i]);
+			}
+
+			staticWorld = make_shared<BVHAccel>(fixed, 0, 0, cache);
+		}
+
+		/// <summary>
+		/// World of a frame: the static hierarchy and the placed animated objects.
+		/// </summary>
+		shared_ptr<Geometry> world(double frame) const {
+			if (dynamic.empty()) return staticWorld;
+
+			auto list = make_shared<GeometryList>(staticWorld);
+			for (const auto& object : dynamic)
+				list->add(make_shared<Instance>(object.second, sequence.transform(object.first, frame)));
+			return list;
+		}
+
+	private:
+		const Sequence& sequence;
+		shared_ptr<Geometry> staticWorld;
+		std::vector<std::pair<int, shared_ptr<Geometry>>> dynamic;
+};
+
+/// <summary>
+/// Output path of a frame. A run of '#' in the path is replaced by the zero
+/// padded frame number, otherwise the number is inserted before the extension.
+/// </summary>
+/// <param name="path">The output path, e.g. "img_####.png".</param>
+/// <param name="frame">The frame number.</param>
+std::string framePath(const std::string& path, int frame) {
+	auto first = path.find('#');
+	if (first != std::string::npos) {
+		auto last = path.find_first_not_of('#', first);
+		size_t width = (last == std::string::npos ? path.size() : last) - first;
+
+		std::string number = std::to_string(frame);
+		if (number.size() < width)
+			number.insert(0, width - number.size(), '0');
+
+		return path.substr(0, first) + number + (last == std::string::npos ? "" : path.substr(last));
+	}
+
+	std::string number = std::to_string(frame);
+	if (number.size() < 4)
+		number.insert(0, 4 - number.size(), '0');
+
+	auto dot = path.find_last_of('.');
+	auto slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return path + "_" + number;
+	return path.substr(0, dot) + "_" + number + path.substr(dot);
+}
+
+#endif // !SEQUENCE_H
@@ -0,0 +1,345 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "common.h"
+#include "bvh.h"
+#include "encoder.h"
+#include "lookdev.h"
+#include "pipeline.h"
+#include "renderOptions.h"
+#include "scene.h"
+#include "threadPool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+// number of built scenes kept by the render server
+#define SCENE_CACHE_SIZE 4
+
+/// <summary>
+/// Built scenes (with their acceleration structure) of a render server,
+/// the least recently used scene is dropped once capacity scenes are cached.
+///
+/// Scenes are keyed by the hash of their description, so jobs only
+/// differing in the camera or in the render options share the scene.
+/// </summary>
+class SceneCache {
+	public:
+		explicit SceneCache(int capacity = SCENE_CACHE_SIZE) : capacity(std::max(capacity, 1)) {}
+
+		/// <summary>
+		/// Hash of the scene description, equal descriptions build equal scenes.
+		/// </summary>
+		static unsigned long long key(const RenderOption& options) {
+			std::string description = options.scene + '\n' + std::to_string(options.seed) + '\n' + std::to_string(options.scene_count) + '\n' + options.stream;
+			for (const auto& edit : options.material_edits)
+				description += '\n' + edit;
+			return fnv1a(FNV1A_BASIS, description.data(), description.size());
+		}
+
+		/// <summary>
+		/// Returns the scene of the options, builds it if it is not cached.
+		/// </summary>
+		/// <param name="options">The render options naming the scene.</param>
+		/// <param name="hit">Set if the scene was cached.</param>
+		/// <returns>The scene, null if there is no scene with the name</returns>
+		shared_ptr<Geometry> get(const RenderOption& options, ThreadPool& pool, bool& hit) {
+			auto k = key(options);
+
+			for (auto it = entries.begin(); it != entries.end(); ++it) {
+				if (it->first == k) {
+					entries.splice(entries.begin(), entries, it);
+					hit = true;
+					return entries.front().second;
+				}
+			}
+
+			hit = false;
+
+			// scenes are generated from the random numbers of the calling thread
+			seed_random(options.seed);
+
+			GeometryList scene;
+			if (!buildScene(options, pool, scene))
+				return nullptr;
+
+			auto world = make_shared<BVHAccel>(scene.getObjects(), 0, 0, BVHCache(options.bvh_cache));
+			entries.push_front(std::make_pair(k, shared_ptr<Geometry>(world)));
+			if ((int)entries.size() > capacity)
+				entries.pop_back();
+
+			return entries.front().second;
+		}
+
+	private:
+		int capacity;
+		std::list<std::pair<unsigned long long, shared_ptr<Geometry>>> entries;	// most recently used first
+};
+
+/// <summary>
+/// Long running render process taking jobs from a stream (stdin), which
+/// keeps the threads, the encoder and the built scenes between jobs.
+///
+/// Requests, one per line:
+///
+///		render <id> [--priority N] [render options, e.g. --out a.png --samples 16 --lookfrom "1 2 3"]
+///		cancel <id>
+///		quit
+///
+/// Jobs with a higher priority are rendered first, equal priorities in the
+/// order they arrived. A cancelled job is removed from the queue or stopped
+/// after the current packet blocks of its tiles.
+///
+/// Replies, one per line: accepted, pass (a progressive snapshot was
+/// written), done (with the render time in milliseconds), cancelled and error,
+/// each followed by the job id.
+/// </summary>
+class RenderServer {
+	public:
+		/// <summary>
+		/// Initializes a new instance of the <see cref="RenderServer"/> class.
+		/// </summary>
+		/// <param name="defaults">The render options jobs start from.</param>
+		/// <param name="pool">The render threads.</param>
+		/// <param name="encoder">The image encoder.</param>
+		RenderServer(const RenderOption& defaults, ThreadPool& pool, ImageEncoder& encoder)
+			: defaults(defaults), pool(pool), encoder(encoder), closed(false) {
+			this->defaults.progress = false;
+		}
+
+		/// <summary>
+		/// Serves the requests of the stream until it ends or quit is received.
+		/// </summary>
+		void run(std::istream& in, std::ostream& out) {
+			output = &out;
+
+			std::thread reader(&RenderServer::read, this, std::ref(in));
+
+			while (true) {
+				shared_ptr<Job> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					queued.wait(lock, [this]() { return closed || !jobs.empty(); });
+
+					if (jobs.empty())
+						break;
+
+					// highest priority, then first come
+					auto best = jobs.begin();
+					for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+						if ((*it)->priority > (*best)->priority)
+							best = it;
+					}
+					job = *best;
+					jobs.erase(best);
+					running = job;
+				}
+
+				render(*job);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				running.reset();
+			}
+
+			reader.join();
+			encoder.finish();
+		}
+
+	private:
+		struct Job {
+			std::string id;
+			int priority = 0;
+			RenderOption options;
+			std::atomic<bool> cancel{ false };
+		};
+
+		void reply(const std::string& message) {
+			std::lock_guard<std::mutex> lock(output_mutex);
+			*output << message << std::endl;
+		}
+
+		void read(std::istream& in) {
+			std::string line;
+			while (std::getline(in, line)) {
+				std::istringstream words(line);
+				std::string command, id;
+				if (!(words >> command))
+					continue;
+
+				if (command == "quit") {
+					std::lock_guard<std::mutex> lock(mutex);
+					for (auto& job : jobs)
+						reply("cancelled " + job->id);
+					jobs.clear();
+					if (running)
+						running->cancel = true;
+					break;
+				}
+
+				if (!(words >> id)) {
+					reply("error - missing job id in '" + line + "'");
+					continue;
+				}
+
+				if (command == "render") {
+					std::string rest;
+					std::getline(words, rest);
+					submit(id, rest);
+				}
+				else if (command == "cancel") {
+					cancel(id);
+				}
+				else {
+					reply("error " + id + " unknown request '" + command + "'");
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+			queued.notify_all();
+		}
+
+		void submit(const std::string& id, const std::string& arguments) {
+			namespace po = boost::program_options;
+
+			auto job = make_shared<Job>();
+			job->id = id;
+			job->options = defaults;
+
+			try {
+				auto desc = renderOptionsDescription();
+				desc.add_options()
+					("priority", po::value<int>(), "priority of the job, higher first");
+
+				po::variables_map vm;
+				po::store(po::command_line_parser(po::split_unix(arguments)).options(desc).run(), vm);
+				po::notify(vm);
+
+				applyRenderOptions(vm, job->options);
+				if (vm.count("priority"))
+					job->priority = vm["priority"].as<int>();
+			}
+			catch (std::exception& e) {
+				reply("error " + id + " " + e.what());
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(job);
+			reply("accepted " + id);
+			queued.notify_one();
+		}
+
+		void cancel(const std::string& id) {
+			std::lock_guard<std::mutex> lock(mutex);
+
+			for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+				if ((*it)->id == id) {
+					jobs.erase(it);
+					reply("cancelled " + id);
+					return;
+				}
+			}
+
+			if (running && running->id == id)
+				running->cancel = true;
+			else
+				reply("error " + id + " no such job");
+		}
+
+		void render(Job& job) {
+			auto start = std::chrono::steady_clock::now();
+
+			if (job.options.image_width <= 0 || job.options.image_height <= 0) {
+				reply("error " + job.id + " empty image " + std::to_string(job.options.image_width) + "x" + std::to_string(job.options.image_height));
+				return;
+			}
+
+			bool cached;
+			auto world = scenes.get(job.options, pool, cached);
+			if (!world) {
+				reply("error " + job.id + " unknown scene '" + job.options.scene + "'");
+				return;
+			}
+
+			// consecutive jobs usually share the environment, the last map is kept
+			const RenderOption& o = job.options;
+			std::string env_key = o.env + '\n' + std::to_string(o.env_intensity) + '\n' + std::to_string(o.env_rotation);
+			if (o.env.empty())
+				environment.reset();
+			else if (!environment || env_key != environment_key) {
+				environment = EnvironmentMap::load(o.env, o.env_intensity, o.env_rotation, pool);
+				if (!environment) {
+					reply("error " + job.id + " cannot load environment '" + o.env + "'");
+					return;
+				}
+			}
+			environment_key = env_key;
+
+			Frame frame;
+			initFrame(frame, job.options, job.options.camera, world, environment);
+			frame.cancel = &job.cancel;
+
+			std::string id = job.id, path = job.options.outputPath;
+
+			// the outcome (done, error or cancelled) is replied once, by whoever decides it first
+			auto finished = make_shared<std::atomic<bool>>(false);
+
+			// the encoder reports the snapshots, the last one finishes the job
+			auto written = [this, id, path, start, finished](int pass, int passes, bool ok) {
+				if (!ok) {
+					if (!finished->exchange(true))
+						reply("error " + id + " cannot write " + path);
+					return;
+				}
+				if (pass + 1 < passes) {
+					reply("pass " + id + " " + std::to_string(pass + 1) + "/" + std::to_string(passes) + " " + path);
+					return;
+				}
+				auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+				if (!finished->exchange(true))
+					reply("done " + id + " " + path + " " + std::to_string(ms));
+			};
+
+			bool completed = job.options.gbuffer.empty() ? renderPasses(pool, encoder, frame, job.options, path, written)
+														 : renderGBuffer(pool, encoder, frame, job.options, path, written);
+
+			if (!completed) {
+				// a cancel after the last pass was handed to the encoder still writes the image, the job is done then
+				encoder.finish();
+				if (!finished->exchange(true))
+					reply("cancelled " + id);
+			}
+		}
+
+	private:
+		RenderOption defaults;
+		ThreadPool& pool;
+		ImageEncoder& encoder;
+		SceneCache scenes;
+
+		shared_ptr<const EnvironmentMap> environment;	// of the last job
+		std::string environment_key;
+
+		std::vector<shared_ptr<Job>> jobs;	// queued jobs in arrival order
+		shared_ptr<Job> running;
+		bool closed;
+
+		std::mutex mutex;
+		std::condition_variable queued;
+
+		std::ostream* output = nullptr;
+		std::mutex output_mutex;
+};
+
+#endif // !SERVER_H
@@ -0,0 +1,353 @@
+#ifndef SPHEREFIELD_H
+#define SPHEREFIELD_H
+
+#include "common.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "material.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// number of spheres generated by one task
+#define SPHERE_FIELD_CHUNK 65536
+// largest number of spheres (the hierarchy uses int indices)
+#define SPHERE_FIELD_MAX_COUNT (1 << 30)
+// spheres per cluster of the clustered distribution
+#define SPHERE_FIELD_CLUSTER_SIZE 1000
+
+/// <summary>
+/// Large set of spheres stored by value in one array, with its own hierarchy.
+///
+/// Spheres only hold an index into a small material palette, so millions of
+/// spheres need neither one allocation nor one shared_ptr each.
+/// </summary>
+/// <seealso cref="Geometry" />
+class SphereField : public Geometry {
+	public:
+		struct sphere {
+			point3 center;
+			double radius;
+			int material;
+		};
+
+		SphereField(const std::vector<shared_ptr<material>>& palette) : palette(palette) {}
+
+		/// <summary>
+		/// The sphere storage, written by the generator before build is called.
+		/// </summary>
+		std::vector<sphere>& getSpheres() {
+			return spheres;
+		}
+
+		/// <summary>
+		/// Builds the hierarchy and reorders the spheres into the order of its leaves.
+		/// </summary>
+		/// <param name="cache">The on-disk cache the hierarchy is loaded from or stored to.</param>
+		void build(const BVHCache& cache = BVHCache());
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const override;
+
+		virtual bool interaction(const ray& r, const surfaceHit& hit, hitRecord& rec) const override {
+			const sphere& s = spheres[hit.primitive];
+			rec.t = hit.t;
+			rec.p = r.point_at_parameter(hit.t);
+			rec.set_face_normal(r, (rec.p - s.center) / s.radius);
+			rec.mat_ptr = palette[s.material];
+			return true;
+		}
+
+		virtual bool may_hit(const RayPacket& packet, double t_min) const override {
+			return bvh.bounds().may_hit(packet, t_min, infinity);
+		}
+
+		virtual bool hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const override;
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+			if (bvh.empty()) return false;
+			output_box = bvh.bounds();
+			return true;
+		}
+
+		virtual void materials(std::vector<shared_ptr<material>>& list) const override {
+			list.insert(list.end(), palette.begin(), palette.end());
+		}
+
+		/// <summary>
+		/// Bytes used by the spheres and the hierarchy.
+		/// </summary>
+		size_t memory() const {
+			return spheres.capacity() * sizeof(sphere) +
+				   (size_t)bvh.nodeCount() * sizeof(bvhNode) + (size_t)bvh.indexCount() * sizeof(int);
+		}
+
+		size_t size() const {
+			return spheres.size();
+		}
+
+		void print(std::ostream& os) const {
+			os << "SphereField {\tspheres:" << spheres.size() << "\tnodes:" << bvh.nodeCount() << "\t}";
+		}
+
+	private:
+		std::vector<sphere> spheres;
+		std::vector<shared_ptr<material>> palette;
+		BVH bvh;
+};
+
+void SphereField::build(const BVHCache& cache) {
+	std::vector<aabb> boxes(spheres.size());
+	for (size_t i = 0; i < spheres.size(); i++) {
+		const sphere& s = spheres[i];
+		boxes[i] = aabb(s.center - vec3(s.radius), s.center + vec3(s.radius));
+	}
+
+	uint64_t key = 0;
+	bool cached = false;
+	if (cache.enabled()) {
+		key = BVHCache::key(boxes);
+		cached = cache.load(key, (int)boxes.size(), bvh);
+	}
+
+	if (!cached) {
+		bvh.build(boxes);
+		cache.store(key, bvh);
+	}
+
+	std::vector<aabb>().swap(boxes);
+
+	std::vector<sphere> ordered(spheres.size());
+	for (int i = 0; i < bvh.indexCount(); i++)
+		ordered[i] = spheres[bvh.getIndices()[i]];
+	spheres.swap(ordered);
+}
+
+bool SphereField::intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const {
+	int closest = -1;
+
+	if (!bvh.traverse(r, t_min, t_max,
+		[&](int i, double& t) {
+			if (!hit_sphere(spheres[i].center, spheres[i].radius, r, t_min, t, t)) return false;
+			closest = i;
+			return true;
+		}))
+		return false;
+
+	hit.t = t_max;
+	hit.geometry = this;
+	hit.primitive = closest;
+	return true;
+}
+
+bool SphereField::hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const {
+	if (!packet.coherent)
+		return Geometry::hit_packet(packet, t_min, rec);
+
+	int closest[PACKET_MAX_RAYS];
+	for (int k = 0; k < packet.count; k++)
+		closest[k] = -1;
+
+	bool hit_anything = bvh.traverse_packet(packet, t_min, rec,
+		[&](int i) {
+			const sphere& s = spheres[i];
+			if (!may_hit_sphere(s.center, s.radius, packet)) return false;
+
+			bool any = false;
+			for (int k = 0; k < packet.count; k++) {
+				if (hit_sphere(s.center, s.radius, packet.rays[k], t_min, rec.closest[k], rec.closest[k])) {
+					closest[k] = i;
+					any = true;
+				}
+			}
+			return any;
+		});
+
+	for (int k = 0; k < packet.count; k++) {
+		if (closest[k] >= 0) {
+			rec.hit[k] = true;
+			rec.surface[k].t = rec.closest[k];
+			rec.surface[k].geometry = this;
+			rec.surface[k].primitive = closest[k];
+		}
+	}
+
+	return hit_anything;
+}
+
+/// <summary>
+/// Random sphere fields of a given distribution.
+///
+/// The spheres lie in a slab (y in [-2, 2]) whose area grows with the count,
+/// so the density stays the same for all counts:
+///
+///		uniform		spheres uniformly distributed, radius 0.1 - 0.3
+///		clustered	gaussian clusters of SPHERE_FIELD_CLUSTER_SIZE spheres
+///		uneven		density and size falling off steeply from the center,
+///					radius 0.02 - 1
+///
+/// Every chunk of SPHERE_FIELD_CHUNK spheres has its own random numbers, so
+/// the field only depends on the seed and the chunks can be generated in
+/// any order, on any thread and more than once.
+/// </summary>
+class SphereFieldGenerator {
+	public:
+		/// <summary>
+		/// Sets up the palette and the clusters, the random numbers of the
+		/// calling thread are reseeded.
+		/// </summary>
+		/// <param name="distribution">The distribution: uniform, clustered or uneven.</param>
+		/// <param name="count">The number of spheres.</param>
+		/// <param name="seed">The random seed.</param>
+		/// <returns>False if the distribution is unknown</returns>
+		bool init(const std::string& distribution, long long count, unsigned int seed);
+
+		/// <summary>
+		/// Writes the spheres of the chunk to out.
+		/// </summary>
+		void generate(long long chunk, SphereField::sphere* out) const;
+
+		const std::vector<shared_ptr<material>>& getPalette() const {
+			return palette;
+		}
+
+		long long size() const {
+			return count;
+		}
+
+		long long chunks() const {
+			return (count + SPHERE_FIELD_CHUNK - 1) / SPHERE_FIELD_CHUNK;
+		}
+
+		/// <summary>
+		/// Number of spheres of the chunk.
+		/// </summary>
+		long long chunkSize(long long chunk) const {
+			return std::min(count, (chunk + 1) * SPHERE_FIELD_CHUNK) - chunk * SPHERE_FIELD_CHUNK;
+		}
+
+		/// <summary>
+		/// Box holding (almost) all sphere centers, clusters may reach a little further.
+		/// </summary>
+		aabb bounds() const {
+			return aabb(point3(-half_width, -2, -half_width), point3(half_width, 2, half_width));
+		}
+
+	private:
+		enum { uniform, clustered, uneven } kind;
+		long long count = 0;
+		unsigned int seed = 0;
+		double half_width = 0;
+		double cluster_sigma = 0;
+		std::vector<point3> clusters;
+		std::vector<shared_ptr<material>> palette;
+};
+
+bool SphereFieldGenerator::init(const std::string& distribution, long long count, unsigned int seed) {
+	if (distribution == "uniform") kind = uniform;
+	else if (distribution == "clustered") kind = clustered;
+	else if (distribution == "uneven") kind = uneven;
+	else return false;
+
+	this->count = std::min(std::max(count, 1LL), (long long)SPHERE_FIELD_MAX_COUNT);
+	this->seed = seed;
+
+	// material palette
+	seed_random(seed);
+	palette.clear();
+	for (int i = 0; i < 12; i++)
+		palette.push_back(make_shared<lambertian>(color::random() * color::random()));
+	for (int i = 0; i < 3; i++)
+		palette.push_back(make_shared<metal>(color::random(0.5, 1), random_double(0, 0.5)));
+	palette.push_back(make_shared<dielectric>(1.5));
+
+	// one sphere per 4 units of volume
+	half_width = 0.5 * sqrt((double)this->count);
+
+	clusters.clear();
+	if (kind == clustered) {
+		long long n = std::max(1LL, this->count / SPHERE_FIELD_CLUSTER_SIZE);
+		for (long long i = 0; i < n; i++)
+			clusters.push_back(point3(random_double(-half_width, half_width), 0, random_double(-half_width, half_width)));
+	}
+	cluster_sigma = kind == clustered ? 0.25 * 2 * half_width / sqrt((double)clusters.size()) : 0;
+
+	return true;
+}
+
+void SphereFieldGenerator::generate(long long chunk, SphereField::sphere* out) const {
+	// a negative pass of its own, the random numbers of the spheres are not those of any render pass
+	seed_random(tileSeed(seed, 0, -5, (int)chunk));
+
+	long long n = chunkSize(chunk);
+	for (long long i = 0; i < n; i++) {
+		SphereField::sphere& s = out[i];
+
+		if (kind == uniform) {
+			s.center = point3(random_double(-half_width, half_width), random_double(-2, 2), random_double(-half_width, half_width));
+			s.radius = random_double(0.1, 0.3);
+		}
+		else if (kind == clustered) {
+			const point3& c = clusters[std::min((size_t)(random_double() * clusters.size()), clusters.size() - 1)];
+
+			// Box-Muller
+			double r = cluster_sigma * sqrt(-2 * log(1 - random_double()));
+			double phi = 2 * pi * random_double();
+			s.center = c + vec3(r * cos(phi), random_double(-2, 2), r * sin(phi));
+			s.radius = random_double(0.1, 0.3);
+		}
+		else {
+			auto falloff = [&]() {
+				double u = random_double();
+				return (random_double() < 0.5 ? -1 : 1) * half_width * u * u * u * u;
+			};
+			s.center = point3(falloff(), random_double(-2, 2), falloff());
+			s.radius = 0.02 * pow(50.0, random_double());
+		}
+
+		s.material = std::min((int)(random_double() * palette.size()), (int)palette.size() - 1);
+	}
+}
+
+/// <summary>
+/// Generates a field of count spheres on the thread pool (see
+/// <see cref="SphereFieldGenerator"/>). The chunks write straight into the
+/// sphere storage of the field.
+/// </summary>
+/// <param name="distribution">The distribution: uniform, clustered or uneven.</param>
+/// <param name="count">The number of spheres.</param>
+/// <param name="seed">The random seed.</param>
+/// <param name="pool">The thread pool.</param>
+/// <param name="cache">The on-disk cache of the hierarchy.</param>
+/// <returns>The field, null if the distribution is unknown</returns>
+shared_ptr<SphereField> generateSphereField(const std::string& distribution, long long count, unsigned int seed,
+											ThreadPool& pool, const BVHCache& cache = BVHCache()) {
+	auto start = std::chrono::steady_clock::now();
+
+	SphereFieldGenerator generator;
+	if (!generator.init(distribution, count, seed))
+		return nullptr;
+
+	auto field = make_shared<SphereField>(generator.getPalette());
+	auto& spheres = field->getSpheres();
+	spheres.resize(generator.size());
+
+	for (long long chunk = 0; chunk < generator.chunks(); chunk++)
+		pool.submit([&, chunk]() { generator.generate(chunk, &spheres[chunk * SPHERE_FIELD_CHUNK]); });
+	pool.wait();
+
+	auto generated = std::chrono::steady_clock::now();
+	field->build(cache);
+	auto built = std::chrono::steady_clock::now();
+
+	std::cerr << distribution << " sphere field: " << generator.size() << " spheres generated in "
+			  << std::chrono::duration<double, std::milli>(generated - start).count() << " ms, hierarchy in "
+			  << std::chrono::duration<double, std::milli>(built - generated).count() << " ms, "
+			  << field->memory() / (1024.0 * 1024.0) << " MB\n";
+
+	return field;
+}
+
+#endif // !SPHEREFIELD_H
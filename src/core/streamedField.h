@@ -0,0 +1,659 @@
+#ifndef STREAMEDFIELD_H
+#define STREAMEDFIELD_H
+
+#include "common.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "sphereField.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// spheres per chunk of a streamed field
+#define STREAM_CHUNK_SPHERES 65536
+// alignment of the chunks in the file (a multiple of the page size and of
+// the allocation granularity of the mappings)
+#define STREAM_CHUNK_ALIGN 65536
+// version of the chunk files, increase when the layout changes
+#define STREAM_VERSION 2
+// entries read at once from each sorted run while merging
+#define STREAM_MERGE_BUFFER 4096
+
+/// <summary>
+/// Header of a chunk file, followed by the chunk table. All offsets are
+/// relative to the start of the file.
+/// </summary>
+struct streamHeader {
+	char magic[8];			// "PTSTRM"
+	uint32_t version;		// STREAM_VERSION
+	uint32_t byte_order;	// 0x01020304 in the byte order of the writer
+	uint32_t sphere_size;	// sizeof(SphereField::sphere)
+	uint32_t node_size;		// sizeof(bvhNode)
+	uint64_t key;			// hash of the generator parameters
+	uint64_t sphere_count;
+	uint64_t chunk_count;
+	uint64_t table_offset;
+	uint64_t size;			// size of the file
+};
+
+/// <summary>
+/// Entry of the chunk table. A chunk holds its spheres in the order of the
+/// leaves of its hierarchy, followed by the hierarchy nodes.
+/// </summary>
+struct streamChunk {
+	double lo[3], hi[3];	// bounds of the spheres
+	uint64_t offset;		// start of the spheres
+	uint64_t size;			// bytes mapped for the chunk
+	uint64_t node_offset;	// start of the nodes, relative to offset
+	uint32_t sphere_count;
+	uint32_t node_count;
+};
+
+/// <summary>
+/// Sphere field kept in a memory-mapped file of spatially clustered chunks,
+/// for fields larger than the memory of the machine.
+///
+/// Only the chunk bounds and a small hierarchy over them stay in memory. A
+/// chunk is mapped when a ray reaches its bounds and unmapped again when
+/// the mapped chunks exceed the residency budget (least recently used
+/// first). A chunk still traversed by another thread stays mapped until it
+/// is released, so the mapped memory stays below the budget plus one chunk
+/// per render thread.
+///
+/// The rays of a packet are sorted by the chunks they reach and every chunk
+/// is mapped once per packet.
+/// </summary>
+/// <seealso cref="Geometry" />
+class StreamedSphereField : public Geometry {
+	public:
+		/// <summary>
+		/// Initializes a new instance of the <see cref="StreamedSphereField"/> class.
+		/// </summary>
+		/// <param name="palette">The materials the sphere indices refer to.</param>
+		/// <param name="budget">The bytes of the chunks kept mapped.</param>
+		StreamedSphereField(const std::vector<shared_ptr<material>>& palette, size_t budget)
+			: palette(palette), budget(budget), use_clock(0), resident_bytes(0), peak_bytes(0), page_ins(0), evictions(0) {}
+
+		/// <summary>
+		/// Opens the chunk file, only the chunk table is read.
+		/// </summary>
+		/// <param name="path">The chunk file.</param>
+		/// <param name="key">The key the file was written with.</param>
+		/// <returns>False if the file is missing, invalid or written for another key</returns>
+		bool open(const std::string& path, uint64_t key);
+
+		/// <summary>
+		/// Writes the field of the generator into a chunk file with bounded memory.
+		///
+		/// The spheres are generated in runs that fit into the memory, each run
+		/// is sorted along a Morton curve and written to a temporary file. The
+		/// merged runs are cut into chunks of STREAM_CHUNK_SPHERES neighbouring
+		/// spheres and the hierarchy of each chunk is built on the pool.
+		/// </summary>
+		/// <param name="path">The chunk file.</param>
+		/// <param name="key">The key stored in the file.</param>
+		/// <param name="generator">The sphere generator.</param>
+		/// <param name="pool">The thread pool.</param>
+		/// <param name="memory">The bytes the sorting may use.</param>
+		/// <returns>False if the file could not be written</returns>
+		static bool write(const std::string& path, uint64_t key, const SphereFieldGenerator& generator,
+						  ThreadPool& pool, size_t memory);
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const override;
+
+		virtual bool interaction(const ray& r, const surfaceHit& hit, hitRecord& rec) const override;
+
+		virtual bool may_hit(const RayPacket& packet, double t_min) const override {
+			return top.bounds().may_hit(packet, t_min, infinity);
+		}
+
+		virtual bool hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const override;
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+			if (top.empty()) return false;
+			output_box = top.bounds();
+			return true;
+		}
+
+		virtual void materials(std::vector<shared_ptr<material>>& list) const override {
+			list.insert(list.end(), palette.begin(), palette.end());
+		}
+
+		/// <summary>
+		/// Bytes of the chunks kept mapped at most (the budget).
+		/// </summary>
+		size_t memory() const {
+			return budget;
+		}
+
+		/// <summary>
+		/// Prints the chunk traffic and the peak of the mapped memory.
+		/// </summary>
+		void printStats(std::ostream& os) const {
+			os << "streamed geometry: " << chunks.size() << " chunks, " << page_ins.load() << " mapped, "
+			   << evictions.load() << " evicted, peak " << peak_bytes.load() / (1024.0 * 1024.0) << " MB of "
+			   << budget / (1024.0 * 1024.0) << " MB budget\n";
+		}
+
+		void print(std::ostream& os) const {
+			os << "StreamedSphereField {\tspheres:" << sphere_count << "\tchunks:" << chunks.size() << "\t}";
+		}
+
+	private:
+		struct residentChunk {
+			std::shared_ptr<boost::interprocess::mapped_region> region;
+			const SphereField::sphere* spheres;
+			BVH bvh;
+		};
+
+		// the mapped chunk, maps it (and unmaps others) if it is not resident
+		std::shared_ptr<const residentChunk> acquire(int chunk) const;
+
+		// intersects the spheres of a mapped chunk, closest is set to the index of the sphere hit
+		static bool hitChunk(const residentChunk& chunk, const ray& r, double t_min, double& t_max, int& closest) {
+			return chunk.bvh.traverse(r, t_min, t_max,
+				[&](int i, double& t) {
+					const SphereField::sphere& s = chunk.spheres[i];
+					if (!hit_sphere(s.center, s.radius, r, t_min, t, t)) return false;
+					closest = i;
+					return true;
+				});
+		}
+
+	private:
+		std::vector<shared_ptr<material>> palette;
+		size_t budget;
+
+		std::unique_ptr<boost::interprocess::file_mapping> mapping;
+		std::vector<streamChunk> chunks;
+		uint64_t sphere_count = 0;
+		BVH top;	// hierarchy over the chunk bounds
+
+		// mapped chunks, read without the lock by std::atomic_load
+		mutable std::vector<std::shared_ptr<const residentChunk>> resident;
+		mutable std::unique_ptr<std::atomic<uint64_t>[]> last_use;
+		mutable std::atomic<uint64_t> use_clock;
+		mutable std::mutex mutex;
+
+		mutable size_t resident_bytes;
+		mutable std::atomic<size_t> peak_bytes;
+		mutable std::atomic<long long> page_ins;
+		mutable std::atomic<long long> evictions;
+};
+
+bool StreamedSphereField::open(const std::string& path, uint64_t key) {
+	if (!std::ifstream(path)) return false;
+
+	namespace bip = boost::interprocess;
+	try {
+		mapping.reset(new bip::file_mapping(path.c_str(), bip::read_only));
+	}
+	catch (std::exception& e) {
+		std::cerr << "streamed geometry: cannot map " << path << ": " << e.what() << "\n";
+		return false;
+	}
+
+	std::ifstream in(path, std::ios::binary);
+	in.seekg(0, std::ios::end);
+	uint64_t size = (uint64_t)in.tellg();
+	in.seekg(0);
+
+	streamHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		std::strncmp(header.magic, "PTSTRM", sizeof(header.magic)) != 0 ||
+		header.version != STREAM_VERSION ||
+		header.byte_order != 0x01020304u ||
+		header.sphere_size != sizeof(SphereField::sphere) ||
+		header.node_size != sizeof(bvhNode) ||
+		header.key != key ||
+		header.size != size ||
+		header.table_offset + header.chunk_count * sizeof(streamChunk) > size) {
+		std::cerr << "streamed geometry: ignoring invalid or outdated " << path << "\n";
+		return false;
+	}
+
+	chunks.resize(header.chunk_count);
+	in.seekg(header.table_offset);
+	if (!in.read(reinterpret_cast<char*>(chunks.data()), chunks.size() * sizeof(streamChunk)))
+		return false;
+
+	std::vector<aabb> boxes;
+	for (const auto& c : chunks) {
+		if (c.offset % STREAM_CHUNK_ALIGN != 0 || c.offset + c.size > size ||
+			c.sphere_count > STREAM_CHUNK_SPHERES || c.node_count > 2 * STREAM_CHUNK_SPHERES ||
+			c.node_offset + c.node_count * sizeof(bvhNode) > c.size ||
+			c.sphere_count * sizeof(SphereField::sphere) > c.node_offset) {
+			std::cerr << "streamed geometry: ignoring invalid " << path << "\n";
+			return false;
+		}
+		boxes.push_back(aabb(point3(c.lo[0], c.lo[1], c.lo[2]), point3(c.hi[0], c.hi[1], c.hi[2])));
+	}
+
+	sphere_count = header.sphere_count;
+	top.build(boxes);
+
+	resident.assign(chunks.size(), nullptr);
+	last_use.reset(new std::atomic<uint64_t>[chunks.size()]);
+	for (size_t i = 0; i < chunks.size(); i++)
+		last_use[i] = 0;
+
+	return true;
+}
+
+std::shared_ptr<const StreamedSphereField::residentChunk> StreamedSphereField::acquire(int chunk) const {
+	last_use[chunk].store(++use_clock, std::memory_order_relaxed);
+
+	auto mapped = std::atomic_load(&resident[chunk]);
+	if (mapped) return mapped;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// mapped by another thread in the meantime
+	mapped = std::atomic_load(&resident[chunk]);
+	if (mapped) return mapped;
+
+	namespace bip = boost::interprocess;
+	const streamChunk& c = chunks[chunk];
+
+	auto loaded = std::make_shared<residentChunk>();
+	loaded->region = std::make_shared<bip::mapped_region>(*mapping, bip::read_only, c.offset, c.size);
+	loaded->region->advise(bip::mapped_region::advice_willneed);
+
+	const char* data = static_cast<const char*>(loaded->region->get_address());
+	const bvhNode* nodes = reinterpret_cast<const bvhNode*>(data + c.node_offset);
+	loaded->spheres = reinterpret_cast<const SphereField::sphere*>(data);
+
+	// the nodes are checked once they are mapped, a corrupt chunk is left empty
+	if (BVH::valid(nodes, c.node_count, c.sphere_count))
+		loaded->bvh.attach(nodes, c.node_count, nullptr, c.sphere_count, loaded->region);
+	else
+		std::cerr << "streamed geometry: chunk " << chunk << " is corrupt, its spheres are skipped\n";
+
+	std::atomic_store(&resident[chunk], std::shared_ptr<const residentChunk>(loaded));
+	page_ins++;
+	resident_bytes += c.size;
+	peak_bytes = std::max(peak_bytes.load(), resident_bytes);
+
+	// unmap the least recently used chunks
+	while (resident_bytes > budget) {
+		int victim = -1;
+		for (size_t i = 0; i < resident.size(); i++) {
+			if ((int)i != chunk && resident[i] && (victim < 0 || last_use[i] < last_use[victim]))
+				victim = (int)i;
+		}
+		if (victim < 0) break;
+
+		std::atomic_store(&resident[victim], std::shared_ptr<const residentChunk>());
+		resident_bytes -= chunks[victim].size;
+		evictions++;
+	}
+
+	return loaded;
+}
+
+bool StreamedSphereField::intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const {
+	int closest_chunk = -1, closest = -1;
+	const int* chunk_index = top.getIndices();
+
+	if (!top.traverse(r, t_min, t_max,
+		[&](int i, double& t) {
+			auto chunk = acquire(chunk_index[i]);
+			if (!hitChunk(*chunk, r, t_min, t, closest)) return false;
+			closest_chunk = chunk_index[i];
+			return true;
+		}))
+		return false;
+
+	hit.t = t_max;
+	hit.geometry = this;
+	hit.primitive = closest_chunk * STREAM_CHUNK_SPHERES + closest;
+	return true;
+}
+
+bool StreamedSphereField::interaction(const ray& r, const surfaceHit& hit, hitRecord& rec) const {
+	// the chunk was used by the intersection, it is usually still mapped
+	auto chunk = acquire(hit.primitive / STREAM_CHUNK_SPHERES);
+	const SphereField::sphere& s = chunk->spheres[hit.primitive % STREAM_CHUNK_SPHERES];
+
+	rec.t = hit.t;
+	rec.p = r.point_at_parameter(hit.t);
+	rec.set_face_normal(r, (rec.p - s.center) / s.radius);
+	rec.mat_ptr = palette[s.material];
+	return true;
+}
+
+bool StreamedSphereField::hit_packet(const RayPacket& packet, double t_min, packetHitRecord& rec) const {
+	if (packet.coherent && !may_hit(packet, t_min))
+		return false;
+
+	const int* chunk_index = top.getIndices();
+
+	// (chunk, ray) pairs of the chunks each ray reaches
+	static thread_local std::vector<std::pair<int, int>> work;
+	work.clear();
+	for (int k = 0; k < packet.count; k++) {
+		double t_max = rec.closest[k];
+		top.traverse(packet.rays[k], t_min, t_max,
+			[&](int i, double&) {
+				work.push_back(std::make_pair(chunk_index[i], k));
+				return false;
+			});
+	}
+	std::sort(work.begin(), work.end());
+
+	bool hit_anything = false;
+
+	for (size_t w = 0; w < work.size();) {
+		int c = work[w].first;
+		auto chunk = acquire(c);
+		for (; w < work.size() && work[w].first == c; w++) {
+			int k = work[w].second;
+			int closest;
+			if (hitChunk(*chunk, packet.rays[k], t_min, rec.closest[k], closest)) {
+				rec.hit[k] = true;
+				rec.surface[k].t = rec.closest[k];
+				rec.surface[k].geometry = this;
+				rec.surface[k].primitive = c * STREAM_CHUNK_SPHERES + closest;
+				hit_anything = true;
+			}
+		}
+	}
+
+	return hit_anything;
+}
+
+/// <summary>
+/// Position of the point along a Morton curve through the box, 21 bits per axis.
+/// </summary>
+inline uint64_t mortonCode(const point3& p, const aabb& box) {
+	auto spread = [](uint64_t x) {
+		x &= 0x1fffff;
+		x = (x | x << 32) & 0x1f00000000ffffull;
+		x = (x | x << 16) & 0x1f0000ff0000ffull;
+		x = (x | x << 8) & 0x100f00f00f00f00full;
+		x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+		x = (x | x << 2) & 0x1249249249249249ull;
+		return x;
+	};
+
+	uint64_t code = 0;
+	for (int a = 0; a < 3; a++) {
+		double extent = box.max()[a] - box.min()[a];
+		double u = extent > 0 ? clamp((p[a] - box.min()[a]) / extent, 0.0, 1.0) : 0;
+		code |= spread((uint64_t)(u * 0x1fffff)) << a;
+	}
+	return code;
+}
+
+bool StreamedSphereField::write(const std::string& path, uint64_t key, const SphereFieldGenerator& generator,
+								ThreadPool& pool, size_t memory) {
+	struct entry {
+		uint64_t code;
+		SphereField::sphere s;
+
+		bool operator<(const entry& other) const {
+			return code < other.code;
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+
+	// sorted runs of whole generator chunks
+	long long run_chunks = std::max(1LL, (long long)(memory / sizeof(entry) / SPHERE_FIELD_CHUNK));
+	long long run_count = (generator.chunks() + run_chunks - 1) / run_chunks;
+	aabb box = generator.bounds();
+
+	std::string runs_path = path + ".runs";
+	std::vector<long long> run_sizes;
+	{
+		std::ofstream runs(runs_path, std::ios::binary | std::ios::trunc);
+		if (!runs) {
+			std::cerr << "streamed geometry: cannot write " << runs_path << "\n";
+			return false;
+		}
+
+		std::vector<entry> run;
+		for (long long r = 0; r < run_count; r++) {
+			long long first = r * run_chunks;
+			long long last = std::min(generator.chunks(), first + run_chunks);
+			run.resize(std::min(generator.size(), last * SPHERE_FIELD_CHUNK) - first * SPHERE_FIELD_CHUNK);
+
+			for (long long chunk = first; chunk < last; chunk++) {
+				pool.submit([&, chunk]() {
+					std::vector<SphereField::sphere> spheres(generator.chunkSize(chunk));
+					generator.generate(chunk, spheres.data());
+
+					entry* out = &run[(chunk - first) * SPHERE_FIELD_CHUNK];
+					for (size_t i = 0; i < spheres.size(); i++) {
+						out[i].s = spheres[i];
+						out[i].code = mortonCode(spheres[i].center, box);
+					}
+				});
+			}
+			pool.wait();
+
+			std::sort(run.begin(), run.end());
+			runs.write(reinterpret_cast<const char*>(run.data()), run.size() * sizeof(entry));
+			run_sizes.push_back((long long)run.size());
+		}
+
+		if (!runs) {
+			std::cerr << "streamed geometry: cannot write " << runs_path << "\n";
+			std::remove(runs_path.c_str());
+			return false;
+		}
+	}
+
+	auto sorted = std::chrono::steady_clock::now();
+
+	// merge the runs
+	struct runReader {
+		std::ifstream in;
+		std::vector<entry> buffer;
+		size_t position = 0;
+		long long left = 0;
+
+		bool next(entry& e) {
+			if (position == buffer.size()) {
+				if (left == 0) return false;
+				buffer.resize((size_t)std::min(left, (long long)STREAM_MERGE_BUFFER));
+				in.read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(entry));
+				left -= (long long)buffer.size();
+				position = 0;
+			}
+			e = buffer[position++];
+			return true;
+		}
+	};
+
+	std::vector<std::unique_ptr<runReader>> readers;
+	long long offset = 0;
+	for (long long size : run_sizes) {
+		std::unique_ptr<runReader> reader(new runReader());
+		reader->in.open(runs_path, std::ios::binary);
+		reader->in.seekg(offset * sizeof(entry));
+		reader->left = size;
+		offset += size;
+		readers.push_back(std::move(reader));
+	}
+
+	typedef std::pair<entry, int> head;
+	auto later = [](const head& a, const head& b) { return b.first < a.first; };
+	std::priority_queue<head, std::vector<head>, decltype(later)> heads(later);
+	for (size_t r = 0; r < readers.size(); r++) {
+		entry e;
+		if (readers[r]->next(e))
+			heads.push(head(e, (int)r));
+	}
+
+	// the file: header, chunk table, chunks
+	uint64_t chunk_count = (generator.size() + STREAM_CHUNK_SPHERES - 1) / STREAM_CHUNK_SPHERES;
+	auto align = [](uint64_t o, uint64_t a) { return (o + a - 1) / a * a; };
+
+	streamHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::strncpy(header.magic, "PTSTRM", sizeof(header.magic));
+	header.version = STREAM_VERSION;
+	header.byte_order = 0x01020304u;
+	header.sphere_size = sizeof(SphereField::sphere);
+	header.node_size = sizeof(bvhNode);
+	header.key = key;
+	header.sphere_count = generator.size();
+	header.chunk_count = chunk_count;
+	header.table_offset = sizeof(header);
+
+	std::vector<streamChunk> table;
+	uint64_t end = align(header.table_offset + chunk_count * sizeof(streamChunk), STREAM_CHUNK_ALIGN);
+
+	std::string temp = temporaryPath(path);
+	std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		std::cerr << "streamed geometry: cannot write " << temp << "\n";
+		std::remove(runs_path.c_str());
+		return false;
+	}
+
+	// chunks are built in batches on the pool and written in order
+	struct builtChunk {
+		std::vector<SphereField::sphere> spheres;
+		BVH bvh;
+		aabb bounds;
+	};
+	std::vector<builtChunk> batch(std::max(1, pool.size()));
+	std::vector<char> zeros(STREAM_CHUNK_ALIGN, 0);
+
+	while (!heads.empty()) {
+		int filled = 0;
+		for (; filled < (int)batch.size() && !heads.empty(); filled++) {
+			auto& spheres = batch[filled].spheres;
+			spheres.clear();
+			while (spheres.size() < STREAM_CHUNK_SPHERES && !heads.empty()) {
+				head h = heads.top();
+				heads.pop();
+				spheres.push_back(h.first.s);
+				if (readers[h.second]->next(h.first))
+					heads.push(h);
+			}
+		}
+
+		for (int b = 0; b < filled; b++) {
+			pool.submit([&batch, b]() {
+				builtChunk& c = batch[b];
+				std::vector<aabb> boxes(c.spheres.size());
+				for (size_t i = 0; i < c.spheres.size(); i++) {
+					const SphereField::sphere& s = c.spheres[i];
+					boxes[i] = aabb(s.center - vec3(s.radius), s.center + vec3(s.radius));
+				}
+				c.bvh.build(boxes);
+				c.bounds = c.bvh.bounds();
+
+				// leaf order, the nodes then index the spheres directly
+				std::vector<SphereField::sphere> ordered(c.spheres.size());
+				for (int i = 0; i < c.bvh.indexCount(); i++)
+					ordered[i] = c.spheres[c.bvh.getIndices()[i]];
+				c.spheres.swap(ordered);
+			});
+		}
+		pool.wait();
+
+		for (int b = 0; b < filled; b++) {
+			const builtChunk& c = batch[b];
+
+			streamChunk entry;
+			std::memset(&entry, 0, sizeof(entry));
+			for (int a = 0; a < 3; a++) {
+				entry.lo[a] = c.bounds.min()[a];
+				entry.hi[a] = c.bounds.max()[a];
+			}
+			entry.offset = end;
+			entry.sphere_count = (uint32_t)c.spheres.size();
+			entry.node_count = (uint32_t)c.bvh.nodeCount();
+			entry.node_offset = align(c.spheres.size() * sizeof(SphereField::sphere), BVH_CACHE_ALIGN);
+			entry.size = entry.node_offset + entry.node_count * sizeof(bvhNode);
+			table.push_back(entry);
+
+			out.seekp(entry.offset);
+			out.write(reinterpret_cast<const char*>(c.spheres.data()), c.spheres.size() * sizeof(SphereField::sphere));
+			out.write(zeros.data(), entry.node_offset - c.spheres.size() * sizeof(SphereField::sphere));
+			out.write(reinterpret_cast<const char*>(c.bvh.getNodes()), entry.node_count * sizeof(bvhNode));
+
+			end = align(entry.offset + entry.size, STREAM_CHUNK_ALIGN);
+		}
+	}
+
+	readers.clear();
+	std::remove(runs_path.c_str());
+
+	// the file ends with the last chunk
+	header.size = table.empty() ? end : table.back().offset + table.back().size;
+	header.chunk_count = table.size();
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(streamChunk));
+	out.close();
+
+	if (!out) {
+		std::cerr << "streamed geometry: cannot write " << temp << "\n";
+		std::remove(temp.c_str());
+		return false;
+	}
+
+	std::remove(path.c_str());
+	if (std::rename(temp.c_str(), path.c_str()) != 0) {
+		std::remove(temp.c_str());
+		return false;
+	}
+
+	auto written = std::chrono::steady_clock::now();
+	std::cerr << "streamed geometry: " << generator.size() << " spheres sorted in " << run_count << " runs in "
+			  << std::chrono::duration<double, std::milli>(sorted - start).count() << " ms, " << table.size()
+			  << " chunks written in " << std::chrono::duration<double, std::milli>(written - sorted).count() << " ms\n";
+	return true;
+}
+
+/// <summary>
+/// Opens the streamed sphere field of the generator parameters, the chunk
+/// file is written first if it does not exist or belongs to other parameters.
+/// </summary>
+/// <param name="distribution">The distribution: uniform, clustered or uneven.</param>
+/// <param name="count">The number of spheres.</param>
+/// <param name="seed">The random seed.</param>
+/// <param name="pool">The thread pool.</param>
+/// <param name="path">The chunk file.</param>
+/// <param name="budget">The bytes of the chunks kept mapped, also used for sorting when writing.</param>
+/// <returns>The field, null if the distribution is unknown or the file cannot be written</returns>
+shared_ptr<StreamedSphereField> streamSphereField(const std::string& distribution, long long count, unsigned int seed,
+												  ThreadPool& pool, const std::string& path, size_t budget) {
+	SphereFieldGenerator generator;
+	if (!generator.init(distribution, count, seed))
+		return nullptr;
+
+	// hash of the parameters the file depends on
+	uint64_t parameters[] = { (uint64_t)generator.size(), seed, STREAM_CHUNK_SPHERES, BVH_CACHE_VERSION, BVH_MAX_LEAF_SIZE, BVH_SAH_BINS };
+	uint64_t key = fnv1a(fnv1a(FNV1A_BASIS, distribution.data(), distribution.size()), parameters, sizeof(parameters));
+
+	auto field = make_shared<StreamedSphereField>(generator.getPalette(), budget);
+	if (field->open(path, key))
+		return field;
+
+	if (!StreamedSphereField::write(path, key, generator, pool, budget) || !field->open(path, key))
+		return nullptr;
+	return field;
+}
+
+#endif // !STREAMEDFIELD_H
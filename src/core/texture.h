@@ -1,4 +1,9 @@
-#include "vec.h"
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "common.h"
+
+#include <vector>
 
 vec3 simpleColorGradient(int x, int y, int i, int j) {
 	float r = float(i) / float(x);
@@ -74,4 +79,6 @@ std::vector<vec3> createColorGradient(int image_width, int image_height, float a
 	}
 
 	return colors;
-}
\ No newline at end of file
+}
+
+#endif // !TEXTURE_H
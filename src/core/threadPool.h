@@ -0,0 +1,240 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "numa.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Fixed size pool of worker threads executing tasks in submission order.
+///
+/// A pool created for a NUMA topology pins its workers to the nodes and
+/// keeps one queue per node. Tasks submitted for a node run on its workers,
+/// idle workers take tasks of other nodes only if their own queue is empty.
+/// </summary>
+class ThreadPool {
+	public:
+		/// <summary>
+		/// Work done by the workers of a node.
+		/// </summary>
+		struct NodeCounters {
+			int threads = 0;
+			long long tasks = 0;	// executed tasks
+			long long stolen = 0;	// tasks taken from the queue of another node
+			double busy = 0;		// seconds spent in tasks, summed over the workers
+		};
+
+		/// <summary>
+		/// Initializes a new instance of the <see cref="ThreadPool"/> class.
+		/// </summary>
+		/// <param name="threads">The number of workers, 0 uses one per hardware thread.</param>
+		explicit ThreadPool(int threads = 0) : active(0), stop(false) {
+			if (threads <= 0)
+				threads = std::max(1u, std::thread::hardware_concurrency());
+
+			start(threads, nullptr);
+		}
+
+		/// <summary>
+		/// Initializes a new instance of the <see cref="ThreadPool"/> class
+		/// with the workers spread evenly over the nodes and pinned to them.
+		/// </summary>
+		/// <param name="threads">The number of workers, 0 uses one per cpu.</param>
+		/// <param name="topology">The NUMA topology.</param>
+		ThreadPool(int threads, const NumaTopology& topology) : active(0), stop(false) {
+			if (threads <= 0)
+				threads = topology.cpuCount();
+
+			start(threads, &topology);
+		}
+
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			task_cv.notify_all();
+
+			for (auto& worker : workers)
+				worker.join();
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		/// <summary>
+		/// Queues the task for execution.
+		/// </summary>
+		/// <param name="task">The task.</param>
+		/// <param name="node">The NUMA node preferred to run the task, -1 for any.</param>
+		/// <param name="strict">Only run the task on the node, never on the workers of other nodes.</param>
+		void submit(std::function<void()> task, int node = -1, bool strict = false) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				queue(node).push_back(Task{ std::move(task), !strict });
+			}
+
+			// with several nodes not every worker may take the task
+			if (nodes() > 1)
+				task_cv.notify_all();
+			else
+				task_cv.notify_one();
+		}
+
+		/// <summary>
+		/// Blocks until all queued tasks are finished.
+		/// </summary>
+		void wait() {
+			std::unique_lock<std::mutex> lock(mutex);
+			done_cv.wait(lock, [this]() { return queued() == 0 && active == 0; });
+		}
+
+		int size() const {
+			return (int)workers.size();
+		}
+
+		/// <summary>
+		/// Number of NUMA nodes the workers are spread over (1 if not pinned).
+		/// </summary>
+		int nodes() const {
+			return (int)counters.size();
+		}
+
+		/// <summary>
+		/// Snapshot of the per node counters.
+		/// </summary>
+		std::vector<NodeCounters> nodeCounters() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return counters;
+		}
+
+	private:
+		struct Task {
+			std::function<void()> run;
+			bool stealable;
+		};
+
+		void start(int threads, const NumaTopology* topology) {
+			int node_count = topology ? topology->nodes() : 1;
+
+			// one queue per node and the last one for tasks of any node
+			queues.resize(node_count + 1);
+			counters.resize(node_count);
+
+			for (int i = 0; i < threads; i++) {
+				int node = i % node_count;
+				counters[node].threads++;
+				workers.push_back(std::thread(&ThreadPool::work, this, node));
+
+				if (topology && !pinThread(workers.back(), topology->nodeCpus(node)) && i == 0)
+					std::cerr << "thread pool: pinning threads is not supported\n";
+			}
+		}
+
+		std::deque<Task>& queue(int node) {
+			if (node < 0 || node >= nodes() || counters[node].threads == 0)
+				return queues.back();
+			return queues[node];
+		}
+
+		size_t queued() const {
+			size_t n = 0;
+			for (const auto& q : queues)
+				n += q.size();
+			return n;
+		}
+
+		// a task the worker of the node may take
+		bool available(int node) const {
+			if (!queues[node].empty() || !queues.back().empty())
+				return true;
+			for (int q = 0; q < nodes(); q++) {
+				if (!queues[q].empty() && queues[q].front().stealable)
+					return true;
+			}
+			return false;
+		}
+
+		// takes the next task: own node, any node, then the other nodes
+		bool take(int node, std::function<void()>& task, bool& stolen) {
+			int order[2] = { node, nodes() };
+			for (int q : order) {
+				if (!queues[q].empty()) {
+					task = std::move(queues[q].front().run);
+					queues[q].pop_front();
+					stolen = false;
+					return true;
+				}
+			}
+
+			for (int q = 0; q < nodes(); q++) {
+				if (!queues[q].empty() && queues[q].front().stealable) {
+					task = std::move(queues[q].front().run);
+					queues[q].pop_front();
+					stolen = true;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void work(int node) {
+			currentNumaNode() = node;
+
+			while (true) {
+				std::function<void()> task;
+				bool stolen = false;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					task_cv.wait(lock, [this, node]() { return (stop && queued() == 0) || available(node); });
+
+					if (!take(node, task, stolen))
+						return;
+
+					active++;
+				}
+
+				auto begin = std::chrono::steady_clock::now();
+				task();
+				std::chrono::duration<double> busy = std::chrono::steady_clock::now() - begin;
+
+				bool stopping;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					active--;
+					counters[node].tasks++;
+					counters[node].stolen += stolen;
+					counters[node].busy += busy.count();
+					stopping = stop;
+				}
+				done_cv.notify_all();
+
+				// workers waiting for tasks of their node may be done now
+				if (stopping)
+					task_cv.notify_all();
+			}
+		}
+
+	private:
+		std::vector<std::thread> workers;
+		std::vector<std::deque<Task>> queues;
+		std::vector<NodeCounters> counters;
+
+		std::mutex mutex;
+		std::condition_variable task_cv;
+		std::condition_variable done_cv;
+
+		int active;
+		bool stop;
+};
+
+#endif // !THREADPOOL_H
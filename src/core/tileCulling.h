@@ -0,0 +1,126 @@
+#ifndef TILECULLING_H
+#define TILECULLING_H
+
+#include "common.h"
+#include "bvh.h"
+#include "camera.h"
+#include "geometry.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// tiles with at most this many candidates test them one by one, larger lists get a hierarchy
+#define CULL_LIST_MAX 8
+
+/// <summary>
+/// Candidates of the camera rays of every tile: the objects of the world
+/// whose bounds project into the tile, all other objects cannot be hit by
+/// a camera ray of the tile. Secondary rays still use the whole world.
+///
+/// An object is projected by the bounding sphere of its bounding box over
+/// the shutter interval, widened by the circle of confusion of the lens
+/// (see Camera::sphere_bounds). Objects reaching behind the lens plane are
+/// candidates of every tile, as are objects without bounds.
+///
+/// Hierarchies and lists at the top of the world are flattened, a tile
+/// with more than CULL_LIST_MAX candidates gets its own hierarchy.
+/// </summary>
+class TileCulling {
+	public:
+		/// <summary>
+		/// Builds the candidates of the tiles in the rows [y0, y1) of the image.
+		/// </summary>
+		/// <param name="cam">The camera.</param>
+		/// <param name="width">The image width.</param>
+		/// <param name="height">The image height.</param>
+		/// <param name="tile_size">The edge length of the tiles (see makeTiles).</param>
+		/// <param name="world">The world.</param>
+		/// <param name="y0">The first row, a multiple of tile_size.</param>
+		/// <param name="y1">The end of the rows, -1 for the image height.</param>
+		TileCulling(const Camera& cam, int width, int height, int tile_size, const shared_ptr<Geometry>& world, int y0 = 0, int y1 = -1)
+			: tile_size(std::max(tile_size, 1)), columns((width + this->tile_size - 1) / this->tile_size) {
+			if (y1 < 0) y1 = height;
+			first_row = y0 / this->tile_size;
+			int rows = std::max(0, (y1 - y0 + this->tile_size - 1) / this->tile_size);
+
+			std::vector<shared_ptr<Geometry>> objects;
+			flattenGeometry(world, objects);
+
+			std::vector<std::vector<shared_ptr<Geometry>>> lists((size_t)columns * rows);
+
+			// image coordinates clamped to keep the pixels in the int range
+			auto image = [](double s) { return clamp(s, -1.0, 2.0); };
+
+			for (const auto& object : objects) {
+				int x0 = 0, x1 = width - 1, ya = 0, yb = height - 1;
+
+				aabb box;
+				if (object->bounding_box(cam.shutter_open(), cam.shutter_close(), box)) {
+					double s0, s1, t0, t1;
+					point3 center = (box.min() + box.max()) / 2;
+					if (!cam.sphere_bounds(center, (box.max() - box.min()).length() / 2, s0, s1, t0, t1))
+						continue;
+
+					// pixel i covers s in [i, i + 1) / (width - 1), with one pixel to spare
+					x0 = std::max(x0, (int)std::floor(image(s0) * (width - 1)) - 1);
+					x1 = std::min(x1, (int)std::floor(image(s1) * (width - 1)) + 1);
+					int j0 = (int)std::floor(image(t0) * (height - 1)) - 1;
+					int j1 = (int)std::floor(image(t1) * (height - 1)) + 1;
+					ya = std::max(ya, height - 1 - j1);
+					yb = std::min(yb, height - 1 - j0);
+				}
+
+				ya = std::max(ya, y0);
+				yb = std::min(yb, y1 - 1);
+				if (x0 > x1 || ya > yb)
+					continue;
+
+				for (int r = ya / this->tile_size; r <= yb / this->tile_size; r++) {
+					for (int c = x0 / this->tile_size; c <= x1 / this->tile_size; c++)
+						lists[(size_t)(r - first_row) * columns + c].push_back(object);
+				}
+			}
+
+			tiles.resize(lists.size());
+			for (size_t i = 0; i < lists.size(); i++) {
+				count += lists[i].size();
+				if (lists[i].size() > CULL_LIST_MAX) {
+					tiles[i] = make_shared<BVHAccel>(lists[i], cam.shutter_open(), cam.shutter_close());
+				}
+				else {
+					auto list = make_shared<GeometryList>();
+					for (const auto& object : lists[i])
+						list->add(object);
+					tiles[i] = list;
+				}
+			}
+		}
+
+		/// <summary>
+		/// The candidates of the tile containing the pixel (x, y).
+		/// </summary>
+		const Geometry& tile(int x, int y) const {
+			return *tiles[(size_t)(y / tile_size - first_row) * columns + x / tile_size];
+		}
+
+		/// <summary>
+		/// Average number of candidates per tile.
+		/// </summary>
+		double candidates() const {
+			return tiles.empty() ? 0 : (double)count / tiles.size();
+		}
+
+		size_t tileCount() const {
+			return tiles.size();
+		}
+
+	private:
+		int tile_size;
+		int columns;
+		int first_row = 0;								// tile row of tiles[0]
+		std::vector<shared_ptr<Geometry>> tiles;		// candidates of each tile, row by row
+		size_t count = 0;								// candidates of all tiles
+};
+
+#endif // !TILECULLING_H
@@ -0,0 +1,193 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "common.h"
+#include "geometry.h"
+
+/// <summary>
+/// Affine transformation (3x4 matrix) with its inverse.
+/// </summary>
+class Transform {
+	public:
+		// identity
+		Transform() : m{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0} },
+					  inv{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0} } {}
+
+		/// <summary>
+		/// Creates the transformation scale, then rotate (x, y, z order), then translate.
+		/// </summary>
+		/// <param name="translate">The translation.</param>
+		/// <param name="rotate">The euler angles in degrees.</param>
+		/// <param name="scale">The uniform scale.</param>
+		static Transform compose(const vec3& translate, const vec3& rotate, double scale) {
+			double cx = cos(degrees_to_radians(rotate.x())), sx = sin(degrees_to_radians(rotate.x()));
+			double cy = cos(degrees_to_radians(rotate.y())), sy = sin(degrees_to_radians(rotate.y()));
+			double cz = cos(degrees_to_radians(rotate.z())), sz = sin(degrees_to_radians(rotate.z()));
+
+			// R = Rz * Ry * Rx
+			double r[3][3] = {
+				{ cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx },
+				{ sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx },
+				{ -sy,     cy * sx,                cy * cx }
+			};
+
+			Transform t;
+			for (int i = 0; i < 3; i++) {
+				for (int j = 0; j < 3; j++) {
+					t.m[i][j] = r[i][j] * scale;
+					// inverse of a scaled rotation is the scaled transpose
+					t.inv[i][j] = r[j][i] / scale;
+				}
+				t.m[i][3] = translate[i];
+			}
+
+			for (int i = 0; i < 3; i++)
+				t.inv[i][3] = -(t.inv[i][0] * translate[0] + t.inv[i][1] * translate[1] + t.inv[i][2] * translate[2]);
+
+			return t;
+		}
+
+		point3 point(const point3& p) const {
+			return apply(m, p) + vec3(m[0][3], m[1][3], m[2][3]);
+		}
+
+		vec3 vector(const vec3& v) const {
+			return apply(m, v);
+		}
+
+		/// <summary>
+		/// Transforms a normal (with the inverse transpose), the result is not normalized.
+		/// </summary>
+		vec3 normal(const vec3& n) const {
+			return vec3(inv[0][0] * n[0] + inv[1][0] * n[1] + inv[2][0] * n[2],
+						inv[0][1] * n[0] + inv[1][1] * n[1] + inv[2][1] * n[2],
+						inv[0][2] * n[0] + inv[1][2] * n[1] + inv[2][2] * n[2]);
+		}
+
+		point3 inverse_point(const point3& p) const {
+			return apply(inv, p) + vec3(inv[0][3], inv[1][3], inv[2][3]);
+		}
+
+		vec3 inverse_vector(const vec3& v) const {
+			return apply(inv, v);
+		}
+
+		/// <summary>
+		/// Transforms a bounding box (box of the transformed corners).
+		/// </summary>
+		aabb box(const aabb& b) const {
+			aabb out;
+			for (int i = 0; i < 8; i++) {
+				point3 corner((i & 1) ? b.max().x() : b.min().x(),
+							  (i & 2) ? b.max().y() : b.min().y(),
+							  (i & 4) ? b.max().z() : b.min().z());
+				out = surrounding_box(out, point(corner));
+			}
+			return out;
+		}
+
+	private:
+		static vec3 apply(const double a[3][4], const vec3& v) {
+			return vec3(a[0][0] * v[0] + a[0][1] * v[1] + a[0][2] * v[2],
+						a[1][0] * v[0] + a[1][1] * v[1] + a[1][2] * v[2],
+						a[2][0] * v[0] + a[2][1] * v[1] + a[2][2] * v[2]);
+		}
+
+	private:
+		double m[3][4];
+		double inv[3][4];
+};
+
+/// <summary>
+/// Places an instance of a Geometry with an affine transformation.
+///
+/// Rays are transformed into the space of the Geometry, the object itself
+/// is shared and never copied.
+/// </summary>
+/// <seealso cref="Geometry" />
+class Instance : public Geometry {
+	public:
+		Instance(shared_ptr<Geometry> p, const Transform& t) : object(p), transform(t) {}
+
+		/// <summary>
+		/// Intersects the object with the ray in its space, the hit of the
+		/// object is kept in hit.object and hit.object_primitive.
+		/// </summary>
+		virtual bool intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const override;
+
+		/// <summary>
+		/// Computes the interaction of the kept hit of the object in its space.
+		/// Only a single hit is kept, the object of a nested instance is
+		/// intersected again around the distance of the hit.
+		/// </summary>
+		virtual bool interaction(const ray& r, const surfaceHit& hit, hitRecord& rec) const override;
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hitRecord& rec) const override;
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+			aabb box;
+			if (!object->bounding_box(time0, time1, box)) return false;
+			output_box = transform.box(box);
+			return true;
+		}
+
+		virtual void materials(std::vector<shared_ptr<material>>& list) const override {
+			object->materials(list);
+		}
+
+		void print(std::ostream& os) const {
+			os << "Instance {\t" << *object << "\t}";
+		}
+
+	private:
+		shared_ptr<Geometry> object;
+		Transform transform;
+};
+
+bool Instance::intersect(const ray& r, double t_min, double t_max, surfaceHit& hit) const {
+	ray local(transform.inverse_point(r.origin()), transform.inverse_vector(r.direction()), r.time());
+
+	if (!object->intersect(local, t_min, t_max, hit))
+		return false;
+
+	bool nested = dynamic_cast<const Instance*>(hit.geometry) != nullptr;
+	hit.object = nested ? nullptr : hit.geometry;
+	hit.object_primitive = hit.primitive;
+	hit.geometry = this;
+	hit.primitive = -1;
+	return true;
+}
+
+bool Instance::interaction(const ray& r, const surfaceHit& hit, hitRecord& rec) const {
+	if (!hit.object) {
+		// a narrow window, a box of the hierarchy of the object can miss [t, t] by rounding
+		double slack = hit.t * 1e-12;
+		return this->hit(r, hit.t - slack, hit.t + slack, rec);
+	}
+
+	// the direction is not normalized, so the ray parameter t stays the same
+	ray local(transform.inverse_point(r.origin()), transform.inverse_vector(r.direction()), r.time());
+	surfaceHit object_hit = { hit.t, hit.object, hit.object_primitive, nullptr, -1 };
+	if (!hit.object->interaction(local, object_hit, rec))
+		return false;
+
+	rec.p = r.point_at_parameter(rec.t);
+	rec.normal = unit_vector(transform.normal(rec.normal));
+
+	return true;
+}
+
+bool Instance::hit(const ray& r, double t_min, double t_max, hitRecord& rec) const {
+	// the direction is not normalized, so the ray parameter t stays the same
+	ray local(transform.inverse_point(r.origin()), transform.inverse_vector(r.direction()), r.time());
+
+	if (!object->hit(local, t_min, t_max, rec))
+		return false;
+
+	rec.p = r.point_at_parameter(rec.t);
+	rec.normal = unit_vector(transform.normal(rec.normal));
+
+	return true;
+}
+
+#endif // !TRANSFORM_H
@@ -227,15 +227,49 @@ inline vec3 lerp(vec3 v1, vec3 v2, double t) {
 }
 
 /// <summary>
-/// Randoms the in unit disk.
+/// Maps a point of the unit square to the unit disk (concentric mapping of
+/// Shirley and Chiu), area preserving and without rejection.
+/// </summary>
+/// <param name="u1">The first coordinate in [0,1).</param>
+/// <param name="u2">The second coordinate in [0,1).</param>
+/// <returns>The point on the disk (z = 0)</returns>
+inline vec3 concentric_disk(double u1, double u2) {
+	double a = 2 * u1 - 1;
+	double b = 2 * u2 - 1;
+
+	if (a == 0 && b == 0)
+		return vec3(0, 0, 0);
+
+	double r, phi;
+	if (a * a > b * b) {
+		r = a;
+		phi = (M_PI / 4) * (b / a);
+	}
+	else {
+		r = b;
+		phi = (M_PI / 2) - (M_PI / 4) * (a / b);
+	}
+
+	return vec3(r * cos(phi), r * sin(phi), 0);
+}
+
+/// <summary>
+/// Returns a random point in the unit disk.
 /// </summary>
 /// <returns></returns>
 inline vec3 random_in_unit_disk() {
-	while (true) {
-		auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-		if (p.squared_length() >= 1) continue;
-		return p;
-	}
+	auto u1 = random_double();
+	return concentric_disk(u1, random_double());
+}
+
+/// <summary>
+/// Returns a cosine weighted direction around +z (Malley's method: a point
+/// on the unit disk is projected up to the hemisphere), pdf = z / pi.
+/// </summary>
+/// <returns></returns>
+inline vec3 random_cosine_direction() {
+	vec3 d = random_in_unit_disk();
+	return vec3(d.x(), d.y(), sqrt(fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y())));
 }
 
 /// <summary>
@@ -258,7 +292,10 @@ inline vec3 random_in_unit_sphere() {
 /// </summary>
 /// <returns></returns>
 inline vec3 random_unit_vector() {
-	return unit_vector(random_in_unit_sphere());
+	auto z = random_double(-1, 1);
+	auto phi = 2 * M_PI * random_double();
+	auto r = sqrt(fmax(0.0, 1 - z * z));
+	return vec3(r * cos(phi), r * sin(phi), z);
 }
 
 /// <summary>
@@ -304,4 +341,13 @@ inline vec3 refract(const vec3& v, const vec3& n, double etai_over_etat) {
 	return r_out_perp + r_out_parallel;
 }
 
+/// <summary>
+/// Luminance of a linear sRGB color (Rec. 709 weights).
+/// </summary>
+/// <param name="c">The color.</param>
+/// <returns></returns>
+inline double luminance(const color& c) {
+	return 0.2126 * c.r() + 0.7152 * c.g() + 0.0722 * c.b();
+}
+
 #endif // !VEC_H
\ No newline at end of file
@@ -0,0 +1,600 @@
+/**
+ * Library with wide (SIMD) vector types and functions.
+ *
+ * The wide types hold 4 or 8 vectors in SoA layout (one register per
+ * component) and mirror the vec3 utility functions of vec.h.
+ * Lanes are single precision floats, SSE/AVX is used if the compiler targets
+ * it, otherwise (or if VECX_NO_SIMD is defined) the functions fall back to
+ * scalar code.
+ */
+#ifndef VECX_H
+#define VECX_H
+
+#include <cstring>
+
+#include "common.h"
+
+#if !defined(VECX_NO_SIMD)
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VECX_AVX 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VECX_SSE 1
+#endif
+
+#endif // !VECX_NO_SIMD
+
+// ------------------------------------------------------------------------------
+// Lane Types
+// ------------------------------------------------------------------------------
+
+/// <summary>
+/// 4 float lanes (SSE register).
+///
+/// Comparisons return masks with all bits of a lane set, which can be used
+/// with select, any and all.
+/// </summary>
+struct floatx4 {
+	static const int width = 4;
+
+#if VECX_SSE
+	__m128 v;
+
+	floatx4() : v(_mm_setzero_ps()) {}
+	floatx4(float f) : v(_mm_set1_ps(f)) {}
+	floatx4(__m128 m) : v(m) {}
+	floatx4(float f0, float f1, float f2, float f3) : v(_mm_setr_ps(f0, f1, f2, f3)) {}
+
+	static floatx4 load(const float* p) { return _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+#else
+	float v[4];
+
+	floatx4() : v{ 0, 0, 0, 0 } {}
+	floatx4(float f) : v{ f, f, f, f } {}
+	floatx4(float f0, float f1, float f2, float f3) : v{ f0, f1, f2, f3 } {}
+
+	static floatx4 load(const float* p) { return floatx4(p[0], p[1], p[2], p[3]); }
+	void store(float* p) const { memcpy(p, v, sizeof(v)); }
+#endif
+
+	float operator[](int i) const {
+		float t[4];
+		store(t);
+		return t[i];
+	}
+
+	void set(int i, float f) {
+		float t[4];
+		store(t);
+		t[i] = f;
+		*this = load(t);
+	}
+};
+
+#if VECX_SSE
+
+inline floatx4 operator+(const floatx4& a, const floatx4& b) { return _mm_add_ps(a.v, b.v); }
+inline floatx4 operator-(const floatx4& a, const floatx4& b) { return _mm_sub_ps(a.v, b.v); }
+inline floatx4 operator*(const floatx4& a, const floatx4& b) { return _mm_mul_ps(a.v, b.v); }
+inline floatx4 operator/(const floatx4& a, const floatx4& b) { return _mm_div_ps(a.v, b.v); }
+inline floatx4 operator-(const floatx4& a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+
+inline floatx4 operator<(const floatx4& a, const floatx4& b) { return _mm_cmplt_ps(a.v, b.v); }
+inline floatx4 operator>(const floatx4& a, const floatx4& b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline floatx4 operator<=(const floatx4& a, const floatx4& b) { return _mm_cmple_ps(a.v, b.v); }
+inline floatx4 operator>=(const floatx4& a, const floatx4& b) { return _mm_cmpge_ps(a.v, b.v); }
+inline floatx4 operator&(const floatx4& a, const floatx4& b) { return _mm_and_ps(a.v, b.v); }
+inline floatx4 operator|(const floatx4& a, const floatx4& b) { return _mm_or_ps(a.v, b.v); }
+
+inline floatx4 min(const floatx4& a, const floatx4& b) { return _mm_min_ps(a.v, b.v); }
+inline floatx4 max(const floatx4& a, const floatx4& b) { return _mm_max_ps(a.v, b.v); }
+inline floatx4 abs(const floatx4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline floatx4 sqrt(const floatx4& a) { return _mm_sqrt_ps(a.v); }
+
+/// <summary>
+/// Approximate reciprocal square root (12 bit precision).
+/// </summary>
+inline floatx4 rsqrt_approx(const floatx4& a) { return _mm_rsqrt_ps(a.v); }
+
+/// <summary>
+/// Selects the lanes of a where the mask is set, otherwise the lanes of b.
+/// </summary>
+inline floatx4 select(const floatx4& mask, const floatx4& a, const floatx4& b) {
+	return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+
+/// <summary>
+/// Bitmask of the sign bits of all lanes (bit i is lane i).
+/// </summary>
+inline int movemask(const floatx4& mask) { return _mm_movemask_ps(mask.v); }
+
+#else
+
+namespace vecx_detail {
+	inline float bits_to_float(unsigned int u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+	inline unsigned int float_to_bits(float f) { unsigned int u; memcpy(&u, &f, sizeof(u)); return u; }
+	inline float mask_lane(bool b) { return bits_to_float(b ? 0xFFFFFFFFu : 0u); }
+}
+
+#define VECX_LANEWISE4(expr) floatx4 r; for (int i = 0; i < 4; i++) r.v[i] = (expr); return r
+
+inline floatx4 operator+(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(a.v[i] + b.v[i]); }
+inline floatx4 operator-(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(a.v[i] - b.v[i]); }
+inline floatx4 operator*(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(a.v[i] * b.v[i]); }
+inline floatx4 operator/(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(a.v[i] / b.v[i]); }
+inline floatx4 operator-(const floatx4& a) { VECX_LANEWISE4(-a.v[i]); }
+
+inline floatx4 operator<(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(vecx_detail::mask_lane(a.v[i] < b.v[i])); }
+inline floatx4 operator>(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(vecx_detail::mask_lane(a.v[i] > b.v[i])); }
+inline floatx4 operator<=(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(vecx_detail::mask_lane(a.v[i] <= b.v[i])); }
+inline floatx4 operator>=(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(vecx_detail::mask_lane(a.v[i] >= b.v[i])); }
+inline floatx4 operator&(const floatx4& a, const floatx4& b) {
+	VECX_LANEWISE4(vecx_detail::bits_to_float(vecx_detail::float_to_bits(a.v[i]) & vecx_detail::float_to_bits(b.v[i])));
+}
+inline floatx4 operator|(const floatx4& a, const floatx4& b) {
+	VECX_LANEWISE4(vecx_detail::bits_to_float(vecx_detail::float_to_bits(a.v[i]) | vecx_detail::float_to_bits(b.v[i])));
+}
+
+inline floatx4 min(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(b.v[i] < a.v[i] ? b.v[i] : a.v[i]); }
+inline floatx4 max(const floatx4& a, const floatx4& b) { VECX_LANEWISE4(b.v[i] > a.v[i] ? b.v[i] : a.v[i]); }
+inline floatx4 abs(const floatx4& a) { VECX_LANEWISE4(std::fabs(a.v[i])); }
+inline floatx4 sqrt(const floatx4& a) { VECX_LANEWISE4(std::sqrt(a.v[i])); }
+inline floatx4 rsqrt_approx(const floatx4& a) { VECX_LANEWISE4(1.0f / std::sqrt(a.v[i])); }
+
+inline floatx4 select(const floatx4& mask, const floatx4& a, const floatx4& b) {
+	VECX_LANEWISE4(vecx_detail::float_to_bits(mask.v[i]) ? a.v[i] : b.v[i]);
+}
+
+inline int movemask(const floatx4& mask) {
+	int m = 0;
+	for (int i = 0; i < 4; i++)
+		m |= (vecx_detail::float_to_bits(mask.v[i]) >> 31) << i;
+	return m;
+}
+
+#undef VECX_LANEWISE4
+
+#endif // VECX_SSE
+
+/// <summary>
+/// 8 float lanes (AVX register).
+/// Without AVX support the lanes are stored in two floatx4.
+/// </summary>
+struct floatx8 {
+	static const int width = 8;
+
+#if VECX_AVX
+	__m256 v;
+
+	floatx8() : v(_mm256_setzero_ps()) {}
+	floatx8(float f) : v(_mm256_set1_ps(f)) {}
+	floatx8(__m256 m) : v(m) {}
+
+	static floatx8 load(const float* p) { return _mm256_loadu_ps(p); }
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+#else
+	floatx4 lo, hi;
+
+	floatx8() {}
+	floatx8(float f) : lo(f), hi(f) {}
+	floatx8(const floatx4& l, const floatx4& h) : lo(l), hi(h) {}
+
+	static floatx8 load(const float* p) { return floatx8(floatx4::load(p), floatx4::load(p + 4)); }
+	void store(float* p) const { lo.store(p); hi.store(p + 4); }
+#endif
+
+	float operator[](int i) const {
+		float t[8];
+		store(t);
+		return t[i];
+	}
+
+	void set(int i, float f) {
+		float t[8];
+		store(t);
+		t[i] = f;
+		*this = load(t);
+	}
+};
+
+#if VECX_AVX
+
+inline floatx8 operator+(const floatx8& a, const floatx8& b) { return _mm256_add_ps(a.v, b.v); }
+inline floatx8 operator-(const floatx8& a, const floatx8& b) { return _mm256_sub_ps(a.v, b.v); }
+inline floatx8 operator*(const floatx8& a, const floatx8& b) { return _mm256_mul_ps(a.v, b.v); }
+inline floatx8 operator/(const floatx8& a, const floatx8& b) { return _mm256_div_ps(a.v, b.v); }
+inline floatx8 operator-(const floatx8& a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+
+inline floatx8 operator<(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline floatx8 operator>(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline floatx8 operator<=(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline floatx8 operator>=(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline floatx8 operator&(const floatx8& a, const floatx8& b) { return _mm256_and_ps(a.v, b.v); }
+inline floatx8 operator|(const floatx8& a, const floatx8& b) { return _mm256_or_ps(a.v, b.v); }
+
+inline floatx8 min(const floatx8& a, const floatx8& b) { return _mm256_min_ps(a.v, b.v); }
+inline floatx8 max(const floatx8& a, const floatx8& b) { return _mm256_max_ps(a.v, b.v); }
+inline floatx8 abs(const floatx8& a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline floatx8 sqrt(const floatx8& a) { return _mm256_sqrt_ps(a.v); }
+inline floatx8 rsqrt_approx(const floatx8& a) { return _mm256_rsqrt_ps(a.v); }
+
+inline floatx8 select(const floatx8& mask, const floatx8& a, const floatx8& b) {
+	return _mm256_blendv_ps(b.v, a.v, mask.v);
+}
+
+inline int movemask(const floatx8& mask) { return _mm256_movemask_ps(mask.v); }
+
+#else
+
+inline floatx8 operator+(const floatx8& a, const floatx8& b) { return floatx8(a.lo + b.lo, a.hi + b.hi); }
+inline floatx8 operator-(const floatx8& a, const floatx8& b) { return floatx8(a.lo - b.lo, a.hi - b.hi); }
+inline floatx8 operator*(const floatx8& a, const floatx8& b) { return floatx8(a.lo * b.lo, a.hi * b.hi); }
+inline floatx8 operator/(const floatx8& a, const floatx8& b) { return floatx8(a.lo / b.lo, a.hi / b.hi); }
+inline floatx8 operator-(const floatx8& a) { return floatx8(-a.lo, -a.hi); }
+
+inline floatx8 operator<(const floatx8& a, const floatx8& b) { return floatx8(a.lo < b.lo, a.hi < b.hi); }
+inline floatx8 operator>(const floatx8& a, const floatx8& b) { return floatx8(a.lo > b.lo, a.hi > b.hi); }
+inline floatx8 operator<=(const floatx8& a, const floatx8& b) { return floatx8(a.lo <= b.lo, a.hi <= b.hi); }
+inline floatx8 operator>=(const floatx8& a, const floatx8& b) { return floatx8(a.lo >= b.lo, a.hi >= b.hi); }
+inline floatx8 operator&(const floatx8& a, const floatx8& b) { return floatx8(a.lo & b.lo, a.hi & b.hi); }
+inline floatx8 operator|(const floatx8& a, const floatx8& b) { return floatx8(a.lo | b.lo, a.hi | b.hi); }
+
+inline floatx8 min(const floatx8& a, const floatx8& b) { return floatx8(min(a.lo, b.lo), min(a.hi, b.hi)); }
+inline floatx8 max(const floatx8& a, const floatx8& b) { return floatx8(max(a.lo, b.lo), max(a.hi, b.hi)); }
+inline floatx8 abs(const floatx8& a) { return floatx8(abs(a.lo), abs(a.hi)); }
+inline floatx8 sqrt(const floatx8& a) { return floatx8(sqrt(a.lo), sqrt(a.hi)); }
+inline floatx8 rsqrt_approx(const floatx8& a) { return floatx8(rsqrt_approx(a.lo), rsqrt_approx(a.hi)); }
+
+inline floatx8 select(const floatx8& mask, const floatx8& a, const floatx8& b) {
+	return floatx8(select(mask.lo, a.lo, b.lo), select(mask.hi, a.hi, b.hi));
+}
+
+inline int movemask(const floatx8& mask) { return movemask(mask.lo) | (movemask(mask.hi) << 4); }
+
+#endif // VECX_AVX
+
+// generic lane functions
+// ----------------------
+
+/// <summary>
+/// Reciprocal square root, hardware approximation refined with one Newton-Raphson step.
+/// </summary>
+template<typename F>
+inline F rsqrt(const F& a) {
+	F y = rsqrt_approx(a);
+	return y * (F(1.5f) - F(0.5f) * a * y * y);
+}
+
+/// <summary>
+/// Returns true if the mask is set in any lane.
+/// </summary>
+template<typename F>
+inline bool any(const F& mask) {
+	return movemask(mask) != 0;
+}
+
+/// <summary>
+/// Returns true if the mask is set in all lanes.
+/// </summary>
+template<typename F>
+inline bool all(const F& mask) {
+	return movemask(mask) == (1 << F::width) - 1;
+}
+
+/// <summary>
+/// Sine and cosine of 2*pi*u for u in [0,1), without calls to the scalar math library.
+///
+/// The angle is reduced to [-pi/2, pi/2] where polynomials approximate both
+/// (absolute error below 1e-5).
+/// </summary>
+template<typename F>
+inline void sincos_2pi(const F& u, F& s, F& c) {
+	// 2*pi*u = pi + x with x in [-pi, pi)  ->  sin(2*pi*u) = -sin(x), cos(2*pi*u) = -cos(x)
+	F x = (u - F(0.5f)) * F(2.0f * (float)pi);
+
+	// mirror |x| > pi/2 into [-pi/2, pi/2], the cosine changes its sign there
+	F half_pi = F(0.5f * (float)pi);
+	F upper = x > half_pi;
+	F lower = x < -half_pi;
+	x = select(upper, F((float)pi) - x, select(lower, F(-(float)pi) - x, x));
+	F cos_sign = select(upper | lower, F(1.0f), F(-1.0f));
+
+	// taylor polynomials up to x^9 (sine) and x^10 (cosine)
+	F x2 = x * x;
+	F p = F(1.0f / 362880.0f);
+	p = p * x2 - F(1.0f / 5040.0f);
+	p = p * x2 + F(1.0f / 120.0f);
+	p = p * x2 - F(1.0f / 6.0f);
+	p = p * x2 + F(1.0f);
+
+	F q = F(-1.0f / 3628800.0f);
+	q = q * x2 + F(1.0f / 40320.0f);
+	q = q * x2 - F(1.0f / 720.0f);
+	q = q * x2 + F(1.0f / 24.0f);
+	q = q * x2 - F(0.5f);
+	q = q * x2 + F(1.0f);
+
+	s = -(p * x);
+	c = cos_sign * q;
+}
+
+// ------------------------------------------------------------------------------
+// Wide Vector
+// ------------------------------------------------------------------------------
+
+/// <summary>
+/// Wide vector storing F::width vec3 in SoA layout.
+/// </summary>
+template<typename F>
+class vec3w {
+	public:
+		static const int width = F::width;
+
+		vec3w() {}
+		vec3w(const F& f) : x(f), y(f), z(f) {}
+		vec3w(const F& _x, const F& _y, const F& _z) : x(_x), y(_y), z(_z) {}
+
+		// broadcast a vec3 to all lanes
+		vec3w(const vec3& v) : x((float)v.x()), y((float)v.y()), z((float)v.z()) {}
+
+		/// <summary>
+		/// Gathers width vectors (AoS) into the SoA layout.
+		/// </summary>
+		static vec3w load(const vec3* v) {
+			float t[3][width];
+			for (int i = 0; i < width; i++) {
+				t[0][i] = (float)v[i].x();
+				t[1][i] = (float)v[i].y();
+				t[2][i] = (float)v[i].z();
+			}
+			return vec3w(F::load(t[0]), F::load(t[1]), F::load(t[2]));
+		}
+
+		/// <summary>
+		/// Scatters the lanes back into width vectors (AoS).
+		/// </summary>
+		void store(vec3* v) const {
+			float t[3][width];
+			x.store(t[0]);
+			y.store(t[1]);
+			z.store(t[2]);
+			for (int i = 0; i < width; i++)
+				v[i] = vec3(t[0][i], t[1][i], t[2][i]);
+		}
+
+		vec3 get(int i) const {
+			return vec3(x[i], y[i], z[i]);
+		}
+
+		void set(int i, const vec3& v) {
+			x.set(i, (float)v.x());
+			y.set(i, (float)v.y());
+			z.set(i, (float)v.z());
+		}
+
+		vec3w operator-() const {
+			return vec3w(-x, -y, -z);
+		}
+
+		vec3w& operator+=(const vec3w& v) {
+			x = x + v.x; y = y + v.y; z = z + v.z;
+			return *this;
+		}
+
+		vec3w& operator-=(const vec3w& v) {
+			x = x - v.x; y = y - v.y; z = z - v.z;
+			return *this;
+		}
+
+		vec3w& operator*=(const F& t) {
+			x = x * t; y = y * t; z = z * t;
+			return *this;
+		}
+
+		F squared_length() const {
+			return x * x + y * y + z * z;
+		}
+
+		F length() const {
+			return sqrt(squared_length());
+		}
+
+	public:
+		// Class Members
+		// -------------
+		F x, y, z;
+};
+
+// Type aliases for the wide vectors
+using vec3x4 = vec3w<floatx4>;	// 4 vectors (SSE)
+using vec3x8 = vec3w<floatx8>;	// 8 vectors (AVX)
+
+
+// wide vector utility functions
+// -----------------------------
+
+template<typename F>
+inline vec3w<F> operator+(const vec3w<F>& v1, const vec3w<F>& v2) {
+	return vec3w<F>(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
+}
+
+template<typename F>
+inline vec3w<F> operator-(const vec3w<F>& v1, const vec3w<F>& v2) {
+	return vec3w<F>(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);
+}
+
+// vector-vector multiplication
+template<typename F>
+inline vec3w<F> operator*(const vec3w<F>& v1, const vec3w<F>& v2) {
+	return vec3w<F>(v1.x * v2.x, v1.y * v2.y, v1.z * v2.z);
+}
+
+// scalar-vector multiplication
+template<typename F>
+inline vec3w<F> operator*(const F& t, const vec3w<F>& v) {
+	return vec3w<F>(t * v.x, t * v.y, t * v.z);
+}
+
+// vector-scalar multiplication
+template<typename F>
+inline vec3w<F> operator*(const vec3w<F>& v, const F& t) {
+	return t * v;
+}
+
+/// <summary>
+/// Selects the lanes of a where the mask is set, otherwise the lanes of b.
+/// </summary>
+template<typename F>
+inline vec3w<F> select(const F& mask, const vec3w<F>& a, const vec3w<F>& b) {
+	return vec3w<F>(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z));
+}
+
+// calulates the dot (skalar) product of the vectors in all lanes
+template<typename F>
+inline F dot(const vec3w<F>& v1, const vec3w<F>& v2) {
+	return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
+}
+
+// calculates the cross product between the vectors in all lanes
+template<typename F>
+inline vec3w<F> cross(const vec3w<F>& v1, const vec3w<F>& v2) {
+	return vec3w<F>(v1.y * v2.z - v1.z * v2.y,
+					v1.z * v2.x - v1.x * v2.z,
+					v1.x * v2.y - v1.y * v2.x);
+}
+
+/// <summary>
+/// Make unit vectors (vectors of length 1).
+/// Uses the fast reciprocal square root instead of a sqrt and divide.
+/// </summary>
+template<typename F>
+inline vec3w<F> unit_vector(const vec3w<F>& v) {
+	return v * rsqrt(v.squared_length());
+}
+
+/// <summary>
+/// Reflects the vectors using the normals.
+/// </summary>
+template<typename F>
+inline vec3w<F> reflect(const vec3w<F>& v, const vec3w<F>& n) {
+	return v - (F(2.0f) * dot(v, n)) * n;
+}
+
+/// <summary>
+/// Refracts the vectors using the normals (snells law).
+///
+/// Note: the incident vectors and the normal vectors need to be unit vectors
+/// </summary>
+/// <param name="v">The incident vectors. Unit vectors</param>
+/// <param name="n">The normal vectors used to refract. Unit vectors</param>
+/// <param name="etai_over_etat">The refractive index ratio per lane.</param>
+template<typename F>
+inline vec3w<F> refract(const vec3w<F>& v, const vec3w<F>& n, const F& etai_over_etat) {
+	F cos_theta = min(-dot(v, n), F(1.0f));
+	// ray perpendicular to n'
+	vec3w<F> r_out_perp = etai_over_etat * (v + cos_theta * n);
+	// ray parallel to n'
+	vec3w<F> r_out_parallel = -sqrt(abs(F(1.0f) - r_out_perp.squared_length())) * n;
+	return r_out_perp + r_out_parallel;
+}
+
+// batch sampling
+// --------------
+// the samplers map uniform random numbers directly onto the domain,
+// no lane is ever rejected and redrawn
+
+/// <summary>
+/// Returns width random reals in [0,1)
+/// </summary>
+template<typename F>
+inline F random_floats() {
+	float t[F::width];
+	for (int i = 0; i < F::width; i++)
+		t[i] = (float)random_double();
+	return F::load(t);
+}
+
+/// <summary>
+/// Maps uniform samples u1, u2 to points in the unit disk (z = 0).
+/// </summary>
+template<typename F>
+inline vec3w<F> sample_unit_disk(const F& u1, const F& u2) {
+	F s, c;
+	sincos_2pi(u2, s, c);
+	F r = sqrt(u1);
+	return vec3w<F>(r * c, r * s, F(0.0f));
+}
+
+/// <summary>
+/// Maps uniform samples u1, u2 to directions on the unit sphere.
+/// </summary>
+template<typename F>
+inline vec3w<F> sample_unit_vector(const F& u1, const F& u2) {
+	F z = F(1.0f) - F(2.0f) * u1;
+	F r = sqrt(max(F(0.0f), F(1.0f) - z * z));
+	F s, c;
+	sincos_2pi(u2, s, c);
+	return vec3w<F>(r * c, r * s, z);
+}
+
+/// <summary>
+/// Maps uniform samples u1, u2 to cosine weighted directions around +z.
+/// </summary>
+template<typename F>
+inline vec3w<F> sample_cosine_direction(const F& u1, const F& u2) {
+	vec3w<F> d = sample_unit_disk(u1, u2);
+	d.z = sqrt(max(F(0.0f), F(1.0f) - u1));
+	return d;
+}
+
+/// <summary>
+/// Returns random points in the unit disk for all lanes.
+/// </summary>
+template<typename F>
+inline vec3w<F> random_in_unit_disk_x() {
+	F u1 = random_floats<F>();
+	F u2 = random_floats<F>();
+	return sample_unit_disk(u1, u2);
+}
+
+/// <summary>
+/// Returns random unit vectors for all lanes.
+/// </summary>
+template<typename F>
+inline vec3w<F> random_unit_vector_x() {
+	F u1 = random_floats<F>();
+	F u2 = random_floats<F>();
+	return sample_unit_vector(u1, u2);
+}
+
+/// <summary>
+/// Returns random points in the unit sphere for all lanes.
+///
+/// The radius of a uniform point in the sphere is distributed as cbrt(u),
+/// the cube root is taken per lane.
+/// </summary>
+template<typename F>
+inline vec3w<F> random_in_unit_sphere_x() {
+	vec3w<F> d = random_unit_vector_x<F>();
+	float t[F::width];
+	for (int i = 0; i < F::width; i++)
+		t[i] = std::cbrt((float)random_double());
+	return d * F::load(t);
+}
+
+/// <summary>
+/// Returns random cosine weighted directions around +z for all lanes.
+/// </summary>
+template<typename F>
+inline vec3w<F> random_cosine_direction_x() {
+	F u1 = random_floats<F>();
+	F u2 = random_floats<F>();
+	return sample_cosine_direction(u1, u2);
+}
+
+#endif // !VECX_H
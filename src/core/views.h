@@ -0,0 +1,154 @@
+#ifndef VIEWS_H
+#define VIEWS_H
+
+#include "common.h"
+#include "camera.h"
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Camera of a multi-view render.
+/// </summary>
+struct ViewSettings {
+	std::string name;		// distinguishes the output of the view
+	CameraSettings camera;
+	double aspect;			// aspect ratio of the camera, 0 for the aspect ratio of the render options
+
+	ViewSettings(const std::string& name, const CameraSettings& camera, double aspect = 0)
+		: name(name), camera(camera), aspect(aspect) {}
+};
+
+/// <summary>
+/// Loads the views of a multi-view render, e.g. stereo pairs, the faces of
+/// a cube map or a camera array of the same scene. The file has one view
+/// (or group of views) per line:
+///
+///		# view name  lookfrom(x y z) lookat(x y z) vup(x y z) vfov aperture focus_dist
+///		view front   13 2 3  0 0 0  0 1 0  20 0.1 10
+///		# stereo name  ... as view ... separation: the views name_left and name_right
+///		stereo eye     13 2 3  0 0 0  0 1 0  20 0.1 10  0.2
+///		# cube name position(x y z): the 90 degree square views name_px, name_nx, name_py, name_ny, name_pz, name_nz
+///		cube probe     0 1 0
+///
+/// The cameras of a stereo pair are moved apart along the right vector of
+/// the view and keep parallel axes. The side faces of a cube have +y up,
+/// the +y and -y faces have -z and +z up.
+/// </summary>
+/// <param name="path">The path of the view file.</param>
+/// <param name="views">The views, in the order of the file.</param>
+/// <param name="error">The error message if loading failed.</param>
+/// <returns>True if the file was read and has at least one view</returns>
+bool loadViews(const std::string& path, std::vector<ViewSettings>& views, std::string& error) {
+	std::ifstream file(path);
+	if (!file) {
+		error = "cannot open views " + path;
+		return false;
+	}
+
+	std::set<std::string> names;
+	auto add = [&](const ViewSettings& view) {
+		if (!names.insert(view.name).second) {
+			error = path + ": view " + view.name + " is defined twice";
+			return false;
+		}
+		views.push_back(view);
+		return true;
+	};
+
+	std::string line;
+	int line_number = 0;
+	while (std::getline(file, line)) {
+		line_number++;
+
+		// strip comments
+		auto comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+
+		std::istringstream in(line);
+		std::string type, name;
+		if (!(in >> type))
+			continue;
+
+		CameraSettings c;
+		if (type == "view") {
+			if (in >> name >> c.lookfrom >> c.lookat >> c.vup >> c.vfov >> c.aperture >> c.focus_dist) {
+				if (!add(ViewSettings(name, c)))
+					return false;
+				continue;
+			}
+		}
+		else if (type == "stereo") {
+			double separation;
+			if (in >> name >> c.lookfrom >> c.lookat >> c.vup >> c.vfov >> c.aperture >> c.focus_dist >> separation) {
+				vec3 right = unit_vector(cross(c.lookat - c.lookfrom, c.vup)) * (separation / 2);
+				CameraSettings left = c, right_eye = c;
+				left.lookfrom -= right;
+				left.lookat -= right;
+				right_eye.lookfrom += right;
+				right_eye.lookat += right;
+				if (!add(ViewSettings(name + "_left", left)) || !add(ViewSettings(name + "_right", right_eye)))
+					return false;
+				continue;
+			}
+		}
+		else if (type == "cube") {
+			point3 position;
+			if (in >> name >> position) {
+				const char* faces[] = { "px", "nx", "py", "ny", "pz", "nz" };
+				const vec3 directions[] = { vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1) };
+				const vec3 ups[] = { vec3(0, 1, 0), vec3(0, 1, 0), vec3(0, 0, -1), vec3(0, 0, 1), vec3(0, 1, 0), vec3(0, 1, 0) };
+
+				bool ok = true;
+				for (int f = 0; f < 6 && ok; f++) {
+					CameraSettings face;
+					face.lookfrom = position;
+					face.lookat = position + directions[f];
+					face.vup = ups[f];
+					face.vfov = 90;
+					face.aperture = 0;
+					face.focus_dist = 1;
+					ok = add(ViewSettings(name + "_" + faces[f], face, 1));
+				}
+				if (!ok)
+					return false;
+				continue;
+			}
+		}
+
+		error = path + ":" + std::to_string(line_number) + ": cannot parse '" + line + "'";
+		return false;
+	}
+
+	if (views.empty()) {
+		error = path + ": no views";
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Output path of a view. A run of '#' in the path is replaced by the view
+/// name, otherwise the name is inserted before the extension.
+/// </summary>
+/// <param name="path">The output path, e.g. "img_#.ppm".</param>
+/// <param name="name">The view name.</param>
+std::string viewPath(const std::string& path, const std::string& name) {
+	auto first = path.find('#');
+	if (first != std::string::npos) {
+		auto last = path.find_first_not_of('#', first);
+		return path.substr(0, first) + name + (last == std::string::npos ? "" : path.substr(last));
+	}
+
+	auto dot = path.find_last_of('.');
+	auto slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return path + "_" + name;
+	return path.substr(0, dot) + "_" + name + path.substr(dot);
+}
+
+#endif // !VIEWS_H
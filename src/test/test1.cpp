@@ -1,3 +1,83 @@
+#include <iostream>
+
+#include "../core/vecx.h"
+
+// the lanes are single precision, the scalar reference is double
+#define TEST_TOLERANCE 1e-4
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, int lane) {
+	if (!ok) {
+		std::cerr << "vecx: " << what << " differs from vec3 in lane " << lane << "\n";
+		failures++;
+	}
+}
+
+static bool near(const vec3& a, const vec3& b) {
+	return (a - b).length() <= TEST_TOLERANCE * std::fmax(1.0, b.length());
+}
+
+static bool near(double a, double b) {
+	return std::fabs(a - b) <= TEST_TOLERANCE * std::fmax(1.0, std::fabs(b));
+}
+
+/// <summary>
+/// Compares the wide vector functions of F::width lanes with the vec3 functions.
+/// </summary>
+template<typename F>
+static void testLanes() {
+	const int width = F::width;
+	vec3 a[width], b[width], n[width];
+	float eta[width];
+	for (int i = 0; i < width; i++) {
+		a[i] = vec3::random(-2, 2);
+		b[i] = vec3::random(-2, 2);
+		n[i] = unit_vector(vec3::random(-1, 1));
+		eta[i] = (float)random_double(0.5, 1.5);
+	}
+
+	vec3w<F> wa = vec3w<F>::load(a), wb = vec3w<F>::load(b), wn = vec3w<F>::load(n);
+	vec3w<F> incident = unit_vector(wa);
+
+	vec3 sums[width], crosses[width], units[width], reflected[width], refracted[width];
+	(wa + wb).store(sums);
+	cross(wa, wb).store(crosses);
+	incident.store(units);
+	reflect(wa, wn).store(reflected);
+	refract(incident, wn, F::load(eta)).store(refracted);
+
+	F dots = dot(wa, wb);
+	for (int i = 0; i < width; i++) {
+		vec3 u = unit_vector(a[i]);
+		check(near(sums[i], a[i] + b[i]), "operator+", i);
+		check(near(dots[i], dot(a[i], b[i])), "dot", i);
+		check(near(crosses[i], cross(a[i], b[i])), "cross", i);
+		check(near(units[i], u), "unit_vector", i);
+		check(near(reflected[i], reflect(a[i], n[i])), "reflect", i);
+		check(near(refracted[i], refract(u, n[i], eta[i])), "refract", i);
+	}
+
+	// the samplers map every lane onto the domain
+	vec3 disk[width], sphere[width], cosine[width];
+	random_in_unit_disk_x<F>().store(disk);
+	random_unit_vector_x<F>().store(sphere);
+	random_cosine_direction_x<F>().store(cosine);
+	for (int i = 0; i < width; i++) {
+		check(disk[i].length() <= 1 + TEST_TOLERANCE && disk[i].z() == 0, "random_in_unit_disk_x", i);
+		check(near(sphere[i].length(), 1), "random_unit_vector_x", i);
+		check(near(cosine[i].length(), 1) && cosine[i].z() >= 0, "random_cosine_direction_x", i);
+	}
+}
+
 int main() {
-	return 0;
-}
\ No newline at end of file
+	seed_random(1);
+	for (int round = 0; round < 1000; round++) {
+		testLanes<floatx4>();
+		testLanes<floatx8>();
+	}
+
+	if (failures)
+		std::cerr << "vecx: " << failures << " failures\n";
+	return failures ? 1 : 0;
+}
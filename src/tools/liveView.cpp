@@ -0,0 +1,82 @@
+// Reference reader of the live framebuffer (Raytracer --live <file>).
+//
+//		LiveView <live file> <out.ppm> [--watch]
+//
+// Writes the current image of the rendering as PPM. With --watch the image
+// is written again after every finished pass until the rendering is done.
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../core/liveFramebuffer.h"
+
+/// <summary>
+/// Writes the image with the tone curve of the renderer (clamp, gamma 2).
+/// </summary>
+bool writePPM(const std::string& path, int width, int height, const std::vector<color>& image) {
+	std::ofstream out(path, std::ios::binary);
+	out << "P6\n" << width << " " << height << "\n255\n";
+
+	std::vector<unsigned char> row(3 * width);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const color& c = image[y * width + x];
+			for (int i = 0; i < 3; i++)
+				row[3 * x + i] = (unsigned char)(256 * clamp(sqrt(fmax(c[i], 0.0)), 0.0, 0.999));
+		}
+		out.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+	return (bool)out;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		std::cerr << "usage: LiveView <live file> <out.ppm> [--watch]\n";
+		return 1;
+	}
+
+	std::string path = argv[1];
+	std::string out = argv[2];
+	bool watch = argc > 3 && std::strcmp(argv[3], "--watch") == 0;
+
+	// the renderer may not have created the file yet
+	LiveFramebufferReader reader;
+	while (!reader.open(path)) {
+		if (!watch) {
+			std::cerr << path << " is not a live framebuffer\n";
+			return 1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	const liveHeader& header = reader.getHeader();
+	std::vector<color> image;
+	int written_pass = -1;
+
+	while (true) {
+		bool done = header.done.load() != 0;
+		int pass = (int)header.pass.load();
+
+		if (!watch || done || pass != written_pass) {
+			reader.snapshot(image);
+			if (!writePPM(out, header.width, header.height, image)) {
+				std::cerr << "cannot write " << out << "\n";
+				return 1;
+			}
+			std::cerr << "pass " << pass << "/" << header.passes << ", " << header.updates.load()
+					  << " tile updates" << (done ? ", done" : "") << "\n";
+			written_pass = pass;
+		}
+
+		if (!watch || done)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+
+	return 0;
+}